@@ -1,16 +1,90 @@
 LOCAL_PATH := $(call my-dir)
 
+# SP_OFFLINE=1 builds the offline stand-in instead of using the prebuilt library
+ifeq ($(SP_OFFLINE),1)
+include $(CLEAR_VARS)
+LOCAL_MODULE := spotify_embedded
+LOCAL_SRC_FILES := spotify_offline.cpp
+include $(BUILD_SHARED_LIBRARY)
+else
 include $(CLEAR_VARS)
 LOCAL_MODULE := spotify_embedded
 LOCAL_SRC_FILES := libspotify_embedded_shared.so
 include $(PREBUILT_SHARED_LIBRARY)
+endif
+
+# Helpers shared by the test and bench apps
+SP_HELPER_SRC_FILES := \
+	storage_mmap.cpp \
+	cache_index.cpp \
+	pump_driver.cpp \
+	socket_hal.cpp \
+	dns_cache.cpp \
+	wmem_probe.cpp \
+	pcm_convert.cpp \
+	resampler.cpp \
+	metadata_cache.cpp \
+	image_cache.cpp \
+	zone_supervisor.cpp \
+	pcm_shm.cpp \
+	prefetcher.cpp \
+	latency_probe.cpp \
+	tracer.cpp \
+	async_logger.cpp \
+	session_recorder.cpp \
+	warm_start.cpp \
+	rt_memory.cpp \
+	write_behind.cpp
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := testapp
-LOCAL_SRC_FILES := test.cpp
+LOCAL_SRC_FILES := test.cpp $(SP_HELPER_SRC_FILES)
 LOCAL_SHARED_LIBRARIES := spotify_embedded
+# SP_TRACE=1 routes every library call through tracer_wrap.cpp, keep the list in sync with it
+ifeq ($(SP_TRACE),1)
+SP_TRACED_FUNCTIONS := \
+	SpRegisterDebugCallbacks SpRegisterConnectionCallbacks SpRegisterPlaybackCallbacks SpGetLibraryVersion \
+	SpGetBrandName SpGetModelName SpGetServerTime SpGetCanonicalUsername \
+	SpGetProductType SpZeroConfGetVars SpPumpEvents SpSetDisplayName \
+	SpConnectionSetConnectivity SpConnectionGetConnectivity SpConnectionLoginPassword SpConnectionLoginBlob \
+	SpConnectionLoginOauthToken SpConnectionIsLoggedIn SpConnectionLogout SpGetMetadataValidRange \
+	SpSetDeviceIsGroup SpPlaybackGetVolume SpPlaybackGetPosition SpPlaybackSetBitrate \
+	SpPlaybackUpdateVolume SpPlayUri SpInit SpFree \
+	SpGetMetadata SpGetMetadataImageURL SpRegisterContentCallbacks SpSetVolumeSteps \
+	SpPlaybackGetRepeatMode SpPlaybackIsActiveDevice SpPlaybackIsAdPlaying SpPlaybackIsPlaying \
+	SpPlaybackIsRepeated SpPlaybackIsShuffled SpPlaybackPause SpPlaybackPlay \
+	SpPlaybackSeek SpPlaybackSkipToNext SpPlaybackSkipToPrev SpQueueUri \
+	SpRegisterPrefetchCallbacks SpRegisterStorageCallbacks SpPrefetchItem SpStopPrefetchingItem \
+	SpZeroConfAnnouncePause SpZeroConfAnnounceResume SpPlaybackEnableShuffle SpPlaybackEnableRepeat \
+	SpRegisterDnsHALCallbacks SpSetAlarmClock SpCancelAlarmClock SpSetBackendEnv \
+	SpRegisterSocketHALCallbacks
+LOCAL_SRC_FILES += tracer_wrap.cpp
+LOCAL_LDFLAGS += $(foreach f,$(SP_TRACED_FUNCTIONS),-Wl,--wrap=$(f))
+endif
 # Don't strip debug builds
 ifeq ($(APP_OPTIM),debug)
     cmd-strip := 
 endif
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := benchapp
+LOCAL_SRC_FILES := bench.cpp $(SP_HELPER_SRC_FILES)
+LOCAL_SHARED_LIBRARIES := spotify_embedded
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := selftestapp
+LOCAL_SRC_FILES := selftest.cpp $(SP_HELPER_SRC_FILES)
+LOCAL_SHARED_LIBRARIES := spotify_embedded
+include $(BUILD_EXECUTABLE)
+
+# spotify_coro.hpp needs C++20, which gnustl does not provide
+ifneq ($(filter c++_%,$(APP_STL)),)
+include $(CLEAR_VARS)
+LOCAL_MODULE := corotestapp
+LOCAL_SRC_FILES := corotest.cpp pump_driver.cpp
+LOCAL_CPPFLAGS += -std=c++20
+LOCAL_SHARED_LIBRARIES := spotify_embedded
+include $(BUILD_EXECUTABLE)
+endif
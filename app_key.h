@@ -0,0 +1,32 @@
+#pragma once
+
+/**
+ * @file app_key.h
+ * @brief Application key of the android SDK demo, shared by the test and bench apps.
+ */
+
+#include <cstdint>
+
+static uint8_t app_key[] = {
+	0x01, 0x42, 0xdf, 0x0e, 0xa6, 0x68, 0x2a, 0x1c, 0xba, 0x50, 0xa4, 0x5a, 0x4e, 0x62, 0x6f, 0xc3,
+	0x13, 0x87, 0x71, 0xa7, 0x08, 0x89, 0x0f, 0x73, 0x99, 0x94, 0xef, 0x0a, 0x50, 0xaf, 0x78, 0xa8,
+	0x0d, 0xe9, 0x6d, 0xd5, 0x4a, 0xc2, 0x5c, 0xa5, 0x6e, 0xbf, 0x1f, 0x98, 0x2b, 0xda, 0x94, 0xa0,
+	0x08, 0xf0, 0xdb, 0xd6, 0x67, 0x85, 0x5c, 0xaf, 0xe8, 0xd6, 0xc2, 0x8b, 0xe1, 0xd2, 0x42, 0x8f,
+	0xc8, 0x9e, 0xf7, 0x50, 0xd8, 0xdc, 0x34, 0x5c, 0x90, 0xaf, 0x04, 0x9b, 0x3c, 0x6d, 0x71, 0x30,
+	0x23, 0x52, 0xa3, 0x80, 0x15, 0xca, 0x09, 0xb8, 0x46, 0x86, 0x7a, 0x91, 0x8e, 0xc0, 0x1f, 0x3e,
+	0x99, 0x09, 0x0a, 0xbf, 0x98, 0x6e, 0x5f, 0x0f, 0xcf, 0xea, 0xa2, 0x78, 0xd2, 0x5e, 0x09, 0xea,
+	0x8a, 0x51, 0x30, 0x97, 0xe1, 0x0d, 0xbc, 0xad, 0x47, 0xfb, 0x90, 0x60, 0x66, 0x39, 0xe2, 0x1c,
+	0xaa, 0xb1, 0x59, 0xfd, 0xe3, 0x09, 0x30, 0x5a, 0x7a, 0xd7, 0xa2, 0x35, 0x51, 0xc6, 0x3a, 0x00,
+	0x75, 0xee, 0xc3, 0x76, 0x98, 0x75, 0x3e, 0x02, 0xf3, 0x40, 0x50, 0x21, 0x7c, 0x51, 0x75, 0x9c,
+	0xe6, 0x66, 0xd3, 0x31, 0xfe, 0x15, 0x84, 0x35, 0xef, 0x45, 0x2e, 0x9c, 0x7d, 0xd0, 0xc5, 0x16,
+	0xea, 0xbe, 0x71, 0x07, 0x7a, 0x6c, 0x40, 0x26, 0x75, 0xef, 0x90, 0x33, 0xa7, 0x65, 0xca, 0xf1,
+	0xa6, 0x50, 0x91, 0x6c, 0x99, 0xf4, 0xba, 0x8a, 0x5e, 0xd1, 0xb4, 0x21, 0x9d, 0x81, 0xbb, 0x61,
+	0x9a, 0x31, 0xe1, 0x82, 0xad, 0x10, 0xd7, 0xd9, 0x06, 0xe0, 0xe3, 0x1f, 0x2f, 0xcf, 0x21, 0x91,
+	0x57, 0x05, 0xf6, 0x39, 0x9f, 0x4c, 0x1f, 0xbd, 0x0b, 0x68, 0x6e, 0xcb, 0x10, 0xd9, 0x6b, 0xc4,
+	0xbb, 0x76, 0xdc, 0x47, 0x96, 0x3e, 0xd4, 0xc6, 0xaf, 0xb5, 0x80, 0x4c, 0x0d, 0xb5, 0x63, 0x82,
+	0xc1, 0x96, 0x35, 0xc1, 0x82, 0x65, 0x62, 0x53, 0x0a, 0xce, 0xb7, 0x6e, 0xf8, 0x1e, 0xf6, 0x8b,
+	0x66, 0xfa, 0x5e, 0xc1, 0x49, 0x7e, 0xc2, 0x95, 0x51, 0xe3, 0xfa, 0x30, 0x55, 0x23, 0x79, 0x69,
+	0x33, 0x3b, 0xe6, 0xb2, 0x07, 0xac, 0x41, 0x6a, 0x5a, 0xc4, 0x05, 0x8c, 0x4a, 0xfc, 0xd2, 0x44,
+	0x8f, 0xac, 0x92, 0x77, 0xc6, 0x76, 0xbe, 0x68, 0x4b, 0xcc, 0x17, 0x3a, 0xdd, 0x8d, 0x40, 0xd5,
+	0x77
+};
@@ -0,0 +1,390 @@
+#include "async_logger.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+namespace sp {
+
+	constexpr size_t async_logger::limiter_count;
+
+	static size_t round_pow2(size_t v) {
+		size_t res = 2;
+		while(res < v) res <<= 1;
+		return res;
+	}
+
+	static uint64_t now_ms() {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	static void write_stderr(const char* data, size_t len) {
+		while(len) {
+			ssize_t res = ::write(2, data, len);
+			if(res <= 0) return;
+			data += res;
+			len -= res;
+		}
+	}
+
+	async_logger::async_logger(options opts, sink_t sink)
+		: m_opts(opts), m_sink(sink ? std::move(sink) : sink_t(&write_stderr)), m_min_level(opts.min_level),
+		m_mask(round_pow2(opts.queue_size) - 1), m_slots(new slot[m_mask + 1]),
+		m_text(new char[(m_mask + 1) * std::min<size_t>(std::max<size_t>(opts.max_line, 16), 0xffff)]),
+		m_limiters(new limiter[limiter_count]), m_enqueue(0), m_dequeue(0),
+		m_accepted(0), m_filtered(0), m_suppressed(0), m_dropped(0), m_truncated(0), m_batches(0), m_written(0),
+		m_stop(false)
+	{
+		for(size_t i = 0; i <= m_mask; i++) m_slots[i].seq.store(i, std::memory_order_relaxed);
+		for(size_t i = 0; i < limiter_count; i++) {
+			m_limiters[i].window.store(0, std::memory_order_relaxed);
+			m_limiters[i].count.store(0, std::memory_order_relaxed);
+			m_limiters[i].suppressed.store(0, std::memory_order_relaxed);
+			m_limiters[i].name_state.store(NS_EMPTY, std::memory_order_relaxed);
+		}
+		m_thread = std::thread(&async_logger::run, this);
+	}
+
+	async_logger::async_logger(options opts)
+		: async_logger(opts, sink_t())
+	{}
+
+	async_logger::async_logger()
+		: async_logger(options(), sink_t())
+	{}
+
+	async_logger::~async_logger() {
+		{
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	static bool is_level_end(char c) {
+		return c == ' ' || c == ':' || c == ']' || c == '/' || c == '\t';
+	}
+
+	static bool match_word(const char* p, const char* word, size_t& len) {
+		size_t i = 0;
+		for(; word[i]; i++)
+			if(toupper((unsigned char)p[i]) != word[i]) return false;
+		if(!is_level_end(p[i])) return false;
+		len = i;
+		return true;
+	}
+
+	static size_t match_digits(const char* p, size_t min, size_t max) {
+		size_t i = 0;
+		while(i < max && isdigit((unsigned char)p[i])) i++;
+		return i >= min && !isdigit((unsigned char)p[i]) ? i : 0;
+	}
+
+	// "12:01:02" with an optional fraction, returns its length or 0
+	static size_t match_time(const char* p) {
+		size_t i = match_digits(p, 1, 2);
+		if(!i) return 0;
+		for(int part = 0; part < 2; part++) {
+			if(p[i] != ':' || match_digits(p + i + 1, 2, 2) != 2) return 0;
+			i += 3;
+		}
+		if(p[i] == '.' || p[i] == ',') {
+			const size_t n = match_digits(p + i + 1, 1, 9);
+			if(n) i += 1 + n;
+		}
+		return i;
+	}
+
+	// "2017-01-01", "2017/01/01" or "01-01" (logcat), returns its length or 0
+	static size_t match_date(const char* p) {
+		size_t i = 0, parts = 0;
+		for(;;) {
+			const size_t n = match_digits(p + i, 2, 4);
+			if(!n) return 0;
+			i += n;
+			parts++;
+			if(parts == 3 || (p[i] != '-' && p[i] != '/')) break;
+			i++;
+		}
+		return parts >= 2 ? i : 0;
+	}
+
+	// A time, or a date followed by a time, returns its length or 0
+	static size_t match_timestamp(const char* p) {
+		size_t len = match_time(p);
+		if(!len) {
+			const size_t date = match_date(p);
+			if(!date || (p[date] != ' ' && p[date] != 'T')) return 0;
+			const size_t time = match_time(p + date + 1);
+			if(!time) return 0;
+			len = date + 1 + time;
+		}
+		if(p[len] == 'Z') len++;
+		return p[len] == ' ' || p[len] == '\t' || p[len] == '\0' ? len : 0;
+	}
+
+	async_logger::parsed async_logger::parse(const char* line) {
+		parsed res;
+		const char* p = line;
+
+		// Timestamp like "12:01:02.345", "2017-01-01 12:01:02" or "01-01 12:01:02.345"
+		const size_t ts = match_timestamp(p);
+		p += ts;
+		while(*p == ' ' || *p == '\t') p++;
+
+		// Level, optionally in brackets
+		{
+			const char* q = p;
+			const bool bracket = *q == '[';
+			if(bracket) q++;
+			static const struct { const char* word; level lvl; } words[] = {
+				{ "VERBOSE", LL_TRACE }, { "TRACE", LL_TRACE }, { "DEBUG", LL_DEBUG }, { "INFO", LL_INFO },
+				{ "WARNING", LL_WARN }, { "WARN", LL_WARN }, { "ERROR", LL_ERROR }, { "FATAL", LL_ERROR },
+				{ "V", LL_TRACE }, { "D", LL_DEBUG }, { "I", LL_INFO }, { "W", LL_WARN }, { "E", LL_ERROR }, { "F", LL_ERROR }
+			};
+			for(auto& w : words) {
+				size_t len;
+				if(!match_word(q, w.word, len)) continue;
+				// A single letter is only a level as "[I]", "I/tag", "I: " or in "12:01:02 I msg",
+				// otherwise it is the first word of the message ("I think", "E coli")
+				if(len == 1 && !(bracket ? q[1] == ']' : q[1] == '/' || q[1] == ':' || (ts && q[1] == ' '))) break;
+				if(bracket && q[len] != ']') break;
+				res.lvl = w.lvl;
+				q += len;
+				if(*q == ']' || *q == ':' || *q == '/') q++;
+				while(*q == ' ') q++;
+				p = q;
+				break;
+			}
+		}
+
+		// Subsystem as "[name]" or "name: "
+		if(*p == '[') {
+			const char* end = strchr(p, ']');
+			if(end) {
+				res.subsystem = p + 1 - line;
+				res.subsystem_len = end - p - 1;
+				p = end + 1;
+			}
+		} else {
+			const char* q = p;
+			while(isalnum((unsigned char)*q) || *q == '_' || *q == '-' || *q == '.') q++;
+			if(q != p && *q == ':' && q[1] == ' ') {
+				res.subsystem = p - line;
+				res.subsystem_len = q - p;
+				p = q + 1;
+			}
+		}
+		while(*p == ' ') p++;
+		res.message = p - line;
+		return res;
+	}
+
+	const char* async_logger::name(level l) {
+		switch(l) {
+			case LL_TRACE: return "TRACE";
+			case LL_DEBUG: return "DEBUG";
+			case LL_INFO: return "INFO";
+			case LL_WARN: return "WARN";
+			default: return "ERROR";
+		}
+	}
+
+	bool async_logger::allow(const char* subsystem, size_t len, uint64_t now) {
+		if(!m_opts.rate_limit) return true;
+		// FNV-1a of the subsystem picks the bucket
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < len; i++) h = (h ^ (uint8_t)subsystem[i]) * 16777619u;
+		limiter& l = m_limiters[h % limiter_count];
+
+		const uint64_t window = now / 1000;
+		uint64_t cur = l.window.load(std::memory_order_relaxed);
+		if(cur != window && l.window.compare_exchange_strong(cur, window, std::memory_order_relaxed))
+			l.count.store(0, std::memory_order_relaxed);
+		if(l.count.fetch_add(1, std::memory_order_relaxed) < m_opts.rate_limit) return true;
+		l.suppressed.fetch_add(1, std::memory_order_relaxed);
+		// Remember whom the report is about, the bucket might be shared by several subsystems
+		int empty = NS_EMPTY;
+		if(l.name_state.compare_exchange_strong(empty, NS_WRITING, std::memory_order_acquire)) {
+			const size_t n = std::min(len, sizeof(l.name) - 1);
+			memcpy(l.name, subsystem, n);
+			l.name[n] = '\0';
+			l.name_state.store(NS_READY, std::memory_order_release);
+		}
+		return false;
+	}
+
+	void async_logger::log(const char* line) {
+		if(!line) return;
+		const parsed p = parse(line);
+		if(p.lvl < m_min_level.load(std::memory_order_relaxed)) {
+			m_filtered.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		const uint64_t now = now_ms();
+		if(!allow(line + p.subsystem, p.subsystem_len, now)) {
+			m_suppressed.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		// Bounded MPMC queue with per slot sequence numbers
+		size_t pos = m_enqueue.load(std::memory_order_relaxed);
+		slot* s;
+		for(;;) {
+			s = &m_slots[pos & m_mask];
+			const size_t seq = s->seq.load(std::memory_order_acquire);
+			const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if(diff == 0) {
+				if(m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if(diff < 0) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			} else pos = m_enqueue.load(std::memory_order_relaxed);
+		}
+
+		const size_t max_line = std::min<size_t>(std::max<size_t>(m_opts.max_line, 16), 0xffff);
+		size_t len = strnlen(line, max_line + 1);
+		if(len > max_line) {
+			len = max_line;
+			m_truncated.fetch_add(1, std::memory_order_relaxed);
+		}
+		memcpy(&m_text[(pos & m_mask) * max_line], line, len);
+		s->ts = now;
+		s->lvl = p.lvl;
+		s->len = len;
+		s->subsystem = std::min(p.subsystem, len);
+		s->subsystem_len = std::min(p.subsystem_len, len - s->subsystem);
+		s->message = std::min(p.message, len);
+		s->seq.store(pos + 1, std::memory_order_release);
+		m_accepted.fetch_add(1, std::memory_order_relaxed);
+
+		// Only wake the writer early when the queue fills up
+		if((pos & (m_mask >> 1)) == (m_mask >> 1)) m_cv.notify_one();
+	}
+
+	void async_logger::flush() {
+		const size_t target = m_enqueue.load(std::memory_order_acquire);
+		std::unique_lock<std::mutex> lck(m_mtx);
+		m_cv.notify_one();
+		while(m_written.load(std::memory_order_acquire) < target && !m_stop) {
+			m_flushed_cv.wait_for(lck, m_opts.flush_interval);
+			m_cv.notify_one();
+		}
+	}
+
+	async_logger::stats async_logger::get_stats() const {
+		stats res;
+		res.accepted = m_accepted.load(std::memory_order_relaxed);
+		res.filtered = m_filtered.load(std::memory_order_relaxed);
+		res.suppressed = m_suppressed.load(std::memory_order_relaxed);
+		res.dropped = m_dropped.load(std::memory_order_relaxed);
+		res.truncated = m_truncated.load(std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lck(m_mtx);
+		res.batches = m_batches;
+		return res;
+	}
+
+	void async_logger::format(std::string& out, uint64_t ts, level lvl, const char* sub, size_t sub_len, const char* msg, size_t msg_len) const {
+		char stamp[32];
+		const time_t secs = ts / 1000;
+		struct tm tm;
+		gmtime_r(&secs, &tm);
+		size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(stamp + n, sizeof(stamp) - n, ".%03uZ", (unsigned)(ts % 1000));
+
+		if(!m_opts.json) {
+			out += stamp;
+			out += ' ';
+			out += name(lvl);
+			out += " [";
+			out.append(sub, sub_len);
+			out += "] ";
+			out.append(msg, msg_len);
+			out += '\n';
+			return;
+		}
+		auto escape = [&out](const char* s, size_t len) {
+			for(size_t i = 0; i < len; i++) {
+				const unsigned char c = s[i];
+				if(c == '"' || c == '\\') {
+					out += '\\';
+					out += c;
+				} else if(c < 0x20) {
+					char buf[8];
+					snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				} else out += c;
+			}
+		};
+		out += "{\"ts\":\"";
+		out += stamp;
+		out += "\",\"level\":\"";
+		out += name(lvl);
+		out += "\",\"subsystem\":\"";
+		escape(sub, sub_len);
+		out += "\",\"msg\":\"";
+		escape(msg, msg_len);
+		out += "\"}\n";
+	}
+
+	void async_logger::drain(std::string& batch) {
+		const size_t max_line = std::min<size_t>(std::max<size_t>(m_opts.max_line, 16), 0xffff);
+		size_t pos = m_dequeue.load(std::memory_order_relaxed);
+		for(;;) {
+			slot& s = m_slots[pos & m_mask];
+			if(s.seq.load(std::memory_order_acquire) != pos + 1) break;
+			const char* text = &m_text[(pos & m_mask) * max_line];
+			// The library sometimes ends lines with a newline itself
+			size_t len = s.len;
+			while(len > s.message && (text[len - 1] == '\n' || text[len - 1] == '\r')) len--;
+			format(batch, s.ts, s.lvl, text + s.subsystem, s.subsystem_len, text + s.message, len - s.message);
+			s.seq.store(pos + m_mask + 1, std::memory_order_release);
+			pos++;
+		}
+		m_dequeue.store(pos, std::memory_order_relaxed);
+
+		// Report what the rate limit swallowed
+		for(size_t i = 0; i < limiter_count; i++) {
+			limiter& l = m_limiters[i];
+			const uint32_t n = l.suppressed.exchange(0, std::memory_order_relaxed);
+			if(!n) continue;
+			char msg[96];
+			int len;
+			if(l.name_state.load(std::memory_order_acquire) == NS_READY) {
+				len = snprintf(msg, sizeof(msg), "suppressed %u lines of %s", n, *l.name ? l.name : "(none)");
+				l.name_state.store(NS_EMPTY, std::memory_order_release);
+			} else len = snprintf(msg, sizeof(msg), "suppressed %u lines", n);
+			format(batch, now_ms(), LL_WARN, "logger", 6, msg, std::min((size_t)len, sizeof(msg) - 1));
+		}
+	}
+
+	void async_logger::run() {
+		std::string batch;
+		batch.reserve(64 * 1024);
+		std::unique_lock<std::mutex> lck(m_mtx);
+		for(;;) {
+			const bool stop = m_stop;
+			lck.unlock();
+			batch.clear();
+			drain(batch);
+			if(!batch.empty()) m_sink(batch.data(), batch.size());
+			lck.lock();
+			if(!batch.empty()) m_batches++;
+			m_written.store(m_dequeue.load(std::memory_order_relaxed), std::memory_order_release);
+			m_flushed_cv.notify_all();
+			if(stop) break;
+			m_cv.wait_for(lck, m_opts.flush_interval);
+		}
+	}
+
+	sp_debug_callbacks_t async_logger::callbacks() {
+		sp_debug_callbacks_t cbs;
+		cbs.print = [](const char* line, void* data) {
+			static_cast<async_logger*>(data)->log(line);
+		};
+		return cbs;
+	}
+}
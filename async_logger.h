@@ -0,0 +1,178 @@
+#pragma once
+
+/**
+ * @file async_logger.h
+ * @brief Asynchronous logger for ::SpRegisterDebugCallbacks.
+ *
+ * The print callback runs inside library calls, so it only parses the line, applies the
+ * level filter and rate limit and copies it into a preallocated bounded queue. No locks
+ * or allocations happen on that path; if the queue is full the line is dropped and
+ * counted. A background thread drains the queue in batches and hands them to the sink
+ * with a single write.
+ *
+ * The format of the library lines is not documented. The parser accepts an optional
+ * leading timestamp (a time "12:01:02.345", optionally after a date), a level (a word like
+ * DEBUG, INFO, WARN, ERROR, or a single letter V/D/I/W/E as "[I]", "I/", "I:" or after a
+ * timestamp) and a subsystem in brackets ("[audio:123]") or followed by a colon ("ap: ...").
+ * Anything not recognized keeps the default level, an empty subsystem and stays part of the
+ * message. Rate limited lines are reported with the subsystem they belong to.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class async_logger {
+	public:
+		enum level {
+			LL_TRACE = 0,
+			LL_DEBUG = 1,
+			LL_INFO = 2,
+			LL_WARN = 3,
+			LL_ERROR = 4
+		};
+
+		/**
+		 * @brief Result of parsing a line, offsets into the line.
+		 */
+		struct parsed {
+			level lvl = LL_INFO;
+			size_t subsystem = 0;
+			size_t subsystem_len = 0;
+			/** Start of the message after the recognized prefixes */
+			size_t message = 0;
+		};
+
+		/** @brief Receives a batch of formatted lines */
+		typedef std::function<void(const char* data, size_t len)> sink_t;
+
+		/**
+		 * @brief Tuning
+		 */
+		struct options {
+			/** Lines below this level are discarded */
+			level min_level = LL_DEBUG;
+			/** Queue slots, rounded up to a power of two */
+			size_t queue_size = 1024;
+			/** Longer lines get truncated */
+			size_t max_line = 480;
+			/** Lines per subsystem and second, 0 for no limit */
+			unsigned rate_limit = 200;
+			/** Upper bound for the time a line waits in the queue */
+			std::chrono::milliseconds flush_interval{100};
+			/** Write JSON lines instead of text */
+			bool json = false;
+		};
+
+		/**
+		 * @brief Counters
+		 */
+		struct stats {
+			uint64_t accepted = 0;
+			/** Below min_level */
+			uint64_t filtered = 0;
+			/** Over the rate limit */
+			uint64_t suppressed = 0;
+			/** Queue was full */
+			uint64_t dropped = 0;
+			uint64_t truncated = 0;
+			/** Calls of the sink */
+			uint64_t batches = 0;
+		};
+
+		/**
+		 * @brief Create a logger and start the writer thread.
+		 * @param sink Output, writes to stderr by default
+		 */
+		async_logger(options opts, sink_t sink);
+		explicit async_logger(options opts);
+		async_logger();
+		/** @brief Writes everything still queued */
+		~async_logger();
+
+		async_logger(const async_logger&) = delete;
+		async_logger& operator=(const async_logger&) = delete;
+
+		/** @brief Queue a line, safe from any thread, never blocks */
+		void log(const char* line);
+		/** @brief Wait until everything queued so far was written */
+		void flush();
+		/** @brief Change the level filter at runtime */
+		void set_level(level l) { m_min_level.store(l, std::memory_order_relaxed); }
+		/** @brief Get counters */
+		stats get_stats() const;
+
+		/** @brief Split a line into level, subsystem and message */
+		static parsed parse(const char* line);
+		static const char* name(level l);
+
+		/**
+		 * @brief Build a callback table, pass this object as data to ::SpRegisterDebugCallbacks.
+		 */
+		static sp_debug_callbacks_t callbacks();
+
+	private:
+		struct slot {
+			std::atomic<size_t> seq;
+			uint64_t ts;
+			level lvl;
+			uint16_t len;
+			uint16_t subsystem;
+			uint16_t subsystem_len;
+			uint16_t message;
+			// max_line bytes follow in m_text
+		};
+
+		// Fixed one second window counter per hashed subsystem
+		struct limiter {
+			/** Second the count belongs to */
+			std::atomic<uint64_t> window;
+			/** Lines seen in that second */
+			std::atomic<uint32_t> count;
+			std::atomic<uint32_t> suppressed;
+			/** name holds the first subsystem suppressed since the last report (NS_*) */
+			std::atomic<int> name_state;
+			char name[32];
+		};
+		enum name_state {
+			NS_EMPTY = 0,
+			NS_WRITING = 1,
+			NS_READY = 2
+		};
+		static constexpr size_t limiter_count = 64;
+
+		bool allow(const char* subsystem, size_t len, uint64_t now_ms);
+		void run();
+		void drain(std::string& batch);
+		void format(std::string& out, uint64_t ts, level lvl, const char* sub, size_t sub_len, const char* msg, size_t msg_len) const;
+
+		const options m_opts;
+		const sink_t m_sink;
+		std::atomic<int> m_min_level;
+		const size_t m_mask;
+		std::unique_ptr<slot[]> m_slots;
+		std::unique_ptr<char[]> m_text;
+		std::unique_ptr<limiter[]> m_limiters;
+		alignas(64) std::atomic<size_t> m_enqueue;
+		alignas(64) std::atomic<size_t> m_dequeue;
+		std::atomic<uint64_t> m_accepted, m_filtered, m_suppressed, m_dropped, m_truncated;
+		uint64_t m_batches;
+		std::atomic<uint64_t> m_written;
+		mutable std::mutex m_mtx;
+		std::condition_variable m_cv;
+		std::condition_variable m_flushed_cv;
+		bool m_stop;
+		std::thread m_thread;
+	};
+}
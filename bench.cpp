@@ -0,0 +1,626 @@
+/**
+ * @file bench.cpp
+ * @brief Benchmarks of the callback hot paths (benchapp).
+ *
+ * Every part of the integration is measured on its own:
+ * - audio: cost of onAudioData into a pcm_ring drained by a pcm_drain_thread, throughput
+ *   with an unpaced producer and arrival jitter at the output with a real-time producer
+ * - resampler: 44.1 to 48 kHz stereo per quality profile, input frames per second on one core
+ * - storage: alloc/write/read/close through the storage HAL table of mmap_storage with
+ *   the pattern the library produces (header, 4116 byte chunks, single byte bitmap updates)
+ * - metadata: ::SpGetMetadata and the metadata_cache refresh/snapshot paths
+ * - pump: ::SpPumpEvents while idle and while playing, share of the pump thread spent
+ *   in the library and wakeups per second of a pump_driver loop
+ *
+ * The metadata and pump benchmarks log in with login_data.h and play a playlist, -l skips
+ * them. Link against spotify_offline.cpp for a hermetic run.
+ *
+ * -w enables the write-behind journal of mmap_storage (io_uring where available), compare
+ * storage.write_call against a run without it.
+ *
+ * -m maps wmem and the pcm rings with rt_region (prefaulted, locked, huge pages for wmem)
+ * and -p runs the drain threads with SCHED_FIFO, compare the *.faults and jitter metrics
+ * of runs with and without them.
+ *
+ * -r replays a session recorded with SP_RECORD (see session_recorder.h) into the pcm ring
+ * and mmap_storage, as fast as possible unless -x sets a speed. That reproduces the load
+ * of a real session without the library.
+ *
+ * Results are written as JSON, one metric per line. Passing a previous result with -c
+ * compares against it and exits with 1 if a metric got worse by more than the tolerance.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "spotify.h"
+#include "pcm_ring.h"
+#include "storage_mmap.h"
+#include "cache_index.h"
+#include "pump_driver.h"
+#include "metadata_cache.h"
+#include "latency_probe.h"
+#include "session_recorder.h"
+#include "rt_memory.h"
+#include "resampler.h"
+#include "app_key.h"
+#include "login_data.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Which direction is an improvement, INFO metrics are never compared
+enum better {
+	HIGHER,
+	LOWER,
+	INFO
+};
+
+struct metric {
+	std::string name;
+	std::string unit;
+	better direction;
+	double value;
+};
+
+static std::vector<metric> results;
+static bool isloggedin = false;
+static bool isplaying = false;
+static std::atomic<uint64_t> frames_played(0);
+// -w, -m and -p
+static bool write_behind = false;
+static bool rt_memory = false;
+static int rt_priority = 0;
+
+static uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+static double since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void add(const std::string& name, const char* unit, better direction, double value) {
+	results.push_back(metric{ name, unit, direction, value });
+	fprintf(stderr, "  %-28s %14.2f %s\n", name.c_str(), value, unit);
+}
+
+// The histograms are in nanoseconds here, latency_histogram does not care about the unit
+static void add_histogram(const std::string& prefix, const sp::latency_histogram& h, const char* unit = "ns") {
+	add(prefix + ".p50", unit, LOWER, (double)h.percentile(50.0));
+	add(prefix + ".p99", unit, LOWER, (double)h.percentile(99.0));
+	// A single preemption decides the maximum, too noisy to fail on
+	add(prefix + ".max", unit, INFO, (double)h.max());
+}
+
+template<typename T>
+inline void clean(T& ptr) {
+	memset(&ptr, 0x00, sizeof(T));
+}
+
+// Storage of a pcm ring, an rt_region with -m
+struct ring_storage {
+	std::unique_ptr<sp::rt_region> region;
+	std::vector<short> heap;
+	short* data = NULL;
+
+	explicit ring_storage(size_t samples) {
+		if(rt_memory) {
+			sp::rt_region::options opts;
+			opts.hugepages = false;
+			region.reset(new sp::rt_region(samples * sizeof(short), opts));
+			data = (short*)region->data();
+		}
+		if(!data) {
+			heap.resize(samples);
+			data = heap.data();
+		}
+	}
+};
+
+static double faults_per_sec(const sp::page_faults& before, double elapsed) {
+	return (sp::page_faults::process() - before).minor / elapsed;
+}
+
+static void bench_audio(double secs) {
+	fprintf(stderr, "audio\n");
+	const sp_sampleformat_t fmt = { 2, 44100 };
+	const size_t block_frames = 2048;
+	std::vector<short> block(block_frames * fmt.nchannels);
+	for(size_t i = 0; i < block.size(); i++) block[i] = (short)(i * 37);
+
+	// Unpaced: the producer pushes as fast as the drain thread makes room
+	{
+		ring_storage mem(22050 * 2);
+		sp::pcm_ring ring(mem.data, 22050, 2);
+		sp::latency_histogram calls;
+		uint64_t frames = 0;
+		bench_clock::time_point start;
+		{
+			sp::pcm_drain_thread out(ring, [](const short*, size_t, const sp_sampleformat_t&) {});
+			if(rt_priority > 0) sp::rt_thread(out.native_handle(), rt_priority, -1);
+			start = bench_clock::now();
+			while(since(start) < secs) {
+				const uint64_t t0 = now_ns();
+				const unsigned long n = sp::pcm_ring::on_audio_data(block.data(), block_frames, &fmt, 0, &ring);
+				calls.record(now_ns() - t0);
+				frames += n;
+				if(n < block_frames) std::this_thread::yield();
+			}
+		}
+		add("audio.throughput", "frames/s", HIGHER, frames / since(start));
+		add_histogram("audio.callback", calls);
+	}
+
+	// Paced: blocks arrive at the frame rate, measure how regularly the output sees them
+	{
+		ring_storage mem(22050 * 2);
+		sp::pcm_ring ring(mem.data, 22050, 2);
+		sp::latency_histogram jitter;
+		uint64_t last = 0, pending = 0;
+		const sp::page_faults before = sp::page_faults::process();
+		bench_clock::time_point start;
+		{
+			sp::pcm_drain_thread out(ring, [&](const short*, size_t n, const sp_sampleformat_t& f) {
+				const uint64_t now = now_ns(), prev = last;
+				last = now;
+				// Deviation from the time the previous block needed to play
+				if(prev && pending) {
+					const int64_t expect = (int64_t)(pending * 1000000000ull / f.samplerate);
+					jitter.record((uint64_t)std::llabs((int64_t)(now - prev) - expect) / 1000);
+				}
+				pending = n;
+			}, 1024, std::chrono::milliseconds(1));
+			if(rt_priority > 0 && !sp::rt_thread(out.native_handle(), rt_priority, -1))
+				fprintf(stderr, "  SCHED_FIFO refused, measuring without\n");
+			const size_t paced_frames = 1024;
+			start = bench_clock::now();
+			uint64_t sent = 0;
+			while(since(start) < secs) {
+				sent += sp::pcm_ring::on_audio_data(block.data(), paced_frames, &fmt, 0, &ring);
+				std::this_thread::sleep_until(start + std::chrono::microseconds(sent * 1000000 / fmt.samplerate));
+			}
+		}
+		add_histogram("audio.jitter", jitter, "us");
+		add("audio.faults", "1/s", LOWER, faults_per_sec(before, since(start)));
+	}
+}
+
+static void bench_resampler(double secs) {
+	fprintf(stderr, "resampler\n");
+	const sp_sampleformat_t fmt = { 2, 44100 };
+	const size_t block_frames = 2048;
+	std::vector<short> block(block_frames * fmt.nchannels);
+	for(size_t i = 0; i < block.size(); i++) block[i] = (short)(i * 37);
+	static const struct {
+		sp::resampler::quality q;
+		const char* name;
+	} profiles[] = {
+		{ sp::resampler::RQ_FAST, "fast" },
+		{ sp::resampler::RQ_BALANCED, "balanced" },
+		{ sp::resampler::RQ_HIGH, "high" }
+	};
+	for(auto& p : profiles) {
+		// Runs on this thread only, so the rate is per core
+		sp::resampler rs(48000, p.q);
+		const size_t capacity = rs.max_output(block_frames);
+		std::vector<float> out(capacity * fmt.nchannels);
+		uint64_t frames = 0;
+		const bench_clock::time_point start = bench_clock::now();
+		while(since(start) < secs / 3) {
+			rs.process(block.data(), block_frames, fmt, out.data(), capacity);
+			frames += block_frames;
+		}
+		add(std::string("resampler.") + p.name, "frames/s", HIGHER, frames / since(start));
+	}
+}
+
+static void bench_storage(const std::string& dir, double secs) {
+	fprintf(stderr, "storage\n");
+	const unsigned nfiles = 8, chunk = 4116, header = 0x1470, bitmap = 0x070;
+	// A bit over four minutes at 160 kBit/s
+	const unsigned nchunks = 1200;
+	const unsigned size = header + nchunks * chunk;
+
+	sp::mmap_storage storage(dir);
+	sp::cache_index index;
+	storage.set_index(&index);
+	if(write_behind) storage.enable_write_behind();
+	const sp_storage_callbacks_t cbs = sp::mmap_storage::callbacks();
+	void* data = &storage;
+	std::vector<std::string> keys;
+	for(unsigned f = 0; f < nfiles; f++) {
+		char key[41];
+		snprintf(key, sizeof(key), "%08x%032x", 0xbe9c0000 + f, f);
+		keys.push_back(key);
+	}
+	std::vector<uint8_t> buf(header > chunk ? header : chunk);
+	for(size_t i = 0; i < buf.size(); i++) buf[i] = (uint8_t)(i * 13);
+
+	// Timed like the reads, eight calls alone are mostly noise
+	auto start = bench_clock::now();
+	uint64_t allocs = 0;
+	while(allocs == 0 || since(start) < secs / 2) {
+		for(auto& key : keys) cbs.alloc(key.c_str(), size, data);
+		allocs += nfiles;
+	}
+	add("storage.alloc", "ops/s", HIGHER, allocs / since(start));
+
+	// Download: header, then chunks each followed by its bitmap byte
+	start = bench_clock::now();
+	uint64_t writes = 0, bytes = 0;
+	// What the pump thread sees per chunk write
+	sp::latency_histogram calls;
+	for(auto& key : keys) {
+		memset(buf.data(), 0x00, header);
+		bytes += cbs.write(key.c_str(), 0, buf.data(), header, data);
+		writes++;
+		for(unsigned c = 0; c < nchunks; c++) {
+			const uint64_t t0 = now_ns();
+			bytes += cbs.write(key.c_str(), header + c * chunk, buf.data(), chunk, data);
+			calls.record(now_ns() - t0);
+			uint8_t bits = (uint8_t)((2u << (c % 8)) - 1);
+			bytes += cbs.write(key.c_str(), bitmap + c / 8, &bits, 1, data);
+			writes += 2;
+			// Like the pump loop between library calls
+			storage.poll();
+		}
+		cbs.close(key.c_str(), data);
+	}
+	double elapsed = since(start);
+	add("storage.write", "ops/s", HIGHER, writes / elapsed);
+	add("storage.write_bandwidth", "MB/s", HIGHER, bytes / elapsed / 1e6);
+	add_histogram("storage.write_call", calls);
+	sp::write_behind::stats wb;
+	bool uring = false;
+	if(storage.get_write_behind_stats(wb, &uring)) {
+		fprintf(stderr, "  write-behind through %s\n", uring ? "io_uring" : "pwrite");
+		add("storage.write_behind.extents", "", INFO, (double)wb.submitted);
+		add("storage.write_behind.pool_waits", "", INFO, (double)wb.pool_waits);
+	}
+
+	// Playback of cached files: sequential chunk reads
+	start = bench_clock::now();
+	uint64_t reads = 0;
+	bytes = 0;
+	while(since(start) < secs / 2) {
+		for(auto& key : keys) {
+			cbs.read(key.c_str(), 0, buf.data(), header, data);
+			for(unsigned c = 0; c < nchunks; c++) bytes += cbs.read(key.c_str(), header + c * chunk, buf.data(), chunk, data);
+			cbs.close(key.c_str(), data);
+			reads += nchunks + 1;
+		}
+	}
+	elapsed = since(start);
+	add("storage.read_sequential", "ops/s", HIGHER, reads / elapsed);
+	add("storage.read_bandwidth", "MB/s", HIGHER, bytes / elapsed / 1e6);
+
+	// Seeks: chunks of random files at random offsets
+	std::mt19937 rng(42);
+	start = bench_clock::now();
+	reads = 0;
+	while(since(start) < secs / 2) {
+		for(int i = 0; i < 1024; i++) {
+			const std::string& key = keys[rng() % nfiles];
+			cbs.read(key.c_str(), header + (rng() % nchunks) * chunk, buf.data(), chunk, data);
+		}
+		reads += 1024;
+	}
+	add("storage.read_random", "ops/s", HIGHER, reads / since(start));
+
+	for(auto& key : keys) {
+		cbs.close(key.c_str(), data);
+		unlink((dir + "/" + key).c_str());
+	}
+	rmdir(dir.c_str());
+}
+
+static bool start_session(sp::pump_driver& pump, double timeout) {
+	sp_init_config_t cfg;
+	clean(cfg);
+	cfg.version = SP_APIVERSION;
+	cfg.wmem_size = 0x1000000;
+	if(rt_memory) {
+		// Lives as long as the library, which is never freed before exit
+		static sp::rt_region wmem(cfg.wmem_size);
+		cfg.wmem = wmem.data();
+		fprintf(stderr, "wmem: %s, %s\n", sp::rt_region::backing_name(wmem.kind()), wmem.locked() ? "locked" : "not locked");
+	}
+	if(!cfg.wmem) cfg.wmem = malloc(cfg.wmem_size);
+	cfg.app_key = app_key;
+	cfg.app_key_len = sizeof(app_key);
+	cfg.uniqueid = "fd7ccecc5c988df3";
+	cfg.displayname = "Spotify_Bench";
+	cfg.brand = "UNKNOWN";
+	cfg.model = "anbox";
+	cfg.clientid = "089d841ccc194c10a77afad9e1c11d54";
+	cfg.osversion = "7.1.1_x86_64";
+	cfg.devicetype = DT_SMARTPHONE;
+	cfg.on_error = [](sp_error_t e, void*) { fprintf(stderr, "async error %d\n", (int)e); };
+	if(SpInit(&cfg) != E_OK) return false;
+
+	sp_playback_callbacks_t pcbs;
+	clean(pcbs);
+	pcbs.onNotify = [](sp_playbacknotify_t n, void*) -> int {
+		if(n == PN_PLAY) isplaying = true;
+		else if(n == PN_PAUSE || n == PN_BECAMEINACTIVE) isplaying = false;
+		return 0;
+	};
+	// Accept everything, the audio path is measured on its own
+	pcbs.onAudioData = [](const short*, unsigned long nframes, const sp_sampleformat_t*, unsigned int, void*) -> unsigned long {
+		frames_played.fetch_add(nframes, std::memory_order_relaxed);
+		return nframes;
+	};
+	SpRegisterPlaybackCallbacks(&pcbs, NULL);
+	sp_connection_callbacks_t ccbs;
+	clean(ccbs);
+	ccbs.onNotifyLoggedIn = [](const char*, const char*, void*) { isloggedin = true; };
+	SpRegisterConnectionCallbacks(&ccbs, NULL);
+
+	if(SpConnectionLoginPassword(SP_USER, SP_PASSWORD) != E_OK) return false;
+	const auto start = bench_clock::now();
+	bool requested = false;
+	while(since(start) < timeout && !(isplaying && frames_played.load())) {
+		pump.pump();
+		if(isloggedin && !requested) {
+			requested = true;
+			SpPlayUri("spotify:user:sollunad:playlist:7sZWboj9zudtQQLOWLKFXF", 0, 0);
+			pump.wake();
+		}
+		pump.set_active(isplaying);
+		pump.wait();
+	}
+	return isplaying;
+}
+
+static void bench_metadata(double secs) {
+	fprintf(stderr, "metadata\n");
+	sp_metadata_t m;
+	sp::latency_histogram fetch;
+	auto start = bench_clock::now();
+	for(int i = 0; since(start) < secs / 3; i++) {
+		const uint64_t t0 = now_ns();
+		SpGetMetadata(&m, i % 3 - 1);
+		fetch.record(now_ns() - t0);
+	}
+	add_histogram("metadata.fetch", fetch);
+
+	// Forced refresh: three fetches, the comparison and publishing
+	sp::metadata_cache cache;
+	sp::latency_histogram refresh;
+	start = bench_clock::now();
+	while(since(start) < secs / 3) {
+		cache.invalidate();
+		const uint64_t t0 = now_ns();
+		cache.refresh();
+		refresh.record(now_ns() - t0);
+	}
+	add_histogram("metadata.refresh", refresh);
+
+	// What readers on other threads pay
+	start = bench_clock::now();
+	uint64_t n = 0;
+	while(since(start) < secs / 3) {
+		for(int i = 0; i < 1024; i++) {
+			auto snap = cache.snapshot();
+			n += snap ? 1 : 0;
+		}
+	}
+	add("metadata.snapshot", "ops/s", HIGHER, n / since(start));
+}
+
+static void bench_pump(sp::pump_driver& pump, double secs) {
+	fprintf(stderr, "pump\n");
+	// Event loop while playing, like test.cpp
+	const sp::pump_driver::stats before = pump.get_stats();
+	sp::latency_histogram active;
+	uint64_t busy = 0;
+	const sp::page_faults faults = sp::page_faults::process();
+	auto start = bench_clock::now();
+	while(since(start) < secs) {
+		const uint64_t t0 = now_ns();
+		pump.pump();
+		const uint64_t t = now_ns() - t0;
+		active.record(t);
+		busy += t;
+		pump.set_active(isplaying);
+		pump.wait();
+	}
+	const double elapsed = since(start);
+	const sp::pump_driver::stats after = pump.get_stats();
+	add_histogram("pump.active", active);
+	add("pump.busy", "%", LOWER, busy / 1e9 / elapsed * 100.0);
+	add("pump.wakeups", "1/s", LOWER, (after.pumps - before.pumps) / elapsed);
+	add("pump.faults", "1/s", LOWER, faults_per_sec(faults, elapsed));
+
+	// Bare call overhead with nothing to do
+	SpPlaybackPause();
+	for(int i = 0; i < 10; i++) pump.pump();
+	sp::latency_histogram idle;
+	start = bench_clock::now();
+	while(since(start) < secs / 4) {
+		const uint64_t t0 = now_ns();
+		pump.pump();
+		idle.record(now_ns() - t0);
+	}
+	add_histogram("pump.idle", idle);
+}
+
+static void bench_replay(const char* file, const std::string& dir, double speed) {
+	fprintf(stderr, "replay\n");
+	sp::session_replayer replay(file);
+	if(!replay.valid()) {
+		fprintf(stderr, "%s is not a session recording\n", file);
+		return;
+	}
+	ring_storage mem(22050 * 2);
+	sp::pcm_ring ring(mem.data, 22050, 2);
+	// Kept between runs, so reads of files cached before the recording started hit from the second run on
+	sp::mmap_storage storage(dir + "_replay");
+	if(write_behind) storage.enable_write_behind();
+	sp::cache_index index;
+	storage.set_index(&index);
+	{
+		sp::pcm_drain_thread out(ring, [](const short*, size_t, const sp_sampleformat_t&) {});
+		sp_playback_callbacks_t pcbs;
+		clean(pcbs);
+		pcbs.onAudioData = &sp::pcm_ring::on_audio_data;
+		replay.set(pcbs, &ring);
+		replay.set(sp::mmap_storage::callbacks(), &storage);
+		if(!replay.run(speed)) fprintf(stderr, "%s is truncated\n", file);
+	}
+	replay.report(std::cerr);
+
+	const sp::session_replayer::stats& st = replay.get_stats();
+	add("replay.elapsed", "s", LOWER, st.elapsed);
+	add("replay.mismatches", "calls", INFO, (double)st.mismatches);
+	if(st.records[sp::rec::REC_AUDIO]) add_histogram("replay.audio", st.replayed[sp::rec::REC_AUDIO]);
+	if(st.records[sp::rec::REC_WRITE]) add_histogram("replay.storage_write", st.replayed[sp::rec::REC_WRITE]);
+	if(st.records[sp::rec::REC_READ]) add_histogram("replay.storage_read", st.replayed[sp::rec::REC_READ]);
+}
+
+// Quoted JSON string, the host name is whatever the machine was given
+static void write_string(std::ostream& out, const char* s) {
+	out << '"';
+	for(; *s; s++) {
+		const unsigned char c = *s;
+		if(c == '"' || c == '\\') out << '\\' << c;
+		else if(c < 0x20) {
+			static const char hex[] = "0123456789abcdef";
+			out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+		} else out << c;
+	}
+	out << '"';
+}
+
+static void write_json(std::ostream& out, double secs) {
+	struct utsname host;
+	clean(host);
+	uname(&host);
+	out << "{\n";
+	out << "\t\"library\": ";
+	write_string(out, SpGetLibraryVersion());
+	out << ",\n\t\"host\": ";
+	write_string(out, host.nodename);
+	out << ",\n\t\"machine\": ";
+	write_string(out, host.machine);
+	out << ",\n";
+	out << "\t\"cpus\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "\t\"seconds\": " << secs << ",\n";
+	out << "\t\"metrics\": [\n";
+	for(size_t i = 0; i < results.size(); i++) {
+		const metric& m = results[i];
+		char value[32];
+		snprintf(value, sizeof(value), "%.6g", m.value);
+		out << "\t\t{\"name\": \"" << m.name << "\", \"unit\": \"" << m.unit << "\", \"better\": \""
+			<< (m.direction == HIGHER ? "higher" : m.direction == LOWER ? "lower" : "none") << "\", \"value\": " << value << "}"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+// Only understands what write_json produces: one metric object per line
+static std::string json_field(const std::string& line, const char* key) {
+	const std::string tag = std::string("\"") + key + "\": ";
+	size_t pos = line.find(tag);
+	if(pos == std::string::npos) return std::string();
+	pos += tag.size();
+	if(line[pos] == '"') {
+		const size_t end = line.find('"', pos + 1);
+		return line.substr(pos + 1, end - pos - 1);
+	}
+	return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+static int compare(const char* baseline, double tolerance) {
+	std::ifstream in(baseline);
+	if(!in) {
+		fprintf(stderr, "Can't read baseline %s\n", baseline);
+		return 1;
+	}
+	int regressions = 0;
+	std::string line;
+	fprintf(stderr, "compared to %s (tolerance %.0f%%)\n", baseline, tolerance);
+	while(std::getline(in, line)) {
+		const std::string name = json_field(line, "name");
+		if(name.empty()) continue;
+		const double base = atof(json_field(line, "value").c_str());
+		auto it = std::find_if(results.begin(), results.end(), [&](const metric& m) { return m.name == name; });
+		if(it == results.end() || base == 0.0) continue;
+		const double change = (it->value - base) / base * 100.0;
+		const bool worse = it->direction == HIGHER ? change < -tolerance : it->direction == LOWER && change > tolerance;
+		regressions += worse;
+		fprintf(stderr, "  %-28s %14.2f -> %14.2f %-8s %+7.1f%%%s\n", name.c_str(), base, it->value, it->unit.c_str(), change, worse ? "  REGRESSION" : "");
+	}
+	return regressions ? 1 : 0;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr, "Usage: %s [-s seconds] [-o results.json] [-c baseline.json] [-t tolerance%%] [-d storage dir] [-l] [-w] [-m] [-p priority] [-r recording [-x speed]]\n", name);
+	fprintf(stderr, "  -l  skip the benchmarks needing a logged in library (metadata, pump)\n");
+	fprintf(stderr, "  -w  write-behind journal for storage writes\n");
+	fprintf(stderr, "  -m  prefaulted, locked (huge page) memory for wmem and the pcm rings\n");
+	fprintf(stderr, "  -p  SCHED_FIFO priority of the drain threads\n");
+	fprintf(stderr, "  -r  replay a session recording, -x 1 at the recorded pace, default as fast as possible\n");
+}
+
+int main(int argc, char** argv) {
+	double secs = 2.0, tolerance = 10.0;
+	const char* output = NULL;
+	const char* baseline = NULL;
+	std::string dir = "bench_storage";
+	bool library = true;
+	const char* recording = NULL;
+	double speed = 0.0;
+	int opt;
+	while((opt = getopt(argc, argv, "s:o:c:t:d:lwmp:r:x:h")) != -1) {
+		switch(opt) {
+			case 's': secs = atof(optarg); break;
+			case 'o': output = optarg; break;
+			case 'c': baseline = optarg; break;
+			case 't': tolerance = atof(optarg); break;
+			case 'd': dir = optarg; break;
+			case 'l': library = false; break;
+			case 'w': write_behind = true; break;
+			case 'm': rt_memory = true; break;
+			case 'p': rt_priority = atoi(optarg); break;
+			case 'r': recording = optarg; break;
+			case 'x': speed = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if(secs <= 0.0) secs = 2.0;
+
+	bench_audio(secs);
+	bench_resampler(secs);
+	bench_storage(dir, secs);
+	if(library) {
+		sp::pump_driver pump;
+		if(start_session(pump, 30.0)) {
+			bench_metadata(secs);
+			bench_pump(pump, secs);
+		} else fprintf(stderr, "Playback did not start, skipping the library benchmarks\n");
+		SpFree();
+	}
+	if(recording) bench_replay(recording, dir, speed);
+
+	if(output) {
+		std::ofstream out(output);
+		write_json(out, secs);
+	} else write_json(std::cout, secs);
+	return baseline ? compare(baseline, tolerance) : 0;
+}
@@ -0,0 +1,122 @@
+#include "cache_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace sp {
+
+	constexpr size_t cache_file_index::header_size;
+	constexpr size_t cache_file_index::max_chunks;
+
+	cache_file_index::cache_file_index()
+		: m_valid(false)
+	{
+		memset(&m_hdr, 0x00, sizeof(m_hdr));
+	}
+
+	bool cache_file_index::parse(const void* data, size_t len) {
+		if(len < header_size) return false;
+		memcpy(&m_hdr, data, header_size);
+		return check();
+	}
+
+	bool cache_file_index::update(uint64_t offset, const void* buf, size_t size) {
+		if(offset >= header_size) return false;
+		size_t n = std::min<uint64_t>(size, header_size - offset);
+		memcpy((uint8_t*)&m_hdr + offset, buf, n);
+		check();
+		return true;
+	}
+
+	size_t cache_file_index::chunk_count() const {
+		if(!m_valid) return 0;
+		return (m_hdr.datasize + m_hdr.chunksize - 1) / m_hdr.chunksize;
+	}
+
+	size_t cache_file_index::chunks_present() const {
+		size_t count = chunk_count();
+		size_t res = 0;
+		for(size_t i = 0; i < count / 8; i++)
+			res += __builtin_popcount(m_hdr.bitmap[i]);
+		for(size_t i = count & ~size_t(7); i < count; i++)
+			res += has_chunk(i) ? 1 : 0;
+		return res;
+	}
+
+	bool cache_file_index::has_chunk(size_t idx) const {
+		if(idx >= chunk_count()) return false;
+		return (m_hdr.bitmap[idx / 8] >> (idx % 8)) & 1;
+	}
+
+	bool cache_file_index::has_range(uint64_t offset, uint64_t len) const {
+		if(!m_valid || offset >= m_hdr.datasize) return false;
+		if(len == 0) return true;
+		uint64_t end = std::min<uint64_t>(offset + len, m_hdr.datasize);
+		for(size_t i = offset / m_hdr.chunksize; i <= (end - 1) / m_hdr.chunksize; i++)
+			if(!has_chunk(i)) return false;
+		return true;
+	}
+
+	bool cache_file_index::has_file_range(uint64_t offset, uint64_t len) const {
+		if(!m_valid) return false;
+		uint64_t end = offset + len;
+		if(end <= header_size) return true;
+		uint64_t start = std::max<uint64_t>(offset, header_size);
+		return has_range(start - header_size, end - start);
+	}
+
+	double cache_file_index::completeness() const {
+		size_t count = chunk_count();
+		if(count == 0) return 0.0;
+		return (double)chunks_present() / count;
+	}
+
+	bool cache_file_index::check() {
+		m_valid = m_hdr.chunksize != 0 && m_hdr.datasize != 0
+			&& (m_hdr.datasize + (uint64_t)m_hdr.chunksize - 1) / m_hdr.chunksize <= max_chunks;
+		return m_valid;
+	}
+
+	void cache_index::load(const std::string& key, const void* header, size_t len) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		cache_file_index idx;
+		if(idx.parse(header, len)) m_files[key] = idx;
+	}
+
+	void cache_index::on_write(const std::string& key, uint64_t offset, const void* buf, size_t size) {
+		if(offset >= cache_file_index::header_size) return;
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_files[key].update(offset, buf, size);
+	}
+
+	void cache_index::forget(const std::string& key) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_files.erase(key);
+	}
+
+	bool cache_index::known(const std::string& key) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_files.find(key);
+		return it != m_files.end() && it->second.valid();
+	}
+
+	bool cache_index::has_file_range(const std::string& key, uint64_t offset, uint64_t len) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_files.find(key);
+		return it != m_files.end() && it->second.has_file_range(offset, len);
+	}
+
+	double cache_index::completeness(const std::string& key) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_files.find(key);
+		return it == m_files.end() ? 0.0 : it->second.completeness();
+	}
+
+	std::map<std::string, double> cache_index::completeness() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		std::map<std::string, double> res;
+		for(auto& e : m_files)
+			if(e.second.valid()) res[e.first] = e.second.completeness();
+		return res;
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+/**
+ * @file cache_index.h
+ * @brief In-memory chunk index of the cache files written through the storage HAL.
+ *
+ * The library writes a header in front of every cache file (see the end of spotify.h)
+ * whose bitmap marks which chunks of the track data are present. Mirroring that header
+ * in memory allows the storage HAL to answer "is this range present" without touching
+ * the disk and to track per file completeness.
+ *
+ * The layout is reverse engineered. The bitmap is assumed to be LSB first (chunk n is bit
+ * n % 8 of byte n / 8) and the track data is assumed to directly follow the header.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace sp {
+
+	/**
+	 * @brief Cache file header as documented in spotify.h
+	 */
+	struct cache_file_header {
+		uint32_t num1;
+		/** Size of encrypted track data */
+		uint32_t datasize;
+		/** Size of a chunk in the bitmap (4116) */
+		uint32_t chunksize;
+		uint32_t num2;
+		uint32_t num3;
+		uint32_t num4;
+		uint8_t blob1[36];
+		uint8_t blob2[52];
+		/** Chunk availability bitmap */
+		uint8_t bitmap[0x1400];
+	};
+	static_assert(sizeof(cache_file_header) == 0x1470, "cache file header size mismatch");
+
+	/**
+	 * @brief Chunk index of a single cache file.
+	 */
+	class cache_file_index {
+	public:
+		/** @brief Size of the header in front of the track data */
+		static constexpr size_t header_size = sizeof(cache_file_header);
+		/** @brief Maximum number of chunks the bitmap can describe */
+		static constexpr size_t max_chunks = sizeof(cache_file_header::bitmap) * 8;
+
+		cache_file_index();
+
+		/**
+		 * @brief Parse a complete header.
+		 * @return false if len is too short or the header is implausible
+		 */
+		bool parse(const void* data, size_t len);
+		/**
+		 * @brief Apply a write done by the library.
+		 * @param offset Offset in the cache file
+		 * @param buf Data written
+		 * @param size Length of data
+		 * @return true if the write touched the header
+		 */
+		bool update(uint64_t offset, const void* buf, size_t size);
+
+		/** @brief True once datasize and chunksize are known */
+		bool valid() const { return m_valid; }
+		/** @brief Size of the track data */
+		uint32_t datasize() const { return m_hdr.datasize; }
+		/** @brief Size of one chunk */
+		uint32_t chunksize() const { return m_hdr.chunksize; }
+		/** @brief Number of chunks the track data is split into */
+		size_t chunk_count() const;
+		/** @brief Number of chunks marked as present */
+		size_t chunks_present() const;
+		/** @brief Check if a single chunk is present */
+		bool has_chunk(size_t idx) const;
+		/** @brief Check if all chunks covering a range of the track data are present */
+		bool has_range(uint64_t offset, uint64_t len) const;
+		/**
+		 * @brief Check a range in cache file coordinates.
+		 *
+		 * Header bytes always count as present, unknown files never do.
+		 */
+		bool has_file_range(uint64_t offset, uint64_t len) const;
+		/** @brief Fraction of present chunks (0.0 - 1.0) */
+		double completeness() const;
+
+	private:
+		bool check();
+
+		cache_file_header m_hdr;
+		bool m_valid;
+	};
+
+	/**
+	 * @brief Chunk indices of all cache files, keyed by storage key.
+	 *
+	 * Thread safe, so completeness can be queried from other threads than the pump thread.
+	 */
+	class cache_index {
+	public:
+		/** @brief Prime an entry from a header read from disk */
+		void load(const std::string& key, const void* header, size_t len);
+		/** @brief Apply a write done by the library */
+		void on_write(const std::string& key, uint64_t offset, const void* buf, size_t size);
+		/** @brief Drop an entry, e.g. because the file got reallocated */
+		void forget(const std::string& key);
+		/** @brief True if the index knows the header of key */
+		bool known(const std::string& key) const;
+		/** @brief See cache_file_index::has_file_range */
+		bool has_file_range(const std::string& key, uint64_t offset, uint64_t len) const;
+		/** @brief Completeness of a file, 0.0 for unknown files */
+		double completeness(const std::string& key) const;
+		/** @brief Completeness of all known files */
+		std::map<std::string, double> completeness() const;
+
+	private:
+		mutable std::mutex m_mtx;
+		std::map<std::string, cache_file_index> m_files;
+	};
+}
@@ -0,0 +1,136 @@
+/**
+ * @file corotest.cpp
+ * @brief Runs spotify_coro.hpp workflows against the offline stand-in (corotestapp).
+ *
+ * spotify_coro.hpp needs C++20 while the rest of the repository is C++14, so it has its own
+ * executable instead of a selftest.cpp section. The workflows cover:
+ * - login: a rejected password fails through on_error, a good one completes
+ * - play: play_uri completes with the first audio frames, a bad uri fails right away
+ * - seek: completes with onSeek, the position is where the seek went
+ * - cancel: a stop token ends a wait from another workflow, an event that never comes times out
+ *
+ * Needs the offline stand-in (spotify_offline.cpp), exits with 1 if any check failed.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stop_token>
+#include <vector>
+
+#include "spotify.h"
+#include "spotify.hpp"
+#include "spotify_coro.hpp"
+#include "pump_driver.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+/*
+ * Playback handler for spotify.hpp, forwards to the coroutine session and feeds it the
+ * delivered frames.
+ */
+struct coro_player {
+	sp::coro_session& session;
+	uint64_t frames = 0;
+
+	void on_notify(sp_playbacknotify_t n) { session.on_notify(n); }
+	void on_seek(uint64_t position) { session.on_seek(position); }
+	unsigned long on_audio_data(const short*, unsigned long nframes, const sp_sampleformat_t&) {
+		frames += nframes;
+		session.on_frames(nframes);
+		return nframes;
+	}
+};
+
+static sp::task<> login_flow(sp::coro_session& s) {
+	sp::op_result r = co_await s.login("corotest", "");
+	CHECK(r.status == sp::WR_ERROR && r.error == E_LOGIN_BAD_CREDENTIALS);
+	r = co_await s.login("corotest", "secret");
+	CHECK(r);
+	CHECK(SpConnectionIsLoggedIn());
+}
+
+static sp::task<> play_flow(sp::coro_session& s, coro_player& p) {
+	sp::op_result r = co_await s.play_uri("nospotify:playlist", 0, 0);
+	CHECK(r.status == sp::WR_ERROR && r.error == E_INVALID_ARGUMENT);
+	r = co_await s.play_uri("spotify:user:corotest:playlist:coro", 0, 0);
+	CHECK(r);
+	CHECK(p.frames > 0);
+
+	r = co_await s.seek(10000);
+	CHECK(r);
+	CHECK(SpPlaybackGetPosition() >= 10000 && SpPlaybackGetPosition() < 12000);
+}
+
+// Waits for an event that never comes until the token stops it
+static sp::task<> waiter_flow(sp::coro_session& s, std::stop_token token, sp::op_result& out) {
+	out = co_await s.next_event(PN_SHUFFLEON).cancel_on(token);
+}
+
+static sp::task<> cancel_flow(sp::coro_session& s, std::stop_source& stop) {
+	sp::op_result r = co_await s.next_event(PN_REPEATON).timeout(std::chrono::milliseconds(50));
+	CHECK(r.status == sp::WR_TIMEOUT);
+	co_await s.sleep_for(std::chrono::milliseconds(20));
+	stop.request_stop();
+	// Already cancelled before it is awaited
+	r = co_await s.seek(0).cancel_on(stop.get_token());
+	CHECK(r.status == sp::WR_CANCELLED);
+}
+
+int main() {
+	if(strncmp(SpGetLibraryVersion(), "offline-", 8) != 0) {
+		fprintf(stderr, "needs the offline stand-in\n");
+		return 1;
+	}
+
+	sp::coro_session::options opts;
+	opts.timeout = std::chrono::milliseconds(5000);
+	sp::coro_session cs(opts);
+	coro_player player{cs};
+
+	static const uint8_t key[321] = { 0 };
+	sp_init_config_t cfg;
+	memset(&cfg, 0x00, sizeof(cfg));
+	cfg.version = SP_APIVERSION;
+	cfg.wmem_size = 0x80000;
+	cfg.app_key = key;
+	cfg.app_key_len = sizeof(key);
+	cfg.uniqueid = "corotest";
+	cfg.displayname = "corotest";
+	cfg.on_error = [](sp_error_t e, void* data) { ((sp::coro_session*)data)->on_error(e); };
+	cfg.on_error_context = &cs;
+	sp::session session(cfg);
+	CHECK(session.valid());
+	CHECK(session.attach_connection(cs) == E_OK);
+	CHECK(session.attach_playback(player) == E_OK);
+
+	sp::pump_driver pump;
+	fprintf(stderr, "login\n");
+	cs.spawn(login_flow(cs));
+	cs.run(pump);
+
+	fprintf(stderr, "play\n");
+	cs.spawn(play_flow(cs, player));
+	cs.run(pump);
+
+	fprintf(stderr, "cancel\n");
+	std::stop_source stop;
+	sp::op_result waited{sp::WR_OK, E_OK};
+	cs.spawn(waiter_flow(cs, stop.get_token(), waited));
+	cs.spawn(cancel_flow(cs, stop));
+	cs.run(pump);
+	CHECK(waited.status == sp::WR_CANCELLED);
+
+	CHECK(cs.active() == 0);
+	CHECK(cs.get_stats().timeouts == 1);
+	CHECK(cs.get_stats().cancelled == 2);
+	fprintf(stderr, failures ? "FAILED\n" : "ok\n");
+	return failures ? 1 : 0;
+}
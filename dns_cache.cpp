@@ -0,0 +1,149 @@
+#include "dns_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace sp {
+
+	constexpr int dns_cache::lookup_failed;
+	constexpr int dns_cache::lookup_pending;
+
+	dns_cache::dns_cache(options opts, resolver_t resolver)
+		: m_opts(opts), m_resolver(std::move(resolver)), m_thread([this]() { run(); })
+	{}
+
+	dns_cache::dns_cache()
+		: dns_cache(options(), &dns_cache::system_resolver)
+	{}
+
+	dns_cache::~dns_cache() {
+		{
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_stop = true;
+		}
+		m_work_cv.notify_all();
+		m_thread.join();
+	}
+
+	int dns_cache::lookup(const char* host, struct sockaddr* out) {
+		std::unique_lock<std::mutex> lck(m_mtx);
+		const auto now = clock::now();
+		entry& e = m_entries[host];
+		e.last_used = now;
+		if(e.resolved) {
+			if(now >= e.refresh_at) enqueue(host, e);
+			if(!e.ok && now < e.expires) {
+				m_stats.negative_hits++;
+				return lookup_failed;
+			}
+			if(e.ok) {
+				if(now < e.expires) m_stats.hits++;
+				else m_stats.stale_hits++;
+			}
+		}
+		if(!e.resolved || !e.ok) {
+			// Nothing usable cached, give the resolver a moment and let the library retry otherwise
+			m_stats.misses++;
+			enqueue(host, e);
+			if(!m_done_cv.wait_for(lck, m_opts.miss_timeout, [&]() { return !e.queued; })) {
+				m_stats.pending++;
+				return lookup_pending;
+			}
+			if(!e.ok) return lookup_failed;
+		}
+		memset(out, 0x00, 16);
+		memcpy(out, &e.addr, 16);
+		// The library expects family and port to be zero
+		memset(out, 0x00, 4);
+		return 0;
+	}
+
+	void dns_cache::prefetch(const std::string& host) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		entry& e = m_entries[host];
+		e.last_used = clock::now();
+		enqueue(host, e);
+	}
+
+	dns_cache::stats dns_cache::get_stats() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_stats;
+	}
+
+	bool dns_cache::system_resolver(const std::string& host, struct sockaddr_in& addr, std::chrono::seconds&) {
+		struct addrinfo hints;
+		memset(&hints, 0x00, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* info;
+		if(getaddrinfo(host.c_str(), NULL, &hints, &info) != 0) return false;
+		memcpy(&addr, info->ai_addr, sizeof(addr));
+		freeaddrinfo(info);
+		return true;
+	}
+
+	sp_dnshal_callbacks_t dns_cache::callbacks() {
+		sp_dnshal_callbacks_t cbs;
+		memset(&cbs, 0x00, sizeof(cbs));
+		cbs.lookup = [](const char* host, struct sockaddr* addr, void* data) {
+			return static_cast<dns_cache*>(data)->lookup(host, addr);
+		};
+		return cbs;
+	}
+
+	void dns_cache::enqueue(const std::string& host, entry& e) {
+		if(e.queued || clock::now() < e.retry_at) return;
+		e.queued = true;
+		m_queue.push_back(host);
+		m_work_cv.notify_one();
+	}
+
+	void dns_cache::run() {
+		std::unique_lock<std::mutex> lck(m_mtx);
+		while(!m_stop) {
+			if(m_queue.empty()) {
+				// Refresh entries that are still in use before they expire
+				const auto now = clock::now();
+				for(auto& e : m_entries) {
+					if(e.second.resolved && e.second.ok && now - e.second.last_used < m_opts.hot_window
+						&& now >= e.second.refresh_at)
+						enqueue(e.first, e.second);
+				}
+			}
+			if(m_queue.empty()) {
+				m_work_cv.wait_for(lck, std::chrono::seconds(1));
+				continue;
+			}
+			std::string host = m_queue.front();
+			m_queue.pop_front();
+
+			lck.unlock();
+			struct sockaddr_in addr;
+			memset(&addr, 0x00, sizeof(addr));
+			std::chrono::seconds ttl = m_opts.positive_ttl;
+			bool ok = m_resolver(host, addr, ttl);
+			lck.lock();
+
+			m_stats.resolves++;
+			entry& e = m_entries[host];
+			e.queued = false;
+			const auto now = clock::now();
+			if(ok) {
+				e.addr = addr;
+				e.ok = true;
+				e.expires = now + ttl;
+				// TTLs shorter than refresh_ahead would otherwise be refreshed in a loop
+				e.refresh_at = e.expires - std::min<clock::duration>(m_opts.refresh_ahead, clock::duration(ttl) / 2);
+			} else {
+				m_stats.failures++;
+				// Keep serving a previously good address, only cache the failure for unknown names
+				if(!e.ok) e.refresh_at = e.expires = now + m_opts.negative_ttl;
+				e.retry_at = now + m_opts.negative_ttl;
+			}
+			e.resolved = true;
+			m_done_cv.notify_all();
+		}
+	}
+}
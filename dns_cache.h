@@ -0,0 +1,140 @@
+#pragma once
+
+/**
+ * @file dns_cache.h
+ * @brief Caching DNS HAL for ::SpRegisterDnsHALCallbacks.
+ *
+ * Lookups are answered from an in-memory cache with TTLs for positive and negative
+ * results. Resolution runs on a background thread: entries that are used get refreshed
+ * shortly before they expire and expired entries are still served while a refresh is
+ * running, so a reconnect (CS_RECONNECT) does not wait on name resolution. A cold miss
+ * waits a few milliseconds for the resolver and then returns lookup_pending instead of
+ * blocking the pump thread; the answer is cached for the library's next attempt.
+ *
+ * The resolver is pluggable, selftestapp dns runs the cache against a local stub.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <netinet/in.h>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class dns_cache {
+	public:
+		/**
+		 * @brief Resolve a host name.
+		 * @param host Name to resolve
+		 * @param addr Receives the address on success
+		 * @param ttl Receives the TTL of the answer, leave untouched to use the default
+		 * @return true on success
+		 */
+		typedef std::function<bool(const std::string& host, struct sockaddr_in& addr, std::chrono::seconds& ttl)> resolver_t;
+
+		/**
+		 * @brief Cache tuning
+		 */
+		struct options {
+			/** TTL used if the resolver does not report one */
+			std::chrono::seconds positive_ttl{300};
+			/** TTL of failed lookups */
+			std::chrono::seconds negative_ttl{30};
+			/** Entries used within this window get refreshed before they expire */
+			std::chrono::seconds hot_window{600};
+			/** How long before expiry hot entries get refreshed, at most half the TTL */
+			std::chrono::seconds refresh_ahead{30};
+			/** Maximum time a cold miss blocks the caller before lookup_pending is returned */
+			std::chrono::milliseconds miss_timeout{20};
+		};
+
+		/**
+		 * @brief Counters
+		 */
+		struct stats {
+			/** Answered from a valid entry */
+			uint64_t hits = 0;
+			/** Answered from an expired entry while it is being refreshed */
+			uint64_t stale_hits = 0;
+			/** Answered from a cached failure */
+			uint64_t negative_hits = 0;
+			/** Had to wait for the resolver */
+			uint64_t misses = 0;
+			/** Misses answered with lookup_pending */
+			uint64_t pending = 0;
+			/** Resolver calls */
+			uint64_t resolves = 0;
+			/** Failed resolver calls */
+			uint64_t failures = 0;
+		};
+
+		/** @brief Error returned to the library if a name can not be resolved */
+		static constexpr int lookup_failed = -10001;
+		/** @brief Retryable error returned while a cold miss is still being resolved */
+		static constexpr int lookup_pending = -EAGAIN;
+
+		dns_cache(options opts, resolver_t resolver);
+		/** @brief Create a cache using getaddrinfo and default options */
+		dns_cache();
+		~dns_cache();
+
+		dns_cache(const dns_cache&) = delete;
+		dns_cache& operator=(const dns_cache&) = delete;
+
+		/**
+		 * @brief See sp_dnshal_callbacks_t::lookup
+		 * @return 0 on success, lookup_pending if the name is still being resolved, lookup_failed otherwise
+		 */
+		int lookup(const char* host, struct sockaddr* out);
+		/** @brief Resolve a name in the background, e.g. the access points before login */
+		void prefetch(const std::string& host);
+		/** @brief Get counters */
+		stats get_stats() const;
+
+		/** @brief Blocking getaddrinfo based resolver (IPv4 only, the library passes 16 byte addresses) */
+		static bool system_resolver(const std::string& host, struct sockaddr_in& addr, std::chrono::seconds& ttl);
+
+		/**
+		 * @brief Build a callback table, pass this object as data to ::SpRegisterDnsHALCallbacks.
+		 */
+		static sp_dnshal_callbacks_t callbacks();
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct entry {
+			struct sockaddr_in addr;
+			bool ok = false;
+			bool resolved = false;
+			bool queued = false;
+			clock::time_point expires;
+			clock::time_point refresh_at;
+			clock::time_point last_used;
+			clock::time_point retry_at;
+		};
+
+		void enqueue(const std::string& host, entry& e);
+		void run();
+
+		const options m_opts;
+		const resolver_t m_resolver;
+		mutable std::mutex m_mtx;
+		std::condition_variable m_work_cv;
+		std::condition_variable m_done_cv;
+		std::map<std::string, entry> m_entries;
+		std::deque<std::string> m_queue;
+		stats m_stats;
+		bool m_stop = false;
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,127 @@
+#include "image_cache.h"
+
+#include <cstring>
+#include <vector>
+
+namespace sp {
+
+	constexpr size_t image_cache::initial_buffer;
+	constexpr size_t image_cache::max_buffer;
+
+	image_cache::image_cache(size_t max_bytes, fetch_t fetch)
+		: m_max_bytes(max_bytes), m_fetch(std::move(fetch)), m_buf_size(initial_buffer)
+	{}
+
+	sp_error_t image_cache::resolve(const char* image_uri, std::string& url) {
+		if(!image_uri) return E_NULL_ARGUMENT;
+		if(!*image_uri) return E_INVALID_ARGUMENT;
+		if(find(image_uri, url)) return E_OK;
+
+		sp_error_t res = fetch(image_uri, url);
+		if(res == E_OK) insert(image_uri, url, false);
+		return res;
+	}
+
+	void image_cache::prefetch(const metadata_snapshot& snap) {
+		for(int idx = 0; idx <= 1; idx++) {
+			const track_info& t = snap.get(idx);
+			if(!t.valid || !*t.image_uri) continue;
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				if(m_index.count(t.image_uri)) continue;
+			}
+			// The current track is looked up right away, only the next track's entry is ahead of time
+			std::string url;
+			if(fetch(t.image_uri, url) == E_OK) insert(t.image_uri, url, idx == 1);
+		}
+	}
+
+	bool image_cache::lookup(const char* image_uri, std::string& url) {
+		if(!image_uri || !*image_uri) return false;
+		return find(image_uri, url);
+	}
+
+	void image_cache::clear() {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_lru.clear();
+		m_index.clear();
+		m_stats.entries = 0;
+		m_stats.bytes = 0;
+	}
+
+	image_cache::stats image_cache::get_stats() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_stats;
+	}
+
+	sp_error_t image_cache::fetch(const char* image_uri, std::string& url) {
+		std::vector<char> buf;
+		sp_error_t res = E_FAILED;
+		for(size_t size = m_buf_size; size <= max_buffer; size *= 2) {
+			if(size != m_buf_size) {
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_stats.grows++;
+			}
+			buf.assign(size, '\0');
+			res = m_fetch(image_uri, buf.data(), buf.size());
+			{
+				std::lock_guard<std::mutex> lck(m_mtx);
+				m_stats.fetches++;
+			}
+			// A url filling the whole buffer might have been cut off, retry with more room
+			size_t len = strnlen(buf.data(), buf.size());
+			if(res == E_OK && len < size - 1) {
+				m_buf_size = size;
+				url.assign(buf.data(), len);
+				return E_OK;
+			}
+			// It is not documented which error a too small buffer causes, only retry the plausible ones
+			if(res != E_OK && res != E_INVALID_ARGUMENT && res != E_FAILED) break;
+		}
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_stats.failures++;
+		return res == E_OK ? E_FAILED : res;
+	}
+
+	bool image_cache::find(const std::string& uri, std::string& url) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_index.find(uri);
+		if(it == m_index.end()) {
+			m_stats.misses++;
+			return false;
+		}
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		entry& e = *it->second;
+		m_stats.hits++;
+		if(e.prefetched) {
+			m_stats.prefetch_hits++;
+			e.prefetched = false;
+		}
+		url = e.url;
+		return true;
+	}
+
+	void image_cache::insert(const std::string& uri, const std::string& url, bool prefetched) {
+		const size_t size = uri.size() + url.size();
+		if(size > m_max_bytes) return;
+
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_index.find(uri);
+		if(it != m_index.end()) {
+			m_stats.bytes -= it->second->uri.size() + it->second->url.size();
+			m_lru.erase(it->second);
+			m_index.erase(it);
+		}
+		while(!m_lru.empty() && m_stats.bytes + size > m_max_bytes) {
+			const entry& last = m_lru.back();
+			m_stats.bytes -= last.uri.size() + last.url.size();
+			m_index.erase(last.uri);
+			m_lru.pop_back();
+			m_stats.evictions++;
+		}
+		m_lru.push_front(entry{uri, url, prefetched});
+		m_index[uri] = m_lru.begin();
+		m_stats.bytes += size;
+		m_stats.entries = m_lru.size();
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * @file image_cache.h
+ * @brief Cover art url cache on top of ::SpGetMetadataImageURL.
+ *
+ * Maps image uris to urls with a byte budget and LRU eviction. The image of the next track
+ * is resolved when the metadata changes, so at the track change the url is already known.
+ * The buffer passed to the library starts at 128 bytes and grows if a url does not fit,
+ * the size that worked is kept for later calls.
+ *
+ * The library is only called from resolve() and prefetch() (pump thread), lookup() is safe
+ * to call from any thread.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "spotify.h"
+#include "metadata_cache.h"
+
+namespace sp {
+
+	class image_cache {
+	public:
+		/** @brief Url source, ::SpGetMetadataImageURL by default */
+		typedef std::function<sp_error_t(const char* uri, char* buf, unsigned long long int buf_size)> fetch_t;
+
+		/**
+		 * @brief Counters
+		 */
+		struct stats {
+			/** Answered from the cache */
+			uint64_t hits = 0;
+			/** First use of a next track entry that was added by prefetch() */
+			uint64_t prefetch_hits = 0;
+			/** Not in the cache */
+			uint64_t misses = 0;
+			/** Library calls */
+			uint64_t fetches = 0;
+			/** Failed resolutions */
+			uint64_t failures = 0;
+			/** Retries with a larger buffer */
+			uint64_t grows = 0;
+			/** Entries dropped to stay within the budget */
+			uint64_t evictions = 0;
+			/** Cached entries */
+			size_t entries = 0;
+			/** Bytes used by cached uris and urls */
+			size_t bytes = 0;
+		};
+
+		/** @brief Initial buffer size */
+		static constexpr size_t initial_buffer = 128;
+		/** @brief Largest buffer tried before giving up */
+		static constexpr size_t max_buffer = 4096;
+
+		/**
+		 * @brief Create a cache.
+		 * @param max_bytes Budget for uris and urls
+		 * @param fetch Url source
+		 */
+		explicit image_cache(size_t max_bytes = 16 * 1024, fetch_t fetch = &SpGetMetadataImageURL);
+
+		image_cache(const image_cache&) = delete;
+		image_cache& operator=(const image_cache&) = delete;
+
+		/**
+		 * @brief Get the url of an image, calling the library on a miss (pump thread).
+		 * @param image_uri Image uri as in ::sp_metadata_t::image_uri
+		 * @param url Receives the url
+		 */
+		sp_error_t resolve(const char* image_uri, std::string& url);
+		/** @brief Resolve the images of the current and next track of a snapshot (pump thread) */
+		void prefetch(const metadata_snapshot& snap);
+		/**
+		 * @brief Get a cached url without calling the library, safe from any thread.
+		 * @return false if the url is not cached
+		 */
+		bool lookup(const char* image_uri, std::string& url);
+		/** @brief Drop all entries */
+		void clear();
+		/** @brief Get counters */
+		stats get_stats() const;
+		/** @brief Buffer size currently used for library calls (pump thread) */
+		size_t buffer_size() const { return m_buf_size; }
+
+	private:
+		struct entry {
+			std::string uri;
+			std::string url;
+			bool prefetched;
+		};
+		typedef std::list<entry> lru_t;
+
+		sp_error_t fetch(const char* image_uri, std::string& url);
+		bool find(const std::string& uri, std::string& url);
+		void insert(const std::string& uri, const std::string& url, bool prefetched);
+
+		const size_t m_max_bytes;
+		const fetch_t m_fetch;
+		size_t m_buf_size;
+		mutable std::mutex m_mtx;
+		// Most recently used first
+		lru_t m_lru;
+		std::unordered_map<std::string, lru_t::iterator> m_index;
+		stats m_stats;
+	};
+}
@@ -0,0 +1,207 @@
+#include "latency_probe.h"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace sp {
+
+	// 64 sub-buckets per power of two, values below 128 are exact
+	static const unsigned sub_bits = 7;
+	static const size_t sub_half = 1u << (sub_bits - 1);
+
+	constexpr uint64_t latency_histogram::max_value;
+	constexpr std::chrono::milliseconds latency_probe::audio_idle;
+
+	latency_histogram::latency_histogram()
+		: m_buckets(index(max_value) + 1), m_count(0), m_min(0), m_max(0), m_sum(0)
+	{}
+
+	size_t latency_histogram::index(uint64_t v) {
+		if(v < (1u << sub_bits)) return v;
+		const unsigned magnitude = 63 - __builtin_clzll(v);
+		const unsigned shift = magnitude - sub_bits + 1;
+		return ((size_t)shift << (sub_bits - 1)) + (v >> shift);
+	}
+
+	uint64_t latency_histogram::value(size_t idx) {
+		if(idx < (1u << sub_bits)) return idx;
+		const unsigned shift = (idx >> (sub_bits - 1)) - 1;
+		const uint64_t low = (uint64_t)(idx - ((size_t)shift << (sub_bits - 1))) << shift;
+		// Middle of the bucket
+		return low + ((1ull << shift) >> 1);
+	}
+
+	void latency_histogram::record(uint64_t us) {
+		if(us > max_value) us = max_value;
+		m_buckets[index(us)]++;
+		if(!m_count || us < m_min) m_min = us;
+		if(us > m_max) m_max = us;
+		m_count++;
+		m_sum += us;
+	}
+
+	void latency_histogram::merge(const latency_histogram& other) {
+		if(!other.m_count) return;
+		for(size_t i = 0; i < m_buckets.size(); i++) m_buckets[i] += other.m_buckets[i];
+		if(!m_count || other.m_min < m_min) m_min = other.m_min;
+		if(other.m_max > m_max) m_max = other.m_max;
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+	}
+
+	void latency_histogram::reset() {
+		std::fill(m_buckets.begin(), m_buckets.end(), 0);
+		m_count = m_min = m_max = m_sum = 0;
+	}
+
+	uint64_t latency_histogram::percentile(double p) const {
+		if(!m_count) return 0;
+		if(p >= 100.0) return m_max;
+		uint64_t rank = (uint64_t)(p / 100.0 * m_count + 0.5);
+		if(rank < 1) rank = 1;
+		uint64_t seen = 0;
+		for(size_t i = 0; i < m_buckets.size(); i++) {
+			seen += m_buckets[i];
+			if(seen >= rank) return std::min(std::max(value(i), m_min), m_max);
+		}
+		return m_max;
+	}
+
+	void latency_histogram::dump(std::ostream& out) const {
+		for(size_t i = 0; i < m_buckets.size(); i++)
+			if(m_buckets[i]) out << value(i) << " " << m_buckets[i] << "\n";
+	}
+
+	// Milestones each operation waits for
+	static unsigned milestones(latency_probe::operation op) {
+		if(op == latency_probe::OP_LOGIN) return 1u << latency_probe::MS_EVENT;
+		return (1u << latency_probe::MS_EVENT) | (1u << latency_probe::MS_FIRST_AUDIO);
+	}
+
+	latency_probe::latency_probe()
+		: m_superseded(), m_audio_armed(false)
+	{}
+
+	void latency_probe::begin(operation op) {
+		pending& p = m_pending[op];
+		if(p.outstanding) m_superseded[op]++;
+		p.start = clock::now();
+		p.outstanding = milestones(op);
+		p.audio_gate = p.start - m_last_frames > audio_idle;
+		update_armed();
+	}
+
+	void latency_probe::abort(operation op) {
+		m_pending[op].outstanding = 0;
+		update_armed();
+	}
+
+	void latency_probe::on_notify(sp_playbacknotify_t n) {
+		const auto now = clock::now();
+		switch(n) {
+			case PN_PLAY:
+				complete(OP_PLAY_URI, MS_EVENT, now);
+				break;
+			case PN_TRACKCHANGED:
+				complete(OP_SKIP_NEXT, MS_EVENT, now);
+				complete(OP_SKIP_PREV, MS_EVENT, now);
+				for(int op = 0; op < OP_COUNT; op++) open_gate((operation)op);
+				break;
+			case PN_AUDIOFLUSH:
+				for(int op = 0; op < OP_COUNT; op++) open_gate((operation)op);
+				break;
+			default:
+				return;
+		}
+		update_armed();
+	}
+
+	void latency_probe::on_seek() {
+		complete(OP_SEEK, MS_EVENT, clock::now());
+		for(int op = 0; op < OP_COUNT; op++) open_gate((operation)op);
+		update_armed();
+	}
+
+	void latency_probe::on_logged_in() {
+		complete(OP_LOGIN, MS_EVENT, clock::now());
+	}
+
+	void latency_probe::complete(operation op, milestone ms, clock::time_point now) {
+		pending& p = m_pending[op];
+		if(!(p.outstanding & (1u << ms))) return;
+		p.outstanding &= ~(1u << ms);
+		m_hist[op][ms].record(std::chrono::duration_cast<std::chrono::microseconds>(now - p.start).count());
+	}
+
+	void latency_probe::complete_audio() {
+		const auto now = clock::now();
+		for(int op = 0; op < OP_COUNT; op++)
+			if(m_pending[op].audio_gate) complete((operation)op, MS_FIRST_AUDIO, now);
+		update_armed();
+	}
+
+	void latency_probe::open_gate(operation op) {
+		if(m_pending[op].outstanding & (1u << MS_FIRST_AUDIO)) m_pending[op].audio_gate = true;
+	}
+
+	void latency_probe::update_armed() {
+		m_audio_armed = false;
+		for(auto& p : m_pending)
+			m_audio_armed |= p.audio_gate && (p.outstanding & (1u << MS_FIRST_AUDIO));
+	}
+
+	void latency_probe::reset() {
+		for(auto& row : m_hist)
+			for(auto& h : row) h.reset();
+		for(auto& s : m_superseded) s = 0;
+	}
+
+	void latency_probe::report(std::ostream& out) const {
+		std::ios::fmtflags fmt = out.flags();
+		out << std::fixed << std::setprecision(2);
+		for(int op = 0; op < OP_COUNT; op++) {
+			for(int ms = 0; ms < MS_COUNT; ms++) {
+				if(!(milestones((operation)op) & (1u << ms))) continue;
+				const latency_histogram& h = m_hist[op][ms];
+				out << name((operation)op) << "." << name((milestone)ms) << ": n=" << h.count();
+				if(h.count()) {
+					out << " min=" << h.min() / 1000.0 << " p50=" << h.percentile(50) / 1000.0
+						<< " p90=" << h.percentile(90) / 1000.0 << " p99=" << h.percentile(99) / 1000.0
+						<< " p99.9=" << h.percentile(99.9) / 1000.0 << " max=" << h.max() / 1000.0 << " ms";
+				}
+				if(m_superseded[op]) out << " superseded=" << m_superseded[op];
+				out << "\n";
+			}
+		}
+		out.flags(fmt);
+	}
+
+	void latency_probe::dump(std::ostream& out) const {
+		for(int op = 0; op < OP_COUNT; op++) {
+			for(int ms = 0; ms < MS_COUNT; ms++) {
+				if(!m_hist[op][ms].count()) continue;
+				out << "# " << name((operation)op) << "." << name((milestone)ms) << "\n";
+				m_hist[op][ms].dump(out);
+			}
+		}
+	}
+
+	const char* latency_probe::name(operation op) {
+		switch(op) {
+			case OP_PLAY_URI: return "play_uri";
+			case OP_SEEK: return "seek";
+			case OP_SKIP_NEXT: return "skip_next";
+			case OP_SKIP_PREV: return "skip_prev";
+			case OP_LOGIN: return "login";
+			default: return "unknown";
+		}
+	}
+
+	const char* latency_probe::name(milestone ms) {
+		switch(ms) {
+			case MS_FIRST_AUDIO: return "first_audio";
+			case MS_EVENT: return "event";
+			default: return "unknown";
+		}
+	}
+}
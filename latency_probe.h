@@ -0,0 +1,155 @@
+#pragma once
+
+/**
+ * @file latency_probe.h
+ * @brief Latency of control commands up to the event that completes them.
+ *
+ * Every command (::SpPlayUri, ::SpPlaybackSeek, ::SpPlaybackSkipToNext/Prev, login) is
+ * timestamped when issued. The events completing it (first audio frames, PN_PLAY,
+ * PN_TRACKCHANGED, onSeek, onNotifyLoggedIn) stop the clock and the latency goes into a
+ * log-linear histogram (HDR style, about 1% relative error) per operation and event.
+ *
+ * If audio was flowing when a command was issued, frames still arriving for the old
+ * position would complete it too early. In that case first audio is only counted after
+ * the next PN_AUDIOFLUSH, PN_TRACKCHANGED or onSeek.
+ *
+ * All hooks are meant for the pump thread and cost a branch when nothing is pending.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "spotify.h"
+
+namespace sp {
+
+	/**
+	 * @brief Histogram of microsecond values with 64 linear sub-buckets per power of two.
+	 */
+	class latency_histogram {
+	public:
+		latency_histogram();
+
+		/** @brief Add a value in microseconds, values above max_value are clamped */
+		void record(uint64_t us);
+		/** @brief Add all values of another histogram */
+		void merge(const latency_histogram& other);
+		void reset();
+
+		uint64_t count() const { return m_count; }
+		uint64_t min() const { return m_count ? m_min : 0; }
+		uint64_t max() const { return m_max; }
+		double mean() const { return m_count ? (double)m_sum / m_count : 0.0; }
+		/** @brief Value at percentile p (0-100) */
+		uint64_t percentile(double p) const;
+		/** @brief Write one "value count" line per non-empty bucket */
+		void dump(std::ostream& out) const;
+
+		/** @brief Largest value kept exactly enough (about 19 hours) */
+		static constexpr uint64_t max_value = (1ull << 36) - 1;
+
+	private:
+		static size_t index(uint64_t v);
+		static uint64_t value(size_t idx);
+
+		std::vector<uint64_t> m_buckets;
+		uint64_t m_count;
+		uint64_t m_min;
+		uint64_t m_max;
+		uint64_t m_sum;
+	};
+
+	class latency_probe {
+	public:
+		enum operation {
+			OP_PLAY_URI = 0,
+			OP_SEEK = 1,
+			OP_SKIP_NEXT = 2,
+			OP_SKIP_PREV = 3,
+			OP_LOGIN = 4,
+			OP_COUNT
+		};
+
+		enum milestone {
+			/** First onAudioData frames */
+			MS_FIRST_AUDIO = 0,
+			/** PN_PLAY, PN_TRACKCHANGED, onSeek or onNotifyLoggedIn depending on the operation */
+			MS_EVENT = 1,
+			MS_COUNT
+		};
+
+		/** @brief Frames delivered within this window count as flowing audio */
+		static constexpr std::chrono::milliseconds audio_idle{200};
+
+		latency_probe();
+
+		/** @brief Timestamp a command, call right before issuing it */
+		void begin(operation op);
+		/** @brief Forget a command, e.g. because the call failed */
+		void abort(operation op);
+		/**
+		 * @brief Issue a command with timing.
+		 *
+		 *     probe.run(sp::latency_probe::OP_SEEK, [] { return SpPlaybackSeek(1000); });
+		 */
+		template<typename F>
+		sp_error_t run(operation op, F&& call) {
+			begin(op);
+			sp_error_t res = call();
+			if(res != E_OK) abort(op);
+			return res;
+		}
+
+		/** @brief Feed playback notifications */
+		void on_notify(sp_playbacknotify_t n);
+		/** @brief Feed onSeek */
+		void on_seek();
+		/** @brief Feed onNotifyLoggedIn */
+		void on_logged_in();
+		/** @brief Call from onAudioData with the number of frames accepted */
+		void on_frames(unsigned long nframes) {
+			if(!nframes) return;
+			if(m_audio_armed) complete_audio();
+			m_last_frames = clock::now();
+		}
+
+		/** @brief Histogram of one operation and milestone */
+		const latency_histogram& histogram(operation op, milestone ms) const { return m_hist[op][ms]; }
+		/** @brief Commands replaced by a new one of the same kind before they completed */
+		uint64_t superseded(operation op) const { return m_superseded[op]; }
+		/** @brief Drop all recorded values */
+		void reset();
+
+		/** @brief Write count, min, p50, p90, p99, p99.9 and max in milliseconds per series */
+		void report(std::ostream& out) const;
+		/** @brief Write the raw buckets of every series, for comparing library builds */
+		void dump(std::ostream& out) const;
+
+		static const char* name(operation op);
+		static const char* name(milestone ms);
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct pending {
+			clock::time_point start;
+			// Bit per milestone still outstanding
+			unsigned outstanding = 0;
+			// First audio only counts once this is set
+			bool audio_gate = false;
+		};
+
+		void complete(operation op, milestone ms, clock::time_point now);
+		void complete_audio();
+		void open_gate(operation op);
+		void update_armed();
+
+		pending m_pending[OP_COUNT];
+		latency_histogram m_hist[OP_COUNT][MS_COUNT];
+		uint64_t m_superseded[OP_COUNT];
+		clock::time_point m_last_frames;
+		bool m_audio_armed;
+	};
+}
@@ -0,0 +1,166 @@
+#include "metadata_cache.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+namespace sp {
+
+	// Accessors for the string fields, in the order of track_info
+	static const size_t nfields = 9;
+	static const size_t field_size[nfields] = { 0x100, 0x80, 0x100, 0x80, 0x100, 0x80, 0x100, 0x80, 0x80 };
+
+	static const char* meta_field(const sp_metadata_t& m, size_t i) {
+		switch(i) {
+			case 0: return m.playlist_title;
+			case 1: return m.playlist_uri;
+			case 2: return m.track_title;
+			case 3: return m.track_uri;
+			case 4: return m.artist_name;
+			case 5: return m.artist_uri;
+			case 6: return m.album_name;
+			case 7: return m.album_uri;
+			default: return m.image_uri;
+		}
+	}
+
+	static const char*& info_field(track_info& t, size_t i) {
+		switch(i) {
+			case 0: return t.playlist_title;
+			case 1: return t.playlist_uri;
+			case 2: return t.track_title;
+			case 3: return t.track_uri;
+			case 4: return t.artist_name;
+			case 5: return t.artist_uri;
+			case 6: return t.album_name;
+			case 7: return t.album_uri;
+			default: return t.image_uri;
+		}
+	}
+
+	static const char* info_field(const track_info& t, size_t i) {
+		return info_field(const_cast<track_info&>(t), i);
+	}
+
+	static std::string field_string(const sp_metadata_t& m, size_t i) {
+		// Fields are fixed size arrays and not guaranteed to be terminated
+		const char* str = meta_field(m, i);
+		return std::string(str, strnlen(str, field_size[i]));
+	}
+
+	static bool same(const track_info& t, const sp_metadata_t& m, bool valid) {
+		if(t.valid != valid) return false;
+		if(!valid) return true;
+		if(t.duration != m.duration || t.playlist_idx != m.playlist_idx || t.bitrate != m.bitrate) return false;
+		for(size_t i = 0; i < nfields; i++) {
+			if(field_string(m, i) != info_field(t, i)) return false;
+		}
+		return true;
+	}
+
+	metadata_snapshot::metadata_snapshot(const sp_metadata_t* meta, const bool* valid, uint64_t generation)
+		: m_generation(generation)
+	{
+		// Intern all strings, identical ones (album, artist, playlist, ...) are stored once
+		std::unordered_map<std::string, size_t> interned;
+		size_t offsets[3][nfields];
+		m_arena.push_back('\0');
+		for(size_t t = 0; t < 3; t++) {
+			for(size_t i = 0; i < nfields; i++) {
+				std::string str = valid[t] ? field_string(meta[t], i) : std::string();
+				if(str.empty()) {
+					offsets[t][i] = 0;
+					continue;
+				}
+				auto it = interned.find(str);
+				if(it == interned.end()) {
+					it = interned.emplace(str, m_arena.size()).first;
+					m_arena.insert(m_arena.end(), str.begin(), str.end());
+					m_arena.push_back('\0');
+				}
+				offsets[t][i] = it->second;
+			}
+		}
+		m_arena.shrink_to_fit();
+		for(size_t t = 0; t < 3; t++) {
+			track_info& info = m_tracks[t];
+			for(size_t i = 0; i < nfields; i++) info_field(info, i) = m_arena.data() + offsets[t][i];
+			info.valid = valid[t];
+			info.duration = valid[t] ? meta[t].duration : 0;
+			info.playlist_idx = valid[t] ? meta[t].playlist_idx : 0;
+			info.bitrate = valid[t] ? meta[t].bitrate : 0;
+		}
+	}
+
+	const track_info* metadata_snapshot::find(const char* track_uri) const {
+		for(auto& t : m_tracks)
+			if(t.valid && strcmp(t.track_uri, track_uri) == 0) return &t;
+		return nullptr;
+	}
+
+	metadata_cache::metadata_cache(fetch_t fetch)
+		: m_fetch(std::move(fetch)), m_dirty(true), m_generation(0), m_current(nullptr), m_readers(0), m_fetches(0)
+	{}
+
+	metadata_cache::~metadata_cache() {
+		for(auto p : m_retired) delete p;
+		delete m_current.load();
+	}
+
+	bool metadata_cache::on_notify(sp_playbacknotify_t n) {
+		switch(n) {
+			// Readers of PN_TRACKCHANGED (prefetcher, image lookup) want the new current track
+			// right away, PN_METADATACHANGED follows every track, context and shuffle change.
+			// The other notifications only announce a change that one of these two reports.
+			case PN_TRACKCHANGED:
+			case PN_METADATACHANGED:
+				m_dirty = true;
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	bool metadata_cache::refresh() {
+		if(!m_dirty) return false;
+		m_dirty = false;
+
+		sp_metadata_t meta[3];
+		bool valid[3];
+		for(int i = 0; i < 3; i++) {
+			memset(&meta[i], 0x00, sizeof(meta[i]));
+			valid[i] = m_fetch(&meta[i], i - 1) == E_OK;
+			m_fetches.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// Notifications often come in bursts without changing anything, keep the old snapshot then
+		const snapshot_ptr* cur = m_current.load(std::memory_order_relaxed);
+		if(cur && same((*cur)->prev(), meta[0], valid[0])
+			&& same((*cur)->current(), meta[1], valid[1]) && same((*cur)->next(), meta[2], valid[2])) {
+			reclaim();
+			return false;
+		}
+
+		const snapshot_ptr* handle = new snapshot_ptr(new metadata_snapshot(meta, valid, ++m_generation));
+		const snapshot_ptr* old = m_current.exchange(handle);
+		if(old) m_retired.push_back(old);
+		reclaim();
+		return true;
+	}
+
+	void metadata_cache::reclaim() {
+		// A reader that enters after this load sees the new handle (both are seq_cst), so a zero
+		// count means nobody can still be copying a retired one
+		if(m_retired.empty() || m_readers.load() != 0) return;
+		for(auto p : m_retired) delete p;
+		m_retired.clear();
+	}
+
+	metadata_cache::snapshot_ptr metadata_cache::snapshot() const {
+		m_readers.fetch_add(1);
+		const snapshot_ptr* handle = m_current.load();
+		snapshot_ptr snap = handle ? *handle : snapshot_ptr();
+		m_readers.fetch_sub(1, std::memory_order_release);
+		return snap;
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+/**
+ * @file metadata_cache.h
+ * @brief Compact metadata cache on top of ::SpGetMetadata.
+ *
+ * ::sp_metadata_t is about 2.3 KB of fixed size char arrays per call. The cache fetches the
+ * previous, current and next track (idx -1/0/1) only after a playback notification that can
+ * change them, interns the strings into one small arena per snapshot and publishes the
+ * snapshot as an immutable object. Readers on any thread grab the current snapshot without
+ * calling into the library, waiting for the pump thread or taking a lock.
+ *
+ * Publication is a pointer swap with quiescent state reclamation: readers announce themselves
+ * in a counter while they copy the published handle, the pump thread swaps in the new handle
+ * and frees retired ones once it sees the counter at zero. Snapshots themselves are reference
+ * counted, a reader keeps its snapshot as long as it likes.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "spotify.h"
+
+namespace sp {
+
+	/**
+	 * @brief Metadata of one track, strings point into the arena of the owning snapshot.
+	 */
+	struct track_info {
+		const char* playlist_title;
+		const char* playlist_uri;
+		const char* track_title;
+		const char* track_uri;
+		const char* artist_name;
+		const char* artist_uri;
+		const char* album_name;
+		const char* album_uri;
+		const char* image_uri;
+		/** Duration in milliseconds */
+		uint32_t duration;
+		uint32_t playlist_idx;
+		/** Bitrate in kBit/s */
+		uint32_t bitrate;
+		/** False if the library had no track at this index */
+		bool valid;
+	};
+
+	/**
+	 * @brief Immutable prev/current/next metadata.
+	 */
+	class metadata_snapshot {
+	public:
+		/** @brief Track at idx (-1 previous, 0 current, 1 next) */
+		const track_info& get(int idx) const { return m_tracks[idx + 1]; }
+		const track_info& prev() const { return m_tracks[0]; }
+		const track_info& current() const { return m_tracks[1]; }
+		const track_info& next() const { return m_tracks[2]; }
+		/** @brief Find a track by uri, null if it is none of the three */
+		const track_info* find(const char* track_uri) const;
+		/** @brief Increases with every published snapshot */
+		uint64_t generation() const { return m_generation; }
+		/** @brief Bytes used by the interned strings */
+		size_t arena_size() const { return m_arena.size(); }
+
+	private:
+		friend class metadata_cache;
+
+		metadata_snapshot(const sp_metadata_t* meta, const bool* valid, uint64_t generation);
+		metadata_snapshot(const metadata_snapshot&) = delete;
+		metadata_snapshot& operator=(const metadata_snapshot&) = delete;
+
+		std::vector<char> m_arena;
+		track_info m_tracks[3];
+		uint64_t m_generation;
+	};
+
+	class metadata_cache {
+	public:
+		typedef std::shared_ptr<const metadata_snapshot> snapshot_ptr;
+		/** @brief Metadata source, ::SpGetMetadata by default */
+		typedef std::function<sp_error_t(sp_metadata_t* m, int idx)> fetch_t;
+
+		explicit metadata_cache(fetch_t fetch = &SpGetMetadata);
+		~metadata_cache();
+
+		/**
+		 * @brief Feed playback notifications (pump thread).
+		 * @return true if the notification invalidated the cache
+		 */
+		bool on_notify(sp_playbacknotify_t n);
+		/** @brief Mark the cache as outdated */
+		void invalidate() { m_dirty = true; }
+		/**
+		 * @brief Fetch and publish new metadata if the cache was invalidated (pump thread).
+		 * @return true if a new snapshot was published
+		 */
+		bool refresh();
+
+		/** @brief Current snapshot, safe to call from any thread, might be null before the first refresh */
+		snapshot_ptr snapshot() const;
+		/** @brief Number of ::SpGetMetadata calls done */
+		uint64_t fetches() const { return m_fetches.load(std::memory_order_relaxed); }
+
+	private:
+		metadata_cache(const metadata_cache&) = delete;
+		metadata_cache& operator=(const metadata_cache&) = delete;
+
+		/** @brief Free retired handles if no reader can still see them (pump thread) */
+		void reclaim();
+
+		const fetch_t m_fetch;
+		bool m_dirty;
+		uint64_t m_generation;
+		/** Published handle, only replaced by the pump thread */
+		std::atomic<const snapshot_ptr*> m_current;
+		/** Readers currently copying a handle */
+		mutable std::atomic<unsigned> m_readers;
+		/** Replaced handles waiting for a moment without readers */
+		std::vector<const snapshot_ptr*> m_retired;
+		std::atomic<uint64_t> m_fetches;
+	};
+}
@@ -0,0 +1,406 @@
+#include "pcm_convert.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SP_PCM_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SP_PCM_NEON 1
+#endif
+
+namespace sp {
+namespace pcm {
+
+	static const float s16_scale = 1.0f / 32768.0f;
+	static const float q16_scale = 1.0f / 65536.0f;
+	static const float dither_lsb = 1.0f / 16777216.0f;
+
+	static inline short clamp_s16(long v) {
+		return v > 32767 ? 32767 : (v < -32768 ? -32768 : (short)v);
+	}
+
+	// Gains are tracked as Q16 integers and converted to float per sample in every
+	// implementation, so the vector kernels produce bit identical results to the scalar ones.
+	static inline float gain_at(int32_t gain, int32_t step, size_t i) {
+		return (float)(gain + (int64_t)step * (int64_t)i) * q16_scale;
+	}
+
+	static inline uint32_t xorshift32(uint32_t& s) {
+		s ^= s << 13;
+		s ^= s >> 17;
+		s ^= s << 5;
+		return s;
+	}
+
+	// Difference of two uniform 24 bit values gives triangular noise of +-1 lsb. Every step
+	// is exact in float (x * 32768 as well), only the final addition rounds, the same way in
+	// the vector kernels.
+	static inline short dither_sample(float x, uint32_t& s) {
+		const int32_t a = (int32_t)(xorshift32(s) >> 8);
+		const int32_t b = (int32_t)(xorshift32(s) >> 8);
+		const float noise = ((float)a - (float)b) * dither_lsb;
+		return clamp_s16(lrintf(x * 32768.0f + noise));
+	}
+
+	/*
+	 * Scalar reference
+	 */
+	static void scalar_s16_to_f32(const short* in, float* out, size_t n) {
+		for(size_t i = 0; i < n; i++) out[i] = in[i] * s16_scale;
+	}
+
+	static void scalar_s16_to_s32(const short* in, int32_t* out, size_t n) {
+		for(size_t i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)(uint16_t)in[i] << 16);
+	}
+
+	static void scalar_deinterleave2_f32(const short* in, float* left, float* right, size_t nframes) {
+		for(size_t i = 0; i < nframes; i++) {
+			left[i] = in[2 * i] * s16_scale;
+			right[i] = in[2 * i + 1] * s16_scale;
+		}
+	}
+
+	static void scalar_gain_s16(short* buf, size_t n, int32_t gain, int32_t step) {
+		for(size_t i = 0; i < n; i++)
+			buf[i] = clamp_s16(lrintf(buf[i] * gain_at(gain, step, i)));
+	}
+
+	static void scalar_dither_s16(const float* in, short* out, size_t n, uint32_t* state) {
+		for(size_t i = 0; i < n; i++) out[i] = dither_sample(in[i], state[i % 4]);
+	}
+
+	static const kernels scalar_kernels = {
+		"scalar", scalar_s16_to_f32, scalar_s16_to_s32, scalar_deinterleave2_f32, scalar_gain_s16, scalar_dither_s16
+	};
+
+#if SP_PCM_X86
+	/*
+	 * SSE2, always available on x86_64
+	 */
+	static void sse2_s16_to_f32(const short* in, float* out, size_t n) {
+		const __m128 scale = _mm_set1_ps(s16_scale);
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+			__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+			_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+			_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+		}
+		scalar_s16_to_f32(in + i, out + i, n - i);
+	}
+
+	static void sse2_s16_to_s32(const short* in, int32_t* out, size_t n) {
+		const __m128i zero = _mm_setzero_si128();
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+			_mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(zero, v));
+			_mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(zero, v));
+		}
+		scalar_s16_to_s32(in + i, out + i, n - i);
+	}
+
+	static void sse2_deinterleave2_f32(const short* in, float* left, float* right, size_t nframes) {
+		const __m128 scale = _mm_set1_ps(s16_scale);
+		size_t i = 0;
+		for(; i + 4 <= nframes; i += 4) {
+			// Each 32 bit lane holds one frame: left in the low, right in the high half
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+			__m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+			__m128i r = _mm_srai_epi32(v, 16);
+			_mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+			_mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+		}
+		scalar_deinterleave2_f32(in + 2 * i, left + i, right + i, nframes - i);
+	}
+
+	static void sse2_gain_s16(short* buf, size_t n, int32_t gain, int32_t step) {
+		const __m128 scale = _mm_set1_ps(q16_scale);
+		// Q16 gains of the eight samples of a block, advanced by 8 steps per block
+		__m128i g0 = _mm_add_epi32(_mm_set1_epi32(gain), _mm_set_epi32(3 * step, 2 * step, step, 0));
+		__m128i g1 = _mm_add_epi32(g0, _mm_set1_epi32(4 * step));
+		const __m128i advance = _mm_set1_epi32(8 * step);
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+			__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+			__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+			__m128i rlo = _mm_cvtps_epi32(_mm_mul_ps(lo, _mm_mul_ps(_mm_cvtepi32_ps(g0), scale)));
+			__m128i rhi = _mm_cvtps_epi32(_mm_mul_ps(hi, _mm_mul_ps(_mm_cvtepi32_ps(g1), scale)));
+			_mm_storeu_si128((__m128i*)(buf + i), _mm_packs_epi32(rlo, rhi));
+			g0 = _mm_add_epi32(g0, advance);
+			g1 = _mm_add_epi32(g1, advance);
+		}
+		scalar_gain_s16(buf + i, n - i, (int32_t)(gain + (int64_t)step * i), step);
+	}
+
+	static inline __m128i xorshift32x4(__m128i& s) {
+		s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+		s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+		s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+		return s;
+	}
+
+	// Used by the AVX2 table as well, the four streams are sequential within a lane
+	static void sse2_dither_s16(const float* in, short* out, size_t n, uint32_t* state) {
+		const __m128 scale = _mm_set1_ps(32768.0f);
+		const __m128 lsb = _mm_set1_ps(dither_lsb);
+		__m128i s = _mm_loadu_si128((const __m128i*)state);
+		for(size_t i = 0; i + 4 <= n; i += 4) {
+			__m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(xorshift32x4(s), 8));
+			__m128 b = _mm_cvtepi32_ps(_mm_srli_epi32(xorshift32x4(s), 8));
+			__m128 noise = _mm_mul_ps(_mm_sub_ps(a, b), lsb);
+			__m128i r = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale), noise));
+			_mm_storel_epi64((__m128i*)(out + i), _mm_packs_epi32(r, r));
+		}
+		_mm_storeu_si128((__m128i*)state, s);
+	}
+
+	static const kernels sse2_kernels = {
+		"sse2", sse2_s16_to_f32, sse2_s16_to_s32, sse2_deinterleave2_f32, sse2_gain_s16, sse2_dither_s16
+	};
+
+	/*
+	 * AVX2, selected at runtime
+	 */
+	__attribute__((target("avx2")))
+	static void avx2_s16_to_f32(const short* in, float* out, size_t n) {
+		const __m256 scale = _mm256_set1_ps(s16_scale);
+		size_t i = 0;
+		for(; i + 16 <= n; i += 16) {
+			__m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+			__m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+			_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+			_mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+		}
+		sse2_s16_to_f32(in + i, out + i, n - i);
+	}
+
+	__attribute__((target("avx2")))
+	static void avx2_s16_to_s32(const short* in, int32_t* out, size_t n) {
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+			_mm256_storeu_si256((__m256i*)(out + i), _mm256_slli_epi32(v, 16));
+		}
+		scalar_s16_to_s32(in + i, out + i, n - i);
+	}
+
+	__attribute__((target("avx2")))
+	static void avx2_deinterleave2_f32(const short* in, float* left, float* right, size_t nframes) {
+		const __m256 scale = _mm256_set1_ps(s16_scale);
+		size_t i = 0;
+		for(; i + 8 <= nframes; i += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(in + 2 * i));
+			__m256i l = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+			__m256i r = _mm256_srai_epi32(v, 16);
+			_mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+			_mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+		}
+		scalar_deinterleave2_f32(in + 2 * i, left + i, right + i, nframes - i);
+	}
+
+	__attribute__((target("avx2")))
+	static void avx2_gain_s16(short* buf, size_t n, int32_t gain, int32_t step) {
+		const __m256 scale = _mm256_set1_ps(q16_scale);
+		__m256i g = _mm256_add_epi32(_mm256_set1_epi32(gain), _mm256_mullo_epi32(_mm256_set1_epi32(step), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+		const __m256i advance = _mm256_set1_epi32(8 * step);
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(buf + i)));
+			__m256i r = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_mul_ps(_mm256_cvtepi32_ps(g), scale)));
+			__m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+			_mm_storeu_si128((__m128i*)(buf + i), packed);
+			g = _mm256_add_epi32(g, advance);
+		}
+		scalar_gain_s16(buf + i, n - i, (int32_t)(gain + (int64_t)step * i), step);
+	}
+
+	static const kernels avx2_kernels = {
+		"avx2", avx2_s16_to_f32, avx2_s16_to_s32, avx2_deinterleave2_f32, avx2_gain_s16, sse2_dither_s16
+	};
+#endif
+
+#if SP_PCM_NEON
+	/*
+	 * NEON, always available on arm64
+	 */
+	static void neon_s16_to_f32(const short* in, float* out, size_t n) {
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			int16x8_t v = vld1q_s16(in + i);
+			vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), s16_scale));
+			vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), s16_scale));
+		}
+		scalar_s16_to_f32(in + i, out + i, n - i);
+	}
+
+	static void neon_s16_to_s32(const short* in, int32_t* out, size_t n) {
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			int16x8_t v = vld1q_s16(in + i);
+			vst1q_s32(out + i, vshll_n_s16(vget_low_s16(v), 16));
+			vst1q_s32(out + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+		}
+		scalar_s16_to_s32(in + i, out + i, n - i);
+	}
+
+	static void neon_deinterleave2_f32(const short* in, float* left, float* right, size_t nframes) {
+		size_t i = 0;
+		for(; i + 8 <= nframes; i += 8) {
+			int16x8x2_t v = vld2q_s16(in + 2 * i);
+			vst1q_f32(left + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))), s16_scale));
+			vst1q_f32(left + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), s16_scale));
+			vst1q_f32(right + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))), s16_scale));
+			vst1q_f32(right + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), s16_scale));
+		}
+		scalar_deinterleave2_f32(in + 2 * i, left + i, right + i, nframes - i);
+	}
+
+	static void neon_gain_s16(short* buf, size_t n, int32_t gain, int32_t step) {
+		static const int32_t lanes[4] = { 0, 1, 2, 3 };
+		int32x4_t g0 = vaddq_s32(vdupq_n_s32(gain), vmulq_n_s32(vld1q_s32(lanes), step));
+		int32x4_t g1 = vaddq_s32(g0, vdupq_n_s32(4 * step));
+		const int32x4_t advance = vdupq_n_s32(8 * step);
+		size_t i = 0;
+		for(; i + 8 <= n; i += 8) {
+			int16x8_t v = vld1q_s16(buf + i);
+			float32x4_t f0 = vmulq_n_f32(vcvtq_f32_s32(g0), q16_scale);
+			float32x4_t f1 = vmulq_n_f32(vcvtq_f32_s32(g1), q16_scale);
+			int32x4_t lo = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), f0));
+			int32x4_t hi = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), f1));
+			vst1q_s16(buf + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+			g0 = vaddq_s32(g0, advance);
+			g1 = vaddq_s32(g1, advance);
+		}
+		scalar_gain_s16(buf + i, n - i, (int32_t)(gain + (int64_t)step * i), step);
+	}
+
+	static inline uint32x4_t xorshift32x4(uint32x4_t& s) {
+		s = veorq_u32(s, vshlq_n_u32(s, 13));
+		s = veorq_u32(s, vshrq_n_u32(s, 17));
+		s = veorq_u32(s, vshlq_n_u32(s, 5));
+		return s;
+	}
+
+	static void neon_dither_s16(const float* in, short* out, size_t n, uint32_t* state) {
+		uint32x4_t s = vld1q_u32(state);
+		for(size_t i = 0; i + 4 <= n; i += 4) {
+			float32x4_t a = vcvtq_f32_s32(vreinterpretq_s32_u32(vshrq_n_u32(xorshift32x4(s), 8)));
+			float32x4_t b = vcvtq_f32_s32(vreinterpretq_s32_u32(vshrq_n_u32(xorshift32x4(s), 8)));
+			float32x4_t noise = vmulq_n_f32(vsubq_f32(a, b), dither_lsb);
+			// Separate multiply and add, a fused multiply-add would round differently than the scalar code
+			float32x4_t x = vaddq_f32(vmulq_n_f32(vld1q_f32(in + i), 32768.0f), noise);
+			vst1_s16(out + i, vqmovn_s32(vcvtnq_s32_f32(x)));
+		}
+		vst1q_u32(state, s);
+	}
+
+	static const kernels neon_kernels = {
+		"neon", neon_s16_to_f32, neon_s16_to_s32, neon_deinterleave2_f32, neon_gain_s16, neon_dither_s16
+	};
+#endif
+
+	static const kernels& select() {
+#if SP_PCM_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return avx2_kernels;
+		return sse2_kernels;
+#elif SP_PCM_NEON
+		return neon_kernels;
+#else
+		return scalar_kernels;
+#endif
+	}
+
+	const kernels& scalar() {
+		return scalar_kernels;
+	}
+
+	const kernels& best() {
+		static const kernels& k = select();
+		return k;
+	}
+
+	std::vector<const kernels*> supported() {
+		std::vector<const kernels*> res(1, &scalar_kernels);
+#if SP_PCM_X86
+		res.push_back(&sse2_kernels);
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) res.push_back(&avx2_kernels);
+#elif SP_PCM_NEON
+		res.push_back(&neon_kernels);
+#endif
+		return res;
+	}
+
+	void deinterleave_f32(const short* in, float* const* planes, size_t nframes, int nchannels) {
+		if(nchannels == 2) {
+			best().deinterleave2_f32(in, planes[0], planes[1], nframes);
+			return;
+		}
+		for(size_t i = 0; i < nframes; i++)
+			for(int c = 0; c < nchannels; c++)
+				planes[c][i] = in[i * nchannels + c] * s16_scale;
+	}
+
+	volume::volume(unsigned ramp_frames)
+		: m_requested(65536), m_gain(65536), m_target(65536), m_ramp_frames(ramp_frames ? ramp_frames : 1), m_ramp_left(0)
+	{}
+
+	void volume::set(unsigned short vol) {
+		m_requested.store(to_gain(vol), std::memory_order_relaxed);
+	}
+
+	void volume::apply(short* frames, size_t nframes, int nchannels) {
+		const kernels& k = best();
+		const int32_t requested = m_requested.load(std::memory_order_relaxed);
+		if(requested != m_target) {
+			m_target = requested;
+			m_ramp_left = m_target != m_gain ? m_ramp_frames : 0;
+		}
+		if(m_ramp_left) {
+			size_t n = nframes < m_ramp_left ? nframes : m_ramp_left;
+			int32_t step = (int32_t)(((int64_t)m_target - m_gain) / ((int64_t)m_ramp_left * nchannels));
+			k.gain_s16(frames, n * nchannels, m_gain, step);
+			m_ramp_left -= n;
+			m_gain = m_ramp_left ? (int32_t)(m_gain + (int64_t)step * n * nchannels) : m_target;
+			frames += n * nchannels;
+			nframes -= n;
+		}
+		if(nframes && m_gain != 65536) k.gain_s16(frames, nframes * nchannels, m_gain, 0);
+	}
+
+	int32_t volume::to_gain(unsigned short vol) {
+		// Squared curve, a linear mapping is way too loud at low volumes
+		return (int32_t)(((uint64_t)vol * vol * 65536) / (65535ull * 65535ull));
+	}
+
+	tpdf_dither::tpdf_dither(uint32_t seed)
+		: m_lane(0)
+	{
+		// xorshift32, plenty for dither noise. Four streams so the vector kernels can run them side by side
+		for(unsigned k = 0; k < 4; k++) {
+			m_state[k] = seed ^ (0x9e3779b9u * (k + 1));
+			if(!m_state[k]) m_state[k] = k + 1;
+		}
+	}
+
+	void tpdf_dither::f32_to_s16(const float* in, short* out, size_t n) {
+		size_t i = 0;
+		// Finish the group of streams the last call stopped in, then whole groups
+		for(; i < n && m_lane; i++, m_lane = (m_lane + 1) % 4) out[i] = dither_sample(in[i], m_state[m_lane]);
+		const size_t groups = (n - i) / 4 * 4;
+		best().dither_s16(in + i, out + i, groups, m_state);
+		i += groups;
+		for(; i < n; i++, m_lane = (m_lane + 1) % 4) out[i] = dither_sample(in[i], m_state[m_lane]);
+	}
+
+	void tpdf_dither::f32_to_s16_nodither(const float* in, short* out, size_t n) {
+		for(size_t i = 0; i < n; i++) out[i] = clamp_s16(lrintf(in[i] * 32768.0f));
+	}
+}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+/**
+ * @file pcm_convert.h
+ * @brief Sample conversion and volume kernels for the interleaved 16 bit frames from onAudioData.
+ *
+ * Every kernel exists as a portable scalar version and, where it pays off, as SSE2/AVX2
+ * (x86_64) or NEON (arm64) version. The fastest version supported by the cpu is picked at
+ * runtime on first use, the scalar table stays available to verify the vector kernels:
+ * every vector kernel produces bit identical output (selftestapp pcm checks that).
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sp {
+namespace pcm {
+
+	/**
+	 * @brief Table of conversion kernels. All counts are in samples unless stated otherwise.
+	 */
+	struct kernels {
+		/** Name of the instruction set ("scalar", "sse2", "avx2", "neon") */
+		const char* name;
+		/** int16 to float in [-1, 1) */
+		void (*s16_to_f32)(const short* in, float* out, size_t n);
+		/** int16 to int32, left aligned (usable as 24 in 32 bit as well) */
+		void (*s16_to_s32)(const short* in, int32_t* out, size_t n);
+		/** Interleaved int16 stereo to two float planes, n is in frames */
+		void (*deinterleave2_f32)(const short* in, float* left, float* right, size_t nframes);
+		/**
+		 * Multiply with a gain that moves linearly from gain to gain + step * n.
+		 * Gains are Q16 fixed point (65536 == unity) and gain + step * n has to fit into
+		 * 32 bits. Used for volume ramps.
+		 */
+		void (*gain_s16)(short* buf, size_t n, int32_t gain, int32_t step);
+		/**
+		 * Float in [-1, 1) to int16 with TPDF dither. Sample i draws its noise from the
+		 * xorshift32 stream state[i % 4]; n has to be a multiple of 4.
+		 */
+		void (*dither_s16)(const float* in, short* out, size_t n, uint32_t* state);
+	};
+
+	/** @brief Portable reference kernels */
+	const kernels& scalar();
+	/** @brief Best kernels for this cpu */
+	const kernels& best();
+	/** @brief Every table this cpu can run, scalar first */
+	std::vector<const kernels*> supported();
+
+	/**
+	 * @brief Interleaved int16 with any channel count to float planes.
+	 * @param planes One output pointer per channel
+	 */
+	void deinterleave_f32(const short* in, float* const* planes, size_t nframes, int nchannels);
+
+	/**
+	 * @brief Software volume with smooth ramps.
+	 *
+	 * Feed it the value from onApplyVolume, apply() then moves from the old to the new
+	 * gain over ramp_frames frames instead of jumping, which would click. set() may be
+	 * called from another thread than apply() (pump thread and output thread).
+	 */
+	class volume {
+	public:
+		/**
+		 * @param ramp_frames Length of a volume ramp in frames
+		 */
+		explicit volume(unsigned ramp_frames = 1024);
+
+		/** @brief Set the target from a library volume (0 - 65535) */
+		void set(unsigned short vol);
+		/** @brief Current gain in Q16 */
+		int32_t gain() const { return m_gain; }
+		/** @brief Apply to interleaved frames in place */
+		void apply(short* frames, size_t nframes, int nchannels);
+
+		/** @brief Map a library volume to a Q16 gain using a perceptual (squared) curve */
+		static int32_t to_gain(unsigned short vol);
+
+	private:
+		std::atomic<int32_t> m_requested;
+		int32_t m_gain;
+		int32_t m_target;
+		unsigned m_ramp_frames;
+		unsigned m_ramp_left;
+	};
+
+	/**
+	 * @brief Float to int16 with triangular (TPDF) dither.
+	 *
+	 * Used when processed float samples (after resampling or volume) go back to 16 bit.
+	 */
+	class tpdf_dither {
+	public:
+		explicit tpdf_dither(uint32_t seed = 0x12345678);
+		/** @brief Convert n samples */
+		void f32_to_s16(const float* in, short* out, size_t n);
+		/** @brief Convert without dither (plain rounding) */
+		static void f32_to_s16_nodither(const float* in, short* out, size_t n);
+
+	private:
+		uint32_t m_state[4];
+		/** Stream of the next sample */
+		unsigned m_lane;
+	};
+}
+}
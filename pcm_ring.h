@@ -0,0 +1,241 @@
+#pragma once
+
+/**
+ * @file pcm_ring.h
+ * @brief Wait-free single producer/single consumer ring buffer for pcm frames.
+ *
+ * The library delivers audio from inside ::SpPumpEvents, so anything slow in onAudioData
+ * stalls the whole event loop. This ring decouples the pump thread (producer) from an
+ * audio output thread (consumer). The producer never blocks: if the ring is full it only
+ * accepts as many frames as fit and reports that count back to the library through the
+ * return value of onAudioData, which makes the library redeliver the rest later.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "spotify.h"
+
+namespace sp {
+
+	/**
+	 * @brief SPSC ring of interleaved 16 bit frames tagged with a ::sp_sampleformat_t.
+	 *
+	 * Capacity is given in frames. Storage is reserved for max_channels per frame, so the
+	 * channel count can change between tracks without reallocating. A format change is only
+	 * accepted once the consumer drained all frames of the old format, which keeps format()
+	 * valid for every frame currently in the ring.
+	 */
+	class pcm_ring {
+	public:
+		/**
+		 * @brief Create a ring.
+		 * @param capacity_frames Number of frames the ring can hold
+		 * @param max_channels Maximum number of channels per frame
+		 */
+		explicit pcm_ring(size_t capacity_frames, int max_channels = 2)
+			: m_owned(capacity_frames * max_channels), m_data(m_owned.data()),
+			m_capacity(capacity_frames), m_max_channels(max_channels)
+		{
+			m_nchannels.store(0, std::memory_order_relaxed);
+			m_samplerate.store(0, std::memory_order_relaxed);
+		}
+
+		/**
+		 * @brief Create a ring on top of caller provided storage.
+		 *
+		 * storage must hold at least capacity_frames * max_channels samples and outlive the ring.
+		 * Used to place the ring in locked or otherwise special memory.
+		 */
+		pcm_ring(short* storage, size_t capacity_frames, int max_channels)
+			: m_data(storage), m_capacity(capacity_frames), m_max_channels(max_channels)
+		{
+			m_nchannels.store(0, std::memory_order_relaxed);
+			m_samplerate.store(0, std::memory_order_relaxed);
+		}
+
+		pcm_ring(const pcm_ring&) = delete;
+		pcm_ring& operator=(const pcm_ring&) = delete;
+
+		/**
+		 * @brief Push frames (producer side, pump thread).
+		 * @param frames Interleaved frame data
+		 * @param nframes Number of frames in frames
+		 * @param format Sampleformat of frames
+		 * @return Number of frames accepted, might be less than nframes (including zero) if the ring is full
+		 */
+		unsigned long write(const short* frames, unsigned long nframes, const sp_sampleformat_t* format) {
+			const size_t tail = m_tail.load(std::memory_order_relaxed);
+			const size_t head = m_head.load(std::memory_order_acquire);
+			if(format->nchannels <= 0 || format->nchannels > m_max_channels) {
+				m_overruns.fetch_add(1, std::memory_order_relaxed);
+				return 0;
+			}
+			if(format->nchannels != m_nchannels.load(std::memory_order_relaxed)
+				|| format->samplerate != m_samplerate.load(std::memory_order_relaxed)) {
+				// Wait for the consumer to drain frames of the old format first
+				if(head != tail) {
+					m_overruns.fetch_add(1, std::memory_order_relaxed);
+					return 0;
+				}
+				m_nchannels.store(format->nchannels, std::memory_order_relaxed);
+				m_samplerate.store(format->samplerate, std::memory_order_relaxed);
+				m_format_changes.fetch_add(1, std::memory_order_relaxed);
+			}
+			const size_t space = m_capacity - (tail - head);
+			const size_t n = nframes < space ? nframes : space;
+			if(n < nframes) m_overruns.fetch_add(1, std::memory_order_relaxed);
+			copy_in(tail, frames, n, format->nchannels);
+			m_tail.store(tail + n, std::memory_order_release);
+			m_frames_written.fetch_add(n, std::memory_order_relaxed);
+			return n;
+		}
+
+		/**
+		 * @brief Pop frames (consumer side, output thread).
+		 * @param out Buffer receiving interleaved frames, must hold maxframes * nchannels samples
+		 * @param maxframes Maximum number of frames to read
+		 * @param format If not null receives the format of the returned frames
+		 * @return Number of frames read, an underrun is counted if this is less than maxframes
+		 */
+		size_t read(short* out, size_t maxframes, sp_sampleformat_t* format = nullptr) {
+			const size_t head = m_head.load(std::memory_order_relaxed);
+			const size_t tail = m_tail.load(std::memory_order_acquire);
+			const int nch = m_nchannels.load(std::memory_order_relaxed);
+			if(format) {
+				format->nchannels = nch;
+				format->samplerate = m_samplerate.load(std::memory_order_relaxed);
+			}
+			const size_t avail = tail - head;
+			const size_t n = maxframes < avail ? maxframes : avail;
+			if(n < maxframes) m_underruns.fetch_add(1, std::memory_order_relaxed);
+			copy_out(head, out, n, nch);
+			m_head.store(head + n, std::memory_order_release);
+			return n;
+		}
+
+		/**
+		 * @brief Drop all buffered frames (consumer side, output thread).
+		 *
+		 * Advances the read index like read(), so it must not be called from the pump thread.
+		 * On PN_AUDIOFLUSH let the output thread call it before its next read().
+		 */
+		void discard() {
+			m_head.store(m_tail.load(std::memory_order_acquire), std::memory_order_release);
+		}
+
+		/** @brief Number of frames currently buffered */
+		size_t available() const {
+			return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+		}
+		/** @brief Maximum number of channels per frame */
+		int max_channels() const { return m_max_channels; }
+		/** @brief Total capacity in frames */
+		size_t capacity() const { return m_capacity; }
+		/** @brief Format of the frames currently buffered (only stable on the consumer side) */
+		sp_sampleformat_t format() const {
+			sp_sampleformat_t f;
+			f.nchannels = m_nchannels.load(std::memory_order_relaxed);
+			f.samplerate = m_samplerate.load(std::memory_order_relaxed);
+			return f;
+		}
+		/** @brief Number of reads that could not be fully satisfied */
+		uint64_t underruns() const { return m_underruns.load(std::memory_order_relaxed); }
+		/** @brief Number of writes that were only partially (or not at all) accepted */
+		uint64_t overruns() const { return m_overruns.load(std::memory_order_relaxed); }
+		/** @brief Number of accepted format changes */
+		uint64_t format_changes() const { return m_format_changes.load(std::memory_order_relaxed); }
+		/** @brief Total number of frames accepted */
+		uint64_t frames_written() const { return m_frames_written.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief onAudioData trampoline, pass the ring as data to ::SpRegisterPlaybackCallbacks.
+		 */
+		static unsigned long on_audio_data(const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int, void* data) {
+			return static_cast<pcm_ring*>(data)->write(frames, nframes, format);
+		}
+
+	private:
+		void copy_in(size_t pos, const short* src, size_t n, int nch) {
+			const size_t idx = pos % m_capacity;
+			const size_t first = n < m_capacity - idx ? n : m_capacity - idx;
+			memcpy(m_data + idx * nch, src, first * nch * sizeof(short));
+			if(first != n) memcpy(m_data, src + first * nch, (n - first) * nch * sizeof(short));
+		}
+		void copy_out(size_t pos, short* dst, size_t n, int nch) const {
+			const size_t idx = pos % m_capacity;
+			const size_t first = n < m_capacity - idx ? n : m_capacity - idx;
+			memcpy(dst, m_data + idx * nch, first * nch * sizeof(short));
+			if(first != n) memcpy(dst + first * nch, m_data, (n - first) * nch * sizeof(short));
+		}
+
+		std::vector<short> m_owned;
+		short* m_data;
+		const size_t m_capacity;
+		const int m_max_channels;
+		std::atomic<int> m_nchannels;
+		std::atomic<int> m_samplerate;
+		// Producer and consumer indices live on separate cache lines
+		alignas(64) std::atomic<size_t> m_tail{0};
+		std::atomic<uint64_t> m_overruns{0};
+		std::atomic<uint64_t> m_format_changes{0};
+		std::atomic<uint64_t> m_frames_written{0};
+		alignas(64) std::atomic<size_t> m_head{0};
+		std::atomic<uint64_t> m_underruns{0};
+	};
+
+	/**
+	 * @brief Output thread draining a pcm_ring into a sink.
+	 *
+	 * The sink is called with blocks of at most block_frames frames. If the ring runs empty
+	 * the thread sleeps for poll_interval instead of spinning.
+	 */
+	class pcm_drain_thread {
+	public:
+		/** @brief Sink receiving frames, format describes the block */
+		typedef std::function<void(const short* frames, size_t nframes, const sp_sampleformat_t& format)> sink_t;
+
+		pcm_drain_thread(pcm_ring& ring, sink_t sink, size_t block_frames = 1024,
+			std::chrono::microseconds poll_interval = std::chrono::milliseconds(5))
+			: m_ring(ring), m_sink(std::move(sink)), m_block(block_frames * ring.max_channels()), m_block_frames(block_frames),
+			m_interval(poll_interval), m_thread([this]() { run(); })
+		{}
+		~pcm_drain_thread() {
+			m_stop.store(true);
+			m_thread.join();
+		}
+
+		pcm_drain_thread(const pcm_drain_thread&) = delete;
+		pcm_drain_thread& operator=(const pcm_drain_thread&) = delete;
+
+		/** @brief Handle of the output thread, e.g. for rt_thread() */
+		std::thread::native_handle_type native_handle() { return m_thread.native_handle(); }
+
+	private:
+		void run() {
+			while(!m_stop.load(std::memory_order_relaxed)) {
+				sp_sampleformat_t fmt;
+				// Only ask for what is there, so idle periods are not counted as underruns
+				size_t want = m_ring.available();
+				if(want > m_block_frames) want = m_block_frames;
+				size_t n = want ? m_ring.read(m_block.data(), want, &fmt) : 0;
+				if(n) m_sink(m_block.data(), n, fmt);
+				else std::this_thread::sleep_for(m_interval);
+			}
+		}
+
+		pcm_ring& m_ring;
+		sink_t m_sink;
+		std::vector<short> m_block;
+		size_t m_block_frames;
+		std::chrono::microseconds m_interval;
+		std::atomic<bool> m_stop{false};
+		std::thread m_thread;
+	};
+}
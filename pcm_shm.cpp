@@ -0,0 +1,253 @@
+#include "pcm_shm.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sp {
+
+	using namespace pcm_shm;
+
+	static int open_shm(const std::string& name, int flags) {
+#ifdef __ANDROID__
+		return ::open(name.c_str(), flags | O_CLOEXEC, 0644);
+#else
+		return ::shm_open(name.c_str(), flags, 0644);
+#endif
+	}
+
+	static void unlink_shm(const std::string& name) {
+#ifdef __ANDROID__
+		::unlink(name.c_str());
+#else
+		::shm_unlink(name.c_str());
+#endif
+	}
+
+	static size_t align64(size_t v) {
+		return (v + 63) & ~(size_t)63;
+	}
+
+	pcm_shm_writer::pcm_shm_writer(const std::string& name, uint32_t block_count, uint32_t block_frames, int max_channels)
+		: m_name(name), m_size(0), m_hdr(nullptr), m_next(0), m_frame_index(0)
+	{
+		if(!block_count || !block_frames || max_channels <= 0) return;
+		const size_t block_size = align64(sizeof(block_header) + (size_t)block_frames * max_channels * sizeof(short));
+		const size_t offset = align64(sizeof(ring_header));
+		m_size = offset + block_size * block_count;
+
+		// Start from scratch, readers of an old ring keep their mapping of it
+		unlink_shm(name);
+		int fd = open_shm(name, O_RDWR | O_CREAT | O_EXCL);
+		if(fd < 0) return;
+		if(::ftruncate(fd, m_size) != 0) {
+			::close(fd);
+			unlink_shm(name);
+			return;
+		}
+		void* mem = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mem == MAP_FAILED) {
+			unlink_shm(name);
+			return;
+		}
+
+		// ftruncate zero fills, so all atomics start at 0
+		ring_header* hdr = static_cast<ring_header*>(mem);
+		hdr->version = version;
+		hdr->block_count = block_count;
+		hdr->block_frames = block_frames;
+		hdr->max_channels = max_channels;
+		hdr->block_size = block_size;
+		hdr->blocks_offset = offset;
+		hdr->writer_pid = ::getpid();
+		// Readers check the magic last
+		std::atomic_thread_fence(std::memory_order_release);
+		reinterpret_cast<std::atomic<uint32_t>*>(&hdr->magic)->store(magic, std::memory_order_release);
+		m_hdr = hdr;
+	}
+
+	pcm_shm_writer::~pcm_shm_writer() {
+		if(!m_hdr) return;
+		::munmap(m_hdr, m_size);
+		unlink_shm(m_name);
+	}
+
+	block_header* pcm_shm_writer::block(uint64_t n) const {
+		char* base = reinterpret_cast<char*>(m_hdr) + m_hdr->blocks_offset;
+		return reinterpret_cast<block_header*>(base + (n % m_hdr->block_count) * m_hdr->block_size);
+	}
+
+	size_t pcm_shm_writer::write(const short* frames, size_t nframes, const sp_sampleformat_t& format, uint32_t position) {
+		if(!m_hdr || format.nchannels <= 0 || format.nchannels > (int)m_hdr->max_channels) return 0;
+		size_t done = 0;
+		while(done < nframes) {
+			const size_t n = std::min<size_t>(nframes - done, m_hdr->block_frames);
+			block_header* b = block(m_next);
+
+			// Seqlock: odd while writing, readers holding this block see the change
+			b->seq.store(2 * m_next + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			b->frame_index = m_frame_index;
+			b->position = format.samplerate > 0 ? position + (uint32_t)(done * 1000 / format.samplerate) : position;
+			b->nframes = n;
+			b->nchannels = format.nchannels;
+			b->samplerate = format.samplerate;
+			memcpy(reinterpret_cast<short*>(b + 1), frames + done * format.nchannels, n * format.nchannels * sizeof(short));
+			b->seq.store(2 * m_next + 2, std::memory_order_release);
+
+			m_next++;
+			m_hdr->write_seq.store(m_next, std::memory_order_release);
+			m_frame_index += n;
+			done += n;
+		}
+		return done;
+	}
+
+	std::vector<pcm_shm_writer::reader_info> pcm_shm_writer::readers() const {
+		std::vector<reader_info> res;
+		if(!m_hdr) return res;
+		for(auto& s : m_hdr->readers) {
+			pid_t pid = s.pid.load(std::memory_order_acquire);
+			if(!pid) continue;
+			uint64_t cursor = s.cursor.load(std::memory_order_relaxed);
+			res.push_back({ pid, m_next > cursor ? m_next - cursor : 0, s.overruns.load(std::memory_order_relaxed) });
+		}
+		return res;
+	}
+
+	unsigned long pcm_shm_writer::on_audio_data(const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int, void* data) {
+		static_cast<pcm_shm_writer*>(data)->write(frames, nframes, *format, SpPlaybackGetPosition());
+		return nframes;
+	}
+
+	pcm_shm_reader::pcm_shm_reader(const std::string& name)
+		: m_size(0), m_hdr(nullptr), m_slot(nullptr), m_cursor(0), m_overruns(0)
+	{
+		int fd = open_shm(name, O_RDWR);
+		if(fd < 0) return;
+		struct stat st;
+		if(::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ring_header)) {
+			::close(fd);
+			return;
+		}
+		void* mem = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mem == MAP_FAILED) return;
+
+		ring_header* hdr = static_cast<ring_header*>(mem);
+		const uint32_t m = reinterpret_cast<std::atomic<uint32_t>*>(&hdr->magic)->load(std::memory_order_acquire);
+		if(m != magic || hdr->version != version || !hdr->block_count
+			|| hdr->blocks_offset + (size_t)hdr->block_size * hdr->block_count > (size_t)st.st_size) {
+			::munmap(mem, st.st_size);
+			return;
+		}
+		m_hdr = hdr;
+		m_size = st.st_size;
+
+		// Claim a slot, slots of readers that died without cleaning up are reused
+		const int32_t self = ::getpid();
+		for(auto& s : m_hdr->readers) {
+			int32_t pid = s.pid.load(std::memory_order_relaxed);
+			if(pid && ::kill(pid, 0) == 0) continue;
+			if(pid && errno != ESRCH) continue;
+			if(s.pid.compare_exchange_strong(pid, self)) {
+				s.overruns.store(0, std::memory_order_relaxed);
+				m_slot = &s;
+				break;
+			}
+		}
+		seek_latest();
+	}
+
+	pcm_shm_reader::~pcm_shm_reader() {
+		if(!m_hdr) return;
+		if(m_slot) m_slot->pid.store(0, std::memory_order_release);
+		::munmap(m_hdr, m_size);
+	}
+
+	const block_header* pcm_shm_reader::block(uint64_t n) const {
+		const char* base = reinterpret_cast<const char*>(m_hdr) + m_hdr->blocks_offset;
+		return reinterpret_cast<const block_header*>(base + (n % m_hdr->block_count) * m_hdr->block_size);
+	}
+
+	void pcm_shm_reader::set_cursor(uint64_t c) {
+		m_cursor = c;
+		if(m_slot) m_slot->cursor.store(c, std::memory_order_relaxed);
+	}
+
+	void pcm_shm_reader::seek_latest() {
+		if(!m_hdr) return;
+		const uint64_t w = m_hdr->write_seq.load(std::memory_order_acquire);
+		set_cursor(w ? w - 1 : 0);
+	}
+
+	uint64_t pcm_shm_reader::lag() const {
+		if(!m_hdr) return 0;
+		const uint64_t w = m_hdr->write_seq.load(std::memory_order_acquire);
+		return w > m_cursor ? w - m_cursor : 0;
+	}
+
+	bool pcm_shm_reader::peek(block_view& view) {
+		if(!m_hdr) return false;
+		for(;;) {
+			const uint64_t w = m_hdr->write_seq.load(std::memory_order_acquire);
+			if(m_cursor >= w) return false;
+			// The writer may already be overwriting the oldest block, skip it as well
+			if(w - m_cursor >= m_hdr->block_count) {
+				const uint64_t lost = w - m_hdr->block_count + 1 - m_cursor;
+				m_overruns += lost;
+				if(m_slot) m_slot->overruns.fetch_add(lost, std::memory_order_relaxed);
+				set_cursor(m_cursor + lost);
+			}
+
+			const block_header* b = block(m_cursor);
+			const uint64_t seq = b->seq.load(std::memory_order_acquire);
+			if(seq < 2 * m_cursor + 2) return false;
+			if(seq > 2 * m_cursor + 2) {
+				// Lapped between loading write_seq and the block
+				m_overruns++;
+				if(m_slot) m_slot->overruns.fetch_add(1, std::memory_order_relaxed);
+				set_cursor(m_cursor + 1);
+				continue;
+			}
+			view.frames = reinterpret_cast<const short*>(b + 1);
+			view.nframes = std::min<size_t>(b->nframes, m_hdr->block_frames);
+			view.format.nchannels = std::min<int>(b->nchannels, m_hdr->max_channels);
+			view.format.samplerate = b->samplerate;
+			view.position = b->position;
+			view.frame_index = b->frame_index;
+			view.seq = m_cursor;
+			return true;
+		}
+	}
+
+	bool pcm_shm_reader::release(const block_view& view) {
+		if(!m_hdr || view.seq != m_cursor) return false;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const bool ok = block(view.seq)->seq.load(std::memory_order_relaxed) == 2 * view.seq + 2;
+		if(!ok) {
+			m_overruns++;
+			if(m_slot) m_slot->overruns.fetch_add(1, std::memory_order_relaxed);
+		}
+		set_cursor(m_cursor + 1);
+		return ok;
+	}
+
+	size_t pcm_shm_reader::read(short* out, block_view* view) {
+		block_view v;
+		while(peek(v)) {
+			memcpy(out, v.frames, v.nframes * v.format.nchannels * sizeof(short));
+			if(!release(v)) continue;
+			v.frames = out;
+			if(view) *view = v;
+			return v.nframes;
+		}
+		return 0;
+	}
+}
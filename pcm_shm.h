@@ -0,0 +1,222 @@
+#pragma once
+
+/**
+ * @file pcm_shm.h
+ * @brief Broadcast the frames from onAudioData to other processes through shared memory.
+ *
+ * The writer publishes every onAudioData delivery as one or more fixed size blocks in a
+ * POSIX shared memory ring. Each block carries its ::sp_sampleformat_t, the playback
+ * position and a running frame index, and is guarded by its own sequence number (a
+ * seqlock), so the writer never waits for anyone: a reader that falls more than one ring
+ * behind loses the oldest blocks and notices it through the sequence numbers.
+ *
+ * Readers keep their own cursor. They register it in one of max_readers slots of the
+ * ring header, which only serves monitoring (see pcm_shm_writer::readers()). Blocks can
+ * be consumed in place with peek()/release() or copied with read().
+ *
+ * On Android, which has no shm_open, the name is used as a file path instead and should
+ * point to a tmpfs.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "spotify.h"
+
+namespace sp {
+
+	namespace pcm_shm {
+
+		constexpr uint32_t magic = 0x4d435053; // "SPCM"
+		constexpr uint32_t version = 1;
+		constexpr size_t max_readers = 16;
+
+		static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory ring needs lock free 64 bit atomics");
+
+		/**
+		 * @brief Cursor of a registered reader.
+		 */
+		struct reader_slot {
+			/** Pid of the reader, 0 if the slot is free */
+			alignas(64) std::atomic<int32_t> pid;
+			/** Next block the reader is going to read */
+			std::atomic<uint64_t> cursor;
+			/** Blocks the reader lost because the writer overwrote them */
+			std::atomic<uint64_t> overruns;
+		};
+
+		/**
+		 * @brief Start of the shared memory, followed by block_count blocks of block_size bytes.
+		 */
+		struct ring_header {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t block_count;
+			uint32_t block_frames;
+			uint32_t max_channels;
+			/** Size of a block including its header */
+			uint32_t block_size;
+			/** Offset of the first block */
+			uint32_t blocks_offset;
+			int32_t writer_pid;
+			/** Number of published blocks */
+			alignas(64) std::atomic<uint64_t> write_seq;
+			reader_slot readers[max_readers];
+		};
+
+		/**
+		 * @brief Header of a block, followed by block_frames * max_channels samples.
+		 *
+		 * Block n is stored at index n % block_count. Its seq is 2n+1 while the writer fills
+		 * it and 2n+2 once it is complete.
+		 */
+		struct block_header {
+			std::atomic<uint64_t> seq;
+			/** Index of the first frame since the writer was created */
+			uint64_t frame_index;
+			/** Playback position of the first frame in milliseconds */
+			uint32_t position;
+			uint32_t nframes;
+			int32_t nchannels;
+			int32_t samplerate;
+		};
+
+		/**
+		 * @brief A block as seen by a reader.
+		 */
+		struct block_view {
+			/** Interleaved frames, points into shared memory for peek() */
+			const short* frames = nullptr;
+			size_t nframes = 0;
+			sp_sampleformat_t format{0, 0};
+			/** Playback position of the first frame in milliseconds */
+			uint32_t position = 0;
+			uint64_t frame_index = 0;
+			/** Block number */
+			uint64_t seq = 0;
+		};
+	}
+
+	class pcm_shm_writer {
+	public:
+		/**
+		 * @brief State of a registered reader.
+		 */
+		struct reader_info {
+			pid_t pid;
+			/** Blocks published but not read yet */
+			uint64_t lag;
+			uint64_t overruns;
+		};
+
+		/**
+		 * @brief Create (or replace) a ring.
+		 * @param name Shared memory name, e.g. "/spotify-pcm"
+		 * @param block_count Number of blocks in the ring
+		 * @param block_frames Frames per block, larger deliveries are split
+		 * @param max_channels Maximum number of channels per frame
+		 */
+		pcm_shm_writer(const std::string& name, uint32_t block_count = 64, uint32_t block_frames = 1024, int max_channels = 2);
+		/** @brief Unmaps and unlinks the ring */
+		~pcm_shm_writer();
+
+		pcm_shm_writer(const pcm_shm_writer&) = delete;
+		pcm_shm_writer& operator=(const pcm_shm_writer&) = delete;
+
+		/** @brief False if the shared memory could not be created */
+		bool valid() const { return m_hdr != nullptr; }
+
+		/**
+		 * @brief Publish frames, never blocks.
+		 * @param position Playback position of the first frame in milliseconds
+		 * @return Number of frames published (0 if the format is not supported)
+		 */
+		size_t write(const short* frames, size_t nframes, const sp_sampleformat_t& format, uint32_t position);
+
+		/** @brief Registered readers */
+		std::vector<reader_info> readers() const;
+		/** @brief Number of published blocks */
+		uint64_t blocks() const { return m_next; }
+		/** @brief Number of published frames */
+		uint64_t frames() const { return m_frame_index; }
+
+		/**
+		 * @brief onAudioData callback, pass the writer as data. Publishes everything and
+		 *        tags it with ::SpPlaybackGetPosition.
+		 */
+		static unsigned long on_audio_data(const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int, void* data);
+
+	private:
+		pcm_shm::block_header* block(uint64_t n) const;
+
+		const std::string m_name;
+		size_t m_size;
+		pcm_shm::ring_header* m_hdr;
+		uint64_t m_next;
+		uint64_t m_frame_index;
+	};
+
+	class pcm_shm_reader {
+	public:
+		/**
+		 * @brief Attach to a ring, reading starts at the newest block.
+		 * @param name Shared memory name as passed to the writer
+		 */
+		explicit pcm_shm_reader(const std::string& name);
+		/** @brief Frees the reader slot and unmaps the ring */
+		~pcm_shm_reader();
+
+		pcm_shm_reader(const pcm_shm_reader&) = delete;
+		pcm_shm_reader& operator=(const pcm_shm_reader&) = delete;
+
+		/** @brief False if the ring does not exist or has an unknown layout */
+		bool valid() const { return m_hdr != nullptr; }
+		/** @brief False if all reader slots were taken, reading works regardless */
+		bool registered() const { return m_slot != nullptr; }
+
+		/**
+		 * @brief Get the next block without copying it.
+		 * @return false if there is no new block
+		 *
+		 * The frames can be overwritten at any time, call release() when done with them.
+		 */
+		bool peek(pcm_shm::block_view& view);
+		/**
+		 * @brief Finish a block returned by peek() and advance to the next one.
+		 * @return false if the block was overwritten while in use, the data must be discarded
+		 */
+		bool release(const pcm_shm::block_view& view);
+		/**
+		 * @brief Copy the next block.
+		 * @param out Receives the frames, must hold block_frames() * max_channels() samples
+		 * @param view If not null receives the block description, frames points to out
+		 * @return Number of frames copied, 0 if there is no new block
+		 */
+		size_t read(short* out, pcm_shm::block_view* view = nullptr);
+		/** @brief Skip to the newest block */
+		void seek_latest();
+
+		/** @brief Frames per block */
+		size_t block_frames() const { return m_hdr ? m_hdr->block_frames : 0; }
+		/** @brief Maximum number of channels per frame */
+		int max_channels() const { return m_hdr ? (int)m_hdr->max_channels : 0; }
+		/** @brief Blocks published but not read yet */
+		uint64_t lag() const;
+		/** @brief Blocks lost because the writer overwrote them */
+		uint64_t overruns() const { return m_overruns; }
+
+	private:
+		const pcm_shm::block_header* block(uint64_t n) const;
+		void set_cursor(uint64_t c);
+
+		size_t m_size;
+		pcm_shm::ring_header* m_hdr;
+		pcm_shm::reader_slot* m_slot;
+		uint64_t m_cursor;
+		uint64_t m_overruns;
+	};
+}
@@ -0,0 +1,196 @@
+#include "prefetcher.h"
+
+namespace sp {
+
+	double prefetcher::stats::hit_rate() const {
+		const uint64_t changes = hits + partial_hits + misses;
+		return changes ? (double)(hits + partial_hits) / changes : 0.0;
+	}
+
+	std::chrono::microseconds prefetcher::stats::gap_saved() const {
+		if(!hit_gaps || !miss_gaps) return std::chrono::microseconds(0);
+		return miss_gap_total / miss_gaps - hit_gap_total / hit_gaps;
+	}
+
+	static prefetcher::api library_api() {
+		prefetcher::api res;
+		res.prefetch = &SpPrefetchItem;
+		res.stop = &SpStopPrefetchingItem;
+		res.position = &SpPlaybackGetPosition;
+		return res;
+	}
+
+	prefetcher::prefetcher(const metadata_cache& meta, options opts, api calls)
+		: m_meta(meta), m_opts(opts), m_api(std::move(calls)), m_enabled(true), m_playing(false),
+		m_state(PS_IDLE), m_attempts(0), m_gap_open(false), m_gap_hit(false)
+	{}
+
+	prefetcher::prefetcher(const metadata_cache& meta, options opts)
+		: prefetcher(meta, opts, library_api())
+	{}
+
+	prefetcher::prefetcher(const metadata_cache& meta)
+		: prefetcher(meta, options(), library_api())
+	{}
+
+	void prefetcher::set_enabled(bool enabled) {
+		if(!enabled) cancel();
+		m_enabled = enabled;
+	}
+
+	void prefetcher::on_notify(sp_playbacknotify_t n) {
+		switch(n) {
+			case PN_PLAY:
+				m_playing = true;
+				break;
+			case PN_PAUSE:
+			case PN_BECAMEINACTIVE:
+				m_playing = false;
+				break;
+			case PN_CONTEXTCHANGED:
+			case PN_SHUFFLEON:
+			case PN_SHUFFLEOFF:
+				// The next track changed
+				cancel();
+				break;
+			case PN_TRACKCHANGED: {
+				// Skips (PN_NEXT/PN_PREV) are only judged here, a skip to the prefetched track is a hit
+				auto snap = m_meta.snapshot();
+				const bool prefetched = snap && snap->current().valid && !m_target.empty() && m_target == snap->current().track_uri;
+				if(prefetched && m_state == PS_DONE) m_stats.hits++;
+				else if(prefetched && m_state == PS_PENDING) m_stats.partial_hits++;
+				else m_stats.misses++;
+				// Only complete hits and plain misses are compared
+				m_gap_open = m_last_frames != clock::time_point() && (!prefetched || m_state == PS_DONE);
+				m_gap_hit = prefetched;
+				// A prefetch of another track is stale now, the prefetched one became the playing track
+				if(!prefetched) cancel();
+				m_target.clear();
+				m_state = PS_IDLE;
+				m_attempts = 0;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	void prefetcher::on_seek(uint64_t position) {
+		if(m_state == PS_IDLE) return;
+		auto snap = m_meta.snapshot();
+		if(!snap) return;
+		const uint64_t duration = snap->current().duration;
+		// A seek within the lead window keeps the prefetch useful
+		if(position + m_opts.lead.count() < duration) cancel();
+	}
+
+	void prefetcher::on_frames(unsigned long nframes) {
+		if(!nframes) return;
+		const auto now = clock::now();
+		if(m_gap_open) {
+			auto gap = std::chrono::duration_cast<std::chrono::microseconds>(now - m_last_frames);
+			if(m_gap_hit) {
+				m_stats.hit_gaps++;
+				m_stats.hit_gap_total += gap;
+			} else {
+				m_stats.miss_gaps++;
+				m_stats.miss_gap_total += gap;
+			}
+			m_gap_open = false;
+		}
+		m_last_frames = now;
+	}
+
+	void prefetcher::on_prefetched(const char* uri) {
+		if(m_state != PS_PENDING || !uri || m_target != uri) return;
+		m_state = PS_DONE;
+		m_stats.completed++;
+	}
+
+	bool prefetcher::on_error(sp_error_t e) {
+		switch(e) {
+			case E_PLAYBACK_PREFETCH_UNAVAILABLE:
+				failed(false);
+				return true;
+			case E_PLAYBACK_PREFETCH_DOWNLOAD_FAILED:
+				failed(true);
+				return true;
+			default:
+				return false;
+		}
+	}
+
+	void prefetcher::tick() {
+		if(!m_enabled || !m_playing) return;
+		auto snap = m_meta.snapshot();
+		if(!snap) return;
+		const track_info& cur = snap->current();
+		const track_info& next = snap->next();
+		if(!cur.valid || !next.valid || !*next.track_uri) return;
+
+		if(m_target != next.track_uri) {
+			// The queue changed under a running prefetch
+			if(m_state == PS_PENDING) cancel();
+			m_target.clear();
+			m_state = PS_IDLE;
+			m_attempts = 0;
+		} else if(m_state == PS_PENDING || m_state == PS_DONE) return;
+		if(m_state == PS_FAILED && (m_attempts >= m_opts.max_attempts || clock::now() < m_retry_at)) return;
+
+		const unsigned int pos = m_api.position();
+		if(pos + m_opts.lead.count() < cur.duration) return;
+		request(next);
+	}
+
+	void prefetcher::request(const track_info& next) {
+		m_target = next.track_uri;
+		m_attempts++;
+		m_stats.requests++;
+		// The meaning of the second argument is unknown, it might be the playlist index
+		const sp_error_t res = m_api.prefetch(next.track_uri, next.playlist_idx);
+		switch(res) {
+			case E_OK:
+				m_state = PS_PENDING;
+				break;
+			case E_PLAYBACK_ALREADY_PREFETCHING:
+				// Most likely a stale prefetch of a track that is not next anymore
+				m_stats.already_prefetching++;
+				m_api.stop();
+				m_state = PS_FAILED;
+				m_retry_at = clock::now();
+				break;
+			case E_PLAYBACK_PREFETCH_UNAVAILABLE:
+				failed(false);
+				break;
+			default:
+				failed(true);
+				break;
+		}
+	}
+
+	void prefetcher::cancel() {
+		if(m_state == PS_PENDING) {
+			m_api.stop();
+			m_stats.cancelled++;
+		}
+		m_target.clear();
+		m_state = PS_IDLE;
+		m_attempts = 0;
+	}
+
+	void prefetcher::failed(bool retry) {
+		m_stats.failures++;
+		if(m_target.empty()) return;
+		m_state = PS_FAILED;
+		if(!retry) m_attempts = m_opts.max_attempts;
+		m_retry_at = clock::now() + m_opts.retry;
+	}
+
+	sp_prefetch_callbacks_t prefetcher::callbacks() {
+		sp_prefetch_callbacks_t cbs;
+		cbs.fn = [](const char* uri, long, long, void* data) {
+			static_cast<prefetcher*>(data)->on_prefetched(uri);
+		};
+		return cbs;
+	}
+}
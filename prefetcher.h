@@ -0,0 +1,155 @@
+#pragma once
+
+/**
+ * @file prefetcher.h
+ * @brief Drives ::SpPrefetchItem so the next track is cached before the current one ends.
+ *
+ * Once the remaining time of the current track (::SpPlaybackGetPosition against
+ * ::sp_metadata_t::duration) drops below the lead time, the next track of the metadata
+ * cache (idx 1) is prefetched. Rejections are handled: E_PLAYBACK_ALREADY_PREFETCHING
+ * stops the stale prefetch and retries, E_PLAYBACK_PREFETCH_UNAVAILABLE gives up on the
+ * track, other failures are retried a few times. Seeks out of the lead window, context and
+ * shuffle changes and track changes to another track than the prefetched one cancel a
+ * running prefetch.
+ *
+ * At every track change the new track is classified as hit (prefetch completed), partial
+ * (still prefetching) or miss. The gap between the last frame of the old track and the
+ * first frame of the new one is measured for hits and misses, the difference of their
+ * averages is the gap the prefetching saves.
+ *
+ * Everything runs on the pump thread: call on_notify() after the metadata cache was
+ * refreshed, on_seek() from onSeek, on_frames() from onAudioData and tick() from the
+ * main loop.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "spotify.h"
+#include "metadata_cache.h"
+
+namespace sp {
+
+	class prefetcher {
+	public:
+		/**
+		 * @brief Library entry points, replaceable for testing.
+		 */
+		struct api {
+			std::function<sp_error_t(const char* uri, unsigned int arg)> prefetch;
+			std::function<sp_error_t()> stop;
+			std::function<unsigned int()> position;
+		};
+
+		/**
+		 * @brief Tuning
+		 */
+		struct options {
+			/** Start prefetching this long before the current track ends */
+			std::chrono::milliseconds lead{20000};
+			/** Delay before retrying a failed prefetch */
+			std::chrono::milliseconds retry{2000};
+			/** Attempts per track */
+			unsigned max_attempts = 3;
+		};
+
+		/**
+		 * @brief Counters
+		 */
+		struct stats {
+			/** ::SpPrefetchItem calls */
+			uint64_t requests = 0;
+			/** Prefetches reported as done by the library */
+			uint64_t completed = 0;
+			/** E_PLAYBACK_ALREADY_PREFETCHING answers */
+			uint64_t already_prefetching = 0;
+			/** Failed requests and E_PLAYBACK_PREFETCH_* errors */
+			uint64_t failures = 0;
+			/** Prefetches stopped because of a seek, context change or a change to another track */
+			uint64_t cancelled = 0;
+			/** Track changes to a completely prefetched track */
+			uint64_t hits = 0;
+			/** Track changes to a track that was still being prefetched */
+			uint64_t partial_hits = 0;
+			/** Track changes to a track that was not prefetched */
+			uint64_t misses = 0;
+			/** Measured gaps for hits and misses */
+			uint64_t hit_gaps = 0;
+			uint64_t miss_gaps = 0;
+			std::chrono::microseconds hit_gap_total{0};
+			std::chrono::microseconds miss_gap_total{0};
+
+			/** @brief Share of track changes that were (at least partially) prefetched */
+			double hit_rate() const;
+			/** @brief Average miss gap minus average hit gap, zero until both were measured */
+			std::chrono::microseconds gap_saved() const;
+		};
+
+		/** @brief Use the library functions */
+		prefetcher(const metadata_cache& meta, options opts);
+		explicit prefetcher(const metadata_cache& meta);
+		prefetcher(const metadata_cache& meta, options opts, api calls);
+
+		prefetcher(const prefetcher&) = delete;
+		prefetcher& operator=(const prefetcher&) = delete;
+
+		/** @brief Enable or disable prefetching, disabling cancels a running prefetch */
+		void set_enabled(bool enabled);
+		/** @brief Feed playback notifications, after the metadata cache was refreshed */
+		void on_notify(sp_playbacknotify_t n);
+		/** @brief Feed onSeek */
+		void on_seek(uint64_t position);
+		/** @brief Call from onAudioData with the number of frames accepted */
+		void on_frames(unsigned long nframes);
+		/** @brief Feed the prefetch callback, see callbacks() */
+		void on_prefetched(const char* uri);
+		/**
+		 * @brief Feed async errors (sp_init_config_t::on_error).
+		 * @return true if the error was a prefetch error
+		 */
+		bool on_error(sp_error_t e);
+		/** @brief Check whether prefetching is due, call regularly from the main loop */
+		void tick();
+
+		/** @brief Uri currently prefetched (or prefetching), empty if none */
+		const std::string& target() const { return m_target; }
+		/** @brief Get counters */
+		const stats& get_stats() const { return m_stats; }
+
+		/**
+		 * @brief Build a callback table, pass this object as data to ::SpRegisterPrefetchCallbacks.
+		 */
+		static sp_prefetch_callbacks_t callbacks();
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		enum state {
+			PS_IDLE,
+			PS_PENDING,
+			PS_DONE,
+			PS_FAILED
+		};
+
+		void request(const track_info& next);
+		void cancel();
+		void failed(bool retry);
+
+		const metadata_cache& m_meta;
+		const options m_opts;
+		const api m_api;
+		bool m_enabled;
+		bool m_playing;
+		std::string m_target;
+		state m_state;
+		unsigned m_attempts;
+		clock::time_point m_retry_at;
+		// Gap measurement
+		clock::time_point m_last_frames;
+		bool m_gap_open;
+		bool m_gap_hit;
+		stats m_stats;
+	};
+}
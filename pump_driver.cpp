@@ -0,0 +1,132 @@
+#include "pump_driver.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace sp {
+
+	pump_driver* pump_driver::s_instance = nullptr;
+
+	pump_driver::pump_driver(std::chrono::milliseconds idle_timeout, std::chrono::milliseconds active_timeout)
+		: m_epoll(epoll_create1(EPOLL_CLOEXEC)), m_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+		m_idle_timeout(idle_timeout), m_active_timeout(active_timeout)
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = m_event;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_event, &ev);
+	}
+
+	pump_driver::~pump_driver() {
+		if(s_instance == this) s_instance = nullptr;
+		close(m_event);
+		close(m_epoll);
+	}
+
+	bool pump_driver::watch(int fd, bool readable, bool writable) {
+		// Interest accumulates until the descriptor fires, so readable and writable can be asked for separately
+		uint32_t& mask = m_interest[fd];
+		uint32_t want = mask | (readable ? (uint32_t)EPOLLIN : 0) | (writable ? (uint32_t)EPOLLOUT : 0);
+		if(want == mask) return true;
+		mask = want;
+		struct epoll_event ev;
+		ev.events = EPOLLONESHOT | want;
+		ev.data.fd = fd;
+		if(epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev) == 0) return true;
+		return errno == ENOENT && epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+	}
+
+	void pump_driver::unwatch(int fd) {
+		m_interest.erase(fd);
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+	}
+
+	void pump_driver::wake() {
+		uint64_t one = 1;
+		(void)!::write(m_event, &one, sizeof(one));
+	}
+
+	sp_error_t pump_driver::pump() {
+		m_pumps.fetch_add(1, std::memory_order_relaxed);
+		return SpPumpEvents();
+	}
+
+	sp_error_t pump_driver::pump_once() {
+		sp_error_t res = pump();
+		wait();
+		return res;
+	}
+
+	void pump_driver::hint(int ms) {
+		if(ms < 0) return;
+		int cur = m_hint.load(std::memory_order_relaxed);
+		while((cur < 0 || ms < cur) && !m_hint.compare_exchange_weak(cur, ms, std::memory_order_relaxed)) {}
+	}
+
+	void pump_driver::wait() {
+		// Without readiness reports only the short timer keeps network round trips from stalling
+		const bool idle = m_io_driven.load(std::memory_order_relaxed) && !m_active.load(std::memory_order_relaxed);
+		int timeout = (int)(idle ? m_idle_timeout : m_active_timeout).count();
+		int hint = m_hint.exchange(-1, std::memory_order_relaxed);
+		if(hint >= 0 && hint < timeout) timeout = hint;
+
+		struct epoll_event evs[16];
+		int n = epoll_wait(m_epoll, evs, 16, timeout);
+		if(n <= 0) {
+			if(n == 0) m_timer_wakeups.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		for(int i = 0; i < n; i++) {
+			if(evs[i].data.fd == m_event) {
+				uint64_t val;
+				(void)!::read(m_event, &val, sizeof(val));
+				m_manual_wakeups.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				m_interest[evs[i].data.fd] = 0;
+				m_io_wakeups.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	pump_driver::stats pump_driver::get_stats() const {
+		stats res;
+		res.pumps = m_pumps.load(std::memory_order_relaxed);
+		res.io_wakeups = m_io_wakeups.load(std::memory_order_relaxed);
+		res.timer_wakeups = m_timer_wakeups.load(std::memory_order_relaxed);
+		res.manual_wakeups = m_manual_wakeups.load(std::memory_order_relaxed);
+		return res;
+	}
+
+	static int poll_now(int fd, short events) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0 && (pfd.revents & (events | POLLERR | POLLHUP)) ? 1 : 0;
+	}
+
+	void pump_driver::install_hooks(sp_sockethal_callbacks_t& cbs) {
+		s_instance = this;
+		set_io_driven(true);
+		cbs.fn13 = [](void* a, void*, void*, void*) -> int {
+			int fd = (int)(intptr_t)a;
+			int res = poll_now(fd, POLLIN);
+			if(!res && s_instance) s_instance->watch(fd, true, false);
+			return res;
+		};
+		cbs.fn14 = [](void* a, void*, void*, void*) -> int {
+			int fd = (int)(intptr_t)a;
+			int res = poll_now(fd, POLLOUT);
+			if(!res && s_instance) s_instance->watch(fd, false, true);
+			return res;
+		};
+		cbs.fn17 = [](int a, void*) -> int {
+			if(s_instance) s_instance->hint(a);
+			return 0;
+		};
+	}
+}
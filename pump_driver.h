@@ -0,0 +1,121 @@
+#pragma once
+
+/**
+ * @file pump_driver.h
+ * @brief Event driven replacement for calling ::SpPumpEvents in a busy loop.
+ *
+ * The driver calls ::SpPumpEvents and then sleeps in epoll_wait until a socket the library
+ * asked about becomes ready, another thread calls wake() or a bounded fallback timer
+ * expires. While audio is playing a shorter timer is used, so the library still delivers
+ * frames at the usual cadence. The longer idle timer is only used once readiness is
+ * reported to the driver (install_hooks() or a socket_hal); without it the library's own
+ * network stack would wait for the timer on every round trip (login, first SpPlayUri).
+ *
+ * The socket HAL hooks fn13 (is_readable), fn14 (is_writable) and fn17 (on_pump) are used
+ * to learn which sockets the library is waiting for. Their arguments are reverse engineered:
+ * the first argument of fn13/fn14 is assumed to be the socket handle (a file descriptor) and
+ * the int passed to fn17 is treated as the number of milliseconds until the library wants to
+ * be pumped again (negative meaning no preference).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class pump_driver {
+	public:
+		/**
+		 * @brief Wakeup counters
+		 */
+		struct stats {
+			/** Number of ::SpPumpEvents calls */
+			uint64_t pumps = 0;
+			/** Wakeups caused by socket readiness */
+			uint64_t io_wakeups = 0;
+			/** Wakeups caused by the fallback timer */
+			uint64_t timer_wakeups = 0;
+			/** Wakeups caused by wake() */
+			uint64_t manual_wakeups = 0;
+		};
+
+		/**
+		 * @brief Create a driver.
+		 * @param idle_timeout Upper bound for sleeping while no audio is playing and readiness is reported
+		 * @param active_timeout Upper bound for sleeping while audio is playing
+		 */
+		explicit pump_driver(std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(100),
+			std::chrono::milliseconds active_timeout = std::chrono::milliseconds(5));
+		~pump_driver();
+
+		pump_driver(const pump_driver&) = delete;
+		pump_driver& operator=(const pump_driver&) = delete;
+
+		/**
+		 * @brief Wait for readiness of a file descriptor.
+		 *
+		 * Interest is one-shot: once the descriptor triggered a wakeup it has to be watched
+		 * again, which the library does by asking is_readable/is_writable.
+		 * Only call from the pump thread.
+		 */
+		bool watch(int fd, bool readable, bool writable);
+		/** @brief Stop watching a file descriptor, must be called before it gets closed (pump thread only) */
+		void unwatch(int fd);
+		/** @brief Interrupt a running wait, safe to call from any thread */
+		void wake();
+		/** @brief Switch between the idle and the active (playing) fallback timer */
+		void set_active(bool active) { m_active.store(active, std::memory_order_relaxed); }
+		/** @brief Whether socket readiness is reported to this driver, enables the idle timer */
+		void set_io_driven(bool io_driven) { m_io_driven.store(io_driven, std::memory_order_relaxed); }
+		/** @brief Limit the next wait, see fn17. The shortest hint since the last wait wins, negative values are ignored */
+		void hint(int ms);
+
+		/** @brief Call ::SpPumpEvents without waiting */
+		sp_error_t pump();
+		/**
+		 * @brief Pump library events once and wait for the next reason to pump.
+		 * @return Result of ::SpPumpEvents
+		 */
+		sp_error_t pump_once();
+		/**
+		 * @brief Wait without pumping, returns once there is a reason to pump.
+		 *
+		 * Call wake() after issuing a command from the pump thread, so it gets processed without delay.
+		 */
+		void wait();
+
+		/** @brief The shared epoll set */
+		int epoll_fd() const { return m_epoll; }
+		/** @brief Get wakeup counters */
+		stats get_stats() const;
+
+		/**
+		 * @brief Fill fn13, fn14 and fn17 of a socket HAL table with hooks feeding this driver.
+		 *
+		 * The socket HAL is global, so only one driver can be installed at a time.
+		 */
+		void install_hooks(sp_sockethal_callbacks_t& cbs);
+		/** @brief Driver the hooks are installed for, if any */
+		static pump_driver* instance() { return s_instance; }
+
+	private:
+		static pump_driver* s_instance;
+
+		int m_epoll;
+		int m_event;
+		std::unordered_map<int, uint32_t> m_interest;
+		const std::chrono::milliseconds m_idle_timeout;
+		const std::chrono::milliseconds m_active_timeout;
+		std::atomic<bool> m_active{false};
+		std::atomic<bool> m_io_driven{false};
+		std::atomic<int> m_hint{-1};
+		std::atomic<uint64_t> m_pumps{0};
+		std::atomic<uint64_t> m_io_wakeups{0};
+		std::atomic<uint64_t> m_timer_wakeups{0};
+		std::atomic<uint64_t> m_manual_wakeups{0};
+	};
+}
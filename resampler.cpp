@@ -0,0 +1,192 @@
+#include "resampler.h"
+#include "pcm_convert.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SP_RESAMPLER_SSE 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SP_RESAMPLER_NEON 1
+#endif
+
+namespace sp {
+
+	constexpr unsigned resampler::max_phases;
+
+	static unsigned taps_for(resampler::quality q) {
+		switch(q) {
+			case resampler::RQ_FAST: return 16;
+			case resampler::RQ_HIGH: return 64;
+			default: return 32;
+		}
+	}
+
+	static double beta_for(resampler::quality q) {
+		switch(q) {
+			case resampler::RQ_FAST: return 5.0;
+			case resampler::RQ_HIGH: return 9.5;
+			default: return 7.5;
+		}
+	}
+
+	static double rolloff_for(resampler::quality q) {
+		switch(q) {
+			case resampler::RQ_FAST: return 0.90;
+			case resampler::RQ_HIGH: return 0.97;
+			default: return 0.94;
+		}
+	}
+
+	static unsigned gcd(unsigned a, unsigned b) {
+		while(b) {
+			unsigned t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+
+	// Modified bessel function of the first kind, order zero (for the kaiser window)
+	static double bessel_i0(double x) {
+		double sum = 1.0, term = 1.0;
+		for(int k = 1; k < 50; k++) {
+			term *= (x / (2.0 * k)) * (x / (2.0 * k));
+			sum += term;
+			if(term < sum * 1e-12) break;
+		}
+		return sum;
+	}
+
+	static float dot(const float* a, const float* b, unsigned n) {
+		unsigned i = 0;
+		float res = 0.0f;
+#if SP_RESAMPLER_SSE
+		__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+		for(; i + 8 <= n; i += 8) {
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+		}
+		float tmp[4];
+		_mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+		res = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#elif SP_RESAMPLER_NEON
+		float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+		for(; i + 8 <= n; i += 8) {
+			acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+			acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+		}
+		res = vaddvq_f32(vaddq_f32(acc0, acc1));
+#endif
+		for(; i < n; i++) res += a[i] * b[i];
+		return res;
+	}
+
+	resampler::resampler(int out_rate, quality q)
+		: m_out_rate(out_rate), m_quality_taps(taps_for(q)), m_beta(beta_for(q)), m_rolloff(rolloff_for(q)),
+		m_taps(0), m_in_rate(0), m_nchannels(0), m_l(1), m_m(1), m_phases(1), m_pos(0), m_phase(0),
+		m_frames_in(0), m_frames_out(0)
+	{}
+
+	size_t resampler::process(const short* in, size_t nframes, const sp_sampleformat_t& format, float* out, size_t out_frames) {
+		if(format.samplerate != m_in_rate || format.nchannels != m_nchannels) configure(format);
+		if(m_nchannels <= 0) return 0;
+
+		// Append the new input to the planar history
+		const size_t base = m_hist[0].size();
+		for(auto& h : m_hist) h.resize(base + nframes);
+		if(m_nchannels == 2) pcm::best().deinterleave2_f32(in, &m_hist[0][base], &m_hist[1][base], nframes);
+		else {
+			std::vector<float*> planes(m_nchannels);
+			for(int c = 0; c < m_nchannels; c++) planes[c] = &m_hist[c][base];
+			pcm::deinterleave_f32(in, planes.data(), nframes, m_nchannels);
+		}
+		m_frames_in += nframes;
+
+		const size_t avail = m_hist[0].size();
+		size_t produced = 0;
+		while(produced < out_frames && m_pos + m_taps <= avail) {
+			const unsigned row = m_phases == m_l ? m_phase : (unsigned)((uint64_t)m_phase * m_phases / m_l);
+			const float* coeffs = &m_coeffs[(size_t)row * m_taps];
+			for(int c = 0; c < m_nchannels; c++)
+				out[produced * m_nchannels + c] = dot(&m_hist[c][m_pos], coeffs, m_taps);
+			produced++;
+			m_phase += m_m;
+			m_pos += m_phase / m_l;
+			m_phase %= m_l;
+		}
+
+		// Keep only what later outputs still need
+		if(m_pos) {
+			size_t drop = m_pos < avail ? m_pos : avail;
+			for(auto& h : m_hist) h.erase(h.begin(), h.begin() + drop);
+			m_pos -= drop;
+		}
+		m_frames_out += produced;
+		return produced;
+	}
+
+	size_t resampler::max_output(size_t nframes) const {
+		if(m_nchannels <= 0) {
+			// Not configured yet, assume the worst supported upsampling ratio
+			return nframes * 8 + 1;
+		}
+		size_t avail = m_hist[0].size() + nframes;
+		if(avail < m_pos + m_taps) return 0;
+		return (size_t)(((uint64_t)(avail - m_pos - m_taps + 1) * m_l + m_m - 1) / m_m) + 1;
+	}
+
+	void resampler::reset() {
+		m_pos = 0;
+		m_phase = 0;
+		for(auto& h : m_hist) h.assign(m_taps / 2 ? m_taps / 2 - 1 : 0, 0.0f);
+	}
+
+	void resampler::configure(const sp_sampleformat_t& format) {
+		m_in_rate = format.samplerate;
+		m_nchannels = format.nchannels;
+		if(m_in_rate <= 0 || m_out_rate <= 0 || m_nchannels <= 0) {
+			m_nchannels = 0;
+			return;
+		}
+
+		unsigned g = gcd(m_out_rate, m_in_rate);
+		m_l = m_out_rate / g;
+		m_m = m_in_rate / g;
+		// Changing L/M here would drift against the input, only the filter gets fewer phases
+		m_phases = std::min(m_l, max_phases);
+
+		if(m_l == 1 && m_m == 1) {
+			// Same rate, a single unity tap turns this into a plain conversion
+			m_taps = 1;
+			m_phases = 1;
+			m_coeffs.assign(1, 1.0f);
+		} else {
+			m_taps = m_quality_taps;
+			m_coeffs.resize((size_t)m_phases * m_taps);
+			// Cutoff relative to the input rate, a bit below nyquist of the lower rate
+			const double fc = 0.5 * std::min(1.0, (double)m_l / m_m) * m_rolloff;
+			const double half = m_taps / 2.0;
+			const double i0beta = bessel_i0(m_beta);
+			for(unsigned p = 0; p < m_phases; p++) {
+				const double frac = (double)p / m_phases;
+				double sum = 0.0;
+				float* c = &m_coeffs[(size_t)p * m_taps];
+				for(unsigned j = 0; j < m_taps; j++) {
+					const double x = (double)j - (half - 1.0) - frac;
+					const double arg = 2.0 * fc * x;
+					const double sinc = std::fabs(arg) < 1e-12 ? 1.0 : std::sin(M_PI * arg) / (M_PI * arg);
+					const double w = x / half;
+					const double win = std::fabs(w) >= 1.0 ? 0.0 : bessel_i0(m_beta * std::sqrt(1.0 - w * w)) / i0beta;
+					c[j] = (float)(2.0 * fc * sinc * win);
+					sum += c[j];
+				}
+				for(unsigned j = 0; j < m_taps; j++) c[j] = (float)(c[j] / sum);
+			}
+		}
+		m_hist.assign(m_nchannels, std::vector<float>());
+		reset();
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+/**
+ * @file resampler.h
+ * @brief Streaming polyphase resampler for the frames delivered by onAudioData.
+ *
+ * The library picks the sample rate (see ::sp_sampleformat_t), output devices and encoders
+ * usually run at a fixed rate. The resampler keeps its filter history across calls and
+ * rebuilds the filter whenever the input format changes mid-stream.
+ *
+ * The ratio is handled exactly as out_rate/in_rate reduced to L/M, so the output never drifts
+ * against the input. Ratios with L above max_phases keep the exact ratio but use the nearest
+ * lower of max_phases filter phases, a timing error below 1/max_phases of an input frame.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class resampler {
+	public:
+		/**
+		 * @brief Quality/latency profile
+		 */
+		enum quality {
+			/** 16 taps, lowest latency and cpu usage */
+			RQ_FAST = 0,
+			/** 32 taps */
+			RQ_BALANCED = 1,
+			/** 64 taps, best stop band attenuation */
+			RQ_HIGH = 2
+		};
+
+		/** @brief Upper limit for the number of filter phases */
+		static constexpr unsigned max_phases = 1024;
+
+		/**
+		 * @brief Create a resampler.
+		 * @param out_rate Output sample rate
+		 * @param q Quality profile
+		 */
+		explicit resampler(int out_rate, quality q = RQ_BALANCED);
+
+		/**
+		 * @brief Resample a block.
+		 * @param in Interleaved input frames as passed to onAudioData
+		 * @param nframes Number of input frames
+		 * @param format Format of the input frames
+		 * @param out Interleaved float output, format->nchannels channels at out_rate
+		 * @param out_frames Capacity of out in frames, use max_output() to size it
+		 * @return Number of frames written to out
+		 *
+		 * All input is always consumed. If out is too small the remaining output is kept and
+		 * returned by the next call.
+		 */
+		size_t process(const short* in, size_t nframes, const sp_sampleformat_t& format, float* out, size_t out_frames);
+		/** @brief Upper bound for the output of the next process() call */
+		size_t max_output(size_t nframes) const;
+		/** @brief Drop the filter history, e.g. on PN_AUDIOFLUSH or seek */
+		void reset();
+
+		/** @brief Output sample rate */
+		int out_rate() const { return m_out_rate; }
+		/** @brief Delay introduced by the filter in input frames */
+		unsigned latency() const { return m_taps / 2; }
+		/** @brief Total number of input frames processed */
+		uint64_t frames_in() const { return m_frames_in; }
+		/** @brief Total number of output frames produced */
+		uint64_t frames_out() const { return m_frames_out; }
+
+	private:
+		void configure(const sp_sampleformat_t& format);
+
+		const int m_out_rate;
+		const unsigned m_quality_taps;
+		const double m_beta;
+		const double m_rolloff;
+		unsigned m_taps;
+		int m_in_rate;
+		int m_nchannels;
+		unsigned m_l;
+		unsigned m_m;
+		// Filter phases, m_l up to max_phases
+		unsigned m_phases;
+		// m_phases phases of m_taps coefficients each
+		std::vector<float> m_coeffs;
+		// One history buffer per channel, planar
+		std::vector<std::vector<float>> m_hist;
+		size_t m_pos;
+		unsigned m_phase;
+		uint64_t m_frames_in;
+		uint64_t m_frames_out;
+	};
+}
@@ -0,0 +1,163 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "rt_memory.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace sp {
+
+	static const size_t huge_page_size = 2 * 1024 * 1024;
+
+	static size_t round_up(size_t v, size_t to) {
+		return (v + to - 1) / to * to;
+	}
+
+	rt_region::rt_region(size_t size, const options& opts)
+		: m_data(nullptr), m_map(nullptr), m_size(size), m_mapped(0), m_backing(RB_NONE), m_locked(false)
+	{
+		if(size == 0) return;
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+		if(opts.hugepages) {
+			const size_t len = round_up(size, huge_page_size);
+			void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+			if(p != MAP_FAILED) {
+				m_map = m_data = p;
+				m_mapped = len;
+				m_backing = RB_HUGETLB;
+			}
+		}
+#endif
+#ifdef MADV_HUGEPAGE
+		if(!m_data && opts.hugepages && size >= huge_page_size) {
+			// Over-allocate to get a 2 MiB aligned start, THP only backs aligned ranges
+			const size_t len = round_up(size, huge_page_size);
+			void* p = mmap(nullptr, len + huge_page_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+			if(p != MAP_FAILED) {
+				uintptr_t start = round_up((uintptr_t)p, huge_page_size);
+				const size_t head = start - (uintptr_t)p;
+				if(head) munmap(p, head);
+				const size_t tail = huge_page_size - head;
+				if(tail) munmap((void*)(start + len), tail);
+				m_map = m_data = (void*)start;
+				m_mapped = len;
+				m_backing = madvise(m_data, len, MADV_HUGEPAGE) == 0 ? RB_THP : RB_PAGES;
+			}
+		}
+#endif
+		if(!m_data) {
+			const size_t len = round_up(size, page);
+			void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+			if(p == MAP_FAILED) return;
+			m_map = m_data = p;
+			m_mapped = len;
+			m_backing = RB_PAGES;
+		}
+		// mlock faults the pages in as well, touching them first also works without the privilege
+		if(opts.prefault) {
+			volatile char* p = (volatile char*)m_data;
+			for(size_t off = 0; off < m_mapped; off += page) p[off] = 0;
+		}
+		if(opts.lock) m_locked = mlock(m_data, m_mapped) == 0;
+	}
+
+	rt_region::rt_region(size_t size)
+		: rt_region(size, options())
+	{}
+
+	rt_region::~rt_region() {
+		if(!m_map) return;
+		if(m_locked) munlock(m_map, m_mapped);
+		munmap(m_map, m_mapped);
+	}
+
+	long rt_region::huge_bytes() const {
+		if(!m_data) return -1;
+		if(m_backing == RB_HUGETLB) return (long)m_mapped;
+		FILE* f = fopen("/proc/self/smaps", "r");
+		if(!f) return -1;
+		char line[256];
+		bool inside = false;
+		long res = -1;
+		const uintptr_t start = (uintptr_t)m_data;
+		while(fgets(line, sizeof(line), f)) {
+			unsigned long lo, hi;
+			if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+				inside = start >= lo && start < hi;
+				continue;
+			}
+			long kb;
+			if(inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+				res = kb * 1024;
+				break;
+			}
+		}
+		fclose(f);
+		return res;
+	}
+
+	void rt_region::report(std::ostream& out) const {
+		out << m_size << " bytes, " << backing_name(m_backing) << ", " << (m_locked ? "locked" : "not locked");
+		const long huge = huge_bytes();
+		if(huge >= 0) out << ", " << huge << " bytes in huge pages";
+		out << std::endl;
+	}
+
+	const char* rt_region::backing_name(backing b) {
+		switch(b) {
+			case RB_NONE: return "none";
+			case RB_HUGETLB: return "hugetlb";
+			case RB_THP: return "thp";
+			case RB_PAGES: return "pages";
+		}
+		return "unknown";
+	}
+
+	bool rt_thread(pthread_t thread, int priority, int cpu) {
+		bool ok = true;
+		if(priority > 0) {
+			struct sched_param param;
+			memset(&param, 0, sizeof(param));
+			param.sched_priority = priority;
+			ok &= pthread_setschedparam(thread, SCHED_FIFO, &param) == 0;
+		}
+		if(cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+#ifdef __ANDROID__
+			// bionic has no pthread_setaffinity_np, pin the kernel thread behind it instead
+			ok &= ::sched_setaffinity(pthread_gettid_np(thread), sizeof(set), &set) == 0;
+#else
+			ok &= pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#endif
+		}
+		return ok;
+	}
+
+	static page_faults from_rusage(int who) {
+		page_faults res;
+		struct rusage ru;
+		if(getrusage(who, &ru) == 0) {
+			res.minor = (uint64_t)ru.ru_minflt;
+			res.major = (uint64_t)ru.ru_majflt;
+		}
+		return res;
+	}
+
+	page_faults page_faults::process() {
+		return from_rusage(RUSAGE_SELF);
+	}
+
+	page_faults page_faults::thread() {
+		return from_rusage(RUSAGE_THREAD);
+	}
+}
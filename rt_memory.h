@@ -0,0 +1,111 @@
+#pragma once
+
+/**
+ * @file rt_memory.h
+ * @brief Page fault free memory for sp_init_config_t::wmem and the audio buffers, real-time audio threads.
+ *
+ * rt_region maps anonymous memory and tries, in this order, explicit huge pages
+ * (MAP_HUGETLB, needs reserved pages in /proc/sys/vm/nr_hugepages), transparent huge pages
+ * (a 2 MiB aligned mapping with MADV_HUGEPAGE) and plain pages. The pages are prefaulted
+ * and locked with mlock, so neither the first touch nor later reclaim faults on the audio
+ * path. Locking fails without CAP_IPC_LOCK once RLIMIT_MEMLOCK is exceeded; the region
+ * stays usable, locked() tells.
+ *
+ * rt_thread() switches a thread (e.g. pcm_drain_thread::native_handle()) to SCHED_FIFO
+ * and/or pins it to a cpu, page_faults reads the fault counters of the process or the
+ * calling thread to check the effect.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <pthread.h>
+
+namespace sp {
+
+	class rt_region {
+	public:
+		enum backing {
+			/** Mapping failed */
+			RB_NONE,
+			/** Explicit huge pages */
+			RB_HUGETLB,
+			/** Transparent huge pages were requested, the kernel decides */
+			RB_THP,
+			/** Normal pages */
+			RB_PAGES
+		};
+
+		struct options {
+			/** Try MAP_HUGETLB and THP before normal pages */
+			bool hugepages = true;
+			/** Touch every page up front */
+			bool prefault = true;
+			/** mlock the region */
+			bool lock = true;
+		};
+
+		/** @brief Map at least size bytes, zero filled like the memory the sdk hands to ::SpInit */
+		explicit rt_region(size_t size);
+		rt_region(size_t size, const options& opts);
+		~rt_region();
+
+		rt_region(const rt_region&) = delete;
+		rt_region& operator=(const rt_region&) = delete;
+
+		bool valid() const { return m_data != nullptr; }
+		void* data() const { return m_data; }
+		/** @brief Requested size */
+		size_t size() const { return m_size; }
+		/** @brief Mapped size, rounded up to the page size in use */
+		size_t mapped_size() const { return m_mapped; }
+		backing kind() const { return m_backing; }
+		bool locked() const { return m_locked; }
+		/** @brief Bytes backed by huge pages according to /proc/self/smaps (-1 if unknown) */
+		long huge_bytes() const;
+
+		/** @brief One line summary: size, backing, locked, huge pages */
+		void report(std::ostream& out) const;
+
+		static const char* backing_name(backing b);
+
+	private:
+		void* m_data;
+		void* m_map;
+		size_t m_size;
+		size_t m_mapped;
+		backing m_backing;
+		bool m_locked;
+	};
+
+	/**
+	 * @brief Make a thread real-time.
+	 * @param thread Thread to change
+	 * @param priority SCHED_FIFO priority (1-99), 0 or less keeps the current policy
+	 * @param cpu Cpu to pin the thread to, -1 to not pin it
+	 * @return false if any of the changes was refused (e.g. missing CAP_SYS_NICE)
+	 */
+	bool rt_thread(pthread_t thread, int priority, int cpu);
+
+	/**
+	 * @brief Page fault counters (getrusage).
+	 */
+	struct page_faults {
+		/** Faults served without I/O, e.g. first touch of anonymous memory */
+		uint64_t minor = 0;
+		/** Faults that needed I/O */
+		uint64_t major = 0;
+
+		/** @brief Counters of the whole process */
+		static page_faults process();
+		/** @brief Counters of the calling thread */
+		static page_faults thread();
+
+		page_faults operator-(const page_faults& other) const {
+			page_faults res;
+			res.minor = minor - other.minor;
+			res.major = major - other.major;
+			return res;
+		}
+	};
+}
@@ -0,0 +1,1167 @@
+/**
+ * @file selftest.cpp
+ * @brief Functional checks of the helpers against local stand-ins (selftestapp).
+ *
+ * Every section runs a helper against something local instead of the library or the
+ * network and checks the results:
+ * - sockets: socket_hal against a loopback TCP server, covering connect, sends that only
+ *   partially fit into the socket buffer, close with queued data and recv
+ * - dns: dns_cache against a stub resolver, covering TTL expiry, negative caching,
+ *   background refresh and cold misses that must not block
+ * - pcm: every vector kernel table of pcm_convert.h against the scalar reference, bit for
+ *   bit, over odd lengths and unaligned buffers
+ * - storage: mmap_storage with the write_behind journal, once through io_uring (if the kernel
+ *   allows it) and once with pwrite: reads see pending writes, alloc drops pending writes
+ *   before truncating and evicting a descriptor writes its data out
+ * - metadata: metadata_cache against a counting fetch, covering which notifications
+ *   refresh and readers on other threads while snapshots are replaced
+ * - prefetcher: prefetcher against stub library calls, a skip to the prefetched track is a
+ *   hit and keeps the prefetch, a skip elsewhere cancels it
+ * - tracer: string arguments are captured, clear() drops the events of other threads
+ *   without touching their rings
+ * - recorder: session_recorder fed from several threads with a small buffer, the file is
+ *   complete after flush() and replays with the recorded results, destroying the recorder
+ *   while callbacks run and replaying a corrupt block size
+ * - logger: async_logger::parse() on timestamp, level and subsystem variants and on plain
+ *   messages that must come through unchanged, rate limit reports
+ * - warm: warm_start callbacks only mark the state, tick() hands it to the writer thread
+ * - zones: zone_supervisor with a worker that crashes and one that echoes commands,
+ *   covering restart backoff and send, list, stop and shutdown over the control socket
+ * - player: playback of the offline stand-in (spotify_offline.cpp), pausing and resuming
+ *   must neither stall the track nor deliver audio twice. Skipped with the real library
+ *
+ * Pass section names to run only those. Exits with 1 if any check failed.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pump_driver.h"
+#include "socket_hal.h"
+#include "dns_cache.h"
+#include "pcm_convert.h"
+#include "storage_mmap.h"
+#include "metadata_cache.h"
+#include "prefetcher.h"
+#include "session_recorder.h"
+#include "tracer.h"
+#include "warm_start.h"
+#include "async_logger.h"
+#include "zone_supervisor.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while(0)
+
+// Wait on the driver until pred holds, false after timeout
+static bool wait_for(sp::pump_driver& pump, std::function<bool()> pred, std::chrono::milliseconds timeout = std::chrono::milliseconds(2000)) {
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(!pred()) {
+		if(std::chrono::steady_clock::now() > deadline) return false;
+		pump.wait();
+	}
+	return true;
+}
+
+/*
+ * Loopback TCP server with a small receive buffer, so a client that sends more than a
+ * few KiB while the server does not read has to queue.
+ */
+struct loopback_server {
+	int listen_fd = -1;
+	int conn_fd = -1;
+	struct sockaddr_in addr;
+
+	loopback_server() {
+		memset(&addr, 0x00, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int small = 4096;
+		setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+		socklen_t len = sizeof(addr);
+		if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 4) != 0
+			|| getsockname(listen_fd, (struct sockaddr*)&addr, &len) != 0) {
+			close(listen_fd);
+			listen_fd = -1;
+		}
+	}
+
+	~loopback_server() {
+		if(conn_fd >= 0) close(conn_fd);
+		if(listen_fd >= 0) close(listen_fd);
+	}
+
+	bool accept_one() {
+		conn_fd = accept(listen_fd, nullptr, nullptr);
+		return conn_fd >= 0;
+	}
+
+	// Read until the client closes, returns the bytes received
+	std::vector<uint8_t> read_all() {
+		std::vector<uint8_t> res;
+		uint8_t buf[16384];
+		ssize_t n;
+		while((n = ::recv(conn_fd, buf, sizeof(buf), 0)) > 0) res.insert(res.end(), buf, buf + n);
+		return res;
+	}
+};
+
+static std::vector<uint8_t> pattern(size_t size) {
+	std::vector<uint8_t> res(size);
+	for(size_t i = 0; i < size; i++) res[i] = (uint8_t)(i * 7 + (i >> 11));
+	return res;
+}
+
+// Connect to srv, fails the checks if it does not get writable
+static int connect_to(sp::pump_driver& pump, sp::socket_hal& hal, loopback_server& srv) {
+	int s = hal.create(AF_INET, SOCK_STREAM, 0);
+	CHECK(s >= 0);
+	if(s < 0) return s;
+	int res = hal.connect(s, (struct sockaddr*)&srv.addr, sizeof(srv.addr));
+	CHECK(res == 0 || res == -EINPROGRESS);
+	CHECK(srv.accept_one());
+	CHECK(wait_for(pump, [&] { return hal.writable(s) == 1; }));
+	CHECK(hal.error(s) == 0);
+	return s;
+}
+
+// Send everything, the hal queues what does not fit and reports it as sent
+static void send_all(sp::socket_hal& hal, int s, const std::vector<uint8_t>& data) {
+	size_t off = 0;
+	while(off < data.size()) {
+		const size_t len = std::min<size_t>(65536, data.size() - off);
+		long n = hal.send(s, data.data() + off, len);
+		CHECK(n == (long)len);
+		if(n <= 0) return;
+		off += n;
+	}
+}
+
+static void test_sockets() {
+	sp::pump_driver pump(std::chrono::milliseconds(20), std::chrono::milliseconds(5));
+	sp::socket_hal::options opts;
+	opts.sndbuf = 4096;
+	opts.max_pending = 4 * 1024 * 1024;
+	opts.close_timeout = std::chrono::milliseconds(5000);
+	sp::socket_hal hal(pump, opts);
+
+	// connect, partial sends and close while the server has not read anything yet
+	{
+		loopback_server srv;
+		CHECK(srv.listen_fd >= 0);
+		int s = connect_to(pump, hal, srv);
+		sp::socket_hal::socket_stats st;
+		CHECK(hal.get_stats(s, st));
+		CHECK(st.connect_us > 0);
+
+		const std::vector<uint8_t> data = pattern(1024 * 1024);
+		send_all(hal, s, data);
+		CHECK(hal.get_stats(s, st));
+		// Far more than the socket buffers hold, so most of it got queued
+		CHECK(st.bytes_sent < data.size());
+		std::vector<uint8_t> got;
+		std::thread reader([&] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			got = srv.read_all();
+		});
+		// The rest goes out from the pump loop, the peer sees EOF once everything was sent
+		CHECK(hal.close(s) == 0);
+		CHECK(wait_for(pump, [&] {
+			hal.flush();
+			return hal.lingering() == 0;
+		}, std::chrono::milliseconds(5000)));
+		reader.join();
+		CHECK(got == data);
+		CHECK(hal.dropped_bytes() == 0);
+	}
+
+	// close returns right away, the pump loop gives up after close_timeout if the peer never reads
+	{
+		sp::socket_hal::options short_opts = opts;
+		short_opts.close_timeout = std::chrono::milliseconds(50);
+		sp::socket_hal hal2(pump, short_opts);
+		loopback_server srv;
+		int s = connect_to(pump, hal2, srv);
+		send_all(hal2, s, pattern(1024 * 1024));
+		const auto start = std::chrono::steady_clock::now();
+		CHECK(hal2.close(s) == 0);
+		CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+		CHECK(hal2.close(s) == -EBADF);
+		CHECK(hal2.lingering() == 1);
+		CHECK(wait_for(pump, [&] {
+			hal2.flush();
+			return hal2.lingering() == 0;
+		}, std::chrono::milliseconds(1000)));
+		CHECK(std::chrono::steady_clock::now() - start >= short_opts.close_timeout);
+		CHECK(hal2.dropped_bytes() > 0);
+	}
+
+	// The callback table dispatches to the instance passed as data and then by socket
+	{
+		sp::socket_hal other(pump, opts);
+		loopback_server srv;
+		const sp_sockethal_callbacks_t cbs = sp::socket_hal::callbacks();
+		int s = cbs.fn1((void*)(intptr_t)AF_INET, (void*)(intptr_t)SOCK_STREAM, nullptr, &other);
+		CHECK(s >= 0);
+		sp::socket_hal::socket_stats st;
+		CHECK(other.get_stats(s, st) && !hal.get_stats(s, st));
+		int res = cbs.fn6((void*)(intptr_t)s, &srv.addr, &other);
+		CHECK(res == 0 || res == -EINPROGRESS);
+		CHECK(srv.accept_one());
+		CHECK(wait_for(pump, [&] { return cbs.fn14((void*)(intptr_t)s, nullptr, nullptr, nullptr) == 1; }));
+		CHECK(cbs.fn9((void*)(intptr_t)s, (void*)"ping", (void*)4, nullptr) == 4);
+		CHECK(other.get_stats(s, st) && st.sends == 1);
+		CHECK(cbs.fn17(10, &other) == 0);
+		CHECK(cbs.fn3((void*)(intptr_t)s, nullptr, nullptr, nullptr) == 0);
+		CHECK(cbs.fn3((void*)(intptr_t)s, nullptr, nullptr, nullptr) == -EBADF);
+	}
+
+	// recv, the driver wakes up once the response arrives
+	{
+		loopback_server srv;
+		int s = connect_to(pump, hal, srv);
+		char buf[64];
+		CHECK(hal.send(s, "ping", 4) == 4);
+		CHECK(hal.recv(s, buf, sizeof(buf)) == -EAGAIN);
+		std::thread responder([&] {
+			char req[4];
+			if(::recv(srv.conn_fd, req, sizeof(req), MSG_WAITALL) == 4) ::send(srv.conn_fd, "pong", 4, 0);
+		});
+		long n = -EAGAIN;
+		CHECK(wait_for(pump, [&] { return (n = hal.recv(s, buf, sizeof(buf))) != -EAGAIN; }));
+		responder.join();
+		CHECK(n == 4 && memcmp(buf, "pong", 4) == 0);
+		sp::socket_hal::socket_stats st;
+		CHECK(hal.get_stats(s, st));
+		CHECK(st.bytes_received == 4 && st.bytes_sent == 4);
+		CHECK(st.last_response_us > 0);
+		CHECK(pump.get_stats().io_wakeups > 0);
+		// Orderly shutdown by the peer reads as 0
+		shutdown(srv.conn_fd, SHUT_WR);
+		CHECK(wait_for(pump, [&] { return (n = hal.recv(s, buf, sizeof(buf))) != -EAGAIN; }));
+		CHECK(n == 0);
+		CHECK(hal.close(s) == 0);
+	}
+}
+
+/*
+ * Resolver answering from a table, with a configurable delay. Names without an entry fail.
+ */
+struct stub_resolver {
+	std::mutex mtx;
+	std::map<std::string, uint32_t> hosts;
+	std::map<std::string, int> calls;
+	std::chrono::seconds ttl{1};
+	std::chrono::milliseconds delay{0};
+
+	void set(const std::string& host, uint32_t ip) {
+		std::lock_guard<std::mutex> lck(mtx);
+		hosts[host] = ip;
+	}
+
+	int count(const std::string& host) {
+		std::lock_guard<std::mutex> lck(mtx);
+		return calls[host];
+	}
+
+	sp::dns_cache::resolver_t resolver() {
+		return [this](const std::string& host, struct sockaddr_in& addr, std::chrono::seconds& out_ttl) {
+			std::this_thread::sleep_for(delay);
+			std::lock_guard<std::mutex> lck(mtx);
+			calls[host]++;
+			auto it = hosts.find(host);
+			if(it == hosts.end()) return false;
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(it->second);
+			out_ttl = ttl;
+			return true;
+		};
+	}
+};
+
+// Address the cache handed out, 0 if the lookup failed
+static uint32_t lookup_ip(sp::dns_cache& dns, const char* host, int* res = nullptr) {
+	struct sockaddr_in addr;
+	memset(&addr, 0xff, sizeof(addr));
+	int r = dns.lookup(host, (struct sockaddr*)&addr);
+	if(res) *res = r;
+	return r == 0 ? ntohl(addr.sin_addr.s_addr) : 0;
+}
+
+// Poll a condition of the background thread
+static bool eventually(std::function<bool()> pred, std::chrono::milliseconds timeout = std::chrono::milliseconds(3000)) {
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(!pred()) {
+		if(std::chrono::steady_clock::now() > deadline) return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	return true;
+}
+
+static void test_dns() {
+	const std::chrono::milliseconds past_ttl(1100);
+
+	// TTL expiry: served stale while the refresh runs, then the new answer
+	{
+		stub_resolver stub;
+		stub.set("ap.local", 0x0a000001);
+		sp::dns_cache::options opts;
+		opts.hot_window = std::chrono::seconds(0);
+		opts.miss_timeout = std::chrono::milliseconds(1000);
+		sp::dns_cache dns(opts, stub.resolver());
+		CHECK(lookup_ip(dns, "ap.local") == 0x0a000001);
+		CHECK(lookup_ip(dns, "ap.local") == 0x0a000001);
+		CHECK(stub.count("ap.local") == 1);
+		stub.set("ap.local", 0x0a000002);
+		std::this_thread::sleep_for(past_ttl);
+		CHECK(lookup_ip(dns, "ap.local") == 0x0a000001);
+		CHECK(eventually([&] { return stub.count("ap.local") == 2; }));
+		CHECK(eventually([&] { return lookup_ip(dns, "ap.local") == 0x0a000002; }));
+		const sp::dns_cache::stats st = dns.get_stats();
+		CHECK(st.misses == 1 && st.stale_hits >= 1 && st.hits >= 2);
+	}
+
+	// Negative caching: failures are not retried before negative_ttl
+	{
+		stub_resolver stub;
+		sp::dns_cache::options opts;
+		opts.negative_ttl = std::chrono::seconds(1);
+		opts.miss_timeout = std::chrono::milliseconds(1000);
+		sp::dns_cache dns(opts, stub.resolver());
+		int res = 0;
+		CHECK(lookup_ip(dns, "gone.local", &res) == 0 && res == sp::dns_cache::lookup_failed);
+		CHECK(lookup_ip(dns, "gone.local", &res) == 0 && res == sp::dns_cache::lookup_failed);
+		CHECK(stub.count("gone.local") == 1);
+		CHECK(dns.get_stats().negative_hits == 1);
+		stub.set("gone.local", 0x0a000003);
+		std::this_thread::sleep_for(past_ttl);
+		CHECK(lookup_ip(dns, "gone.local") == 0x0a000003);
+		CHECK(stub.count("gone.local") == 2);
+	}
+
+	// Background refresh: an entry in use is renewed before it expires, without a lookup
+	{
+		stub_resolver stub;
+		stub.ttl = std::chrono::seconds(2);
+		stub.set("hot.local", 0x0a000004);
+		sp::dns_cache::options opts;
+		opts.miss_timeout = std::chrono::milliseconds(1000);
+		sp::dns_cache dns(opts, stub.resolver());
+		CHECK(lookup_ip(dns, "hot.local") == 0x0a000004);
+		CHECK(eventually([&] { return stub.count("hot.local") == 2; }));
+		CHECK(lookup_ip(dns, "hot.local") == 0x0a000004);
+		// TTLs below refresh_ahead are refreshed once per half TTL, not continuously
+		CHECK(stub.count("hot.local") == 2);
+		const sp::dns_cache::stats st = dns.get_stats();
+		CHECK(st.misses == 1 && st.stale_hits == 0);
+	}
+
+	// A cold miss returns lookup_pending quickly, the retry gets the answer
+	{
+		stub_resolver stub;
+		stub.delay = std::chrono::milliseconds(300);
+		stub.set("slow.local", 0x0a000005);
+		sp::dns_cache dns(sp::dns_cache::options(), stub.resolver());
+		int res = 0;
+		const auto start = std::chrono::steady_clock::now();
+		CHECK(lookup_ip(dns, "slow.local", &res) == 0 && res == sp::dns_cache::lookup_pending);
+		CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(200));
+		CHECK(eventually([&] { return lookup_ip(dns, "slow.local") == 0x0a000005; }));
+		CHECK(stub.count("slow.local") == 1);
+		CHECK(dns.get_stats().pending >= 1);
+	}
+}
+
+// Compare the output of a vector kernel with the reference, reports the first difference
+static void expect_same(const char* kernel, const char* fn, size_t n, const void* got, const void* want, size_t bytes) {
+	if(memcmp(got, want, bytes) == 0) return;
+	size_t at = 0;
+	while(((const uint8_t*)got)[at] == ((const uint8_t*)want)[at]) at++;
+	fprintf(stderr, "  %s %s n=%zu: differs at byte %zu\n", kernel, fn, n, at);
+	failures++;
+}
+
+static void test_pcm() {
+	namespace pcm = sp::pcm;
+	std::mt19937 rng(1234);
+	std::uniform_int_distribution<int> sample(-32768, 32767);
+	std::uniform_real_distribution<float> level(-1.0f, 1.0f);
+
+	std::vector<size_t> lengths;
+	for(size_t n = 0; n < 68; n++) lengths.push_back(n);
+	lengths.push_back(1023);
+	lengths.push_back(4097);
+	// Q16 gain and per sample step, gain + step * n stays within 32 bits for every length
+	const int32_t gains[][2] = { { 65536, 0 }, { 0, 0 }, { 23170, 0 }, { 0, 16 }, { 65536, -16 }, { 131072, -7 }, { 98304, 3 } };
+
+	const std::vector<const pcm::kernels*> tables = pcm::supported();
+	const pcm::kernels& ref = *tables[0];
+	CHECK(strcmp(ref.name, "scalar") == 0);
+	CHECK(&pcm::best() == tables.back());
+	for(size_t t = 1; t < tables.size(); t++) {
+		const pcm::kernels& k = *tables[t];
+		fprintf(stderr, "  %s\n", k.name);
+		for(size_t n : lengths) {
+			// One sample of offset, so the vector loads are not aligned
+			for(size_t off = 0; off < 2; off++) {
+				std::vector<short> in(2 * n + off);
+				for(auto& v : in) v = (short)sample(rng);
+				if(in.size() > 2) {
+					in[off] = -32768;
+					in[off + 1] = 32767;
+				}
+				const short* src = in.data() + off;
+
+				std::vector<float> f_want(2 * n), f_got(2 * n);
+				ref.s16_to_f32(src, f_want.data(), 2 * n);
+				k.s16_to_f32(src, f_got.data(), 2 * n);
+				expect_same(k.name, "s16_to_f32", 2 * n, f_got.data(), f_want.data(), f_want.size() * sizeof(float));
+
+				std::vector<int32_t> i_want(2 * n), i_got(2 * n);
+				ref.s16_to_s32(src, i_want.data(), 2 * n);
+				k.s16_to_s32(src, i_got.data(), 2 * n);
+				expect_same(k.name, "s16_to_s32", 2 * n, i_got.data(), i_want.data(), i_want.size() * sizeof(int32_t));
+
+				std::vector<float> l_want(n), r_want(n), l_got(n), r_got(n);
+				ref.deinterleave2_f32(src, l_want.data(), r_want.data(), n);
+				k.deinterleave2_f32(src, l_got.data(), r_got.data(), n);
+				expect_same(k.name, "deinterleave2_f32", n, l_got.data(), l_want.data(), n * sizeof(float));
+				expect_same(k.name, "deinterleave2_f32", n, r_got.data(), r_want.data(), n * sizeof(float));
+
+				for(auto& g : gains) {
+					std::vector<short> want(in), got(in);
+					ref.gain_s16(want.data() + off, 2 * n, g[0], g[1]);
+					k.gain_s16(got.data() + off, 2 * n, g[0], g[1]);
+					expect_same(k.name, "gain_s16", 2 * n, got.data(), want.data(), in.size() * sizeof(short));
+				}
+
+				const size_t nd = 2 * n / 4 * 4;
+				std::vector<float> levels(nd + off);
+				for(auto& v : levels) v = level(rng);
+				if(nd >= 4) {
+					levels[off] = -1.0f;
+					levels[off + 1] = 32767.0f / 32768.0f;
+					levels[off + 2] = 0.0f;
+				}
+				uint32_t s_want[4] = { 1, 0x9e3779b9u, 0xdeadbeefu, 0x12345678u };
+				uint32_t s_got[4];
+				memcpy(s_got, s_want, sizeof(s_got));
+				std::vector<short> d_want(nd), d_got(nd);
+				ref.dither_s16(levels.data() + off, d_want.data(), nd, s_want);
+				k.dither_s16(levels.data() + off, d_got.data(), nd, s_got);
+				expect_same(k.name, "dither_s16", nd, d_got.data(), d_want.data(), nd * sizeof(short));
+				expect_same(k.name, "dither_s16 state", nd, s_got, s_want, sizeof(s_want));
+			}
+		}
+	}
+
+	// Dither streams carry over between calls of any size
+	{
+		std::vector<float> levels(4099);
+		for(auto& v : levels) v = level(rng);
+		pcm::tpdf_dither whole(42), pieces(42);
+		std::vector<short> want(levels.size()), got(levels.size());
+		whole.f32_to_s16(levels.data(), want.data(), levels.size());
+		for(size_t i = 0, len = 1; i < levels.size(); i += len, len = len % 9 + 1)
+			pieces.f32_to_s16(levels.data() + i, got.data() + i, std::min(len, levels.size() - i));
+		expect_same(pcm::best().name, "tpdf_dither", levels.size(), got.data(), want.data(), want.size() * sizeof(short));
+	}
+
+	// A volume change ramps over ramp_frames and then holds the target
+	{
+		pcm::volume vol(256);
+		std::vector<short> frames(2 * 1024, 16384);
+		vol.set(0);
+		vol.apply(frames.data(), 1024, 2);
+		CHECK(frames[0] == 16384);
+		CHECK(frames[2 * 128] > 0 && frames[2 * 128] < 16384);
+		CHECK(frames[2 * 256] == 0 && frames.back() == 0);
+		CHECK(vol.gain() == 0);
+	}
+}
+
+// Read a cache file behind the back of the storage backend, what actually reached it
+static std::vector<uint8_t> read_file(const std::string& path, size_t size) {
+	std::vector<uint8_t> out(size, 0);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return out;
+	ssize_t n = pread(fd, out.data(), size, 0);
+	close(fd);
+	out.resize(n > 0 ? (size_t)n : 0);
+	return out;
+}
+
+static void test_write_behind(const std::string& root, bool use_io_uring) {
+	const std::string a = root + "/a", b = root + "/b";
+	sp::write_behind::options opts;
+	opts.use_io_uring = use_io_uring;
+	// Nothing gets written because of its age during the test
+	opts.max_delay = std::chrono::milliseconds(60000);
+	std::vector<uint8_t> header(167), chunk(4116), buf(8192);
+	for(size_t i = 0; i < header.size(); i++) header[i] = (uint8_t)(i + 1);
+	for(size_t i = 0; i < chunk.size(); i++) chunk[i] = (uint8_t)(i * 7 + 3);
+
+	{
+		// One descriptor, opening another key evicts the first
+		sp::mmap_storage storage(root, 1);
+		storage.enable_write_behind(opts);
+		sp::write_behind::stats st;
+		bool uring = false;
+		CHECK(storage.get_write_behind_stats(st, &uring));
+		if(use_io_uring && !uring) fprintf(stderr, "  io_uring not available, writes use pwrite\n");
+		if(!use_io_uring) CHECK(!uring);
+
+		// Reads see writes that are still buffered: header, a chunk and a bitmap byte update
+		CHECK(storage.alloc("a", 8192) == 0);
+		CHECK(storage.write("a", 0, header.data(), header.size()) == (long)header.size());
+		CHECK(storage.write("a", (unsigned)header.size(), chunk.data(), chunk.size()) == (long)chunk.size());
+		const uint8_t bit = 0xff;
+		CHECK(storage.write("a", 10, &bit, 1) == 1);
+		header[10] = bit;
+		CHECK(storage.read("a", 0, buf.data(), buf.size()) == 8192);
+		CHECK(memcmp(buf.data(), header.data(), header.size()) == 0);
+		CHECK(memcmp(buf.data() + header.size(), chunk.data(), chunk.size()) == 0);
+		CHECK(buf[header.size() + chunk.size()] == 0);
+		CHECK(storage.get_write_behind_stats(st));
+		CHECK(st.submitted == 0 && st.read_hits == 1 && st.coalesced == 2);
+		CHECK(read_file(a, 8192) == std::vector<uint8_t>(8192, 0));
+
+		// Alloc drops the pending writes and waits for submitted ones before truncating
+		CHECK(storage.write("a", 4096, chunk.data(), chunk.size()) == (long)chunk.size());
+		storage.close("a");
+		CHECK(storage.write("a", 0, header.data(), header.size()) == (long)header.size());
+		CHECK(storage.alloc("a", 4096) == 0);
+		CHECK(storage.read("a", 0, buf.data(), buf.size()) == 4096);
+		CHECK(std::all_of(buf.begin(), buf.begin() + 4096, [](uint8_t c) { return c == 0; }));
+		CHECK(read_file(a, 8192) == std::vector<uint8_t>(4096, 0));
+
+		// Opening b evicts a, which writes out its pending data first
+		CHECK(storage.write("a", 0, header.data(), header.size()) == (long)header.size());
+		CHECK(read_file(a, header.size()) != header);
+		CHECK(storage.alloc("b", 4096) == 0);
+		CHECK(read_file(a, header.size()) == header);
+		CHECK(storage.write("b", 0, chunk.data(), 4096) == 4096);
+
+		CHECK(storage.get_write_behind_stats(st, &uring));
+		CHECK(st.errors == 0 && st.submitted >= 2);
+		if(!uring) CHECK(st.pwrites == st.submitted);
+	}
+	// The destructor writes what is left
+	CHECK(read_file(b, 4096) == std::vector<uint8_t>(chunk.begin(), chunk.begin() + 4096));
+	unlink(a.c_str());
+	unlink(b.c_str());
+}
+
+static void test_storage() {
+	char root[64];
+	snprintf(root, sizeof(root), "/tmp/selftest_%d.storage", (int)getpid());
+	test_write_behind(root, true);
+	test_write_behind(root, false);
+	rmdir(root);
+}
+
+static void test_metadata() {
+	// Track number the stub reports as current, titles encode the index
+	std::atomic<int> track(0);
+	auto fetch = [&track](sp_metadata_t* m, int idx) -> sp_error_t {
+		const int t = track.load() + idx;
+		if(t < 0) return E_FAILED;
+		snprintf(m->track_title, sizeof(m->track_title), "track %d", t);
+		snprintf(m->track_uri, sizeof(m->track_uri), "spotify:track:%d", t);
+		snprintf(m->album_name, sizeof(m->album_name), "album");
+		m->duration = 1000 + t;
+		return E_OK;
+	};
+
+	// Only notifications that change the tracks cost fetches, unchanged metadata is not republished
+	{
+		sp::metadata_cache cache(fetch);
+		CHECK(!cache.snapshot());
+		CHECK(cache.refresh());
+		CHECK(cache.fetches() == 3);
+		const sp_playbacknotify_t quiet[] = { PN_PLAY, PN_PAUSE, PN_NEXT, PN_PREV, PN_SHUFFLEON, PN_REPEATON, PN_BECAMEACTIVE, PN_CONTEXTCHANGED };
+		for(auto n : quiet) CHECK(!cache.on_notify(n) && !cache.refresh());
+		CHECK(cache.fetches() == 3);
+		CHECK(cache.on_notify(PN_METADATACHANGED) && !cache.refresh());
+		CHECK(cache.fetches() == 6 && cache.snapshot()->generation() == 1);
+		track = 1;
+		CHECK(cache.on_notify(PN_TRACKCHANGED) && cache.refresh());
+		auto snap = cache.snapshot();
+		CHECK(snap->generation() == 2);
+		CHECK(strcmp(snap->current().track_title, "track 1") == 0 && snap->prev().valid && snap->next().duration == 1002);
+		// Both albums are the same string in the arena
+		CHECK(snap->prev().album_name == snap->next().album_name);
+	}
+
+	// Readers on other threads always see a complete snapshot and never an older one
+	{
+		track = 0;
+		sp::metadata_cache cache(fetch);
+		cache.refresh();
+		std::atomic<bool> done(false);
+		std::vector<std::thread> readers;
+		std::atomic<int> bad(0);
+		for(int r = 0; r < 4; r++) {
+			readers.emplace_back([&]() {
+				uint64_t last = 0;
+				while(!done.load()) {
+					auto snap = cache.snapshot();
+					char want[32];
+					snprintf(want, sizeof(want), "track %u", snap->current().duration - 1000);
+					if(snap->generation() < last || strcmp(snap->current().track_title, want) != 0) bad++;
+					last = snap->generation();
+				}
+			});
+		}
+		for(int i = 1; i <= 20000; i++) {
+			track = i;
+			cache.invalidate();
+			cache.refresh();
+		}
+		done = true;
+		for(auto& t : readers) t.join();
+		CHECK(bad == 0);
+		CHECK(cache.snapshot()->generation() == 20001);
+	}
+}
+
+static void test_prefetcher() {
+	int track = 0;
+	auto fetch = [&track](sp_metadata_t* m, int idx) -> sp_error_t {
+		const int t = track + idx;
+		if(t < 0) return E_FAILED;
+		snprintf(m->track_uri, sizeof(m->track_uri), "spotify:track:%d", t);
+		m->duration = 30000;
+		return E_OK;
+	};
+	sp::metadata_cache meta(fetch);
+	std::vector<std::string> requested;
+	int stops = 0;
+	sp::prefetcher::api calls;
+	calls.prefetch = [&requested](const char* uri, unsigned int) { requested.push_back(uri); return E_OK; };
+	calls.stop = [&stops]() { stops++; return E_OK; };
+	calls.position = []() { return 25000u; };
+	sp::prefetcher pf(meta, sp::prefetcher::options(), calls);
+
+	// The library reports a skip as PN_NEXT, PN_AUDIOFLUSH, PN_TRACKCHANGED
+	auto skip_to = [&](int t, sp_playbacknotify_t n) {
+		pf.on_notify(n);
+		pf.on_notify(PN_AUDIOFLUSH);
+		track = t;
+		meta.on_notify(PN_TRACKCHANGED);
+		meta.refresh();
+		pf.on_notify(PN_TRACKCHANGED);
+	};
+
+	meta.refresh();
+	pf.on_notify(PN_PLAY);
+	pf.tick();
+	CHECK(requested.size() == 1 && requested.back() == "spotify:track:1");
+	pf.on_prefetched("spotify:track:1");
+
+	// Skipping to the prefetched track uses it
+	skip_to(1, PN_NEXT);
+	CHECK(pf.get_stats().hits == 1 && pf.get_stats().misses == 0);
+	CHECK(pf.get_stats().cancelled == 0 && stops == 0);
+
+	// Skipping elsewhere while prefetching stops the stale prefetch
+	pf.tick();
+	CHECK(requested.size() == 2 && requested.back() == "spotify:track:2");
+	skip_to(0, PN_PREV);
+	CHECK(pf.get_stats().misses == 1 && pf.get_stats().partial_hits == 0);
+	CHECK(pf.get_stats().cancelled == 1 && stops == 1);
+	CHECK(pf.target().empty());
+}
+
+// Count the events of an export
+static size_t trace_events(const char* name) {
+	std::ostringstream out;
+	sp::trace::write_chrome_json(out);
+	const std::string json = out.str();
+	const std::string key = std::string("\"name\":\"") + name + "\"";
+	size_t n = 0;
+	for(size_t pos = json.find(key); pos != std::string::npos; pos = json.find(key, pos + 1)) n++;
+	return n;
+}
+
+static void test_tracer() {
+	sp::trace::start();
+	char uri[] = "spotify:track:mutable";
+	{
+		sp::trace::scope s("selftest.scope", "test", uri, 7);
+	}
+	std::ostringstream out;
+	sp::trace::write_chrome_json(out);
+	CHECK(out.str().find("\"s\":\"spotify:track:mutable\"") != std::string::npos);
+
+	// Another thread records until it sees the clear, its old events must not come back
+	std::atomic<int> phase(0);
+	std::thread other([&phase]() {
+		for(int i = 0; i < 100; i++) sp::trace::instant("selftest.before");
+		phase = 1;
+		while(phase != 2) std::this_thread::yield();
+		sp::trace::instant("selftest.after");
+	});
+	while(phase != 1) std::this_thread::yield();
+	CHECK(trace_events("selftest.before") == 100);
+	sp::trace::clear();
+	CHECK(trace_events("selftest.before") == 0);
+	CHECK(trace_events("selftest.scope") == 0);
+	phase = 2;
+	other.join();
+	CHECK(trace_events("selftest.before") == 0);
+	CHECK(trace_events("selftest.after") == 1);
+	sp::trace::stop();
+	sp::trace::clear();
+}
+
+static void test_recorder() {
+	char name[64];
+	snprintf(name, sizeof(name), "/tmp/selftest_%d.sprc", (int)getpid());
+	const std::string path = name;
+	const int threads = 4, blocks = 2000;
+	const unsigned long nframes = 64;
+	sp_playback_callbacks_t cbs;
+	memset(&cbs, 0, sizeof(cbs));
+	cbs.onNotify = [](sp_playbacknotify_t, void*) -> int { return 0; };
+	cbs.onAudioData = [](const short*, unsigned long n, const sp_sampleformat_t*, unsigned int, void*) -> unsigned long { return n / 2; };
+
+	// A buffer of a few records keeps the writer thread busy while the callbacks go on
+	{
+		sp::session_recorder::options opts;
+		opts.buffer_size = 256;
+		sp::session_recorder recorder(path, opts);
+		CHECK(recorder.valid());
+		sp_playback_callbacks_t wrapped = cbs;
+		sp::session_recorder::wrap(wrapped);
+		std::vector<std::thread> feeders;
+		for(int t = 0; t < threads; t++) {
+			feeders.emplace_back([&wrapped, t]() {
+				std::vector<short> frames(2 * nframes, (short)t);
+				sp_sampleformat_t fmt = { 2, 44100 };
+				for(int i = 0; i < blocks; i++) wrapped.onAudioData(frames.data(), nframes, &fmt, 0, nullptr);
+			});
+		}
+		wrapped.onNotify(PN_PLAY, nullptr);
+		for(auto& t : feeders) t.join();
+		recorder.flush();
+		const sp::session_recorder::stats st = recorder.get_stats();
+		CHECK(st.records == (uint64_t)threads * blocks + 1);
+		CHECK(st.errors == 0);
+		FILE* f = fopen(path.c_str(), "rb");
+		CHECK(f != nullptr);
+		if(f) {
+			fseek(f, 0, SEEK_END);
+			CHECK((uint64_t)ftell(f) == st.bytes);
+			fclose(f);
+		}
+	}
+
+	sp::session_replayer replayer(path);
+	CHECK(replayer.valid());
+	replayer.set(cbs, nullptr);
+	CHECK(replayer.run(0));
+	const sp::session_replayer::stats& st = replayer.get_stats();
+	CHECK(st.records[sp::rec::REC_AUDIO] == (uint64_t)threads * blocks);
+	CHECK(st.records[sp::rec::REC_NOTIFY] == 1);
+	CHECK(st.audio_frames == (uint64_t)threads * blocks * nframes / 2);
+	CHECK(st.mismatches == 0);
+
+	// The recorder goes away while other threads are inside its trampolines
+	{
+		std::atomic<bool> stop(false);
+		std::vector<std::thread> feeders;
+		{
+			sp::session_recorder recorder(path);
+			sp_playback_callbacks_t wrapped = cbs;
+			sp::session_recorder::wrap(wrapped);
+			for(int t = 0; t < threads; t++) {
+				feeders.emplace_back([wrapped, &stop]() {
+					std::vector<short> frames(2 * nframes);
+					sp_sampleformat_t fmt = { 2, 44100 };
+					while(!stop.load()) wrapped.onAudioData(frames.data(), nframes, &fmt, 0, nullptr);
+				});
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		CHECK(sp::session_recorder::instance() == nullptr);
+		stop = true;
+		for(auto& t : feeders) t.join();
+	}
+
+	// A corrupt block size ends the replay instead of sizing buffers by it
+	{
+		FILE* f = fopen(path.c_str(), "wb");
+		sp::rec::file_header hdr;
+		memset(&hdr, 0x00, sizeof(hdr));
+		hdr.magic = sp::rec::magic;
+		hdr.version = sp::rec::version;
+		fwrite(&hdr, sizeof(hdr), 1, f);
+		// REC_AUDIO, no delta or duration, 2^42 frames, 2 channels, 44100 Hz, all accepted
+		const uint8_t audio[] = { sp::rec::REC_AUDIO, 0, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 2, 0xc4, 0xd8, 0x02, 0 };
+		fwrite(audio, sizeof(audio), 1, f);
+		fclose(f);
+		sp::session_replayer corrupt(path);
+		CHECK(corrupt.valid());
+		corrupt.set(cbs, nullptr);
+		CHECK(!corrupt.run(0));
+		CHECK(corrupt.get_stats().audio_frames == 0);
+	}
+	unlink(path.c_str());
+}
+
+static void test_logger() {
+	typedef sp::async_logger logger;
+	static const struct {
+		const char* line;
+		logger::level lvl;
+		const char* subsystem;
+		const char* message;
+	} cases[] = {
+		// What the library and the stand-in print
+		{ "12:01:02.345 I [player] audio started", logger::LL_INFO, "player", "audio started" },
+		{ "12:01:02.345 W [ap] resolved", logger::LL_WARN, "ap", "resolved" },
+		{ "2017-01-01 12:01:02 ERROR ap: login failed", logger::LL_ERROR, "ap", "login failed" },
+		{ "2017-01-01T12:01:02.345Z DEBUG [core] x", logger::LL_DEBUG, "core", "x" },
+		{ "01-01 12:01:02.345 D/audio: underrun", logger::LL_DEBUG, "audio", "underrun" },
+		{ "E/core: crashed", logger::LL_ERROR, "core", "crashed" },
+		{ "[W] [audio:123] late", logger::LL_WARN, "audio:123", "late" },
+		{ "[WARNING] low memory", logger::LL_WARN, "", "low memory" },
+		{ "I: started", logger::LL_INFO, "", "started" },
+		// Plain messages keep their first word
+		{ "3 tracks loaded", logger::LL_INFO, "", "3 tracks loaded" },
+		{ "2017 was a good year", logger::LL_INFO, "", "2017 was a good year" },
+		{ "12:30 is lunch time", logger::LL_INFO, "", "12:30 is lunch time" },
+		{ "I think so", logger::LL_INFO, "", "I think so" },
+		{ "E coli found", logger::LL_INFO, "", "E coli found" },
+		{ "D-Bus is gone", logger::LL_INFO, "", "D-Bus is gone" },
+		{ "[I am a bracket", logger::LL_INFO, "", "[I am a bracket" },
+		{ "", logger::LL_INFO, "", "" },
+	};
+	for(auto& c : cases) {
+		const logger::parsed res = logger::parse(c.line);
+		const std::string sub(c.line + res.subsystem, res.subsystem_len);
+		const std::string msg(c.line + res.message);
+		if(res.lvl != c.lvl || sub != c.subsystem || msg != c.message) {
+			fprintf(stderr, "  parse(\"%s\"): %s [%s] \"%s\"\n", c.line, logger::name(res.lvl), sub.c_str(), msg.c_str());
+			failures++;
+		}
+	}
+
+	// Suppressed lines are reported with their subsystem
+	{
+		std::string out;
+		std::mutex mtx;
+		logger::options opts;
+		opts.rate_limit = 2;
+		{
+			logger log(opts, [&out, &mtx](const char* data, size_t len) {
+				std::lock_guard<std::mutex> lck(mtx);
+				out.append(data, len);
+			});
+			for(int i = 0; i < 10; i++) log.log("12:00:00 I [noisy] again");
+			log.flush();
+			CHECK(log.get_stats().suppressed == 8);
+		}
+		CHECK(out.find("suppressed 8 lines of noisy") != std::string::npos);
+	}
+}
+
+static void test_warm() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/selftest_%d.warm", (int)getpid());
+	unlink(path);
+	{
+		sp::warm_start warm(path);
+		// Callbacks run on the pump thread inside the library, they must not write
+		warm.on_logged_in("blob1", "user1");
+		CHECK(access(path, F_OK) != 0);
+		CHECK(warm.get_stats().saves == 0);
+		// The next tick queues it, save() waits for the writer thread
+		warm.tick();
+		CHECK(warm.save());
+		CHECK(access(path, F_OK) == 0);
+		CHECK(warm.get_stats().saves == 1);
+
+		// Nothing changed, nothing written
+		warm.tick();
+		CHECK(warm.save());
+		CHECK(warm.get_stats().saves == 1);
+
+		// A newer state replaces one still waiting, the destructor writes what is left
+		warm.on_logged_in("blob2", "user1");
+		warm.tick();
+		warm.on_logged_in("blob3", "user1");
+	}
+	sp::warm_start loaded(path);
+	CHECK(loaded.load());
+	CHECK(loaded.get().username == "user1" && loaded.get().blob == "blob3");
+	CHECK(loaded.can_login() && !loaded.can_resume());
+	unlink(path);
+}
+
+// Poll the supervisor until pred holds, false after timeout
+static bool poll_until(sp::zone_supervisor& sup, std::function<bool()> pred, std::chrono::milliseconds timeout = std::chrono::milliseconds(2000)) {
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(!pred()) {
+		if(std::chrono::steady_clock::now() > deadline) return false;
+		sup.poll(std::chrono::milliseconds(5));
+	}
+	return true;
+}
+
+// Send one control line and poll the supervisor until the reply is complete
+static std::string ask(sp::zone_supervisor& sup, int fd, const std::string& line) {
+	const std::string out = line + "\n";
+	if(send(fd, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size()) return std::string();
+	std::string reply;
+	poll_until(sup, [&]() {
+		char buf[1024];
+		ssize_t res;
+		while((res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) reply.append(buf, res);
+		// Every reply ends with an ok or error line
+		const size_t last = reply.rfind('\n', reply.size() >= 2 ? reply.size() - 2 : 0);
+		const std::string tail = reply.substr(last == std::string::npos ? 0 : last + 1);
+		return !reply.empty() && reply.back() == '\n' && (tail.compare(0, 2, "ok") == 0 || tail.compare(0, 5, "error") == 0);
+	});
+	return reply;
+}
+
+static void test_zones() {
+	sp_init_config_t base;
+	memset(&base, 0x00, sizeof(base));
+	base.wmem_size = 4096;
+	sp::zone_supervisor::options opts;
+	opts.min_backoff = std::chrono::milliseconds(20);
+	opts.max_backoff = std::chrono::milliseconds(80);
+	opts.kill_timeout = std::chrono::milliseconds(500);
+
+	sp::zone_supervisor sup(base, [](size_t zone, sp_init_config_t& cfg, int ctrl) -> int {
+		if(zone == 0) ::raise(SIGKILL);
+		// Echo every command, "quit" ends the worker normally
+		std::string cmd;
+		for(;;) {
+			if(sp::zone_supervisor::receive(ctrl, cmd)) {
+				if(cmd == "quit") return 0;
+				sp::zone_supervisor::reply(ctrl, std::string(cfg.uniqueid) + " " + cmd);
+			}
+			usleep(1000);
+		}
+	}, opts);
+	sp::zone_supervisor::zone_config crash, echo;
+	crash.uniqueid = "crash";
+	crash.displayname = "Crash";
+	echo.uniqueid = "echo";
+	echo.displayname = "Echo";
+	CHECK(sup.add(crash) == 0 && sup.add(echo) == 1);
+
+	// Restarts back off 20, 40, 80, 80 ms, the fourth crash can not come before 140 ms
+	const auto start = std::chrono::steady_clock::now();
+	CHECK(poll_until(sup, [&]() { return sup.status(0).restarts >= 4; }));
+	CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(140));
+	CHECK(WIFSIGNALED(sup.status(0).last_status) && WTERMSIG(sup.status(0).last_status) == SIGKILL);
+	CHECK(sup.status(1).state == sp::zone_supervisor::ZS_RUNNING && sup.status(1).restarts == 0);
+
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/selftest_%d.zones", (int)getpid());
+	CHECK(sup.listen(path));
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	CHECK(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+
+	CHECK(ask(sup, fd, "send 1 hello") == "ok\n");
+	CHECK(poll_until(sup, [&]() { return sup.status(1).report == "echo hello"; }));
+	const std::string list = ask(sup, fd, "list");
+	char line[128];
+	snprintf(line, sizeof(line), "1 echo \"Echo\" %d running 0 -1 echo hello\n", (int)sup.status(1).pid);
+	CHECK(list.find(line) != std::string::npos);
+	CHECK(list.find("0 crash \"Crash\" ") == 0);
+	CHECK(list.size() >= 3 && list.compare(list.size() - 3, 3, "ok\n") == 0);
+	CHECK(ask(sup, fd, "frobnicate 1") == "error unknown command\n");
+	CHECK(ask(sup, fd, "send 7 hello") == "error invalid zone\n");
+
+	// A stopped zone stays down and takes no commands
+	CHECK(ask(sup, fd, "stop 0") == "ok\n");
+	CHECK(poll_until(sup, [&]() { return sup.status(0).state == sp::zone_supervisor::ZS_STOPPED; }));
+	const uint64_t restarts = sup.status(0).restarts;
+	poll_until(sup, []() { return false; }, std::chrono::milliseconds(200));
+	CHECK(sup.status(0).state == sp::zone_supervisor::ZS_STOPPED && sup.status(0).restarts == restarts);
+	CHECK(ask(sup, fd, "send 0 hello") == "error failed\n");
+
+	// Shutdown terminates the running worker and waits for it
+	const pid_t pid = sup.status(1).pid;
+	sup.shutdown();
+	CHECK(sup.status(1).state == sp::zone_supervisor::ZS_STOPPED && sup.status(1).pid == -1);
+	CHECK(WIFSIGNALED(sup.status(1).last_status) && WTERMSIG(sup.status(1).last_status) == SIGTERM);
+	CHECK(kill(pid, 0) != 0 && errno == ESRCH);
+	CHECK(sup.status(1).restarts == 0);
+
+	// A worker that exits with 0 is not restarted
+	CHECK(sup.start(1));
+	CHECK(sup.send(1, "quit"));
+	CHECK(poll_until(sup, [&]() { return sup.status(1).pid == -1; }));
+	CHECK(sup.status(1).state == sp::zone_supervisor::ZS_STOPPED && sup.status(1).restarts == 0);
+	close(fd);
+}
+
+// Pump the library until pred holds, false after timeout
+static bool pump_until(sp::pump_driver& pump, std::function<bool()> pred, std::chrono::milliseconds timeout = std::chrono::milliseconds(3000)) {
+	return wait_for(pump, [&pump, &pred]() {
+		pump.pump();
+		return pred();
+	}, timeout);
+}
+
+struct player_events {
+	bool logged_in = false;
+	bool playing = false;
+	int track_changes = 0;
+	uint64_t frames = 0;
+	/** Frames delivered when the last PN_TRACKCHANGED came in */
+	uint64_t frames_at_change = 0;
+};
+
+static void test_player() {
+	if(strncmp(SpGetLibraryVersion(), "offline-", 8) != 0) {
+		fprintf(stderr, "  skipped, needs the offline stand-in\n");
+		return;
+	}
+	// Short tracks, their end is reached within the test
+	const unsigned track_ms = 3000;
+	char env[16];
+	snprintf(env, sizeof(env), "%u", track_ms);
+	setenv("SP_OFFLINE_TRACK_MS", env, 1);
+
+	static std::vector<uint8_t> wmem(0x80000);
+	static const uint8_t key[321] = { 0 };
+	sp_init_config_t cfg;
+	memset(&cfg, 0x00, sizeof(cfg));
+	cfg.version = SP_APIVERSION;
+	cfg.wmem = wmem.data();
+	cfg.wmem_size = wmem.size();
+	cfg.app_key = key;
+	cfg.app_key_len = sizeof(key);
+	cfg.uniqueid = "selftest";
+	cfg.displayname = "selftest";
+	CHECK(SpInit(&cfg) == E_OK);
+
+	player_events ev;
+	sp_playback_callbacks_t pcbs;
+	memset(&pcbs, 0x00, sizeof(pcbs));
+	pcbs.onNotify = [](sp_playbacknotify_t n, void* data) -> int {
+		player_events& ev = *(player_events*)data;
+		if(n == PN_PLAY) ev.playing = true;
+		else if(n == PN_PAUSE) ev.playing = false;
+		else if(n == PN_TRACKCHANGED) {
+			ev.track_changes++;
+			ev.frames_at_change = ev.frames;
+		}
+		return 0;
+	};
+	pcbs.onAudioData = [](const short*, unsigned long nframes, const sp_sampleformat_t*, unsigned int, void* data) -> unsigned long {
+		((player_events*)data)->frames += nframes;
+		return nframes;
+	};
+	SpRegisterPlaybackCallbacks(&pcbs, &ev);
+	sp_connection_callbacks_t ccbs;
+	memset(&ccbs, 0x00, sizeof(ccbs));
+	ccbs.onNotifyLoggedIn = [](const char*, const char*, void* data) { ((player_events*)data)->logged_in = true; };
+	SpRegisterConnectionCallbacks(&ccbs, &ev);
+
+	{
+		sp::pump_driver pump;
+		CHECK(SpConnectionLoginPassword("selftest", "secret") == E_OK);
+		CHECK(pump_until(pump, [&ev]() { return ev.logged_in; }));
+		CHECK(SpPlayUri("spotify:user:selftest:playlist:pause", 0, 0) == E_OK);
+		CHECK(pump_until(pump, [&ev]() { return ev.playing && ev.frames > 0; }));
+		const int changes = ev.track_changes;
+
+		// Pause with read-ahead delivered, the position holds still
+		CHECK(pump_until(pump, []() { return SpPlaybackGetPosition() >= 1000; }));
+		CHECK(SpPlaybackPause() == E_OK);
+		CHECK(pump_until(pump, [&ev]() { return !ev.playing; }));
+		const uint64_t pos = SpPlaybackGetPosition();
+		const uint64_t frames = ev.frames;
+		pump_until(pump, []() { return false; }, std::chrono::milliseconds(200));
+		CHECK(SpPlaybackGetPosition() == pos);
+		CHECK(ev.frames == frames);
+
+		// Resumed, the track plays to its end and the next one starts
+		CHECK(SpPlaybackPlay() == E_OK);
+		CHECK(pump_until(pump, [&ev, changes]() { return ev.track_changes > changes; }, std::chrono::milliseconds(track_ms)));
+		// Every frame of the track exactly once
+		CHECK(ev.frames_at_change == (uint64_t)track_ms * 44100 / 1000);
+	}
+	SpFree();
+	unsetenv("SP_OFFLINE_TRACK_MS");
+}
+
+struct section {
+	const char* name;
+	void (*run)();
+};
+
+static const section sections[] = {
+	{ "sockets", test_sockets },
+	{ "dns", test_dns },
+	{ "pcm", test_pcm },
+	{ "storage", test_storage },
+	{ "metadata", test_metadata },
+	{ "prefetcher", test_prefetcher },
+	{ "tracer", test_tracer },
+	{ "recorder", test_recorder },
+	{ "logger", test_logger },
+	{ "warm", test_warm },
+	{ "zones", test_zones },
+	{ "player", test_player },
+};
+
+int main(int argc, char** argv) {
+	int run = 0;
+	for(const section& sec : sections) {
+		bool selected = argc < 2;
+		for(int i = 1; i < argc; i++) selected |= strcmp(argv[i], sec.name) == 0;
+		if(!selected) continue;
+		const int before = failures;
+		fprintf(stderr, "%s\n", sec.name);
+		sec.run();
+		fprintf(stderr, "  %s\n", failures == before ? "ok" : "FAILED");
+		run++;
+	}
+	if(!run) {
+		fprintf(stderr, "usage: %s [section...]\n", argv[0]);
+		for(const section& sec : sections) fprintf(stderr, "  %s\n", sec.name);
+		return 2;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,739 @@
+#include "session_recorder.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+
+namespace sp {
+
+	namespace rec {
+
+		const char* type_name(record_type t) {
+			switch(t) {
+				case REC_KEY: return "key";
+				case REC_NOTIFY: return "playback.onNotify";
+				case REC_AUDIO: return "playback.onAudioData";
+				case REC_SEEK: return "playback.onSeek";
+				case REC_VOLUME: return "playback.onApplyVolume";
+				case REC_UNAVAILABLE: return "playback.onUnavailableTrack";
+				case REC_CON_NOTIFY: return "connection.onNotify";
+				case REC_LOGGED_IN: return "connection.onNotifyLoggedIn";
+				case REC_ALLOC: return "storage.alloc";
+				case REC_WRITE: return "storage.write";
+				case REC_READ: return "storage.read";
+				case REC_CLOSE: return "storage.close";
+				case REC_LOOKUP: return "dnshal.lookup";
+				case REC_SOCKET: return "sockethal";
+				default: return "unknown";
+			}
+		}
+	}
+
+	static uint64_t now_ns() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Word wise multiply/xor hash, a few times faster than a byte wise FNV on 16 KB blocks
+	static uint64_t hash_samples(const short* frames, size_t nsamples) {
+		uint64_t h = 0xcbf29ce484222325ull ^ nsamples;
+		size_t i = 0;
+		for(; i + 4 <= nsamples; i += 4) {
+			uint64_t w;
+			memcpy(&w, frames + i, sizeof(w));
+			h = (h ^ w) * 0x100000001b3ull;
+			h ^= h >> 29;
+		}
+		for(; i < nsamples; i++) h = (h ^ (uint16_t)frames[i]) * 0x100000001b3ull;
+		return h;
+	}
+
+	// ---- trampolines -----------------------------------------------------------
+
+	namespace {
+		sp_playback_callbacks_t orig_playback;
+		sp_connection_callbacks_t orig_connection;
+		sp_storage_callbacks_t orig_storage;
+		sp_dnshal_callbacks_t orig_dnshal;
+		sp_sockethal_callbacks_t orig_sockethal;
+
+		int playback_notify(sp_playbacknotify_t n, void* data) {
+			const uint64_t t0 = now_ns();
+			const int res = orig_playback.onNotify(n, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_notify(t0, now_ns() - t0, n, res);
+			return res;
+		}
+		unsigned long playback_audio(const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int arg4, void* data) {
+			const uint64_t t0 = now_ns();
+			const unsigned long res = orig_playback.onAudioData(frames, nframes, format, arg4, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_audio(t0, now_ns() - t0, frames, nframes, *format, res);
+			return res;
+		}
+		void playback_seek(uint64_t position, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_playback.onSeek(position, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_seek(t0, now_ns() - t0, position);
+		}
+		void playback_volume(unsigned short volume, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_playback.onApplyVolume(volume, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_volume(t0, now_ns() - t0, volume);
+		}
+		void playback_unavailable(const char* uri, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_playback.onUnavailableTrack(uri, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_unavailable(t0, now_ns() - t0, uri);
+		}
+
+		void connection_notify(sp_con_state_t state, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_connection.onNotify(state, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_con_notify(t0, now_ns() - t0, state);
+		}
+		void connection_logged_in(const char* blob, const char* username, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_connection.onNotifyLoggedIn(blob, username, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_logged_in(t0, now_ns() - t0, username);
+		}
+
+		long storage_alloc(const char* key, unsigned int size, void* data) {
+			const uint64_t t0 = now_ns();
+			const long res = orig_storage.alloc(key, size, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_alloc(t0, now_ns() - t0, key, size, res);
+			return res;
+		}
+		long storage_write(const char* key, unsigned int offset, const void* buf, unsigned int size, void* data) {
+			const uint64_t t0 = now_ns();
+			const long res = orig_storage.write(key, offset, buf, size, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_write(t0, now_ns() - t0, key, offset, size, res);
+			return res;
+		}
+		long storage_read(const char* key, unsigned int offset, void* buf, unsigned int size, void* data) {
+			const uint64_t t0 = now_ns();
+			const long res = orig_storage.read(key, offset, buf, size, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_read(t0, now_ns() - t0, key, offset, size, res);
+			return res;
+		}
+		void storage_close(const char* key, void* data) {
+			const uint64_t t0 = now_ns();
+			orig_storage.close(key, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_close(t0, now_ns() - t0, key);
+		}
+
+		int dnshal_lookup(const char* hostname, struct sockaddr* addr, void* data) {
+			const uint64_t t0 = now_ns();
+			const int res = orig_dnshal.lookup(hostname, addr, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_lookup(t0, now_ns() - t0, hostname, res);
+			return res;
+		}
+
+		// fn1-fn16 except fn6 share one signature, N is the index of the function (fn1 = 0)
+		typedef int (*socket_fn)(void*, void*, void*, void*);
+		socket_fn orig_socket[16];
+
+		template<int N>
+		int socket_hook(void* a, void* b, void* c, void* d) {
+			const uint64_t t0 = now_ns();
+			const int res = orig_socket[N](a, b, c, d);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_socket(t0, now_ns() - t0, N + 1, 0, res);
+			return res;
+		}
+		int socket_fn6(void* a, void* b, void* data) {
+			const uint64_t t0 = now_ns();
+			const int res = orig_sockethal.fn6(a, b, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_socket(t0, now_ns() - t0, 6, 0, res);
+			return res;
+		}
+		int socket_fn17(int ms, void* data) {
+			const uint64_t t0 = now_ns();
+			const int res = orig_sockethal.fn17(ms, data);
+			session_recorder::scope rec;
+			if(session_recorder* r = rec.get()) r->on_socket(t0, now_ns() - t0, 17, ms, res);
+			return res;
+		}
+
+		template<typename F>
+		void install(F& fn, F& orig, F hook) {
+			if(!fn || fn == hook) return;
+			orig = fn;
+			fn = hook;
+		}
+		template<int N>
+		void install_socket(socket_fn& fn) {
+			install(fn, orig_socket[N], &socket_hook<N>);
+		}
+	}
+
+	// ---- recorder --------------------------------------------------------------
+
+	std::atomic<session_recorder*> session_recorder::s_instance(nullptr);
+	std::atomic<int> session_recorder::s_callers(0);
+
+	session_recorder::scope::scope() {
+		// Announce first, the destructor unregisters first and then waits: one of both sees the other
+		s_callers.fetch_add(1);
+		m_recorder = s_instance.load();
+	}
+
+	session_recorder::scope::~scope() {
+		s_callers.fetch_sub(1);
+	}
+
+	session_recorder::session_recorder(const std::string& path)
+		: session_recorder(path, options())
+	{}
+
+	session_recorder::session_recorder(const std::string& path, const options& opts)
+		: m_opts(opts), m_file(fopen(path.c_str(), "wb")), m_last(now_ns()), m_last_flush(m_last),
+		m_handoff(false), m_stop(false), m_swaps(0), m_writes(0)
+	{
+		if(!m_file) return;
+		m_buffer.reserve(m_opts.buffer_size + 4096);
+		m_spare.reserve(m_opts.buffer_size + 4096);
+		rec::file_header hdr;
+		hdr.magic = rec::magic;
+		hdr.version = rec::version;
+		hdr.flags = m_opts.store_audio ? rec::flag_audio : 0;
+		hdr.start = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		const uint8_t* p = (const uint8_t*)&hdr;
+		m_buffer.insert(m_buffer.end(), p, p + sizeof(hdr));
+		m_thread = std::thread(&session_recorder::run, this);
+		s_instance = this;
+	}
+
+	session_recorder::~session_recorder() {
+		session_recorder* self = this;
+		s_instance.compare_exchange_strong(self, nullptr);
+		// Trampolines that got this recorder before are still recording into it
+		while(s_callers.load() != 0) std::this_thread::yield();
+		if(!m_file) return;
+		flush();
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+		fclose(m_file);
+	}
+
+	void session_recorder::flush() {
+		std::unique_lock<std::mutex> lock(m_lock);
+		if(!m_file) return;
+		// Everything buffered now is written once the writer finished the next swap
+		uint64_t target = m_swaps;
+		if(!m_buffer.empty()) {
+			m_handoff = true;
+			m_cv.notify_one();
+			target++;
+		}
+		m_written_cv.wait(lock, [this, target]() { return m_writes >= target; });
+	}
+
+	void session_recorder::run() {
+		std::unique_lock<std::mutex> lock(m_lock);
+		for(;;) {
+			m_cv.wait(lock, [this]() { return m_handoff || m_stop; });
+			if(!m_handoff) break;
+			m_handoff = false;
+			m_buffer.swap(m_spare);
+			m_last_flush = m_last;
+			m_swaps++;
+
+			lock.unlock();
+			const bool ok = fwrite(m_spare.data(), 1, m_spare.size(), m_file) == m_spare.size();
+			fflush(m_file);
+			lock.lock();
+
+			if(ok) m_stats.bytes += m_spare.size();
+			else m_stats.errors++;
+			m_spare.clear();
+			m_writes++;
+			m_written_cv.notify_all();
+		}
+	}
+
+	session_recorder::stats session_recorder::get_stats() const {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_stats;
+	}
+
+	void session_recorder::wrap(sp_playback_callbacks_t& cbs) {
+		if(!s_instance) return;
+		install(cbs.onNotify, orig_playback.onNotify, &playback_notify);
+		install(cbs.onAudioData, orig_playback.onAudioData, &playback_audio);
+		install(cbs.onSeek, orig_playback.onSeek, &playback_seek);
+		install(cbs.onApplyVolume, orig_playback.onApplyVolume, &playback_volume);
+		install(cbs.onUnavailableTrack, orig_playback.onUnavailableTrack, &playback_unavailable);
+	}
+
+	void session_recorder::wrap(sp_connection_callbacks_t& cbs) {
+		if(!s_instance) return;
+		install(cbs.onNotify, orig_connection.onNotify, &connection_notify);
+		install(cbs.onNotifyLoggedIn, orig_connection.onNotifyLoggedIn, &connection_logged_in);
+	}
+
+	void session_recorder::wrap(sp_storage_callbacks_t& cbs) {
+		if(!s_instance) return;
+		install(cbs.alloc, orig_storage.alloc, &storage_alloc);
+		install(cbs.write, orig_storage.write, &storage_write);
+		install(cbs.read, orig_storage.read, &storage_read);
+		install(cbs.close, orig_storage.close, &storage_close);
+	}
+
+	void session_recorder::wrap(sp_dnshal_callbacks_t& cbs) {
+		if(!s_instance) return;
+		install(cbs.lookup, orig_dnshal.lookup, &dnshal_lookup);
+	}
+
+	void session_recorder::wrap(sp_sockethal_callbacks_t& cbs) {
+		if(!s_instance) return;
+		install_socket<0>(cbs.fn1);
+		install_socket<1>(cbs.fn2);
+		install_socket<2>(cbs.fn3);
+		install_socket<3>(cbs.fn4);
+		install_socket<4>(cbs.fn5);
+		install(cbs.fn6, orig_sockethal.fn6, &socket_fn6);
+		install_socket<6>(cbs.fn7);
+		install_socket<7>(cbs.fn8);
+		install_socket<8>(cbs.fn9);
+		install_socket<9>(cbs.fn10);
+		install_socket<10>(cbs.fn11);
+		install_socket<11>(cbs.fn12);
+		install_socket<12>(cbs.fn13);
+		install_socket<13>(cbs.fn14);
+		install_socket<14>(cbs.fn15);
+		install_socket<15>(cbs.fn16);
+		install(cbs.fn17, orig_sockethal.fn17, &socket_fn17);
+	}
+
+	void session_recorder::begin(rec::record_type type, uint64_t start, uint64_t dur) {
+		m_lock.lock();
+		m_buffer.push_back((uint8_t)type);
+		// Records of other threads can finish out of order, never go back in time
+		put_varint(start > m_last ? start - m_last : 0);
+		put_varint(dur);
+		if(start > m_last) m_last = start;
+	}
+
+	void session_recorder::end() {
+		m_stats.records++;
+		const uint64_t interval = std::chrono::duration_cast<std::chrono::nanoseconds>(m_opts.flush_interval).count();
+		const bool full = m_buffer.size() >= m_opts.buffer_size || m_last - m_last_flush >= interval;
+		const bool wake = full && !m_handoff;
+		if(wake) m_handoff = true;
+		m_lock.unlock();
+		if(wake) m_cv.notify_one();
+	}
+
+	uint64_t session_recorder::key_id(const char* key) {
+		auto it = m_keys.find(key);
+		if(it != m_keys.end()) return it->second;
+		const uint64_t id = m_keys.size();
+		m_keys.emplace(key, id);
+		// Written in the middle of the caller's record would break it, the caller started none yet
+		m_buffer.push_back((uint8_t)rec::REC_KEY);
+		put_varint(0);
+		put_varint(0);
+		put_varint(id);
+		put_string(key);
+		m_stats.records++;
+		return id;
+	}
+
+	void session_recorder::put_varint(uint64_t v) {
+		while(v >= 0x80) {
+			m_buffer.push_back((uint8_t)(v | 0x80));
+			v >>= 7;
+		}
+		m_buffer.push_back((uint8_t)v);
+	}
+
+	void session_recorder::put_string(const char* s) {
+		const size_t len = s ? strlen(s) : 0;
+		put_varint(len);
+		m_buffer.insert(m_buffer.end(), (const uint8_t*)s, (const uint8_t*)s + len);
+	}
+
+	void session_recorder::on_notify(uint64_t start, uint64_t dur, sp_playbacknotify_t n, int result) {
+		begin(rec::REC_NOTIFY, start, dur);
+		put_varint(n);
+		put_svarint(result);
+		end();
+	}
+
+	void session_recorder::on_audio(uint64_t start, uint64_t dur, const short* frames, unsigned long nframes, const sp_sampleformat_t& fmt, unsigned long accepted) {
+		const size_t nsamples = fmt.nchannels > 0 ? nframes * fmt.nchannels : 0;
+		// Hash outside of the lock, it's the expensive part
+		const uint64_t hash = m_opts.store_audio ? 0 : hash_samples(frames, nsamples);
+		begin(rec::REC_AUDIO, start, dur);
+		put_varint(nframes);
+		put_varint(fmt.nchannels > 0 ? fmt.nchannels : 0);
+		put_varint(fmt.samplerate > 0 ? fmt.samplerate : 0);
+		put_varint(accepted);
+		if(m_opts.store_audio) {
+			const uint8_t* p = (const uint8_t*)frames;
+			m_buffer.insert(m_buffer.end(), p, p + nsamples * sizeof(short));
+		} else {
+			const uint8_t* p = (const uint8_t*)&hash;
+			m_buffer.insert(m_buffer.end(), p, p + sizeof(hash));
+		}
+		m_stats.audio_frames += accepted;
+		end();
+	}
+
+	void session_recorder::on_seek(uint64_t start, uint64_t dur, uint64_t position) {
+		begin(rec::REC_SEEK, start, dur);
+		put_varint(position);
+		end();
+	}
+
+	void session_recorder::on_volume(uint64_t start, uint64_t dur, unsigned short volume) {
+		begin(rec::REC_VOLUME, start, dur);
+		put_varint(volume);
+		end();
+	}
+
+	void session_recorder::on_unavailable(uint64_t start, uint64_t dur, const char* uri) {
+		begin(rec::REC_UNAVAILABLE, start, dur);
+		put_string(uri);
+		end();
+	}
+
+	void session_recorder::on_con_notify(uint64_t start, uint64_t dur, sp_con_state_t state) {
+		begin(rec::REC_CON_NOTIFY, start, dur);
+		put_varint(state);
+		end();
+	}
+
+	void session_recorder::on_logged_in(uint64_t start, uint64_t dur, const char* username) {
+		begin(rec::REC_LOGGED_IN, start, dur);
+		put_string(username);
+		end();
+	}
+
+	void session_recorder::on_alloc(uint64_t start, uint64_t dur, const char* key, unsigned int size, long result) {
+		m_lock.lock();
+		const uint64_t id = key_id(key);
+		m_lock.unlock();
+		begin(rec::REC_ALLOC, start, dur);
+		put_varint(id);
+		put_varint(size);
+		put_svarint(result);
+		end();
+	}
+
+	void session_recorder::on_write(uint64_t start, uint64_t dur, const char* key, unsigned int offset, unsigned int size, long result) {
+		m_lock.lock();
+		const uint64_t id = key_id(key);
+		m_lock.unlock();
+		begin(rec::REC_WRITE, start, dur);
+		put_varint(id);
+		put_varint(offset);
+		put_varint(size);
+		put_svarint(result);
+		end();
+	}
+
+	void session_recorder::on_read(uint64_t start, uint64_t dur, const char* key, unsigned int offset, unsigned int size, long result) {
+		m_lock.lock();
+		const uint64_t id = key_id(key);
+		m_lock.unlock();
+		begin(rec::REC_READ, start, dur);
+		put_varint(id);
+		put_varint(offset);
+		put_varint(size);
+		put_svarint(result);
+		end();
+	}
+
+	void session_recorder::on_close(uint64_t start, uint64_t dur, const char* key) {
+		m_lock.lock();
+		const uint64_t id = key_id(key);
+		m_lock.unlock();
+		begin(rec::REC_CLOSE, start, dur);
+		put_varint(id);
+		end();
+	}
+
+	void session_recorder::on_lookup(uint64_t start, uint64_t dur, const char* hostname, int result) {
+		begin(rec::REC_LOOKUP, start, dur);
+		put_string(hostname);
+		put_svarint(result);
+		end();
+	}
+
+	void session_recorder::on_socket(uint64_t start, uint64_t dur, int fn, int64_t arg, int result) {
+		begin(rec::REC_SOCKET, start, dur);
+		put_varint(fn);
+		put_svarint(arg);
+		put_svarint(result);
+		end();
+	}
+
+	// ---- replayer --------------------------------------------------------------
+
+	session_replayer::session_replayer(const std::string& path)
+		: m_valid(false), m_playback_data(nullptr), m_connection_data(nullptr), m_storage_data(nullptr),
+		m_dnshal_data(nullptr), m_sockethal_data(nullptr)
+	{
+		memset(&m_header, 0x00, sizeof(m_header));
+		memset(&m_playback, 0x00, sizeof(m_playback));
+		memset(&m_connection, 0x00, sizeof(m_connection));
+		memset(&m_storage, 0x00, sizeof(m_storage));
+		memset(&m_dnshal, 0x00, sizeof(m_dnshal));
+		memset(&m_sockethal, 0x00, sizeof(m_sockethal));
+
+		FILE* f = fopen(path.c_str(), "rb");
+		if(!f) return;
+		uint8_t buf[65536];
+		size_t n;
+		while((n = fread(buf, 1, sizeof(buf), f)) > 0) m_data.insert(m_data.end(), buf, buf + n);
+		fclose(f);
+		if(m_data.size() < sizeof(m_header)) return;
+		memcpy(&m_header, m_data.data(), sizeof(m_header));
+		m_valid = m_header.magic == rec::magic && m_header.version == rec::version;
+	}
+
+	void session_replayer::set(const sp_playback_callbacks_t& cbs, void* data) {
+		m_playback = cbs;
+		m_playback_data = data;
+	}
+
+	void session_replayer::set(const sp_connection_callbacks_t& cbs, void* data) {
+		m_connection = cbs;
+		m_connection_data = data;
+	}
+
+	void session_replayer::set(const sp_storage_callbacks_t& cbs, void* data) {
+		m_storage = cbs;
+		m_storage_data = data;
+	}
+
+	void session_replayer::set(const sp_dnshal_callbacks_t& cbs, void* data) {
+		m_dnshal = cbs;
+		m_dnshal_data = data;
+	}
+
+	void session_replayer::set(const sp_sockethal_callbacks_t& cbs, void* data) {
+		m_sockethal = cbs;
+		m_sockethal_data = data;
+	}
+
+	bool session_replayer::get_varint(size_t& pos, uint64_t& v) const {
+		v = 0;
+		for(unsigned shift = 0; shift < 64; shift += 7) {
+			if(pos >= m_data.size()) return false;
+			const uint8_t b = m_data[pos++];
+			v |= (uint64_t)(b & 0x7f) << shift;
+			if(!(b & 0x80)) return true;
+		}
+		return false;
+	}
+
+	bool session_replayer::get_svarint(size_t& pos, int64_t& v) const {
+		uint64_t u;
+		if(!get_varint(pos, u)) return false;
+		v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+		return true;
+	}
+
+	bool session_replayer::get_string(size_t& pos, std::string& s) const {
+		uint64_t len;
+		if(!get_varint(pos, len) || len > m_data.size() - pos) return false;
+		s.assign((const char*)&m_data[pos], len);
+		pos += len;
+		return true;
+	}
+
+	const std::string& session_replayer::key(uint64_t id) const {
+		static const std::string unknown("unknown");
+		return id < m_keys.size() ? m_keys[id] : unknown;
+	}
+
+	bool session_replayer::run(double speed) {
+		if(!m_valid) return false;
+		m_stats = stats();
+		m_keys.clear();
+		const auto start = std::chrono::steady_clock::now();
+		uint64_t ts = 0;
+		size_t pos = sizeof(m_header);
+		bool ok = true;
+		while(pos < m_data.size()) {
+			const rec::record_type type = (rec::record_type)m_data[pos++];
+			uint64_t delta, dur;
+			if(type >= rec::REC_COUNT || !get_varint(pos, delta) || !get_varint(pos, dur)) {
+				ok = false;
+				break;
+			}
+			ts += delta;
+			if(speed > 0.0)
+				std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)(ts / speed)));
+			if(!replay(type, dur, pos)) {
+				ok = false;
+				break;
+			}
+			m_stats.records[type]++;
+		}
+		m_stats.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		m_stats.duration = ts / 1e9;
+		return ok;
+	}
+
+	bool session_replayer::replay(rec::record_type type, uint64_t dur, size_t& pos) {
+		uint64_t a = 0, b = 0, c = 0;
+		int64_t res = 0;
+		std::string str;
+		bool handled = false;
+		if(type != rec::REC_KEY) m_stats.recorded[type].record(dur);
+		const uint64_t t0 = now_ns();
+
+		switch(type) {
+			case rec::REC_KEY:
+				if(!get_varint(pos, a) || !get_string(pos, str)) return false;
+				if(a == m_keys.size()) m_keys.push_back(str);
+				return true;
+			case rec::REC_NOTIFY:
+				if(!get_varint(pos, a) || !get_svarint(pos, res)) return false;
+				if((handled = m_playback.onNotify != nullptr))
+					m_stats.mismatches += m_playback.onNotify((sp_playbacknotify_t)a, m_playback_data) != res;
+				break;
+			case rec::REC_AUDIO: {
+				uint64_t nchannels, samplerate, accepted;
+				if(!get_varint(pos, a) || !get_varint(pos, nchannels) || !get_varint(pos, samplerate) || !get_varint(pos, accepted))
+					return false;
+				// Bounded before sizing anything by them
+				if(a > rec::max_frames || nchannels > rec::max_channels) return false;
+				const size_t bytes = has_audio() ? a * nchannels * sizeof(short) : sizeof(uint64_t);
+				if(bytes > m_data.size() - pos) return false;
+				const short* frames;
+				if(has_audio()) frames = (const short*)&m_data[pos];
+				else {
+					// Deterministic noise seeded with the recorded hash
+					uint64_t seed;
+					memcpy(&seed, &m_data[pos], sizeof(seed));
+					m_scratch.resize(a * nchannels * sizeof(short));
+					short* out = (short*)m_scratch.data();
+					for(size_t i = 0; i < a * nchannels; i++) {
+						seed ^= seed << 13;
+						seed ^= seed >> 7;
+						seed ^= seed << 17;
+						out[i] = (short)(seed >> 48) / 4;
+					}
+					frames = out;
+				}
+				pos += bytes;
+				if((handled = m_playback.onAudioData != nullptr)) {
+					const sp_sampleformat_t fmt = { (int)nchannels, (int)samplerate };
+					const unsigned long n = m_playback.onAudioData(frames, a, &fmt, 0, m_playback_data);
+					m_stats.mismatches += n != accepted;
+					m_stats.audio_frames += n;
+				}
+				break;
+			}
+			case rec::REC_SEEK:
+				if(!get_varint(pos, a)) return false;
+				if((handled = m_playback.onSeek != nullptr)) m_playback.onSeek(a, m_playback_data);
+				break;
+			case rec::REC_VOLUME:
+				if(!get_varint(pos, a)) return false;
+				if((handled = m_playback.onApplyVolume != nullptr)) m_playback.onApplyVolume((unsigned short)a, m_playback_data);
+				break;
+			case rec::REC_UNAVAILABLE:
+				if(!get_string(pos, str)) return false;
+				if((handled = m_playback.onUnavailableTrack != nullptr)) m_playback.onUnavailableTrack(str.c_str(), m_playback_data);
+				break;
+			case rec::REC_CON_NOTIFY:
+				if(!get_varint(pos, a)) return false;
+				if((handled = m_connection.onNotify != nullptr)) m_connection.onNotify((sp_con_state_t)a, m_connection_data);
+				break;
+			case rec::REC_LOGGED_IN:
+				if(!get_string(pos, str)) return false;
+				// The blob was not recorded
+				if((handled = m_connection.onNotifyLoggedIn != nullptr)) m_connection.onNotifyLoggedIn("", str.c_str(), m_connection_data);
+				break;
+			case rec::REC_ALLOC:
+				if(!get_varint(pos, a) || !get_varint(pos, b) || !get_svarint(pos, res)) return false;
+				if((handled = m_storage.alloc != nullptr))
+					m_stats.mismatches += m_storage.alloc(key(a).c_str(), (unsigned int)b, m_storage_data) != res;
+				break;
+			case rec::REC_WRITE:
+			case rec::REC_READ: {
+				if(!get_varint(pos, a) || !get_varint(pos, b) || !get_varint(pos, c) || !get_svarint(pos, res)) return false;
+				if(c > rec::max_io_size) return false;
+				if(m_scratch.size() < c) m_scratch.resize(c);
+				long n;
+				if(type == rec::REC_WRITE) {
+					if(!(handled = m_storage.write != nullptr)) break;
+					// Filler depending on the position only, so replays write identical files
+					for(uint64_t i = 0; i < c; i++) m_scratch[i] = (uint8_t)((b + i) * 0x9e);
+					n = m_storage.write(key(a).c_str(), (unsigned int)b, m_scratch.data(), (unsigned int)c, m_storage_data);
+					if(n > 0) m_stats.bytes_written += n;
+				} else {
+					if(!(handled = m_storage.read != nullptr)) break;
+					n = m_storage.read(key(a).c_str(), (unsigned int)b, m_scratch.data(), (unsigned int)c, m_storage_data);
+					if(n > 0) m_stats.bytes_read += n;
+				}
+				m_stats.mismatches += n != res;
+				break;
+			}
+			case rec::REC_CLOSE:
+				if(!get_varint(pos, a)) return false;
+				if((handled = m_storage.close != nullptr)) m_storage.close(key(a).c_str(), m_storage_data);
+				break;
+			case rec::REC_LOOKUP:
+				if(!get_string(pos, str) || !get_svarint(pos, res)) return false;
+				if((handled = m_dnshal.lookup != nullptr)) {
+					struct sockaddr_storage addr;
+					memset(&addr, 0x00, sizeof(addr));
+					m_stats.mismatches += m_dnshal.lookup(str.c_str(), (struct sockaddr*)&addr, m_dnshal_data) != res;
+				}
+				break;
+			case rec::REC_SOCKET: {
+				int64_t arg;
+				if(!get_varint(pos, a) || !get_svarint(pos, arg) || !get_svarint(pos, res)) return false;
+				// Only the pump hint makes sense without the library owning the sockets
+				if(a == 17 && (handled = m_sockethal.fn17 != nullptr)) m_sockethal.fn17((int)arg, m_sockethal_data);
+				break;
+			}
+			default:
+				return false;
+		}
+
+		if(handled) m_stats.replayed[type].record(now_ns() - t0);
+		else m_stats.skipped++;
+		return true;
+	}
+
+	void session_replayer::report(std::ostream& out) const {
+		char line[160];
+		snprintf(line, sizeof(line), "Replayed %.1fs of recording in %.3fs, %llu skipped, %llu mismatches\n",
+			m_stats.duration, m_stats.elapsed, (unsigned long long)m_stats.skipped, (unsigned long long)m_stats.mismatches);
+		out << line;
+		snprintf(line, sizeof(line), "%-28s %10s %12s %12s %12s %12s\n", "record", "count", "rec p50 ns", "rec p99 ns", "p50 ns", "p99 ns");
+		out << line;
+		for(int t = 1; t < rec::REC_COUNT; t++) {
+			if(!m_stats.records[t]) continue;
+			const latency_histogram& r = m_stats.recorded[t];
+			const latency_histogram& p = m_stats.replayed[t];
+			snprintf(line, sizeof(line), "%-28s %10llu %12llu %12llu %12llu %12llu\n", rec::type_name((rec::record_type)t),
+				(unsigned long long)m_stats.records[t], (unsigned long long)r.percentile(50.0), (unsigned long long)r.percentile(99.0),
+				(unsigned long long)p.percentile(50.0), (unsigned long long)p.percentile(99.0));
+			out << line;
+		}
+	}
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+/**
+ * @file session_recorder.h
+ * @brief Binary recording of the callback stream of a session and its replay.
+ *
+ * The recorder replaces the function pointers of the callback tables (like trace::wrap())
+ * and appends one record per call: start time, time spent in the handler, arguments and
+ * the return value. Covered are the playback and connection callbacks, the storage HAL
+ * (key, offset, size), dnshal lookups and the socket HAL. Audio blocks are hashed by
+ * default, samples are only stored with options::store_audio. Login blobs are never
+ * recorded.
+ *
+ * The replayer reads a recording and calls the tables registered with it in the original
+ * order, at the original pace, faster or as fast as possible. Audio and storage writes get
+ * the recorded samples or deterministic filler of the recorded size. Socket calls besides
+ * on_pump (fn17) can't be replayed without the library and are only counted.
+ *
+ * The trampolines stay installed after the recorder is gone and then only forward. Records
+ * are taken through a scope, the destructor unregisters the recorder and waits until the
+ * trampolines still inside one of its calls left.
+ *
+ * Records are appended to a buffer under a lock. Once it is full or old enough, the next
+ * record wakes a writer thread that swaps it with its empty spare buffer and writes it
+ * without holding the lock, so the audio callback never waits for the file.
+ *
+ * Format: file_header, then records of a type byte, varint start time delta and handler
+ * duration (ns) and the type specific fields. Storage keys are written once as REC_KEY and
+ * referenced by index afterwards.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "spotify.h"
+#include "latency_probe.h"
+
+namespace sp {
+
+	namespace rec {
+
+		const uint32_t magic = 0x43525053; // "SPRC"
+		const uint16_t version = 1;
+		/** Samples are stored instead of hashes */
+		const uint16_t flag_audio = 1;
+		/** Larger audio blocks or storage calls only come from corrupt files */
+		const uint64_t max_channels = 8;
+		const uint64_t max_frames = 1 << 20;
+		const uint64_t max_io_size = 1 << 24;
+
+		struct file_header {
+			uint32_t magic;
+			uint16_t version;
+			uint16_t flags;
+			/** Wall clock time of the first record, ns since the epoch */
+			uint64_t start;
+		};
+
+		enum record_type {
+			/** id, key string */
+			REC_KEY = 0,
+			/** notify, result */
+			REC_NOTIFY = 1,
+			/** nframes, nchannels, samplerate, accepted, hash or samples */
+			REC_AUDIO = 2,
+			/** position */
+			REC_SEEK = 3,
+			/** volume */
+			REC_VOLUME = 4,
+			/** uri */
+			REC_UNAVAILABLE = 5,
+			/** state */
+			REC_CON_NOTIFY = 6,
+			/** username */
+			REC_LOGGED_IN = 7,
+			/** key id, size, result */
+			REC_ALLOC = 8,
+			/** key id, offset, size, result */
+			REC_WRITE = 9,
+			/** key id, offset, size, result */
+			REC_READ = 10,
+			/** key id */
+			REC_CLOSE = 11,
+			/** hostname, result */
+			REC_LOOKUP = 12,
+			/** function (1-17), first argument (fn17 only), result */
+			REC_SOCKET = 13,
+			REC_COUNT
+		};
+
+		/** @brief Name of a record type for reports */
+		const char* type_name(record_type t);
+	}
+
+	class session_recorder {
+	public:
+		struct options {
+			/** Store the samples of every audio block, otherwise a 64 bit hash */
+			bool store_audio = false;
+			/** Records are handed to the writer thread once this many bytes are buffered */
+			size_t buffer_size = 1 << 16;
+			/** or the oldest buffered record is this old */
+			std::chrono::milliseconds flush_interval = std::chrono::milliseconds(1000);
+		};
+
+		struct stats {
+			uint64_t records = 0;
+			/** Bytes written to the file including the header */
+			uint64_t bytes = 0;
+			uint64_t audio_frames = 0;
+			/** Failed writes, the recording is truncated */
+			uint64_t errors = 0;
+		};
+
+		/**
+		 * @brief Start recording into a file, only one recorder can be active at a time.
+		 */
+		explicit session_recorder(const std::string& path);
+		session_recorder(const std::string& path, const options& opts);
+		~session_recorder();
+
+		session_recorder(const session_recorder&) = delete;
+		session_recorder& operator=(const session_recorder&) = delete;
+
+		/** @brief False if the file couldn't be created */
+		bool valid() const { return m_file != nullptr; }
+		/** @brief Write buffered records to the file, waits for the writer thread */
+		void flush();
+		stats get_stats() const;
+
+		/**
+		 * @brief Replace the callbacks of a table with recording trampolines.
+		 *
+		 * Does nothing if no recorder is active. Only one table per type can be recorded,
+		 * wrapping a second one replaces the first.
+		 */
+		static void wrap(sp_playback_callbacks_t& cbs);
+		static void wrap(sp_connection_callbacks_t& cbs);
+		static void wrap(sp_storage_callbacks_t& cbs);
+		static void wrap(sp_dnshal_callbacks_t& cbs);
+		static void wrap(sp_sockethal_callbacks_t& cbs);
+		/** @brief The active recorder, if any */
+		static session_recorder* instance() { return s_instance.load(); }
+
+		/**
+		 * @brief The active recorder for one record, its destructor waits until the scope is left.
+		 */
+		class scope {
+		public:
+			scope();
+			~scope();
+			scope(const scope&) = delete;
+			scope& operator=(const scope&) = delete;
+
+			session_recorder* get() const { return m_recorder; }
+
+		private:
+			session_recorder* m_recorder;
+		};
+
+		// Called by the trampolines
+		void on_notify(uint64_t start, uint64_t dur, sp_playbacknotify_t n, int result);
+		void on_audio(uint64_t start, uint64_t dur, const short* frames, unsigned long nframes, const sp_sampleformat_t& fmt, unsigned long accepted);
+		void on_seek(uint64_t start, uint64_t dur, uint64_t position);
+		void on_volume(uint64_t start, uint64_t dur, unsigned short volume);
+		void on_unavailable(uint64_t start, uint64_t dur, const char* uri);
+		void on_con_notify(uint64_t start, uint64_t dur, sp_con_state_t state);
+		void on_logged_in(uint64_t start, uint64_t dur, const char* username);
+		void on_alloc(uint64_t start, uint64_t dur, const char* key, unsigned int size, long result);
+		void on_write(uint64_t start, uint64_t dur, const char* key, unsigned int offset, unsigned int size, long result);
+		void on_read(uint64_t start, uint64_t dur, const char* key, unsigned int offset, unsigned int size, long result);
+		void on_close(uint64_t start, uint64_t dur, const char* key);
+		void on_lookup(uint64_t start, uint64_t dur, const char* hostname, int result);
+		void on_socket(uint64_t start, uint64_t dur, int fn, int64_t arg, int result);
+
+	private:
+		void begin(rec::record_type type, uint64_t start, uint64_t dur);
+		uint64_t key_id(const char* key);
+		void put_varint(uint64_t v);
+		void put_svarint(int64_t v) { put_varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+		void put_string(const char* s);
+		void end();
+		void run();
+
+		static std::atomic<session_recorder*> s_instance;
+		/** Trampolines inside a scope */
+		static std::atomic<int> s_callers;
+
+		const options m_opts;
+		FILE* m_file;
+		mutable std::mutex m_lock;
+		/** Records are appended here */
+		std::vector<uint8_t> m_buffer;
+		/** Swapped with m_buffer and written by the writer thread */
+		std::vector<uint8_t> m_spare;
+		uint64_t m_last;
+		uint64_t m_last_flush;
+		std::unordered_map<std::string, uint64_t> m_keys;
+		stats m_stats;
+		std::condition_variable m_cv;
+		std::condition_variable m_written_cv;
+		/** m_buffer should be written */
+		bool m_handoff;
+		bool m_stop;
+		/** Buffers taken and written by the writer thread */
+		uint64_t m_swaps;
+		uint64_t m_writes;
+		std::thread m_thread;
+	};
+
+	class session_replayer {
+	public:
+		struct stats {
+			uint64_t records[rec::REC_COUNT] = {};
+			/** Handler time per record type as recorded and during the replay (ns) */
+			latency_histogram recorded[rec::REC_COUNT];
+			latency_histogram replayed[rec::REC_COUNT];
+			/** Records without a registered handler (and socket calls other than fn17) */
+			uint64_t skipped = 0;
+			/** Calls returning something else than during the recording */
+			uint64_t mismatches = 0;
+			/** Frames accepted by onAudioData */
+			uint64_t audio_frames = 0;
+			uint64_t bytes_read = 0;
+			uint64_t bytes_written = 0;
+			/** Wall time of the replay in seconds */
+			double elapsed = 0.0;
+			/** Duration of the recording in seconds */
+			double duration = 0.0;
+		};
+
+		explicit session_replayer(const std::string& path);
+
+		/** @brief False if the file is missing or not a recording */
+		bool valid() const { return m_valid; }
+		/** @brief Samples were recorded, not only hashes */
+		bool has_audio() const { return m_header.flags & rec::flag_audio; }
+
+		/** @brief Handlers to drive, same tables and data pointers as for the library */
+		void set(const sp_playback_callbacks_t& cbs, void* data);
+		void set(const sp_connection_callbacks_t& cbs, void* data);
+		void set(const sp_storage_callbacks_t& cbs, void* data);
+		void set(const sp_dnshal_callbacks_t& cbs, void* data);
+		void set(const sp_sockethal_callbacks_t& cbs, void* data);
+
+		/**
+		 * @brief Replay the whole recording.
+		 * @param speed 1 for the original pace, 2 twice as fast, 0 as fast as possible
+		 * @return false if the recording is truncated or corrupt (everything before was replayed)
+		 */
+		bool run(double speed = 1.0);
+
+		const stats& get_stats() const { return m_stats; }
+		/** @brief Write counts and handler times (p50/p99 recorded vs replayed) per record type */
+		void report(std::ostream& out) const;
+
+	private:
+		bool replay(rec::record_type type, uint64_t dur, size_t& pos);
+		bool get_varint(size_t& pos, uint64_t& v) const;
+		bool get_svarint(size_t& pos, int64_t& v) const;
+		bool get_string(size_t& pos, std::string& s) const;
+		const std::string& key(uint64_t id) const;
+
+		bool m_valid;
+		rec::file_header m_header;
+		std::vector<uint8_t> m_data;
+		std::vector<std::string> m_keys;
+		std::vector<uint8_t> m_scratch;
+		sp_playback_callbacks_t m_playback;
+		void* m_playback_data;
+		sp_connection_callbacks_t m_connection;
+		void* m_connection_data;
+		sp_storage_callbacks_t m_storage;
+		void* m_storage_data;
+		sp_dnshal_callbacks_t m_dnshal;
+		void* m_dnshal_data;
+		sp_sockethal_callbacks_t m_sockethal;
+		void* m_sockethal_data;
+		stats m_stats;
+	};
+}
@@ -0,0 +1,471 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "socket_hal.h"
+#include "pump_driver.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace sp {
+
+	// Socket -> socket_hal that created it, for callbacks without a data pointer
+	static std::mutex s_owners_mtx;
+	static std::unordered_map<int, socket_hal*> s_owners;
+
+	static void set_owner(int s, socket_hal* hal) {
+		std::lock_guard<std::mutex> lck(s_owners_mtx);
+		if(hal) s_owners[s] = hal;
+		else s_owners.erase(s);
+	}
+
+	static int poll_now(int fd, short events) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0 && (pfd.revents & (events | POLLERR | POLLHUP)) ? 1 : 0;
+	}
+
+	static uint64_t elapsed_us(std::chrono::steady_clock::time_point since) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+	}
+
+	socket_hal::socket_hal(pump_driver& driver, options opts)
+		: m_driver(driver), m_opts(opts)
+	{
+		m_driver.set_io_driven(true);
+	}
+
+	socket_hal::socket_hal(pump_driver& driver)
+		: socket_hal(driver, options())
+	{}
+
+	socket_hal::~socket_hal() {
+		m_driver.set_io_driven(false);
+		for(auto& e : m_sockets) release(e.first);
+		for(auto& e : m_closing) {
+			m_dropped_bytes += e.second.pending_bytes;
+			release(e.first);
+		}
+	}
+
+	int socket_hal::create(int domain, int type, int protocol) {
+		int fd = ::socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+		if(fd < 0) return -errno;
+		apply_options(fd, type == SOCK_STREAM);
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_sockets[fd].stream = type == SOCK_STREAM;
+		set_owner(fd, this);
+		return fd;
+	}
+
+	int socket_hal::close(int s) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_sockets.find(s);
+		if(it == m_sockets.end()) return -EBADF;
+		if(!it->second.pending.empty()) flush(s, it->second);
+		if(it->second.pending.empty()) {
+			m_sockets.erase(it);
+			m_driver.unwatch(s);
+			set_owner(s, nullptr);
+			return ::close(s) == 0 ? 0 : -errno;
+		}
+		// Keep the descriptor until the pump loop sent the rest, the library already sees it closed
+		entry& e = m_closing[s];
+		e = std::move(it->second);
+		e.close_deadline = clock::now() + m_opts.close_timeout;
+		m_sockets.erase(it);
+		m_driver.hint((int)m_opts.close_timeout.count());
+		return 0;
+	}
+
+	int socket_hal::bind(int s, const struct sockaddr* addr, socklen_t len) {
+		return ::bind(s, addr, len) == 0 ? 0 : -errno;
+	}
+
+	int socket_hal::listen(int s, int backlog) {
+		return ::listen(s, backlog) == 0 ? 0 : -errno;
+	}
+
+	int socket_hal::connect(int s, const struct sockaddr* addr, socklen_t len) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		entry* e = find(s);
+		if(!e) return -EBADF;
+		e->connect_start = clock::now();
+		if(::connect(s, addr, len) == 0) return 0;
+		int err = errno;
+		if(err == EINPROGRESS) {
+			e->connecting = true;
+			m_driver.watch(s, false, true);
+		}
+		return -err;
+	}
+
+	int socket_hal::accept(int s, struct sockaddr* addr, socklen_t* len) {
+		int fd = ::accept4(s, addr, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			int err = errno;
+			if(err == EAGAIN || err == EWOULDBLOCK) m_driver.watch(s, true, false);
+			return -err;
+		}
+		apply_options(fd, true);
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_sockets[fd].stream = true;
+		set_owner(fd, this);
+		return fd;
+	}
+
+	long socket_hal::recv(int s, void* buf, size_t len) {
+		return recvfrom(s, buf, len, nullptr, nullptr);
+	}
+
+	long socket_hal::send(int s, const void* buf, size_t len) {
+		return sendto(s, buf, len, nullptr, 0);
+	}
+
+	long socket_hal::recvfrom(int s, void* buf, size_t len, struct sockaddr* addr, socklen_t* addrlen) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		entry* e = find(s);
+		if(!e) return -EBADF;
+		e->stats.recvs++;
+		ssize_t n = ::recvfrom(s, buf, len, MSG_DONTWAIT, addr, addrlen);
+		if(n < 0) {
+			int err = errno;
+			if(err == EAGAIN || err == EWOULDBLOCK) {
+				e->stats.would_block++;
+				m_driver.watch(s, true, false);
+				return -EAGAIN;
+			}
+			return -err;
+		}
+		received(*e, n);
+		return n;
+	}
+
+	long socket_hal::sendto(int s, const void* buf, size_t len, const struct sockaddr* addr, socklen_t addrlen) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		entry* e = find(s);
+		if(!e) return -EBADF;
+		e->stats.sends++;
+		check_connected(*e);
+		if(!e->stream || addr) {
+			// Datagrams are never queued
+			ssize_t n = ::sendto(s, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL, addr, addrlen);
+			if(n < 0) {
+				int err = errno;
+				if(err == EAGAIN || err == EWOULDBLOCK) {
+					e->stats.would_block++;
+					m_driver.watch(s, false, true);
+					return -EAGAIN;
+				}
+				return -err;
+			}
+			e->stats.send_syscalls++;
+			e->stats.bytes_sent += n;
+			e->last_send = clock::now();
+			e->awaiting_response = true;
+			return n;
+		}
+
+		if(!e->pending.empty()) {
+			int err = flush(s, *e);
+			if(err) return err;
+		}
+		size_t done = 0;
+		if(e->pending.empty()) {
+			ssize_t n = ::send(s, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -errno;
+			if(n > 0) {
+				e->stats.send_syscalls++;
+				e->stats.bytes_sent += n;
+				done = n;
+			}
+		}
+		if(done != len) {
+			// Queue the rest, it is flushed with a single sendmsg once the socket is writable
+			if(e->pending_bytes + (len - done) > m_opts.max_pending) {
+				if(done) return done;
+				e->stats.would_block++;
+				m_driver.watch(s, false, true);
+				return -EAGAIN;
+			}
+			const uint8_t* ptr = (const uint8_t*)buf + done;
+			e->pending.emplace_back(ptr, ptr + (len - done));
+			e->pending_bytes += len - done;
+			m_driver.watch(s, false, true);
+		}
+		e->last_send = clock::now();
+		e->awaiting_response = true;
+		return len;
+	}
+
+	int socket_hal::error(int s) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) != 0) return -errno;
+		return err ? -err : 0;
+	}
+
+	int socket_hal::readable(int s) {
+		int res = poll_now(s, POLLIN);
+		if(!res) m_driver.watch(s, true, false);
+		return res;
+	}
+
+	int socket_hal::writable(int s) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		entry* e = find(s);
+		if(!e) return 0;
+		if(!e->pending.empty()) flush(s, *e);
+		int res = poll_now(s, POLLOUT);
+		if(res) check_connected(*e);
+		if(e->pending_bytes >= m_opts.max_pending) res = 0;
+		if(!res) m_driver.watch(s, false, true);
+		return res;
+	}
+
+	int socket_hal::local_address(int s, struct sockaddr* addr, socklen_t* len) {
+		return getsockname(s, addr, len) == 0 ? 0 : -errno;
+	}
+
+	int socket_hal::remote_address(int s, struct sockaddr* addr, socklen_t* len) {
+		return getpeername(s, addr, len) == 0 ? 0 : -errno;
+	}
+
+	void socket_hal::flush() {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		for(auto& e : m_sockets)
+			if(!e.second.pending.empty()) flush(e.first, e.second);
+		if(!m_closing.empty()) linger();
+	}
+
+	size_t socket_hal::lingering() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_closing.size();
+	}
+
+	uint64_t socket_hal::dropped_bytes() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_dropped_bytes;
+	}
+
+	bool socket_hal::get_stats(int s, socket_stats& out) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_sockets.find(s);
+		if(it == m_sockets.end()) return false;
+		out = it->second.stats;
+		return true;
+	}
+
+	std::map<int, socket_hal::socket_stats> socket_hal::all_stats() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		std::map<int, socket_stats> res;
+		for(auto& e : m_sockets) res[e.first] = e.second.stats;
+		return res;
+	}
+
+	socket_hal::entry* socket_hal::find(int s) {
+		auto it = m_sockets.find(s);
+		return it == m_sockets.end() ? nullptr : &it->second;
+	}
+
+	void socket_hal::apply_options(int fd, bool stream) {
+		int one = 1;
+		if(stream && m_opts.nodelay) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(m_opts.sndbuf > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &m_opts.sndbuf, sizeof(m_opts.sndbuf));
+		if(m_opts.rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &m_opts.rcvbuf, sizeof(m_opts.rcvbuf));
+	}
+
+	int socket_hal::flush(int s, entry& e) {
+		while(!e.pending.empty()) {
+			struct iovec iov[32];
+			size_t cnt = 0;
+			for(auto it = e.pending.begin(); it != e.pending.end() && cnt < 32; ++it, ++cnt) {
+				size_t skip = cnt == 0 ? e.pending_front : 0;
+				iov[cnt].iov_base = it->data() + skip;
+				iov[cnt].iov_len = it->size() - skip;
+			}
+			struct msghdr msg;
+			memset(&msg, 0x00, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = cnt;
+			ssize_t n = ::sendmsg(s, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(n < 0) {
+				int err = errno;
+				if(err == EAGAIN || err == EWOULDBLOCK) break;
+				return -err;
+			}
+			e.stats.send_syscalls++;
+			e.stats.bytes_sent += n;
+			e.pending_bytes -= n;
+			while(n > 0) {
+				size_t left = e.pending.front().size() - e.pending_front;
+				if((size_t)n < left) {
+					e.pending_front += n;
+					break;
+				}
+				n -= left;
+				e.pending.pop_front();
+				e.pending_front = 0;
+			}
+		}
+		if(!e.pending.empty()) m_driver.watch(s, false, true);
+		return 0;
+	}
+
+	void socket_hal::linger() {
+		const clock::time_point now = clock::now();
+		long next = -1;
+		for(auto it = m_closing.begin(); it != m_closing.end();) {
+			entry& e = it->second;
+			const bool failed = flush(it->first, e) != 0;
+			if(!failed && !e.pending.empty() && now < e.close_deadline) {
+				// Wake up for the deadline even if the socket never gets writable
+				const long left = (long)std::chrono::duration_cast<std::chrono::milliseconds>(e.close_deadline - now).count() + 1;
+				if(next < 0 || left < next) next = left;
+				++it;
+				continue;
+			}
+			m_dropped_bytes += e.pending_bytes;
+			release(it->first);
+			it = m_closing.erase(it);
+		}
+		if(next >= 0) m_driver.hint((int)next);
+	}
+
+	void socket_hal::release(int s) {
+		m_driver.unwatch(s);
+		set_owner(s, nullptr);
+		::close(s);
+	}
+
+	socket_hal* socket_hal::owner(void* s) {
+		std::lock_guard<std::mutex> lck(s_owners_mtx);
+		auto it = s_owners.find((int)(intptr_t)s);
+		return it == s_owners.end() ? nullptr : it->second;
+	}
+
+	void socket_hal::received(entry& e, long n) {
+		e.stats.bytes_received += n;
+		if(n > 0 && e.awaiting_response) {
+			e.awaiting_response = false;
+			e.stats.last_response_us = elapsed_us(e.last_send);
+			if(e.stats.last_response_us > e.stats.max_response_us)
+				e.stats.max_response_us = e.stats.last_response_us;
+		}
+	}
+
+	void socket_hal::check_connected(entry& e) {
+		if(!e.connecting) return;
+		e.connecting = false;
+		e.stats.connect_us = elapsed_us(e.connect_start);
+	}
+
+	// The library does not seem to pass a length with its addresses, derive it from the family
+	static socklen_t addr_len(const struct sockaddr* addr) {
+		return addr && addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	}
+
+	/*
+	 * Argument mapping (reverse engineered):
+	 * fn1 create(domain, type, protocol)     fn2 setsockopt(socket, option, value)
+	 * fn3 close(socket)                      fn4 bind(socket, addr)
+	 * fn5 listen(socket, backlog)            fn6 connect(socket, addr)
+	 * fn7 accept(socket, addr)               fn8 recv(socket, buf, len)
+	 * fn9 send(socket, buf, len)             fn10 recvfrom(socket, buf, len, addr)
+	 * fn11 sendto(socket, buf, len, addr)    fn12 error(socket)
+	 * fn13 is_readable(socket)               fn14 is_writable(socket)
+	 * fn15 local_address(socket, addr)       fn16 remote_address(socket, addr)
+	 * fn17 on_pump(timeout hint)
+	 */
+	sp_sockethal_callbacks_t socket_hal::callbacks() {
+		sp_sockethal_callbacks_t cbs;
+		memset(&cbs, 0x00, sizeof(cbs));
+		cbs.fn1 = [](void* a, void* b, void* c, void* data) -> int {
+			socket_hal* hal = (socket_hal*)data;
+			return hal ? hal->create((int)(intptr_t)a, (int)(intptr_t)b, (int)(intptr_t)c) : -EBADF;
+		};
+		cbs.fn2 = [](void*, void*, void*, void*) -> int {
+			// Option ids of the library are unknown, sockets are tuned from socket_hal::options instead
+			return 0;
+		};
+		cbs.fn3 = [](void* a, void*, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? hal->close((int)(intptr_t)a) : -EBADF;
+		};
+		cbs.fn4 = [](void* a, void* b, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			const struct sockaddr* addr = (const struct sockaddr*)b;
+			return hal ? hal->bind((int)(intptr_t)a, addr, addr_len(addr)) : -EBADF;
+		};
+		cbs.fn5 = [](void* a, void* b, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? hal->listen((int)(intptr_t)a, (int)(intptr_t)b) : -EBADF;
+		};
+		cbs.fn6 = [](void* a, void* b, void* data) -> int {
+			socket_hal* hal = (socket_hal*)data;
+			const struct sockaddr* addr = (const struct sockaddr*)b;
+			return hal ? hal->connect((int)(intptr_t)a, addr, addr_len(addr)) : -EBADF;
+		};
+		cbs.fn7 = [](void* a, void* b, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			socklen_t len = sizeof(struct sockaddr_in);
+			return hal ? hal->accept((int)(intptr_t)a, (struct sockaddr*)b, b ? &len : nullptr) : -EBADF;
+		};
+		cbs.fn8 = [](void* a, void* b, void* c, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? (int)hal->recv((int)(intptr_t)a, b, (size_t)c) : -EBADF;
+		};
+		cbs.fn9 = [](void* a, void* b, void* c, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? (int)hal->send((int)(intptr_t)a, b, (size_t)c) : -EBADF;
+		};
+		cbs.fn10 = [](void* a, void* b, void* c, void* d) -> int {
+			socket_hal* hal = owner(a);
+			socklen_t len = sizeof(struct sockaddr_in);
+			return hal ? (int)hal->recvfrom((int)(intptr_t)a, b, (size_t)c, (struct sockaddr*)d, d ? &len : nullptr) : -EBADF;
+		};
+		cbs.fn11 = [](void* a, void* b, void* c, void* d) -> int {
+			socket_hal* hal = owner(a);
+			const struct sockaddr* addr = (const struct sockaddr*)d;
+			return hal ? (int)hal->sendto((int)(intptr_t)a, b, (size_t)c, addr, addr ? addr_len(addr) : 0) : -EBADF;
+		};
+		cbs.fn12 = [](void* a, void*, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? hal->error((int)(intptr_t)a) : -EBADF;
+		};
+		cbs.fn13 = [](void* a, void*, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? hal->readable((int)(intptr_t)a) : 0;
+		};
+		cbs.fn14 = [](void* a, void*, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			return hal ? hal->writable((int)(intptr_t)a) : 0;
+		};
+		cbs.fn15 = [](void* a, void* b, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			socklen_t len = sizeof(struct sockaddr_in);
+			return hal ? hal->local_address((int)(intptr_t)a, (struct sockaddr*)b, &len) : -EBADF;
+		};
+		cbs.fn16 = [](void* a, void* b, void*, void*) -> int {
+			socket_hal* hal = owner(a);
+			socklen_t len = sizeof(struct sockaddr_in);
+			return hal ? hal->remote_address((int)(intptr_t)a, (struct sockaddr*)b, &len) : -EBADF;
+		};
+		cbs.fn17 = [](int a, void* data) -> int {
+			socket_hal* hal = (socket_hal*)data;
+			if(!hal) return 0;
+			hal->flush();
+			hal->m_driver.hint(a);
+			return 0;
+		};
+		return cbs;
+	}
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+/**
+ * @file socket_hal.h
+ * @brief Socket HAL for ::SpRegisterSocketHALCallbacks on non-blocking sockets.
+ *
+ * All sockets are non-blocking and share the epoll set of a pump_driver, so the pump
+ * thread sleeps until the library can make progress. Streams get TCP_NODELAY and tuned
+ * buffer sizes. Sends that can not be written immediately are queued (up to a limit) and
+ * flushed with a single scatter/gather sendmsg once the socket becomes writable. The
+ * library counts queued bytes as sent, so close() returns right away but keeps the socket
+ * open while flush() (every pump) sends the rest, for up to options::close_timeout. Bytes
+ * still queued then are dropped and counted in dropped_bytes().
+ * Every socket keeps byte, call and latency counters.
+ *
+ * The member functions use BSD semantics and can be used (and tested) directly, e.g.
+ * against a loopback server (selftestapp sockets). They return a negative errno on failure, -EAGAIN meaning
+ * the call would block.
+ *
+ * The argument layout of the sp_sockethal_callbacks_t hooks is reverse engineered and
+ * only partially verified, see callbacks() for the mapping used.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class pump_driver;
+
+	class socket_hal {
+	public:
+		/**
+		 * @brief Tuning applied to every new socket
+		 */
+		struct options {
+			/** Disable nagle on stream sockets */
+			bool nodelay = true;
+			/** SO_SNDBUF, 0 keeps the system default */
+			int sndbuf = 256 * 1024;
+			/** SO_RCVBUF, 0 keeps the system default */
+			int rcvbuf = 256 * 1024;
+			/** Maximum number of bytes queued per socket while it is not writable */
+			size_t max_pending = 256 * 1024;
+			/** How long a closed socket keeps sending queued bytes from the pump loop */
+			std::chrono::milliseconds close_timeout{100};
+		};
+
+		/**
+		 * @brief Per socket counters
+		 */
+		struct socket_stats {
+			uint64_t bytes_sent = 0;
+			uint64_t bytes_received = 0;
+			/** Number of send/sendto calls */
+			uint64_t sends = 0;
+			/** Number of recv/recvfrom calls */
+			uint64_t recvs = 0;
+			/** Number of sendmsg syscalls, less than sends if queued data got coalesced */
+			uint64_t send_syscalls = 0;
+			/** Number of calls that returned -EAGAIN */
+			uint64_t would_block = 0;
+			/** Time from connect to the socket becoming writable */
+			uint64_t connect_us = 0;
+			/** Time from the last send to the first data received after it */
+			uint64_t last_response_us = 0;
+			/** Largest observed response time */
+			uint64_t max_response_us = 0;
+		};
+
+		/**
+		 * @brief Create a socket HAL.
+		 * @param driver Driver whose epoll set is used to wait for readiness
+		 * @param opts Socket tuning
+		 */
+		socket_hal(pump_driver& driver, options opts);
+		/** @brief Create a socket HAL with default tuning */
+		explicit socket_hal(pump_driver& driver);
+		~socket_hal();
+
+		socket_hal(const socket_hal&) = delete;
+		socket_hal& operator=(const socket_hal&) = delete;
+
+		int create(int domain, int type, int protocol);
+		/** @brief Close, queued bytes are still sent by flush() for up to options::close_timeout */
+		int close(int s);
+		int bind(int s, const struct sockaddr* addr, socklen_t len);
+		int listen(int s, int backlog);
+		int connect(int s, const struct sockaddr* addr, socklen_t len);
+		int accept(int s, struct sockaddr* addr, socklen_t* len);
+		long recv(int s, void* buf, size_t len);
+		long send(int s, const void* buf, size_t len);
+		long recvfrom(int s, void* buf, size_t len, struct sockaddr* addr, socklen_t* addrlen);
+		long sendto(int s, const void* buf, size_t len, const struct sockaddr* addr, socklen_t addrlen);
+		/** @brief Pending socket error (SO_ERROR), 0 if none */
+		int error(int s);
+		/** @brief 1 if data can be read, 0 otherwise (and wait for it) */
+		int readable(int s);
+		/** @brief 1 if data can be sent, 0 otherwise (and wait for it) */
+		int writable(int s);
+		int local_address(int s, struct sockaddr* addr, socklen_t* len);
+		int remote_address(int s, struct sockaddr* addr, socklen_t* len);
+		/** @brief Flush queued sends of all sockets and finish closed ones, called on every pump */
+		void flush();
+		/** @brief Closed sockets still sending queued bytes */
+		size_t lingering() const;
+		/** @brief Queued bytes dropped because close_timeout passed */
+		uint64_t dropped_bytes() const;
+
+		/** @brief Get the counters of a socket */
+		bool get_stats(int s, socket_stats& out) const;
+		/** @brief Get the counters of all open sockets */
+		std::map<int, socket_stats> all_stats() const;
+
+		/**
+		 * @brief Build a callback table for ::SpRegisterSocketHALCallbacks, pass the socket_hal as data.
+		 *
+		 * create (fn1), connect (fn6) and on_pump (fn17) get the data pointer. For the other
+		 * functions its position is unknown, they are dispatched to the socket_hal that
+		 * created or accepted the socket.
+		 */
+		static sp_sockethal_callbacks_t callbacks();
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct entry {
+			bool stream = false;
+			bool connecting = false;
+			clock::time_point connect_start;
+			clock::time_point last_send;
+			bool awaiting_response = false;
+			/** Set once closed with bytes still queued */
+			clock::time_point close_deadline;
+			std::deque<std::vector<uint8_t>> pending;
+			size_t pending_front = 0;
+			size_t pending_bytes = 0;
+			socket_stats stats;
+		};
+
+		entry* find(int s);
+		void apply_options(int fd, bool stream);
+		int flush(int s, entry& e);
+		/** @brief Finish closed sockets that are drained or out of time, sets a wait hint for the rest */
+		void linger();
+		void release(int s);
+		static socket_hal* owner(void* s);
+		void received(entry& e, long n);
+		void check_connected(entry& e);
+
+		pump_driver& m_driver;
+		const options m_opts;
+		mutable std::mutex m_mtx;
+		std::unordered_map<int, entry> m_sockets;
+		/** Closed by the library, still sending */
+		std::unordered_map<int, entry> m_closing;
+		uint64_t m_dropped_bytes = 0;
+	};
+}
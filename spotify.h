@@ -914,11 +914,11 @@ SpConnectionLoginZeroConf(const char*, const char*, const char*, const char*)
  * uint32_t num1;   		0x000 ? = 1
  * uint32_t datasize; 		0x004 Size of encrypted track data 
  * uint32_t chunksize;		0x008 Size of a chunk in Bitmap = 4116
- * uint32_t num2;			0x00b ? = 60
+ * uint32_t num2;			0x00c ? = 60
  * uint32_t num3;			0x010 ? = 0
  * uint32_t num4;			0x014 ? = 0
  * uint8_t blob1[36];		0x018 Maybe some sort of key/non ascii
- * uint8_t blob2[52];		0x03b Blob, filled with 0xcc
- * uint8_t bitmap[0x1400];	Bitmap chunk availablility
+ * uint8_t blob2[52];		0x03c Blob, filled with 0xcc
+ * uint8_t bitmap[0x1400];	0x070 Bitmap chunk availablility
  * ...
  */
\ No newline at end of file
@@ -0,0 +1,322 @@
+#pragma once
+
+/**
+ * @file spotify.hpp
+ * @brief Header-only C++ layer over spotify.h: an owning session and callback tables built from handler types.
+ *
+ * The callback tables are built at compile time from the member functions a handler type
+ * has, the data pointer is the handler itself. Every slot calls the member directly, so
+ * the calls can be inlined into the trampoline, there is no std::function or virtual call
+ * in between. Slots without a matching member stay null.
+ *
+ * Member functions looked up on the handler (the helpers of this repository already use
+ * these names, e.g. mmap_storage, dns_cache, prefetcher and async_logger):
+ * - debug: log(const char* line)
+ * - connection: on_connection(sp_con_state_t), on_logged_in(const char* blob, const char* username),
+ *   on_message(const char* msg)
+ * - playback: on_notify(sp_playbacknotify_t), on_audio_data(const short* frames, unsigned long nframes,
+ *   const sp_sampleformat_t& format), on_seek(uint64_t position), on_volume(unsigned short volume),
+ *   on_unavailable_track(const char* uri)
+ * - prefetch: on_prefetched(const char* uri)
+ * - storage: alloc(key, size), write(key, offset, buf, size), read(key, offset, buf, size), close(key)
+ * - dnshal: lookup(const char* hostname, struct sockaddr* addr)
+ *
+ * on_notify may return void (0 is passed to the library) and on_audio_data may return void
+ * (all frames are accepted). The socket HAL and content callbacks are not covered, their
+ * arguments are not known well enough for typed members (see socket_hal::callbacks()).
+ *
+ * @code
+ * struct player {
+ *     bool playing = false;
+ *     void on_notify(sp_playbacknotify_t n) { playing = n == PN_PLAY ? true : n == PN_PAUSE ? false : playing; }
+ *     unsigned long on_audio_data(const short* frames, unsigned long n, const sp_sampleformat_t& fmt);
+ * };
+ * sp::session session(cfg);
+ * player p;
+ * session.attach(p);
+ * @endcode
+ */
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "spotify.h"
+
+namespace sp {
+
+	namespace detail {
+
+		template<typename...>
+		struct voider {
+			typedef void type;
+		};
+
+// has_<name><H>::value is true if H has a member name callable with the given arguments
+#define SP_HPP_HAS_MEMBER(trait, name, ...) \
+		template<typename H, typename = void> \
+		struct trait : std::false_type {}; \
+		template<typename H> \
+		struct trait<H, typename voider<decltype(std::declval<H&>().name(__VA_ARGS__))>::type> : std::true_type {};
+
+		SP_HPP_HAS_MEMBER(has_log, log, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_on_connection, on_connection, CS_LOGGEDIN)
+		SP_HPP_HAS_MEMBER(has_on_logged_in, on_logged_in, (const char*)nullptr, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_on_message, on_message, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_on_notify, on_notify, PN_PLAY)
+		SP_HPP_HAS_MEMBER(has_on_audio_data, on_audio_data, (const short*)nullptr, 0ul, std::declval<const sp_sampleformat_t&>())
+		SP_HPP_HAS_MEMBER(has_on_seek, on_seek, (uint64_t)0)
+		SP_HPP_HAS_MEMBER(has_on_volume, on_volume, (unsigned short)0)
+		SP_HPP_HAS_MEMBER(has_on_unavailable_track, on_unavailable_track, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_on_prefetched, on_prefetched, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_alloc, alloc, (const char*)nullptr, 0u)
+		SP_HPP_HAS_MEMBER(has_write, write, (const char*)nullptr, 0u, (const void*)nullptr, 0u)
+		SP_HPP_HAS_MEMBER(has_read, read, (const char*)nullptr, 0u, (void*)nullptr, 0u)
+		SP_HPP_HAS_MEMBER(has_close, close, (const char*)nullptr)
+		SP_HPP_HAS_MEMBER(has_lookup, lookup, (const char*)nullptr, (struct sockaddr*)nullptr)
+
+#undef SP_HPP_HAS_MEMBER
+
+		// One slot per callback: get() is null unless the handler has the member, the
+		// trampoline of a missing member is never instantiated
+#define SP_HPP_SLOT(slot, trait, ret, params, call) \
+		template<typename H, bool = trait<H>::value> \
+		struct slot { \
+			static constexpr std::nullptr_t get() { return nullptr; } \
+		}; \
+		template<typename H> \
+		struct slot<H, true> { \
+			static ret fn params { call; } \
+			static constexpr decltype(&fn) get() { return &fn; } \
+		};
+
+		// Adapters for members that may return void
+		template<typename H>
+		inline int notify(H& h, sp_playbacknotify_t n, std::true_type) { return h.on_notify(n); }
+		template<typename H>
+		inline int notify(H& h, sp_playbacknotify_t n, std::false_type) { h.on_notify(n); return 0; }
+		template<typename H>
+		inline unsigned long audio(H& h, const short* frames, unsigned long nframes, const sp_sampleformat_t& fmt, std::false_type) {
+			return h.on_audio_data(frames, nframes, fmt);
+		}
+		template<typename H>
+		inline unsigned long audio(H& h, const short* frames, unsigned long nframes, const sp_sampleformat_t& fmt, std::true_type) {
+			h.on_audio_data(frames, nframes, fmt);
+			return nframes;
+		}
+
+		SP_HPP_SLOT(debug_print, has_log, void, (const char* line, void* data),
+			static_cast<H*>(data)->log(line))
+		SP_HPP_SLOT(connection_notify, has_on_connection, void, (sp_con_state_t state, void* data),
+			static_cast<H*>(data)->on_connection(state))
+		SP_HPP_SLOT(connection_logged_in, has_on_logged_in, void, (const char* blob, const char* username, void* data),
+			static_cast<H*>(data)->on_logged_in(blob, username))
+		SP_HPP_SLOT(connection_message, has_on_message, void, (const char* msg, void* data),
+			static_cast<H*>(data)->on_message(msg))
+		SP_HPP_SLOT(playback_notify, has_on_notify, int, (sp_playbacknotify_t n, void* data),
+			return notify(*static_cast<H*>(data), n, std::is_same<decltype(std::declval<H&>().on_notify(n)), int>()))
+		SP_HPP_SLOT(playback_audio, has_on_audio_data, unsigned long,
+			(const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int, void* data),
+			return audio(*static_cast<H*>(data), frames, nframes, *format, std::is_void<decltype(std::declval<H&>().on_audio_data(frames, nframes, *format))>()))
+		SP_HPP_SLOT(playback_seek, has_on_seek, void, (uint64_t position, void* data),
+			static_cast<H*>(data)->on_seek(position))
+		SP_HPP_SLOT(playback_volume, has_on_volume, void, (unsigned short volume, void* data),
+			static_cast<H*>(data)->on_volume(volume))
+		SP_HPP_SLOT(playback_unavailable, has_on_unavailable_track, void, (const char* uri, void* data),
+			static_cast<H*>(data)->on_unavailable_track(uri))
+		SP_HPP_SLOT(prefetch_done, has_on_prefetched, void, (const char* uri, long, long, void* data),
+			static_cast<H*>(data)->on_prefetched(uri))
+		SP_HPP_SLOT(storage_alloc, has_alloc, long, (const char* key, unsigned int size, void* data),
+			return static_cast<H*>(data)->alloc(key, size))
+		SP_HPP_SLOT(storage_write, has_write, long, (const char* key, unsigned int offset, const void* buf, unsigned int size, void* data),
+			return static_cast<H*>(data)->write(key, offset, buf, size))
+		SP_HPP_SLOT(storage_read, has_read, long, (const char* key, unsigned int offset, void* buf, unsigned int size, void* data),
+			return static_cast<H*>(data)->read(key, offset, buf, size))
+		SP_HPP_SLOT(storage_close, has_close, void, (const char* key, void* data),
+			static_cast<H*>(data)->close(key))
+		SP_HPP_SLOT(dnshal_lookup, has_lookup, int, (const char* hostname, struct sockaddr* addr, void* data),
+			return static_cast<H*>(data)->lookup(hostname, addr))
+
+#undef SP_HPP_SLOT
+
+		// Tables with at least one slot implemented by H
+		template<typename H>
+		struct handles {
+			static constexpr bool debug = has_log<H>::value;
+			static constexpr bool connection = has_on_connection<H>::value || has_on_logged_in<H>::value || has_on_message<H>::value;
+			static constexpr bool playback = has_on_notify<H>::value || has_on_audio_data<H>::value || has_on_seek<H>::value
+				|| has_on_volume<H>::value || has_on_unavailable_track<H>::value;
+			static constexpr bool prefetch = has_on_prefetched<H>::value;
+			static constexpr bool storage = has_alloc<H>::value || has_write<H>::value || has_read<H>::value || has_close<H>::value;
+			static constexpr bool dnshal = has_lookup<H>::value;
+		};
+	}
+
+	/** @brief Debug table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_debug_callbacks_t debug_callbacks() {
+		return sp_debug_callbacks_t{ detail::debug_print<H>::get() };
+	}
+
+	/** @brief Connection table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_connection_callbacks_t connection_callbacks() {
+		return sp_connection_callbacks_t{ detail::connection_notify<H>::get(), detail::connection_logged_in<H>::get(),
+			detail::connection_message<H>::get() };
+	}
+
+	/** @brief Playback table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_playback_callbacks_t playback_callbacks() {
+		return sp_playback_callbacks_t{ detail::playback_notify<H>::get(), detail::playback_audio<H>::get(),
+			detail::playback_seek<H>::get(), detail::playback_volume<H>::get(), detail::playback_unavailable<H>::get(), nullptr };
+	}
+
+	/** @brief Prefetch table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_prefetch_callbacks_t prefetch_callbacks() {
+		return sp_prefetch_callbacks_t{ detail::prefetch_done<H>::get() };
+	}
+
+	/** @brief Storage table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_storage_callbacks_t storage_callbacks() {
+		return sp_storage_callbacks_t{ detail::storage_alloc<H>::get(), detail::storage_write<H>::get(),
+			detail::storage_read<H>::get(), detail::storage_close<H>::get(), nullptr };
+	}
+
+	/** @brief dnshal table for H, pass a H* as data */
+	template<typename H>
+	constexpr sp_dnshal_callbacks_t dnshal_callbacks() {
+		return sp_dnshal_callbacks_t{ detail::dnshal_lookup<H>::get() };
+	}
+
+	/**
+	 * @brief Owns the library between ::SpInit and ::SpFree.
+	 *
+	 * The library is a process wide singleton, so only one session can be valid at a time.
+	 * Move-only, a moved-from session is invalid and doesn't call ::SpFree.
+	 */
+	class session {
+	public:
+		/** @brief An invalid session */
+		session() noexcept : m_error(E_UNINITIALIZED), m_owner(false) {}
+
+		/**
+		 * @brief Initialize the library, check valid()/error() for the result.
+		 *
+		 * If config.wmem is null the session allocates config.wmem_size bytes and keeps
+		 * them until ::SpFree was called.
+		 */
+		explicit session(sp_init_config_t config) : m_owner(false) {
+			if(!config.wmem && config.wmem_size > 0) {
+				m_wmem.reset(new char[config.wmem_size]);
+				config.wmem = m_wmem.get();
+			}
+			m_error = SpInit(&config);
+			m_owner = m_error == E_OK;
+			if(!m_owner) m_wmem.reset();
+		}
+
+		~session() { reset(); }
+
+		session(session&& other) noexcept
+			: m_error(other.m_error), m_owner(other.m_owner), m_wmem(std::move(other.m_wmem))
+		{
+			other.m_owner = false;
+			other.m_error = E_UNINITIALIZED;
+		}
+
+		session& operator=(session&& other) noexcept {
+			if(this != &other) {
+				reset();
+				m_error = other.m_error;
+				m_owner = other.m_owner;
+				m_wmem = std::move(other.m_wmem);
+				other.m_owner = false;
+				other.m_error = E_UNINITIALIZED;
+			}
+			return *this;
+		}
+
+		session(const session&) = delete;
+		session& operator=(const session&) = delete;
+
+		/** @brief True if this session initialized the library */
+		bool valid() const { return m_owner; }
+		explicit operator bool() const { return m_owner; }
+		/** @brief Result of ::SpInit, E_UNINITIALIZED after reset() or a move */
+		sp_error_t error() const { return m_error; }
+
+		/** @brief Call ::SpFree now, returns its result (E_OK if there was nothing to free) */
+		sp_error_t reset() {
+			sp_error_t res = E_OK;
+			if(m_owner) res = SpFree();
+			m_owner = false;
+			m_error = E_UNINITIALIZED;
+			m_wmem.reset();
+			return res;
+		}
+
+		sp_error_t pump() { return SpPumpEvents(); }
+
+		/**
+		 * @brief Register every table the handler implements at least one slot of.
+		 * @return First error of a registration, E_OK if all succeeded
+		 */
+		template<typename H>
+		sp_error_t attach(H& handler) {
+			typedef detail::handles<H> has;
+			sp_error_t res = E_OK;
+			update(res, attach_debug(handler, has::debug));
+			update(res, attach_connection(handler, has::connection));
+			update(res, attach_playback(handler, has::playback));
+			update(res, attach_prefetch(handler, has::prefetch));
+			update(res, attach_storage(handler, has::storage));
+			update(res, attach_dnshal(handler, has::dnshal));
+			return res;
+		}
+
+		// Single tables, the table is a static constant per handler type
+		template<typename H>
+		sp_error_t attach_debug(H& handler, bool enable = true) {
+			static constexpr sp_debug_callbacks_t cbs = debug_callbacks<H>();
+			return enable ? SpRegisterDebugCallbacks(&cbs, &handler) : E_OK;
+		}
+		template<typename H>
+		sp_error_t attach_connection(H& handler, bool enable = true) {
+			static constexpr sp_connection_callbacks_t cbs = connection_callbacks<H>();
+			return enable ? SpRegisterConnectionCallbacks(&cbs, &handler) : E_OK;
+		}
+		template<typename H>
+		sp_error_t attach_playback(H& handler, bool enable = true) {
+			static constexpr sp_playback_callbacks_t cbs = playback_callbacks<H>();
+			return enable ? SpRegisterPlaybackCallbacks(&cbs, &handler) : E_OK;
+		}
+		template<typename H>
+		sp_error_t attach_prefetch(H& handler, bool enable = true) {
+			static constexpr sp_prefetch_callbacks_t cbs = prefetch_callbacks<H>();
+			return enable ? SpRegisterPrefetchCallbacks(&cbs, &handler) : E_OK;
+		}
+		template<typename H>
+		sp_error_t attach_storage(H& handler, bool enable = true) {
+			static constexpr sp_storage_callbacks_t cbs = storage_callbacks<H>();
+			return enable ? SpRegisterStorageCallbacks(&cbs, &handler) : E_OK;
+		}
+		template<typename H>
+		sp_error_t attach_dnshal(H& handler, bool enable = true) {
+			static constexpr sp_dnshal_callbacks_t cbs = dnshal_callbacks<H>();
+			return enable ? SpRegisterDnsHALCallbacks(&cbs, &handler) : E_OK;
+		}
+
+	private:
+		static void update(sp_error_t& res, sp_error_t e) {
+			if(res == E_OK) res = e;
+		}
+
+		sp_error_t m_error;
+		bool m_owner;
+		std::unique_ptr<char[]> m_wmem;
+	};
+}
@@ -0,0 +1,498 @@
+#pragma once
+
+/**
+ * @file spotify_coro.hpp
+ * @brief C++20 coroutines over the pump loop: awaitable login, play, seek, prefetch and events.
+ *
+ * coro_session turns the callbacks completing a command into resumptions of the coroutine
+ * that issued it:
+ * @code
+ * sp::task<> workflow(sp::coro_session& s) {
+ *     if(!co_await s.login(user, password)) co_return;
+ *     co_await s.play_uri("spotify:user:x:playlist:y", 0, 0).timeout(std::chrono::seconds(10));
+ *     co_await s.next_event(PN_TRACKCHANGED);
+ *     co_await s.seek(60000);
+ * }
+ * s.spawn(workflow(s));
+ * s.run(driver);
+ * @endcode
+ *
+ * Coroutines are never resumed from inside a library callback. The callbacks only mark
+ * operations as complete, poll() resumes them after ::SpPumpEvents returned, so a resumed
+ * coroutine can call into the library right away. Timeouts and cancellation
+ * (std::stop_token) are checked by poll() as well; after request_stop() from another thread
+ * call pump_driver::wake() to get it noticed before the next pump.
+ *
+ * Completion events:
+ * - login, login_blob: onNotifyLoggedIn, fails on E_LOGIN_* / E_NEEDS_PREMIUM / ... (on_error)
+ * - play_uri: first audio frames, if audio was flowing only after PN_AUDIOFLUSH, PN_TRACKCHANGED
+ *   or onSeek (like latency_probe), fails on E_PLAYBACK_* errors
+ * - seek: onSeek
+ * - prefetch: the prefetch callback for the uri, fails on E_PLAYBACK_PREFETCH_* errors; a
+ *   cancelled or timed out prefetch is stopped with ::SpStopPrefetchingItem
+ * - next_event: the next playback notification or connection state
+ *
+ * Cancelling login, play and seek only stops waiting, the command itself can't be taken back.
+ *
+ * Feed the events from the registered handlers (on_connection, on_logged_in, on_notify,
+ * on_seek, on_prefetched and on_error have the names spotify.hpp looks for, so the
+ * connection and prefetch tables can be built from a coro_session directly) and on_frames()
+ * from onAudioData. Everything runs on the pump thread. The library is a singleton, so
+ * this drives the workflows of one zone; one zone per process, see zone_supervisor.
+ *
+ * Requires C++20 (-std=c++20), the rest of the repository stays C++14.
+ */
+
+#if !defined(__cpp_impl_coroutine)
+#error "spotify_coro.hpp requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spotify.h"
+#include "pump_driver.h"
+
+namespace sp {
+
+	template<typename T = void>
+	class task;
+
+	namespace detail {
+
+		struct task_promise_base {
+			std::coroutine_handle<> continuation;
+
+			struct final_awaiter {
+				bool await_ready() const noexcept { return false; }
+				template<typename P>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+					std::coroutine_handle<> c = h.promise().continuation;
+					return c ? c : std::noop_coroutine();
+				}
+				void await_resume() const noexcept {}
+			};
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			final_awaiter final_suspend() const noexcept { return {}; }
+			// Like the rest of the repository this code does not use exceptions
+			void unhandled_exception() const noexcept { std::terminate(); }
+		};
+
+		template<typename T>
+		struct task_promise : task_promise_base {
+			std::optional<T> value;
+
+			task<T> get_return_object() noexcept;
+			template<typename U>
+			void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+		};
+
+		template<>
+		struct task_promise<void> : task_promise_base {
+			task<void> get_return_object() noexcept;
+			void return_void() const noexcept {}
+		};
+	}
+
+	/**
+	 * @brief Lazily started coroutine, runs when awaited or passed to coro_session::spawn().
+	 */
+	template<typename T>
+	class task {
+	public:
+		typedef detail::task_promise<T> promise_type;
+		typedef std::coroutine_handle<promise_type> handle_type;
+
+		task() noexcept : m_handle() {}
+		explicit task(handle_type h) noexcept : m_handle(h) {}
+		task(task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+		task& operator=(task&& other) noexcept {
+			if(this != &other) {
+				if(m_handle) m_handle.destroy();
+				m_handle = std::exchange(other.m_handle, nullptr);
+			}
+			return *this;
+		}
+		~task() {
+			if(m_handle) m_handle.destroy();
+		}
+
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+
+		bool valid() const noexcept { return (bool)m_handle; }
+		bool done() const noexcept { return !m_handle || m_handle.done(); }
+		handle_type handle() const noexcept { return m_handle; }
+
+		auto operator co_await() && noexcept {
+			struct awaiter {
+				handle_type h;
+				bool await_ready() const noexcept { return !h || h.done(); }
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+					h.promise().continuation = c;
+					return h;
+				}
+				T await_resume() {
+					if constexpr(!std::is_void<T>::value) return std::move(*h.promise().value);
+				}
+			};
+			return awaiter{m_handle};
+		}
+
+	private:
+		handle_type m_handle;
+	};
+
+	namespace detail {
+		template<typename T>
+		inline task<T> task_promise<T>::get_return_object() noexcept {
+			return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+		}
+
+		inline task<void> task_promise<void>::get_return_object() noexcept {
+			return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+		}
+	}
+
+	enum wait_result {
+		/** The completing event arrived */
+		WR_OK,
+		/** The library rejected the command or reported an error, see op_result::error */
+		WR_ERROR,
+		/** The timeout expired first */
+		WR_TIMEOUT,
+		/** The stop token was triggered */
+		WR_CANCELLED
+	};
+
+	struct op_result {
+		wait_result status;
+		/** Error returned by the command or passed to on_error, E_OK otherwise */
+		sp_error_t error;
+
+		explicit operator bool() const noexcept { return status == WR_OK; }
+	};
+
+	class coro_session {
+	public:
+		typedef std::chrono::steady_clock clock;
+
+		struct options {
+			/** Default timeout of login, play_uri, seek and prefetch (next_event waits forever) */
+			std::chrono::milliseconds timeout{30000};
+		};
+
+		struct stats {
+			uint64_t started = 0;
+			uint64_t completed = 0;
+			uint64_t failed = 0;
+			uint64_t timeouts = 0;
+			uint64_t cancelled = 0;
+			/** Coroutine resumptions done by poll() */
+			uint64_t resumes = 0;
+		};
+
+		/**
+		 * @brief A pending command or event, returned by the coro_session methods and awaited once.
+		 *
+		 * The command is issued when the operation is awaited, so timeout() and cancel_on()
+		 * can be chained first. Operations can be moved until they are awaited.
+		 */
+		class operation {
+		public:
+			/** @brief Give up after this long, std::chrono::milliseconds::max() waits forever */
+			operation timeout(std::chrono::milliseconds t) && {
+				m_timeout = t;
+				return std::move(*this);
+			}
+			operation cancel_on(std::stop_token token) && {
+				m_stop = std::move(token);
+				return std::move(*this);
+			}
+
+			bool await_ready() const noexcept { return false; }
+			bool await_suspend(std::coroutine_handle<> h) { return m_session.start(*this, h); }
+			op_result await_resume() const noexcept { return m_result; }
+
+			/** @brief Only before it is awaited */
+			operation(operation&& other)
+				: m_session(other.m_session), m_kind(other.m_kind), m_event(other.m_event), m_uri(other.m_uri),
+				m_timeout(other.m_timeout), m_stop(std::move(other.m_stop)), m_command(std::move(other.m_command)),
+				m_gated(false), m_queued(false), m_result(other.m_result)
+			{}
+			~operation() { m_session.forget(*this); }
+			operation(const operation&) = delete;
+			operation& operator=(const operation&) = delete;
+
+		private:
+			friend class coro_session;
+
+			enum kind {
+				OP_LOGIN,
+				OP_PLAY,
+				OP_SEEK,
+				OP_PREFETCH,
+				OP_NOTIFY,
+				OP_STATE,
+				OP_SLEEP
+			};
+
+			operation(coro_session& s, kind k, int event, std::string uri, std::chrono::milliseconds timeout,
+				std::function<sp_error_t()> command)
+				: m_session(s), m_kind(k), m_event(event), m_uri(std::move(uri)), m_timeout(timeout), m_command(std::move(command)),
+				m_gated(false), m_queued(false), m_result{WR_OK, E_OK}
+			{}
+
+			coro_session& m_session;
+			const kind m_kind;
+			const int m_event;
+			const std::string m_uri;
+			std::chrono::milliseconds m_timeout;
+			std::stop_token m_stop;
+			std::function<sp_error_t()> m_command;
+			std::coroutine_handle<> m_handle;
+			clock::time_point m_deadline;
+			/** play_uri: frames of the old position are still arriving */
+			bool m_gated;
+			/** Waiting or ready in one of the session queues */
+			bool m_queued;
+			op_result m_result;
+		};
+
+		coro_session() : coro_session(options()) {}
+		explicit coro_session(options opts) : m_opts(opts), m_audio_flowing(false) {}
+		~coro_session() {
+			// Destroying the tasks destroys their pending operations, which unlink themselves
+			m_tasks.clear();
+		}
+
+		coro_session(const coro_session&) = delete;
+		coro_session& operator=(const coro_session&) = delete;
+
+		operation login(std::string user, std::string password) {
+			return operation(*this, operation::OP_LOGIN, 0, std::string(), m_opts.timeout, [user, password]() {
+				return SpConnectionLoginPassword(user.c_str(), password.c_str());
+			});
+		}
+		operation login_blob(std::string user, std::string blob) {
+			return operation(*this, operation::OP_LOGIN, 0, std::string(), m_opts.timeout, [user, blob]() {
+				return SpConnectionLoginBlob(user.c_str(), blob.c_str());
+			});
+		}
+		operation play_uri(std::string uri, int index, int position) {
+			return operation(*this, operation::OP_PLAY, 0, std::string(), m_opts.timeout, [uri, index, position]() {
+				return SpPlayUri(uri.c_str(), index, position);
+			});
+		}
+		operation seek(unsigned int position) {
+			return operation(*this, operation::OP_SEEK, 0, std::string(), m_opts.timeout, [position]() {
+				return SpPlaybackSeek(position);
+			});
+		}
+		operation prefetch(std::string uri) {
+			return operation(*this, operation::OP_PREFETCH, 0, uri, m_opts.timeout, [uri]() {
+				return SpPrefetchItem(uri.c_str(), 0);
+			});
+		}
+		/** @brief Wait for the next playback notification n */
+		operation next_event(sp_playbacknotify_t n) {
+			return operation(*this, operation::OP_NOTIFY, n, std::string(), std::chrono::milliseconds::max(), nullptr);
+		}
+		/** @brief Wait for the next connection state change to state */
+		operation next_event(sp_con_state_t state) {
+			return operation(*this, operation::OP_STATE, state, std::string(), std::chrono::milliseconds::max(), nullptr);
+		}
+		/** @brief Resume after this long, always WR_OK unless cancelled */
+		operation sleep_for(std::chrono::milliseconds duration) {
+			return operation(*this, operation::OP_SLEEP, 0, std::string(), duration, nullptr);
+		}
+
+		/** @brief Start a workflow, it runs until its first suspension before this returns */
+		void spawn(task<> t) {
+			if(!t.valid()) return;
+			std::coroutine_handle<> h = t.handle();
+			m_tasks.push_back(std::move(t));
+			h.resume();
+		}
+		/** @brief Spawned workflows that have not finished yet */
+		size_t active() const noexcept {
+			return (size_t)std::count_if(m_tasks.begin(), m_tasks.end(), [](const task<>& t) { return !t.done(); });
+		}
+
+		// Events, call from the registered callbacks (pump thread)
+		void on_connection(sp_con_state_t state) {
+			complete([state](const operation& op) { return op.m_kind == operation::OP_STATE && op.m_event == state; }, WR_OK, E_OK);
+		}
+		void on_logged_in(const char*, const char*) {
+			complete([](const operation& op) { return op.m_kind == operation::OP_LOGIN; }, WR_OK, E_OK);
+		}
+		void on_notify(sp_playbacknotify_t n) {
+			if(n == PN_AUDIOFLUSH || n == PN_TRACKCHANGED) open_gates();
+			if(n == PN_PAUSE || n == PN_AUDIODELIVERYDONE) m_audio_flowing = false;
+			complete([n](const operation& op) { return op.m_kind == operation::OP_NOTIFY && op.m_event == n; }, WR_OK, E_OK);
+		}
+		void on_seek(uint64_t) {
+			open_gates();
+			complete([](const operation& op) { return op.m_kind == operation::OP_SEEK; }, WR_OK, E_OK);
+		}
+		void on_prefetched(const char* uri) {
+			const std::string u = uri ? uri : "";
+			complete([&u](const operation& op) { return op.m_kind == operation::OP_PREFETCH && op.m_uri == u; }, WR_OK, E_OK);
+		}
+		/** @brief Call from onAudioData with the number of frames accepted */
+		void on_frames(unsigned long nframes) {
+			if(nframes == 0) return;
+			m_audio_flowing = true;
+			complete([](const operation& op) { return op.m_kind == operation::OP_PLAY && !op.m_gated; }, WR_OK, E_OK);
+		}
+		/**
+		 * @brief Feed async errors (sp_init_config_t::on_error).
+		 * @return true if the error failed a pending operation
+		 */
+		bool on_error(sp_error_t e) {
+			operation::kind k;
+			if(e >= E_LOGIN_BAD_CREDENTIALS && e <= E_GENERAL_LOGIN_ERROR) k = operation::OP_LOGIN;
+			else if(e == E_PLAYBACK_PREFETCH_UNAVAILABLE || e == E_PLAYBACK_ALREADY_PREFETCHING
+				|| e == E_PLAYBACK_PREFETCH_DOWNLOAD_FAILED) k = operation::OP_PREFETCH;
+			else if(e >= E_PLAYBACK_ERROR_START) k = operation::OP_PLAY;
+			else return false;
+			return complete([k](const operation& op) { return op.m_kind == k; }, WR_ERROR, e) != 0;
+		}
+
+		/**
+		 * @brief Expire timeouts, handle cancellation, resume completed coroutines and drop
+		 * finished workflows. Call after every ::SpPumpEvents.
+		 */
+		void poll() {
+			const clock::time_point now = clock::now();
+			for(size_t i = 0; i < m_waiting.size();) {
+				operation* op = m_waiting[i];
+				if(op->m_stop.stop_requested()) {
+					finish(i, WR_CANCELLED, E_OK);
+				} else if(now >= op->m_deadline) {
+					finish(i, op->m_kind == operation::OP_SLEEP ? WR_OK : WR_TIMEOUT, E_OK);
+				} else i++;
+			}
+			// Resumed coroutines can destroy other operations, which then leave the queue
+			while(!m_ready.empty()) {
+				operation* op = m_ready.front();
+				m_ready.pop_front();
+				op->m_queued = false;
+				m_stats.resumes++;
+				op->m_handle.resume();
+			}
+			m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(), [](const task<>& t) { return t.done(); }), m_tasks.end());
+		}
+
+		/** @brief Milliseconds until the next deadline, -1 if there is none */
+		int next_timeout() const {
+			if(!m_ready.empty()) return 0;
+			clock::time_point next = clock::time_point::max();
+			for(const operation* op : m_waiting) next = std::min(next, op->m_deadline);
+			if(next == clock::time_point::max()) return -1;
+			const auto left = std::chrono::ceil<std::chrono::milliseconds>(next - clock::now()).count();
+			return left <= 0 ? 0 : (int)std::min<int64_t>(left, INT32_MAX);
+		}
+
+		/** @brief Pump and poll until every spawned workflow finished */
+		void run(pump_driver& driver) {
+			while(true) {
+				driver.pump();
+				poll();
+				if(m_tasks.empty()) break;
+				const int ms = next_timeout();
+				if(ms >= 0) driver.hint(ms);
+				driver.wait();
+			}
+		}
+
+		const stats& get_stats() const noexcept { return m_stats; }
+
+	private:
+		bool start(operation& op, std::coroutine_handle<> h) {
+			op.m_handle = h;
+			if(op.m_stop.stop_requested()) {
+				op.m_result = op_result{WR_CANCELLED, E_OK};
+				m_stats.cancelled++;
+				return false;
+			}
+			op.m_deadline = op.m_timeout == std::chrono::milliseconds::max()
+				? clock::time_point::max() : clock::now() + op.m_timeout;
+			op.m_gated = op.m_kind == operation::OP_PLAY && m_audio_flowing;
+			// Queue before issuing the command, in case the library calls back synchronously
+			m_waiting.push_back(&op);
+			op.m_queued = true;
+			m_stats.started++;
+			if(op.m_command) {
+				const sp_error_t res = op.m_command();
+				if(res != E_OK && op.m_queued) {
+					unlink(op);
+					op.m_result = op_result{WR_ERROR, res};
+					m_stats.failed++;
+					return false;
+				}
+			}
+			return true;
+		}
+
+		template<typename F>
+		size_t complete(F match, wait_result status, sp_error_t error) {
+			size_t n = 0;
+			for(size_t i = 0; i < m_waiting.size();) {
+				if(match(*m_waiting[i])) {
+					finish(i, status, error);
+					n++;
+				} else i++;
+			}
+			return n;
+		}
+
+		/** Move waiting operation i to the ready queue */
+		void finish(size_t i, wait_result status, sp_error_t error) {
+			operation* op = m_waiting[i];
+			m_waiting.erase(m_waiting.begin() + i);
+			op->m_result = op_result{status, error};
+			switch(status) {
+				case WR_OK: m_stats.completed++; break;
+				case WR_ERROR: m_stats.failed++; break;
+				case WR_TIMEOUT: m_stats.timeouts++; break;
+				case WR_CANCELLED: m_stats.cancelled++; break;
+			}
+			if(op->m_kind == operation::OP_PREFETCH && (status == WR_TIMEOUT || status == WR_CANCELLED))
+				SpStopPrefetchingItem();
+			m_ready.push_back(op);
+		}
+
+		void open_gates() {
+			for(operation* op : m_waiting) op->m_gated = false;
+		}
+
+		void unlink(operation& op) {
+			m_waiting.erase(std::remove(m_waiting.begin(), m_waiting.end(), &op), m_waiting.end());
+			m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), &op), m_ready.end());
+			op.m_queued = false;
+		}
+
+		void forget(operation& op) {
+			if(op.m_queued) unlink(op);
+		}
+
+		const options m_opts;
+		bool m_audio_flowing;
+		std::vector<operation*> m_waiting;
+		std::deque<operation*> m_ready;
+		std::vector<task<>> m_tasks;
+		stats m_stats;
+	};
+}
@@ -0,0 +1,1022 @@
+/**
+ * @file spotify_offline.cpp
+ * @brief Offline stand-in for libspotify_embedded_shared.so.
+ *
+ * Exports every function declared in spotify.h and drives the registered callbacks
+ * from ::SpPumpEvents the way the real library does, without an account or network:
+ *
+ * - Login (password, blob or token) goes through CS_CONNECTING, a dnshal lookup of the
+ *   access point and CS_LOGGEDIN/onNotifyLoggedIn after a short delay. An empty password
+ *   fails with E_LOGIN_BAD_CREDENTIALS. Connectivity changes disconnect and reconnect.
+ * - ::SpPlayUri creates a synthetic playlist of 20 tracks for any context uri and plays it
+ *   with the usual PN_* sequences. Audio is a sine tone per track, 44.1kHz stereo,
+ *   delivered at the real frame cadence with up to 500ms read ahead. A consumer that
+ *   takes fewer frames gets the rest again later.
+ * - Tracks are "downloaded" at 8x real time into the storage HAL: alloc, a cache file
+ *   header matching the documented layout, 4116 byte chunks and single byte bitmap
+ *   updates. Cached tracks are read back (and verified) instead and start faster.
+ * - ::SpPrefetchItem downloads a track of the current playlist and reports it through the
+ *   prefetch callback.
+ * - The sockethal on_pump hook (fn17) gets the milliseconds until the next event, no
+ *   sockets are created.
+ *
+ * Timing can be changed with SP_OFFLINE_TRACK_MS (track length, default 30000).
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "spotify.h"
+
+namespace {
+
+	typedef std::chrono::steady_clock clock;
+
+	const int sample_rate = 44100;
+	const int nchannels = 2;
+	const unsigned playlist_size = 20;
+	const uint32_t bitrate = 160;
+	// Read ahead of the playback position
+	const unsigned ahead_ms = 500;
+	const unsigned max_block = 4096;
+	// Delays of the simulated backend
+	const unsigned login_ms = 350;
+	const unsigned blob_login_ms = 150;
+	const unsigned reconnect_ms = 200;
+	const unsigned start_cold_ms = 250;
+	const unsigned start_cached_ms = 40;
+	const unsigned download_speed = 8;
+
+	// Cache file layout, see the file format comment at the end of spotify.h
+	struct file_header {
+		uint32_t num1;
+		uint32_t datasize;
+		uint32_t chunksize;
+		uint32_t num2;
+		uint32_t num3;
+		uint32_t num4;
+		uint8_t blob1[36];
+		uint8_t blob2[52];
+		uint8_t bitmap[0x1400];
+	};
+	static_assert(sizeof(file_header) == 0x1470, "cache file header size mismatch");
+	const uint32_t chunk_size = 4116;
+
+	struct track {
+		std::string uri;
+		std::string title;
+		std::string artist;
+		std::string artist_uri;
+		std::string album;
+		std::string album_uri;
+		std::string image;
+		std::string file_id;
+		uint32_t duration;
+		double frequency;
+	};
+
+	struct cache_file {
+		uint32_t size = 0;
+		uint32_t nchunks = 0;
+		uint32_t written = 0;
+		bool complete = false;
+	};
+
+	struct download {
+		size_t track = 0;
+		bool prefetch = false;
+		bool active = false;
+		double progress = 0.0;
+	};
+
+	struct state {
+		bool initialized = false;
+		sp_init_config_t config;
+		std::string uniqueid;
+		std::string displayname;
+		std::string brand;
+		std::string model;
+
+		sp_debug_callbacks_t debug;
+		void* debug_data = nullptr;
+		sp_connection_callbacks_t connection;
+		void* connection_data = nullptr;
+		sp_playback_callbacks_t playback;
+		void* playback_data = nullptr;
+		sp_content_callbacks_t content;
+		void* content_data = nullptr;
+		sp_prefetch_callbacks_t prefetch;
+		void* prefetch_data = nullptr;
+		sp_storage_callbacks_t storage;
+		void* storage_data = nullptr;
+		sp_dnshal_callbacks_t dnshal;
+		void* dnshal_data = nullptr;
+		sp_sockethal_callbacks_t sockethal;
+		void* sockethal_data = nullptr;
+
+		// Scheduled events, equal times keep their order
+		std::multimap<clock::time_point, std::function<void()>> timers;
+		clock::time_point last_pump;
+
+		sp_connectivity_t connectivity = CON_WIRED;
+		bool logging_in = false;
+		bool logged_in = false;
+		std::string username;
+		std::string blob;
+
+		std::string context;
+		std::vector<track> tracks;
+		size_t current = 0;
+		bool active = false;
+		bool playing = false;
+		bool shuffle = false;
+		bool repeat = false;
+		unsigned volume = 0xffff;
+		unsigned volume_steps = 0xffff;
+		sp_bitrate_t quality = BR_NORMAL;
+		// Bumped on every track change/seek, stale timers check it
+		uint64_t generation = 0;
+		// Audio of the current track
+		bool audio_started = false;
+		uint32_t base_ms = 0;
+		clock::time_point run_start;
+		uint64_t frames_delivered = 0;
+		uint64_t frames_total = 0;
+		bool delivery_done = false;
+		double phase = 0.0;
+		// Next chunk read back from a cached file
+		uint32_t read_chunk = 0;
+
+		std::map<std::string, cache_file> files;
+		download dl;
+		download prefetch_dl;
+		std::set<std::string> reading;
+		uint64_t read_mismatches = 0;
+	};
+
+	state s;
+
+	void log(char level, const char* sub, const char* fmt, ...) {
+		if(!s.debug.print) return;
+		char line[512];
+		const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+		const long ms = now % 1000, secs = now / 1000;
+		int n = snprintf(line, sizeof(line), "%02ld:%02ld:%02ld.%03ld %c [%s] ", secs / 3600 % 24, secs / 60 % 60, secs % 60, ms, level, sub);
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(line + n, sizeof(line) - n, fmt, args);
+		va_end(args);
+		s.debug.print(line, s.debug_data);
+	}
+
+	void after(unsigned ms, std::function<void()> fn) {
+		s.timers.emplace(clock::now() + std::chrono::milliseconds(ms), std::move(fn));
+	}
+
+	// Run fn later unless the track changed in between
+	void after_same_track(unsigned ms, std::function<void()> fn) {
+		const uint64_t gen = s.generation;
+		after(ms, [gen, fn]() { if(s.generation == gen) fn(); });
+	}
+
+	void async_error(sp_error_t e) {
+		if(s.config.on_error) s.config.on_error(e, s.config.on_error_context);
+	}
+
+	void notify(sp_playbacknotify_t n) {
+		if(s.playback.onNotify) s.playback.onNotify(n, s.playback_data);
+	}
+
+	void con_notify(sp_con_state_t st) {
+		if(s.connection.onNotify) s.connection.onNotify(st, s.connection_data);
+	}
+
+	uint32_t hash(const std::string& str) {
+		uint32_t h = 2166136261u;
+		for(unsigned char c : str) h = (h ^ c) * 16777619u;
+		return h;
+	}
+
+	uint32_t track_ms() {
+		const char* env = getenv("SP_OFFLINE_TRACK_MS");
+		const long v = env ? atol(env) : 0;
+		return v > 1000 ? (uint32_t)v : 30000;
+	}
+
+	track make_track(const std::string& context, unsigned idx) {
+		char buf[128];
+		const uint32_t h = hash(context) ^ (idx * 2654435761u);
+		track t;
+		snprintf(buf, sizeof(buf), "spotify:track:offline%08x", h);
+		t.uri = buf;
+		snprintf(buf, sizeof(buf), "Offline Track %u", idx + 1);
+		t.title = buf;
+		snprintf(buf, sizeof(buf), "Offline Artist %u", idx % 4 + 1);
+		t.artist = buf;
+		snprintf(buf, sizeof(buf), "spotify:artist:offline%u", idx % 4 + 1);
+		t.artist_uri = buf;
+		snprintf(buf, sizeof(buf), "Offline Album %u", idx / 5 + 1);
+		t.album = buf;
+		snprintf(buf, sizeof(buf), "spotify:album:offline%u", idx / 5 + 1);
+		t.album_uri = buf;
+		snprintf(buf, sizeof(buf), "spotify:image:%08x%08x", hash(t.album_uri), h);
+		t.image = buf;
+		snprintf(buf, sizeof(buf), "%08x%08x%08x%08x%08x", h, hash(t.uri), h ^ 0x5a5a5a5a, hash(t.title), idx);
+		t.file_id = buf;
+		t.duration = track_ms();
+		// A semitone apart per track, repeating every octave, easy to tell apart by ear
+		t.frequency = 220.0 * std::pow(2.0, (idx % 12) / 12.0);
+		return t;
+	}
+
+	// Deterministic content of cache files, reads are checked against it
+	uint8_t file_byte(const std::string& key, uint32_t offset) {
+		uint32_t x = hash(key) ^ (offset * 2654435761u);
+		x ^= x >> 15;
+		x *= 0x2c1b3c6d;
+		x ^= x >> 12;
+		return (uint8_t)x;
+	}
+
+	// ---- storage -------------------------------------------------------------
+
+	uint32_t file_size(const track& t) {
+		const uint64_t data = (uint64_t)t.duration * bitrate / 8;
+		return sizeof(file_header) + (uint32_t)data;
+	}
+
+	void start_download(download& dl, size_t idx, bool prefetch) {
+		if(!s.storage.alloc || idx >= s.tracks.size()) return;
+		const track& t = s.tracks[idx];
+		cache_file& f = s.files[t.file_id];
+		if(f.complete) return;
+		if(!f.size) {
+			f.size = file_size(t);
+			f.nchunks = (f.size - sizeof(file_header) + chunk_size - 1) / chunk_size;
+			s.storage.alloc(t.file_id.c_str(), f.size, s.storage_data);
+			file_header hdr;
+			memset(&hdr, 0x00, sizeof(hdr));
+			hdr.num1 = 1;
+			hdr.datasize = f.size - sizeof(file_header);
+			hdr.chunksize = chunk_size;
+			s.storage.write(t.file_id.c_str(), 0, &hdr, sizeof(hdr), s.storage_data);
+		}
+		dl.track = idx;
+		dl.prefetch = prefetch;
+		dl.active = true;
+		dl.progress = f.written;
+		log('D', "storage", "download %s (%s)", t.file_id.c_str(), prefetch ? "prefetch" : "stream");
+	}
+
+	void finish_download(download& dl) {
+		const track& t = s.tracks[dl.track];
+		s.storage.close(t.file_id.c_str(), s.storage_data);
+		dl.active = false;
+		log('D', "storage", "cached %s", t.file_id.c_str());
+		if(dl.prefetch && s.prefetch.fn) s.prefetch.fn(t.uri.c_str(), 0, 0, s.prefetch_data);
+	}
+
+	void advance_download(download& dl, double secs) {
+		if(!dl.active || dl.track >= s.tracks.size()) return;
+		const track& t = s.tracks[dl.track];
+		cache_file& f = s.files[t.file_id];
+		dl.progress += secs * bitrate * 1000 / 8 * download_speed / chunk_size;
+		const uint32_t target = std::min<uint32_t>((uint32_t)dl.progress, f.nchunks);
+		std::vector<uint8_t> buf(chunk_size);
+		for(; f.written < target; f.written++) {
+			const uint32_t offset = sizeof(file_header) + f.written * chunk_size;
+			const uint32_t len = std::min<uint32_t>(chunk_size, f.size - offset);
+			for(uint32_t i = 0; i < len; i++) buf[i] = file_byte(t.file_id, offset + i);
+			s.storage.write(t.file_id.c_str(), offset, buf.data(), len, s.storage_data);
+
+			// Bitmap byte covering this chunk
+			const uint32_t byte = f.written / 8;
+			uint8_t bits = 0;
+			for(uint32_t c = byte * 8; c <= f.written; c++) bits |= 1 << (c % 8);
+			s.storage.write(t.file_id.c_str(), offsetof(file_header, bitmap) + byte, &bits, 1, s.storage_data);
+		}
+		if(f.written >= f.nchunks) {
+			f.complete = true;
+			finish_download(dl);
+		}
+	}
+
+	// Cached tracks are read back at the playback rate
+	void read_cached(uint64_t position_ms) {
+		if(!s.storage.read || s.current >= s.tracks.size()) return;
+		const track& t = s.tracks[s.current];
+		auto it = s.files.find(t.file_id);
+		if(it == s.files.end() || !it->second.complete || !s.reading.count(t.file_id)) return;
+		const cache_file& f = it->second;
+		const uint64_t bytes = position_ms * bitrate / 8 + (uint64_t)ahead_ms * bitrate / 8 * 4;
+		const uint32_t target = std::min<uint32_t>(bytes / chunk_size + 1, f.nchunks);
+		std::vector<uint8_t> buf(chunk_size);
+		for(; s.read_chunk < target; s.read_chunk++) {
+			const uint32_t offset = sizeof(file_header) + s.read_chunk * chunk_size;
+			const uint32_t len = std::min<uint32_t>(chunk_size, f.size - offset);
+			const long res = s.storage.read(t.file_id.c_str(), offset, buf.data(), len, s.storage_data);
+			bool ok = res == (long)len;
+			for(uint32_t i = 0; ok && i < len; i++) ok = buf[i] == file_byte(t.file_id, offset + i);
+			if(!ok && !s.read_mismatches++) log('W', "storage", "read of %s at %u returned wrong data", t.file_id.c_str(), offset);
+		}
+	}
+
+	void open_cached(const track& t) {
+		if(!s.storage.read) return;
+		file_header hdr;
+		s.storage.read(t.file_id.c_str(), 0, &hdr, sizeof(hdr), s.storage_data);
+		s.reading.insert(t.file_id);
+		s.read_chunk = 0;
+	}
+
+	void close_reads() {
+		if(s.storage.close)
+			for(auto& key : s.reading) s.storage.close(key.c_str(), s.storage_data);
+		s.reading.clear();
+	}
+
+	// ---- playback ------------------------------------------------------------
+
+	uint32_t position_ms() {
+		if(!s.audio_started) return s.base_ms;
+		uint64_t pos = s.base_ms;
+		if(s.playing) pos += std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - s.run_start).count();
+		// Never ahead of what the consumer accepted
+		const uint64_t delivered = s.base_ms + s.frames_delivered * 1000 / sample_rate;
+		return (uint32_t)std::min(pos, delivered);
+	}
+
+	// Frames from base_ms to the end of the current track, rounded up so the position reaches the duration
+	uint64_t frames_to_end() {
+		return ((uint64_t)(s.tracks[s.current].duration - s.base_ms) * sample_rate + 999) / 1000;
+	}
+
+	void begin_audio() {
+		s.audio_started = true;
+		s.run_start = clock::now();
+		log('I', "player", "audio started for %s at %ums", s.tracks[s.current].uri.c_str(), s.base_ms);
+	}
+
+	void start_track(size_t idx, uint32_t pos_ms, bool announce) {
+		close_reads();
+		s.generation++;
+		s.current = idx;
+		const track& t = s.tracks[idx];
+		s.base_ms = std::min(pos_ms, t.duration);
+		s.frames_total = frames_to_end();
+		s.frames_delivered = 0;
+		s.delivery_done = false;
+		s.audio_started = false;
+		s.phase = 0.0;
+		if(announce) {
+			notify(PN_TRACKCHANGED);
+			notify(PN_METADATACHANGED);
+		}
+
+		auto it = s.files.find(t.file_id);
+		const bool cached = it != s.files.end() && it->second.complete;
+		if(s.dl.active && s.dl.track != idx) {
+			// Skipped away from a track still downloading
+			s.storage.close(s.tracks[s.dl.track].file_id.c_str(), s.storage_data);
+			s.dl.active = false;
+		}
+		if(cached) open_cached(t);
+		else if(!s.dl.active) {
+			if(s.prefetch_dl.active && s.prefetch_dl.track == idx) {
+				// The running prefetch becomes the stream
+				s.dl = s.prefetch_dl;
+				s.dl.prefetch = false;
+				s.prefetch_dl.active = false;
+			} else start_download(s.dl, idx, false);
+		}
+		if(s.playing) after_same_track(cached ? start_cached_ms : start_cold_ms, begin_audio);
+	}
+
+	void next_track(bool user) {
+		if(s.tracks.empty()) return;
+		size_t next;
+		if(s.shuffle) next = (s.current + 7) % s.tracks.size();
+		else next = s.current + 1;
+		if(next >= s.tracks.size()) {
+			if(!s.repeat && !user) {
+				s.playing = false;
+				notify(PN_PAUSE);
+				start_track(0, 0, true);
+				return;
+			}
+			next = 0;
+		}
+		start_track(next, 0, true);
+	}
+
+	void deliver_audio() {
+		if(!s.playing || !s.audio_started || s.current >= s.tracks.size()) return;
+		const uint64_t wall = s.base_ms + std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - s.run_start).count();
+		const uint64_t delivered_ms = s.base_ms + s.frames_delivered * 1000 / sample_rate;
+		// The consumer fell behind, the playback clock waits for it
+		if(wall > delivered_ms + ahead_ms) s.run_start += std::chrono::milliseconds(wall - delivered_ms - ahead_ms);
+
+		const uint64_t pos = position_ms();
+		read_cached(pos - s.base_ms);
+		const uint64_t target = std::min<uint64_t>(s.frames_total, (pos - s.base_ms + ahead_ms) * sample_rate / 1000);
+		if(s.playback.onAudioData) {
+			static short block[max_block * nchannels];
+			const double step = 2.0 * M_PI * s.tracks[s.current].frequency / sample_rate;
+			const sp_sampleformat_t fmt = { nchannels, sample_rate };
+			while(s.frames_delivered < target) {
+				const unsigned n = (unsigned)std::min<uint64_t>(max_block, target - s.frames_delivered);
+				double phase = s.phase;
+				for(unsigned i = 0; i < n; i++) {
+					const short v = (short)(std::sin(phase) * 8000.0);
+					block[i * 2] = v;
+					block[i * 2 + 1] = v;
+					phase += step;
+				}
+				const unsigned long accepted = s.playback.onAudioData(block, n, &fmt, 0, s.playback_data);
+				if(s.current >= s.tracks.size() || !s.audio_started) return;
+				const unsigned long taken = std::min<unsigned long>(accepted, n);
+				s.phase = std::fmod(s.phase + step * taken, 2.0 * M_PI);
+				s.frames_delivered += taken;
+				if(taken < n) break;
+			}
+		} else s.frames_delivered = target;
+
+		if(s.frames_delivered >= s.frames_total && !s.delivery_done) {
+			s.delivery_done = true;
+			notify(PN_TRACKDELIVERED);
+		}
+		if(position_ms() >= s.tracks[s.current].duration) next_track(false);
+	}
+
+	// ---- connection ----------------------------------------------------------
+
+	void resolve_ap() {
+		if(!s.dnshal.lookup) return;
+		struct sockaddr_in addr;
+		memset(&addr, 0x00, sizeof(addr));
+		const int res = s.dnshal.lookup("ap.spotify.com", (struct sockaddr*)&addr, s.dnshal_data);
+		log(res == 0 ? 'D' : 'W', "ap", "resolved ap.spotify.com: %d", res);
+	}
+
+	void logged_in() {
+		s.logging_in = false;
+		s.logged_in = true;
+		s.blob = "offline-blob-" + s.username;
+		log('I', "ap", "logged in as %s", s.username.c_str());
+		con_notify(CS_LOGGEDIN);
+		if(s.connection.onNotifyLoggedIn) s.connection.onNotifyLoggedIn(s.blob.c_str(), s.username.c_str(), s.connection_data);
+	}
+
+	sp_error_t login(const std::string& user, bool bad, unsigned delay) {
+		if(!s.initialized) return E_UNINITIALIZED;
+		s.username = user;
+		s.logging_in = true;
+		after(0, []() {
+			con_notify(CS_CONNECTING);
+			resolve_ap();
+		});
+		after(delay, [bad]() {
+			if(!s.logging_in) return;
+			if(bad) {
+				s.logging_in = false;
+				log('E', "ap", "login failed: bad credentials");
+				async_error(E_LOGIN_BAD_CREDENTIALS);
+				con_notify(CS_LOGGEDOUT);
+				return;
+			}
+			if(s.connectivity == CON_OFFLINE) return;
+			logged_in();
+		});
+		return E_OK;
+	}
+
+	void copy_string(char* dst, size_t size, const std::string& src) {
+		strncpy(dst, src.c_str(), size - 1);
+		dst[size - 1] = '\0';
+	}
+
+	unsigned next_timeout_ms() {
+		// Audio is refilled at least every 20ms while playing
+		unsigned res = s.playing && s.audio_started ? 20 : 1000;
+		if(s.dl.active || s.prefetch_dl.active) res = std::min(res, 50u);
+		if(!s.timers.empty()) {
+			const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(s.timers.begin()->first - clock::now()).count();
+			res = std::min<unsigned>(res, wait > 0 ? (unsigned)wait : 0);
+		}
+		return res;
+	}
+}
+
+extern "C" {
+
+sp_error_t SpRegisterDebugCallbacks(const sp_debug_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	s.debug = *cbs;
+	s.debug_data = data;
+	return E_OK;
+}
+
+sp_error_t SpRegisterConnectionCallbacks(const sp_connection_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.connection = *cbs;
+	s.connection_data = data;
+	return E_OK;
+}
+
+sp_error_t SpRegisterPlaybackCallbacks(const sp_playback_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.playback = *cbs;
+	s.playback_data = data;
+	return E_OK;
+}
+
+const char* SpGetLibraryVersion(void) {
+	return "offline-v2.18.357";
+}
+
+const char* SpGetBrandName(void) {
+	return s.brand.c_str();
+}
+
+const char* SpGetModelName(void) {
+	return s.model.c_str();
+}
+
+uint64_t SpGetServerTime(void) {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+const char* SpGetCanonicalUsername(void) {
+	return s.logged_in ? s.username.c_str() : NULL;
+}
+
+sp_error_t SpGetProductType(char* buffer, int buflen) {
+	if(!buffer) return E_NULL_ARGUMENT;
+	if(buflen < 8) return E_INVALID_ARGUMENT;
+	copy_string(buffer, buflen, "premium");
+	return E_OK;
+}
+
+sp_error_t SpZeroConfGetVars(sp_zeroconfvars_t* vars) {
+	if(!vars) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	memset(vars, 0x00, sizeof(*vars));
+	char buf[65];
+	snprintf(buf, sizeof(buf), "%08x%08x%08x%08x%08x", hash(s.uniqueid), hash(s.uniqueid + "1"), hash(s.uniqueid + "2"), hash(s.uniqueid + "3"), hash(s.uniqueid + "4"));
+	copy_string(vars->token, sizeof(vars->token), "offline-token");
+	copy_string(vars->uniqueid_hash, sizeof(vars->uniqueid_hash), buf);
+	copy_string(vars->username, sizeof(vars->username), s.logged_in ? s.username : "");
+	copy_string(vars->displayname, sizeof(vars->displayname), s.displayname);
+	copy_string(vars->accounttype, sizeof(vars->accounttype), "PREMIUM");
+	copy_string(vars->devicetype, sizeof(vars->devicetype), "SPEAKER");
+	copy_string(vars->version, sizeof(vars->version), SpGetLibraryVersion());
+	vars->unknown = 1;
+	copy_string(vars->unknown2, sizeof(vars->unknown2), "NONE");
+	return E_OK;
+}
+
+sp_error_t SpPumpEvents(void) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	const auto now = clock::now();
+	const double secs = std::chrono::duration<double>(now - s.last_pump).count();
+	s.last_pump = now;
+
+	// Timers added by callbacks run on the next pump at the earliest
+	std::vector<std::function<void()>> due;
+	while(!s.timers.empty() && s.timers.begin()->first <= now) {
+		due.push_back(std::move(s.timers.begin()->second));
+		s.timers.erase(s.timers.begin());
+	}
+	for(auto& fn : due) fn();
+
+	if(s.logged_in) {
+		advance_download(s.dl, std::min(secs, 1.0));
+		advance_download(s.prefetch_dl, std::min(secs, 1.0));
+		deliver_audio();
+	}
+	if(s.sockethal.fn17) s.sockethal.fn17((int)next_timeout_ms(), s.sockethal_data);
+	return E_OK;
+}
+
+sp_error_t SpSetDisplayName(const char* dname) {
+	if(!dname) return E_NULL_ARGUMENT;
+	s.displayname = dname;
+	return E_OK;
+}
+
+sp_error_t SpConnectionSetConnectivity(sp_connectivity_t con) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	const bool was_offline = s.connectivity == CON_OFFLINE;
+	s.connectivity = con;
+	if(con == CON_OFFLINE && s.logged_in) {
+		s.logged_in = false;
+		s.logging_in = true;
+		after(0, []() { con_notify(CS_DISCONNECTED); });
+	} else if(con != CON_OFFLINE && was_offline && s.logging_in) {
+		after(0, []() {
+			con_notify(CS_RECONNECT);
+			resolve_ap();
+		});
+		after(reconnect_ms, []() {
+			if(s.logging_in && s.connectivity != CON_OFFLINE) logged_in();
+		});
+	}
+	return E_OK;
+}
+
+sp_connectivity_t SpConnectionGetConnectivity(void) {
+	return s.connectivity;
+}
+
+sp_error_t SpConnectionLoginPassword(const char* user, const void* pass) {
+	if(!user || !pass) return E_NULL_ARGUMENT;
+	return login(user, !*(const char*)pass, login_ms);
+}
+
+sp_error_t SpConnectionLoginBlob(const char* user, const void* blob) {
+	if(!user || !blob) return E_NULL_ARGUMENT;
+	return login(user, false, blob_login_ms);
+}
+
+sp_error_t SpConnectionLoginOauthToken(const char* token) {
+	if(!token) return E_NULL_ARGUMENT;
+	return login("offline", !*token, login_ms);
+}
+
+unsigned int SpConnectionIsLoggedIn(void) {
+	return s.logged_in;
+}
+
+sp_error_t SpConnectionLogout(void) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	if(!s.logged_in && !s.logging_in) return E_OK;
+	s.logged_in = s.logging_in = false;
+	s.playing = false;
+	after(0, []() {
+		if(s.active) {
+			s.active = false;
+			notify(PN_BECAMEINACTIVE);
+		}
+		con_notify(CS_LOGGEDOUT);
+	});
+	return E_OK;
+}
+
+sp_error_t SpGetMetadataValidRange(int* max, int* min) {
+	if(!max || !min) return E_NULL_ARGUMENT;
+	if(s.tracks.empty()) {
+		*max = *min = 0;
+		return E_FAILED;
+	}
+	*min = -(int)s.current;
+	*max = (int)(s.tracks.size() - 1 - s.current);
+	return E_OK;
+}
+
+sp_error_t SpSetDeviceIsGroup(int group) {
+	(void)group;
+	return s.initialized ? E_OK : E_UNINITIALIZED;
+}
+
+unsigned int SpPlaybackGetVolume(void) {
+	return s.volume;
+}
+
+unsigned int SpPlaybackGetPosition(void) {
+	return s.tracks.empty() ? 0 : position_ms();
+}
+
+sp_error_t SpPlaybackSetBitrate(sp_bitrate_t rate) {
+	s.quality = rate;
+	return s.initialized ? E_OK : E_UNINITIALIZED;
+}
+
+sp_error_t SpPlaybackUpdateVolume(unsigned int vol) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.volume = std::min(vol, 0xffffu);
+	after(0, []() {
+		if(s.playback.onApplyVolume) s.playback.onApplyVolume((unsigned short)s.volume, s.playback_data);
+	});
+	return E_OK;
+}
+
+sp_error_t SpPlayUri(const char* uri, int index, int posInMs) {
+	if(!uri) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	if(!s.logged_in) return E_NOT_ACTIVE_DEVICE;
+	if(strncmp(uri, "spotify:", 8) != 0) return E_INVALID_ARGUMENT;
+	const std::string context = uri;
+	const unsigned idx = index >= 0 ? (unsigned)index % playlist_size : 0;
+	const uint32_t pos = posInMs > 0 ? (uint32_t)posInMs : 0;
+	after(0, [context, idx, pos]() {
+		s.context = context;
+		s.tracks.clear();
+		for(unsigned i = 0; i < playlist_size; i++) s.tracks.push_back(make_track(context, i));
+		s.current = idx;
+		if(!s.active) {
+			s.active = true;
+			notify(PN_BECAMEACTIVE);
+		}
+		s.dl.active = s.prefetch_dl.active = false;
+		notify(PN_CONTEXTCHANGED);
+		s.playing = true;
+		start_track(idx, pos, true);
+		after_same_track(start_cold_ms, []() { notify(PN_PLAY); });
+	});
+	return E_OK;
+}
+
+sp_error_t SpInit(const sp_init_config_t* config) {
+	if(!config) return E_NULL_ARGUMENT;
+	if(s.initialized) return E_ALREADY_INITIALIZED;
+	if(config->version != SP_APIVERSION) return E_API_VERSION;
+	if(!config->wmem || config->wmem_size < 0x80000 || !config->app_key || !config->uniqueid || !config->displayname)
+		return E_INVALID_ARGUMENT;
+	const sp_debug_callbacks_t debug = s.debug;
+	void* debug_data = s.debug_data;
+	s = state();
+	s.debug = debug;
+	s.debug_data = debug_data;
+	s.config = *config;
+	s.uniqueid = config->uniqueid;
+	s.displayname = config->displayname;
+	s.brand = config->brand ? config->brand : "";
+	s.model = config->model ? config->model : "";
+	memset(&s.connection, 0x00, sizeof(s.connection));
+	memset(&s.playback, 0x00, sizeof(s.playback));
+	memset(&s.content, 0x00, sizeof(s.content));
+	memset(&s.prefetch, 0x00, sizeof(s.prefetch));
+	memset(&s.storage, 0x00, sizeof(s.storage));
+	memset(&s.dnshal, 0x00, sizeof(s.dnshal));
+	memset(&s.sockethal, 0x00, sizeof(s.sockethal));
+	s.last_pump = clock::now();
+	s.initialized = true;
+	log('I', "core", "offline stand-in %s initialized for %s", SpGetLibraryVersion(), s.displayname.c_str());
+	return E_OK;
+}
+
+sp_error_t SpFree(void) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	close_reads();
+	s.initialized = false;
+	s.timers.clear();
+	return E_OK;
+}
+
+sp_error_t SpGetMetadata(sp_metadata_t* m, int idx) {
+	if(!m) return E_NULL_ARGUMENT;
+	const long i = (long)s.current + idx;
+	if(s.tracks.empty() || i < 0 || i >= (long)s.tracks.size()) return E_FAILED;
+	const track& t = s.tracks[i];
+	memset(m, 0x00, sizeof(*m));
+	copy_string(m->playlist_title, sizeof(m->playlist_title), "Offline Playlist");
+	copy_string(m->playlist_uri, sizeof(m->playlist_uri), s.context);
+	copy_string(m->track_title, sizeof(m->track_title), t.title);
+	copy_string(m->track_uri, sizeof(m->track_uri), t.uri);
+	copy_string(m->artist_name, sizeof(m->artist_name), t.artist);
+	copy_string(m->artist_uri, sizeof(m->artist_uri), t.artist_uri);
+	copy_string(m->album_name, sizeof(m->album_name), t.album);
+	copy_string(m->album_uri, sizeof(m->album_uri), t.album_uri);
+	copy_string(m->image_uri, sizeof(m->image_uri), t.image);
+	m->duration = t.duration;
+	m->playlist_idx = m->arg3 = (uint32_t)i;
+	m->bitrate = bitrate;
+	return E_OK;
+}
+
+sp_error_t SpGetMetadataImageURL(const char* uri, char* buf, unsigned long long int buf_size) {
+	if(!uri || !buf) return E_NULL_ARGUMENT;
+	if(strncmp(uri, "spotify:image:", 14) != 0) return E_INVALID_ARGUMENT;
+	char url[128];
+	snprintf(url, sizeof(url), "https://i.scdn.co/image/%s", uri + 14);
+	if(strlen(url) >= buf_size) return E_INVALID_ARGUMENT;
+	strcpy(buf, url);
+	return E_OK;
+}
+
+sp_error_t SpRegisterContentCallbacks(const sp_content_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.content = *cbs;
+	s.content_data = data;
+	return E_OK;
+}
+
+sp_error_t SpSetVolumeSteps(unsigned int max) {
+	s.volume_steps = max;
+	return E_OK;
+}
+
+unsigned int SpPlaybackGetRepeatMode(void) {
+	return s.repeat;
+}
+
+unsigned int SpPlaybackIsActiveDevice(void) {
+	return s.active;
+}
+
+unsigned int SpPlaybackIsAdPlaying(void) {
+	return 0;
+}
+
+unsigned int SpPlaybackIsPlaying(void) {
+	return s.playing;
+}
+
+unsigned int SpPlaybackIsRepeated(void) {
+	return s.repeat;
+}
+
+unsigned int SpPlaybackIsShuffled(void) {
+	return s.shuffle;
+}
+
+sp_error_t SpPlaybackPause(void) {
+	if(!s.active) return E_NOT_ACTIVE_DEVICE;
+	if(!s.playing) return E_OK;
+	// Rebase on the position, the read-ahead already delivered stays delivered
+	const uint32_t pos = position_ms();
+	const uint64_t played = (uint64_t)(pos - s.base_ms) * sample_rate / 1000;
+	s.frames_delivered -= std::min(s.frames_delivered, played);
+	s.base_ms = pos;
+	if(s.current < s.tracks.size()) s.frames_total = frames_to_end();
+	s.playing = false;
+	after(0, []() { notify(PN_PAUSE); });
+	return E_OK;
+}
+
+sp_error_t SpPlaybackPlay(void) {
+	if(!s.active) return E_NOT_ACTIVE_DEVICE;
+	if(s.playing) return E_OK;
+	s.playing = true;
+	s.run_start = clock::now();
+	if(!s.audio_started) after_same_track(start_cached_ms, begin_audio);
+	after(0, []() { notify(PN_PLAY); });
+	return E_OK;
+}
+
+sp_error_t SpPlaybackSeek(unsigned int posInMs) {
+	if(!s.active || s.tracks.empty()) return E_NOT_ACTIVE_DEVICE;
+	after(0, [posInMs]() {
+		notify(PN_AUDIOFLUSH);
+		start_track(s.current, posInMs, false);
+		if(s.playback.onSeek) s.playback.onSeek(s.base_ms, s.playback_data);
+	});
+	return E_OK;
+}
+
+sp_error_t SpPlaybackSkipToNext(void) {
+	if(!s.active || s.tracks.empty()) return E_NOT_ACTIVE_DEVICE;
+	after(0, []() {
+		notify(PN_NEXT);
+		notify(PN_AUDIOFLUSH);
+		next_track(true);
+	});
+	return E_OK;
+}
+
+sp_error_t SpPlaybackSkipToPrev(void) {
+	if(!s.active || s.tracks.empty()) return E_NOT_ACTIVE_DEVICE;
+	after(0, []() {
+		notify(PN_PREV);
+		notify(PN_AUDIOFLUSH);
+		// Like most players: restart the track unless it just began
+		if(position_ms() > 3000 || s.current == 0) start_track(s.current, 0, true);
+		else start_track(s.current - 1, 0, true);
+	});
+	return E_OK;
+}
+
+sp_error_t SpQueueUri(const char* uri) {
+	if(!uri) return E_NULL_ARGUMENT;
+	if(!s.active || s.tracks.empty()) return E_NOT_ACTIVE_DEVICE;
+	track t = make_track(uri, (unsigned)s.tracks.size());
+	t.uri = uri;
+	const size_t pos = s.current + 1;
+	s.tracks.insert(s.tracks.begin() + pos, t);
+	// Running downloads refer to tracks by index, keep them on their track
+	if(s.dl.track >= pos) s.dl.track++;
+	if(s.prefetch_dl.track >= pos) s.prefetch_dl.track++;
+	after(0, []() { notify(PN_METADATACHANGED); });
+	return E_OK;
+}
+
+sp_error_t SpRegisterPrefetchCallbacks(const sp_prefetch_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.prefetch = *cbs;
+	s.prefetch_data = data;
+	return E_OK;
+}
+
+sp_error_t SpRegisterStorageCallbacks(const sp_storage_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.storage = *cbs;
+	s.storage_data = data;
+	return E_OK;
+}
+
+sp_error_t SpPrefetchItem(const char* uri, unsigned int arg) {
+	(void)arg;
+	if(!uri) return E_NULL_ARGUMENT;
+	if(!s.logged_in) return E_NOT_ACTIVE_DEVICE;
+	if(s.prefetch_dl.active) return E_PLAYBACK_ALREADY_PREFETCHING;
+	for(size_t i = 0; i < s.tracks.size(); i++) {
+		if(s.tracks[i].uri != uri) continue;
+		auto it = s.files.find(s.tracks[i].file_id);
+		if(it != s.files.end() && it->second.complete) {
+			// Already cached, report it right away
+			const std::string u = uri;
+			after(0, [u]() { if(s.prefetch.fn) s.prefetch.fn(u.c_str(), 0, 0, s.prefetch_data); });
+			return E_OK;
+		}
+		if(s.dl.active && s.dl.track == i) return E_PLAYBACK_ALREADY_PREFETCHING;
+		start_download(s.prefetch_dl, i, true);
+		return s.storage.alloc ? E_OK : E_PLAYBACK_PREFETCH_UNAVAILABLE;
+	}
+	return E_PLAYBACK_PREFETCH_UNAVAILABLE;
+}
+
+sp_error_t SpStopPrefetchingItem(void) {
+	if(s.prefetch_dl.active) {
+		s.storage.close(s.tracks[s.prefetch_dl.track].file_id.c_str(), s.storage_data);
+		s.prefetch_dl.active = false;
+	}
+	return E_OK;
+}
+
+sp_error_t SpZeroConfAnnouncePause(void) {
+	return s.initialized ? E_OK : E_UNINITIALIZED;
+}
+
+sp_error_t SpZeroConfAnnounceResume(void) {
+	return s.initialized ? E_OK : E_UNINITIALIZED;
+}
+
+sp_error_t SpPlaybackEnableShuffle(int enable) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	if((bool)enable == s.shuffle) return E_OK;
+	s.shuffle = enable;
+	after(0, []() {
+		notify(s.shuffle ? PN_SHUFFLEON : PN_SHUFFLEOFF);
+		notify(PN_METADATACHANGED);
+	});
+	return E_OK;
+}
+
+sp_error_t SpPlaybackEnableRepeat(unsigned int enable) {
+	if(!s.initialized) return E_UNINITIALIZED;
+	if((bool)enable == s.repeat) return E_OK;
+	s.repeat = enable;
+	after(0, []() { notify(s.repeat ? PN_REPEATON : PN_REPEATOFF); });
+	return E_OK;
+}
+
+sp_error_t SpRegisterDnsHALCallbacks(const sp_dnshal_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.dnshal = *cbs;
+	s.dnshal_data = data;
+	return E_OK;
+}
+
+sp_error_t SpSetAlarmClock(int a, void* b, unsigned long c, unsigned int d) {
+	(void)a; (void)b; (void)c; (void)d;
+	return E_UNSUPPORTED;
+}
+
+sp_error_t SpCancelAlarmClock(int a) {
+	(void)a;
+	return E_UNSUPPORTED;
+}
+
+sp_error_t SpSetBackendEnv(int a) {
+	(void)a;
+	return E_OK;
+}
+
+sp_error_t SpRegisterSocketHALCallbacks(const sp_sockethal_callbacks_t* cbs, void* data) {
+	if(!cbs) return E_NULL_ARGUMENT;
+	if(!s.initialized) return E_UNINITIALIZED;
+	s.sockethal = *cbs;
+	s.sockethal_data = data;
+	return E_OK;
+}
+
+}
@@ -0,0 +1,249 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "storage_mmap.h"
+#include "cache_index.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sp {
+
+	mmap_storage::mmap_storage(std::string root, size_t max_open)
+		: m_root(std::move(root)), m_max_open(max_open ? max_open : 1)
+	{
+		mkdir(m_root.c_str(), 0755);
+	}
+
+	mmap_storage::~mmap_storage() {
+		// Pending writes need the descriptors
+		if(m_write_behind) m_write_behind->flush_all();
+		for(auto& e : m_files) {
+			unmap(e.second);
+			::close(e.second.fd);
+		}
+	}
+
+	void mmap_storage::set_index(cache_index* index, bool refuse_missing) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		m_index = index;
+		m_refuse_missing = refuse_missing;
+	}
+
+	void mmap_storage::enable_write_behind() {
+		enable_write_behind(write_behind::options());
+	}
+
+	void mmap_storage::enable_write_behind(const write_behind::options& opts) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		if(m_write_behind) m_write_behind->flush_all();
+		m_write_behind.reset(new write_behind(opts));
+	}
+
+	bool mmap_storage::get_write_behind_stats(write_behind::stats& out, bool* uring) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		if(!m_write_behind) return false;
+		out = m_write_behind->get_stats();
+		if(uring) *uring = m_write_behind->uring();
+		return true;
+	}
+
+	void mmap_storage::poll() {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		if(m_write_behind) m_write_behind->poll();
+	}
+
+	long mmap_storage::alloc(const char* key, unsigned int size) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto& st = m_stats[key];
+		st.allocs++;
+		if(m_index) m_index->forget(key);
+		// The file gets truncated, older pending writes must neither land afterwards nor show up in reads
+		if(m_write_behind) m_write_behind->discard(key);
+		file* f = open(key, true);
+		if(!f) {
+			st.errors++;
+			return -1;
+		}
+		// Reserve blocks without writing them, fall back to a sparse file if the fs can't do it
+		if(size != 0 && fallocate(f->fd, 0, 0, size) != 0 && ftruncate(f->fd, size) != 0) {
+			st.errors++;
+			return -1;
+		}
+		f->size = size;
+		return 0;
+	}
+
+	long mmap_storage::write(const char* key, unsigned int offset, const void* buf, unsigned int size) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto& st = m_stats[key];
+		st.writes++;
+		if(m_write_behind) {
+			file* f = open(key, false);
+			const size_t end = (size_t)offset + size;
+			// Grow the file right away, reads are bounded by its size
+			if(!f || (f->size < end && ftruncate(f->fd, end) != 0)) {
+				st.errors++;
+				return 0;
+			}
+			if(f->size < end) f->size = end;
+			m_write_behind->write(key, f->fd, offset, buf, size);
+			st.bytes_written += size;
+			if(m_index) m_index->on_write(key, offset, buf, size);
+			return size;
+		}
+		file* f = open(key, false);
+		if(!f || !map(*f, (size_t)offset + size)) {
+			st.errors++;
+			return 0;
+		}
+		memcpy((uint8_t*)f->map + offset, buf, size);
+		st.bytes_written += size;
+		if(m_index) m_index->on_write(key, offset, buf, size);
+		return size;
+	}
+
+	long mmap_storage::read(const char* key, unsigned int offset, void* buf, unsigned int size) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto& st = m_stats[key];
+		st.reads++;
+		if(m_refuse_missing && m_index && m_index->known(key) && !m_index->has_file_range(key, offset, size)) {
+			st.refused++;
+			return 0;
+		}
+		file* f = open(key, false);
+		if(!f) {
+			st.errors++;
+			return 0;
+		}
+		if(offset >= f->size) return 0;
+		size_t n = std::min<size_t>(size, f->size - offset);
+		if(!map(*f, f->size)) {
+			st.errors++;
+			return 0;
+		}
+		memcpy(buf, (const uint8_t*)f->map + offset, n);
+		if(m_write_behind) m_write_behind->overlay(key, offset, buf, n);
+		st.bytes_read += n;
+		return n;
+	}
+
+	void mmap_storage::close(const char* key) {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		// The reads overlay what is still in flight, waiting here would stall the pump thread
+		if(m_write_behind) m_write_behind->submit(key);
+		auto it = m_files.find(key);
+		if(it != m_files.end()) unmap(it->second);
+	}
+
+	bool mmap_storage::get_stats(const std::string& key, stats& out) const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		auto it = m_stats.find(key);
+		if(it == m_stats.end()) return false;
+		out = it->second;
+		return true;
+	}
+
+	std::map<std::string, mmap_storage::stats> mmap_storage::all_stats() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_stats;
+	}
+
+	sp_storage_callbacks_t mmap_storage::callbacks() {
+		sp_storage_callbacks_t cbs;
+		memset(&cbs, 0x00, sizeof(cbs));
+		cbs.alloc = [](const char* key, unsigned int size, void* data) -> long {
+			return static_cast<mmap_storage*>(data)->alloc(key, size);
+		};
+		cbs.write = [](const char* key, unsigned int offset, const void* buf, unsigned int size, void* data) -> long {
+			return static_cast<mmap_storage*>(data)->write(key, offset, buf, size);
+		};
+		cbs.read = [](const char* key, unsigned int offset, void* buf, unsigned int size, void* data) -> long {
+			return static_cast<mmap_storage*>(data)->read(key, offset, buf, size);
+		};
+		cbs.close = [](const char* key, void* data) {
+			static_cast<mmap_storage*>(data)->close(key);
+		};
+		return cbs;
+	}
+
+	mmap_storage::file* mmap_storage::open(const std::string& key, bool truncate) {
+		auto it = m_files.find(key);
+		if(it != m_files.end()) {
+			file& f = it->second;
+			m_lru.splice(m_lru.begin(), m_lru, f.lru);
+			if(truncate) {
+				unmap(f);
+				if(ftruncate(f.fd, 0) != 0) return nullptr;
+				f.size = 0;
+			}
+			return &f;
+		}
+		while(m_files.size() >= m_max_open) evict();
+
+		int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+		if(truncate) flags |= O_TRUNC;
+		int fd = ::open((m_root + "/" + key).c_str(), flags, 0644);
+		if(fd < 0) return nullptr;
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			::close(fd);
+			return nullptr;
+		}
+		m_stats[key].opens++;
+		if(m_index && !truncate && (size_t)st.st_size >= cache_file_index::header_size && !m_index->known(key)) {
+			cache_file_header hdr;
+			if(pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr))
+				m_index->load(key, &hdr, sizeof(hdr));
+		}
+		m_lru.push_front(key);
+		file& f = m_files[key];
+		f.fd = fd;
+		f.size = st.st_size;
+		f.lru = m_lru.begin();
+		return &f;
+	}
+
+	bool mmap_storage::map(file& f, size_t min_size) {
+		if(min_size == 0) min_size = 1;
+		if(f.size < min_size) {
+			// Writes past the allocated size grow the file sparse
+			if(ftruncate(f.fd, min_size) != 0) return false;
+			f.size = min_size;
+		}
+		if(f.map && f.map_size >= min_size) return true;
+		void* ptr;
+		if(f.map) ptr = mremap(f.map, f.map_size, f.size, MREMAP_MAYMOVE);
+		else ptr = mmap(nullptr, f.size, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd, 0);
+		if(ptr == MAP_FAILED) {
+			if(f.map) munmap(f.map, f.map_size);
+			f.map = nullptr;
+			f.map_size = 0;
+			return false;
+		}
+		f.map = ptr;
+		f.map_size = f.size;
+		return true;
+	}
+
+	void mmap_storage::unmap(file& f) {
+		if(f.map) munmap(f.map, f.map_size);
+		f.map = nullptr;
+		f.map_size = 0;
+	}
+
+	void mmap_storage::evict() {
+		const std::string key = m_lru.back();
+		m_lru.pop_back();
+		auto it = m_files.find(key);
+		if(m_write_behind) m_write_behind->flush(key);
+		unmap(it->second);
+		::close(it->second.fd);
+		m_files.erase(it);
+	}
+}
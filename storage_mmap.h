@@ -0,0 +1,136 @@
+#pragma once
+
+/**
+ * @file storage_mmap.h
+ * @brief Storage HAL backend for ::SpRegisterStorageCallbacks built on mmap.
+ *
+ * Files are kept open in a small LRU of descriptors, sized with fallocate (or sparse
+ * via ftruncate if the filesystem does not support it) and read/written through a
+ * shared mapping, so a read or write call is a memcpy instead of open/seek/io/close.
+ * The mapping of a key is released when the library calls close for it, the
+ * descriptor stays cached until it gets evicted.
+ *
+ * With enable_write_behind() writes no longer touch the mapping: they are buffered and
+ * coalesced by a write_behind journal and written through io_uring (or pwrite), so the
+ * pump thread does not stall on page faults or dirty page writeback. Reads overlay the
+ * data still pending. close submits the buffered writes of the key without waiting for
+ * them, like the mapping before it did not msync, eviction and alloc wait for them. Call
+ * poll() from the pump loop to reap completions and submit extents older than max_delay.
+ */
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "spotify.h"
+#include "write_behind.h"
+
+namespace sp {
+
+	class cache_index;
+
+	class mmap_storage {
+	public:
+		/**
+		 * @brief Per key counters
+		 */
+		struct stats {
+			/** Number of alloc calls */
+			uint64_t allocs = 0;
+			/** Number of read calls */
+			uint64_t reads = 0;
+			/** Number of write calls */
+			uint64_t writes = 0;
+			/** Bytes returned by read calls */
+			uint64_t bytes_read = 0;
+			/** Bytes stored by write calls */
+			uint64_t bytes_written = 0;
+			/** Number of times the file had to be opened (descriptor cache misses) */
+			uint64_t opens = 0;
+			/** Number of failed calls */
+			uint64_t errors = 0;
+			/** Number of reads refused because the cache index marked the range as missing */
+			uint64_t refused = 0;
+		};
+
+		/**
+		 * @brief Create a storage backend.
+		 * @param root Directory to store cache files in, created if missing
+		 * @param max_open Maximum number of descriptors kept open
+		 */
+		explicit mmap_storage(std::string root, size_t max_open = 16);
+		~mmap_storage();
+
+		mmap_storage(const mmap_storage&) = delete;
+		mmap_storage& operator=(const mmap_storage&) = delete;
+
+		/**
+		 * @brief Keep a chunk index of the cache files up to date.
+		 * @param index Index to update, must outlive this object (null to disable)
+		 * @param refuse_missing Fail reads of chunks the index marks as missing without touching the disk
+		 */
+		void set_index(cache_index* index, bool refuse_missing = false);
+
+		/** @brief Buffer writes in a write-behind journal, see write_behind.h */
+		void enable_write_behind();
+		void enable_write_behind(const write_behind::options& opts);
+		/**
+		 * @brief Get the journal counters.
+		 * @param uring Set to true if the journal writes through io_uring
+		 * @return false if write-behind is not enabled
+		 */
+		bool get_write_behind_stats(write_behind::stats& out, bool* uring = nullptr) const;
+		/** @brief Reap finished and submit aged write-behind extents, does not block (pump thread) */
+		void poll();
+
+		/** @brief See sp_storage_callbacks_t::alloc, returns 0 on success and -1 on error */
+		long alloc(const char* key, unsigned int size);
+		/** @brief See sp_storage_callbacks_t::write */
+		long write(const char* key, unsigned int offset, const void* buf, unsigned int size);
+		/** @brief See sp_storage_callbacks_t::read */
+		long read(const char* key, unsigned int offset, void* buf, unsigned int size);
+		/** @brief See sp_storage_callbacks_t::close, submits pending writes of key without waiting */
+		void close(const char* key);
+
+		/**
+		 * @brief Get counters of a single key.
+		 * @return false if the key was never used
+		 */
+		bool get_stats(const std::string& key, stats& out) const;
+		/** @brief Get counters of all keys */
+		std::map<std::string, stats> all_stats() const;
+
+		/**
+		 * @brief Build a callback table, pass this object as data to ::SpRegisterStorageCallbacks.
+		 */
+		static sp_storage_callbacks_t callbacks();
+
+	private:
+		struct file {
+			int fd = -1;
+			void* map = nullptr;
+			size_t map_size = 0;
+			size_t size = 0;
+			std::list<std::string>::iterator lru;
+		};
+
+		file* open(const std::string& key, bool truncate);
+		bool map(file& f, size_t min_size);
+		void unmap(file& f);
+		void evict();
+
+		const std::string m_root;
+		const size_t m_max_open;
+		cache_index* m_index = nullptr;
+		std::unique_ptr<write_behind> m_write_behind;
+		bool m_refuse_missing = false;
+		mutable std::mutex m_mtx;
+		std::unordered_map<std::string, file> m_files;
+		std::list<std::string> m_lru;
+		std::map<std::string, stats> m_stats;
+	};
+}
@@ -4,6 +4,8 @@
 #include <cstring>
 #include <iomanip>
 #include <string>
+#include <memory>
+#include <vector>
 #include <cctype>
 #include <iostream>
 #include <fstream>
@@ -14,6 +16,26 @@
 #include <unistd.h>
 
 #include "spotify.h"
+#include "spotify.hpp"
+#include "pcm_ring.h"
+#include "storage_mmap.h"
+#include "cache_index.h"
+#include "pump_driver.h"
+#include "socket_hal.h"
+#include "dns_cache.h"
+#include "wmem_probe.h"
+#include "metadata_cache.h"
+#include "image_cache.h"
+#include "pcm_shm.h"
+#include "prefetcher.h"
+#include "latency_probe.h"
+#include "tracer.h"
+#include "async_logger.h"
+#include "session_recorder.h"
+#include "warm_start.h"
+#include "rt_memory.h"
+#include "pcm_convert.h"
+#include "app_key.h"
 #include "login_data.h"
 
 #define CONCAT(a, b) a ## b
@@ -37,7 +59,21 @@ static void memdump(const void* data, size_t len) {
 	std::clog.flags(fmt);
 }
 
-static bool isloggedin = false;
+static bool isplaying = false;
+static sp::metadata_cache metadata;
+static sp::image_cache images;
+static sp::pcm_shm_writer* pcm_export = NULL;
+static sp::prefetcher prefetch(metadata);
+static sp::latency_probe latency;
+// Set from onApplyVolume on the pump thread, applied on the output thread
+static sp::pcm::volume software_volume;
+static std::unique_ptr<sp::warm_start> warm;
+// Storage HAL if registered, its write-behind journal is polled from the pump loop
+static sp::mmap_storage* storage_hal = NULL;
+// The saved blob was rejected, log in with the password
+static bool password_login = false;
+static volatile sig_atomic_t dump_latency = 0;
+static volatile sig_atomic_t dump_trace = 0;
 
 inline bool check_return(sp_error_t e) {
 	const char* str;
@@ -59,49 +95,81 @@ inline void clean(T& ptr) {
 	memset(&ptr, 0x00, sizeof(T));
 }
 
-static uint8_t app_key[] = {
-	0x01, 0x42, 0xdf, 0x0e, 0xa6, 0x68, 0x2a, 0x1c, 0xba, 0x50, 0xa4, 0x5a, 0x4e, 0x62, 0x6f, 0xc3,
-	0x13, 0x87, 0x71, 0xa7, 0x08, 0x89, 0x0f, 0x73, 0x99, 0x94, 0xef, 0x0a, 0x50, 0xaf, 0x78, 0xa8,
-	0x0d, 0xe9, 0x6d, 0xd5, 0x4a, 0xc2, 0x5c, 0xa5, 0x6e, 0xbf, 0x1f, 0x98, 0x2b, 0xda, 0x94, 0xa0,
-	0x08, 0xf0, 0xdb, 0xd6, 0x67, 0x85, 0x5c, 0xaf, 0xe8, 0xd6, 0xc2, 0x8b, 0xe1, 0xd2, 0x42, 0x8f,
-	0xc8, 0x9e, 0xf7, 0x50, 0xd8, 0xdc, 0x34, 0x5c, 0x90, 0xaf, 0x04, 0x9b, 0x3c, 0x6d, 0x71, 0x30,
-	0x23, 0x52, 0xa3, 0x80, 0x15, 0xca, 0x09, 0xb8, 0x46, 0x86, 0x7a, 0x91, 0x8e, 0xc0, 0x1f, 0x3e,
-	0x99, 0x09, 0x0a, 0xbf, 0x98, 0x6e, 0x5f, 0x0f, 0xcf, 0xea, 0xa2, 0x78, 0xd2, 0x5e, 0x09, 0xea,
-	0x8a, 0x51, 0x30, 0x97, 0xe1, 0x0d, 0xbc, 0xad, 0x47, 0xfb, 0x90, 0x60, 0x66, 0x39, 0xe2, 0x1c,
-	0xaa, 0xb1, 0x59, 0xfd, 0xe3, 0x09, 0x30, 0x5a, 0x7a, 0xd7, 0xa2, 0x35, 0x51, 0xc6, 0x3a, 0x00,
-	0x75, 0xee, 0xc3, 0x76, 0x98, 0x75, 0x3e, 0x02, 0xf3, 0x40, 0x50, 0x21, 0x7c, 0x51, 0x75, 0x9c,
-	0xe6, 0x66, 0xd3, 0x31, 0xfe, 0x15, 0x84, 0x35, 0xef, 0x45, 0x2e, 0x9c, 0x7d, 0xd0, 0xc5, 0x16,
-	0xea, 0xbe, 0x71, 0x07, 0x7a, 0x6c, 0x40, 0x26, 0x75, 0xef, 0x90, 0x33, 0xa7, 0x65, 0xca, 0xf1,
-	0xa6, 0x50, 0x91, 0x6c, 0x99, 0xf4, 0xba, 0x8a, 0x5e, 0xd1, 0xb4, 0x21, 0x9d, 0x81, 0xbb, 0x61,
-	0x9a, 0x31, 0xe1, 0x82, 0xad, 0x10, 0xd7, 0xd9, 0x06, 0xe0, 0xe3, 0x1f, 0x2f, 0xcf, 0x21, 0x91,
-	0x57, 0x05, 0xf6, 0x39, 0x9f, 0x4c, 0x1f, 0xbd, 0x0b, 0x68, 0x6e, 0xcb, 0x10, 0xd9, 0x6b, 0xc4,
-	0xbb, 0x76, 0xdc, 0x47, 0x96, 0x3e, 0xd4, 0xc6, 0xaf, 0xb5, 0x80, 0x4c, 0x0d, 0xb5, 0x63, 0x82,
-	0xc1, 0x96, 0x35, 0xc1, 0x82, 0x65, 0x62, 0x53, 0x0a, 0xce, 0xb7, 0x6e, 0xf8, 0x1e, 0xf6, 0x8b,
-	0x66, 0xfa, 0x5e, 0xc1, 0x49, 0x7e, 0xc2, 0x95, 0x51, 0xe3, 0xfa, 0x30, 0x55, 0x23, 0x79, 0x69,
-	0x33, 0x3b, 0xe6, 0xb2, 0x07, 0xac, 0x41, 0x6a, 0x5a, 0xc4, 0x05, 0x8c, 0x4a, 0xfc, 0xd2, 0x44,
-	0x8f, 0xac, 0x92, 0x77, 0xc6, 0x76, 0xbe, 0x68, 0x4b, 0xcc, 0x17, 0x3a, 0xdd, 0x8d, 0x40, 0xd5,
-	0x77
-};
+// Connection events, the callback table is generated by spotify.hpp
+struct connection_events {
+	bool logged_in = false;
+
+	void on_connection(sp_con_state_t n) {
+		std::clog << "=>connection.onNotify(" << (int)n << ", " << this << ")" << std::endl;
+	}
 
+	void on_logged_in(const char* blob, const char* uname) {
+		std::ios::fmtflags fmt = std::clog.flags();
+		std::clog  << "=>connection.onNotifyLoggedIn(" << blob << "," << uname << "," << this << ")" << std::endl;
+		std::clog.flags(fmt);
+		logged_in = true;
+		latency.on_logged_in();
+		if(warm) warm->on_logged_in(blob, uname);
+		sp_zeroconfvars_t zconf;
+		clean(zconf);
+		check_return(SpZeroConfGetVars(&zconf));
+		std::clog << "Token:       " << zconf.token << std::endl;
+		std::clog << "Hash:        " << zconf.uniqueid_hash << std::endl;
+		std::clog << "Username:    " << zconf.username << std::endl;
+		std::clog << "Displayname: " << zconf.displayname << std::endl;
+		std::clog << "Accounttype: " << zconf.accounttype << std::endl;
+		std::clog << "Devicetype:  " << zconf.devicetype << std::endl;
+		std::clog << "Version:     " << zconf.version << std::endl;
+		memdump(&zconf, sizeof(zconf));
+	}
+};
 
 int main(int argc, const char** argv) {
 	assert(sizeof(sp_zeroconfvars_t) == 428);
 	assert(sizeof(sp_init_config_t) == 0x90);
 	assert(sizeof(app_key) == 321);
-	// Setup debug output
+	// Set SP_TRACE_FILE to a file name to record a Chrome trace, kill -USR2 writes it
+	const char* trace_file = getenv("SP_TRACE_FILE");
+	if(trace_file) {
+		sp::trace::start();
+		sp::trace::set_thread_name("pump");
+		signal(SIGUSR2, [](int) { dump_trace = 1; });
+	}
+	// Set SP_RECORD to a file name to record the callbacks for benchapp -r (SP_RECORD_AUDIO=1 keeps the samples)
+	std::unique_ptr<sp::session_recorder> recorder;
+	if(const char* record_file = getenv("SP_RECORD")) {
+		sp::session_recorder::options opts;
+		opts.store_audio = getenv("SP_RECORD_AUDIO") != NULL;
+		recorder.reset(new sp::session_recorder(record_file, opts));
+		// kill -USR2 flushes the recording as well
+		signal(SIGUSR2, [](int) { dump_trace = 1; });
+	}
+	// Setup debug output, written in batches by a background thread
+	sp::async_logger logger;
 	{
-		sp_debug_callbacks_t dcbs;
-		dcbs.print = [](const char* line, void* context) {
-			std::clog << line << std::endl;
-		};
-		check_return(SpRegisterDebugCallbacks(&dcbs, NULL));
+		sp_debug_callbacks_t dcbs = sp::async_logger::callbacks();
+		sp::trace::wrap(dcbs);
+		check_return(SpRegisterDebugCallbacks(&dcbs, &logger));
 	}
 
 	sp_init_config_t cfg;
 	clean(cfg);
 	cfg.version = SP_APIVERSION;
 	cfg.wmem_size = 0x1000000;
-	cfg.wmem = malloc(cfg.wmem_size);
+	// Set SP_RT_MEMORY to prefault and lock wmem and the pcm ring (on huge pages if possible)
+	const bool rt_memory = getenv("SP_RT_MEMORY") != NULL;
+	std::unique_ptr<sp::rt_region> wmem_region;
+	if(rt_memory) {
+		wmem_region.reset(new sp::rt_region(cfg.wmem_size));
+		cfg.wmem = wmem_region->data();
+		std::clog << "wmem: ";
+		wmem_region->report(std::clog);
+	}
+	if(!cfg.wmem) cfg.wmem = malloc(cfg.wmem_size);
+	// Set SP_WMEM_PROBE to find out how much of wmem is really used, kill -USR1 takes a sample
+	const bool probe_wmem = getenv("SP_WMEM_PROBE") != NULL;
+	sp::wmem_probe wmem(cfg.wmem, cfg.wmem_size);
+	if(probe_wmem) wmem.fill();
 	cfg.app_key = app_key;
 	cfg.app_key_len = sizeof(app_key);
 	cfg.uniqueid = "fd7ccecc5c988df3";
@@ -111,61 +179,112 @@ int main(int argc, const char** argv) {
 	cfg.clientid = "089d841ccc194c10a77afad9e1c11d54";
 	cfg.osversion = "7.1.1_x86_64";
 	cfg.devicetype = DT_SMARTPHONE;
-	cfg.on_error = [](sp_error_t e, void* data) { std::clog << "=>async_error(" << (int)e << ", " << data << ")" << std::endl; };
+	cfg.on_error = [](sp_error_t e, void* data) {
+		std::clog << "=>async_error(" << (int)e << ", " << data << ")" << std::endl;
+		prefetch.on_error(e);
+		if(warm && warm->on_error(e)) password_login = true;
+	};
 	cfg.on_error_context = (void*)0xDEADBEEF;
 
-	if(!check_return(SpInit(&cfg))) {
+	sp::session session(cfg);
+	if(!check_return(session.error())) {
 		std::clog << "Init failed, exiting" << std::endl;
 		return -1;
 	}
+	connection_events connection;
 
+	sp::pump_driver pump;
+	// Socket HAL on the epoll set of pump, only created if registered below
+	std::unique_ptr<sp::socket_hal> sockets;
+	// Roughly 500ms of 44.1kHz stereo between the pump thread and the output thread
+	const size_t ring_frames = 22050;
+	std::unique_ptr<sp::rt_region> ring_region;
+	std::vector<short> ring_heap;
+	short* ring_storage = NULL;
+	if(rt_memory) {
+		// Far below a huge page, only prefault and lock it
+		sp::rt_region::options opts;
+		opts.hugepages = false;
+		ring_region.reset(new sp::rt_region(ring_frames * 2 * sizeof(short), opts));
+		ring_storage = (short*)ring_region->data();
+	}
+	if(!ring_storage) {
+		ring_heap.resize(ring_frames * 2);
+		ring_storage = ring_heap.data();
+	}
+	sp::pcm_ring audio_ring(ring_storage, ring_frames, 2);
+	sp::pcm_drain_thread audio_out(audio_ring, [](const short* frames, size_t nframes, const sp_sampleformat_t& fmt) {
+		static std::vector<short> block;
+		block.assign(frames, frames + nframes * fmt.nchannels);
+		software_volume.apply(block.data(), nframes, fmt.nchannels);
+		// Hand block to the audio device here
+	});
+	// SP_RT_PRIO runs the output thread with SCHED_FIFO at that priority, SP_RT_CPU pins it
+	if(getenv("SP_RT_PRIO") || getenv("SP_RT_CPU")) {
+		const int prio = getenv("SP_RT_PRIO") ? atoi(getenv("SP_RT_PRIO")) : 0;
+		const int cpu = getenv("SP_RT_CPU") ? atoi(getenv("SP_RT_CPU")) : -1;
+		if(!sp::rt_thread(audio_out.native_handle(), prio, cpu))
+			std::clog << "Failed to make the output thread real-time" << std::endl;
+	}
+	// Set SP_PCM_SHM (e.g. /spotify-pcm) to publish the audio to other processes
+	std::unique_ptr<sp::pcm_shm_writer> pcm_shm;
+	if(const char* name = getenv("SP_PCM_SHM")) {
+		pcm_shm.reset(new sp::pcm_shm_writer(name));
+		if(pcm_shm->valid()) pcm_export = pcm_shm.get();
+	}
 	if(1) {
 		sp_playback_callbacks_t cbs;
 		clean(cbs);
 		cbs.onNotify = [](sp_playbacknotify_t n, void* data) -> int{
 			std::clog << "=>playback.onNotify(" << (int)n << ", " << data << ")" << std::endl;
-			if(n == PN_METADATACHANGED) {
-				char buf[128];
-				sp_metadata_t meta;
-				check_return(SpGetMetadata(&meta, 0));
-				check_return(SpGetMetadataImageURL(meta.image_uri, buf, 128));
+			if(n == PN_PLAY) isplaying = true;
+			else if(n == PN_PAUSE || n == PN_BECAMEINACTIVE) isplaying = false;
+			if(metadata.on_notify(n) && metadata.refresh()) {
+				std::string url;
+				auto snap = metadata.snapshot();
+				const sp::track_info& meta = snap->current();
+				images.prefetch(*snap);
+				images.lookup(meta.image_uri, url);
 				std::clog << "Artist:   " << meta.artist_name << " (" << meta.artist_uri << ")" << std::endl;
 				std::clog << "Album:    " << meta.album_name << " (" << meta.album_uri << ")" << std::endl;
 				std::clog << "Track:    " << meta.track_title << " (" << meta.track_uri << ")" << std::endl;
-				std::clog << "Options:  " << meta.duration << "ms, "<<meta.bitrate << "k, idx=" << meta.playlist_idx << ", idx2=" << meta.arg3 << std::endl;
-				std::clog << "Image url:" << buf << std::endl;
+				std::clog << "Options:  " << meta.duration << "ms, "<<meta.bitrate << "k, idx=" << meta.playlist_idx << std::endl;
+				std::clog << "Image url:" << url << std::endl;
+				if(warm) warm->on_track(meta);
 			}
+			if(warm) warm->on_notify(n);
+			prefetch.on_notify(n);
+			latency.on_notify(n);
 			return 0;
 		};
-		cbs.onAudioData = [](const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int arg4, void* handle) { return nframes; };
-		cbs.onSeek = [](uint64_t position, void* data) { std::clog << "=>playback.onSeek(" << position << ", " << data << ")" << std::endl; };
-		cbs.onApplyVolume = [](unsigned short vol, void* data) { std::clog  << "=>playback.onApplyVolume(" << vol << "," << data << ")" << std::endl; };
+		cbs.onAudioData = [](const short* frames, unsigned long nframes, const sp_sampleformat_t* format, unsigned int arg4, void* data) -> unsigned long {
+			unsigned long n = sp::pcm_ring::on_audio_data(frames, nframes, format, arg4, data);
+			// Only export what the ring accepted, the rest gets delivered again
+			if(pcm_export && n) pcm_export->write(frames, n, *format, SpPlaybackGetPosition());
+			prefetch.on_frames(n);
+			latency.on_frames(n);
+			return n;
+		};
+		cbs.onSeek = [](uint64_t position, void* data) {
+			std::clog << "=>playback.onSeek(" << position << ", " << data << ")" << std::endl;
+			prefetch.on_seek(position);
+			latency.on_seek();
+		};
+		cbs.onApplyVolume = [](unsigned short vol, void* data) {
+			std::clog  << "=>playback.onApplyVolume(" << vol << "," << data << ")" << std::endl;
+			software_volume.set(vol);
+		};
 		cbs.onUnavailableTrack = [](const char* uri, void* data) { std::clog << std::hex << "=>playback.onUnavailableTrack(" << uri << ", " << data << ")" << std::endl;};
 		//cbs.fn6 = [](long a, long b, long c, long d) { std::ios::fmtflags fmt = std::clog.flags(); std::clog << std::hex << "=>playback.fn6(" << a << ", " << b << ", " << c << ", " << d << ")" << std::endl; std::clog.flags(fmt); };;
-		check_return(SpRegisterPlaybackCallbacks(&cbs, (void*)0xDEADBEEF));
+		sp::trace::wrap(cbs);
+		sp::session_recorder::wrap(cbs);
+		check_return(SpRegisterPlaybackCallbacks(&cbs, &audio_ring));
 	}
 	if(1) {
-		sp_connection_callbacks_t cbs;
-		clean(cbs);
-		cbs.onNotifyLoggedIn = [](const char* blob, const char* uname, void* handle){
-			std::ios::fmtflags fmt = std::clog.flags();
-			std::clog  << "=>connection.onNotifyLoggedIn(" << blob << "," << uname << "," << handle << ")" << std::endl;
-			std::clog.flags(fmt);
-			isloggedin = true;
-			sp_zeroconfvars_t zconf;
-			clean(zconf);
-			check_return(SpZeroConfGetVars(&zconf));
-			std::clog << "Token:       " << zconf.token << std::endl;
-			std::clog << "Hash:        " << zconf.uniqueid_hash << std::endl;
-			std::clog << "Username:    " << zconf.username << std::endl;
-			std::clog << "Displayname: " << zconf.displayname << std::endl;
-			std::clog << "Accounttype: " << zconf.accounttype << std::endl;
-			std::clog << "Devicetype:  " << zconf.devicetype << std::endl;
-			std::clog << "Version:     " << zconf.version << std::endl;
-			memdump(&zconf, sizeof(zconf));
-		};
-		cbs.onNotify = [](sp_con_state_t n, void* data){ std::clog << "=>connection.onNotify(" << (int)n << ", " << data << ")" << std::endl; };;
-		check_return(SpRegisterConnectionCallbacks(&cbs, (void*)0xDEADBEEF));
+		sp_connection_callbacks_t cbs = sp::connection_callbacks<connection_events>();
+		sp::trace::wrap(cbs);
+		sp::session_recorder::wrap(cbs);
+		check_return(SpRegisterConnectionCallbacks(&cbs, &connection));
 	}
 	if(0) {
 		sp_content_callbacks_t cbs;
@@ -176,91 +295,99 @@ int main(int argc, const char** argv) {
 		check_return(SpRegisterContentCallbacks(&cbs, (void*)0xDEADBEEF));
 	}
 	if(0) {
-		sp_storage_callbacks_t cbs;
-		clean(cbs);
-		cbs.alloc = [](const char* key, unsigned int size, void* data) -> long {
-			std::clog << "=>storage.alloc("<<key<<","<<size<<","<<data<<")" << std::endl;
-			std::ofstream file(std::string("tmp/") + key, std::ios::binary | std::ios::trunc);
-			if(file) {
-				char buf[1024];
-				clean(buf);
-				while(size > 0) {
-					auto s = std::min(size, 1024u);
-					file.write(buf, s);
-					size -= s;
-				}
-				file.flush();
-				file.close();
-				return size;
-			}
-			return 0;
-		};
-		cbs.write = [](const char* key, unsigned int offset, const void* buf, unsigned int size, void* data) -> long {
-			std::clog << "=>storage.write(" << key << ", " << offset << ", " << buf << ", " << size << ", " << data << ")" << std::endl;
-			std::fstream file(std::string("tmp/") + key, std::ios::binary | std::ios::in | std::ios::out);
-			if(file) {
-				file.seekp(offset);
-				file.write((char*)buf, size);
-				file.flush();
-				file.close();
-				return size;
-			}
-			return 0;
-		};
-		cbs.read = [](const char* key, unsigned int offset, void* buf, unsigned int size, void* data) -> long {
-			std::clog << "=>storage.read(" << key << ", " << offset << ", " << buf << ", " << size << ", " << data << ")" << std::endl;
-			std::ifstream file(std::string("tmp/") + key, std::ios::binary);
-			if(file) {
-				file.seekg(offset);
-				return file.read((char*)buf, size).gcount();
-			}
-			return 0;
-		};
-		cbs.close = [](const char* key, void* data) {
-			std::clog  << "=>storage.finish(" << key << ", " << data << ")" << std::endl;
-		};
+		static sp::mmap_storage storage("tmp");
+		static sp::cache_index cache;
+		storage.set_index(&cache);
+		if(getenv("SP_WRITE_BEHIND")) storage.enable_write_behind();
+		storage_hal = &storage;
+		sp_storage_callbacks_t cbs = sp::mmap_storage::callbacks();
 		cbs.fn5 = [](long a, long b, long c, long d) { std::ios::fmtflags fmt = std::clog.flags(); std::clog << std::hex << "=>storage.fn4(" << a << ", " << b << ", " << c << ", " << d << ")" << std::endl; std::clog.flags(fmt); };
-		check_return(SpRegisterStorageCallbacks(&cbs, (void*)0xDEADBEEF));
+		sp::trace::wrap(cbs);
+		sp::session_recorder::wrap(cbs);
+		check_return(SpRegisterStorageCallbacks(&cbs, &storage));
+	}
+	if(1) {
+		sp_prefetch_callbacks_t cbs = sp::prefetcher::callbacks();
+		sp::trace::wrap(cbs);
+		check_return(SpRegisterPrefetchCallbacks(&cbs, &prefetch));
 	}
 	if(0) {
-		sp_prefetch_callbacks_t cbs;
-		clean(cbs);
-		cbs.fn = [](const char* a, long b, long c, void* d) { std::clog << "=>prefetch.fn(" << a << ", " << b << ", " << c << ", " << d << ")" << std::endl; };
-		check_return(SpRegisterPrefetchCallbacks(&cbs, (void*)0xDEADBEEF));
+		static sp::dns_cache dns;
+		sp_dnshal_callbacks_t cbs = sp::dns_cache::callbacks();
+		sp::trace::wrap(cbs);
+		sp::session_recorder::wrap(cbs);
+		check_return(SpRegisterDnsHALCallbacks(&cbs, &dns));
 	}
 	if(0) {
-		sp_dnshal_callbacks_t cbs;
-		clean(cbs);
-		cbs.lookup = [](const char* host, struct sockaddr* b, void* data) {
-			std::clog << "=>dnshal.lookup(" << host << ", " << b << ", " << data << ")" << std::endl;
-			memset(b, 0x0, 16);
-			struct addrinfo* info;
-			if(getaddrinfo(host, NULL, NULL, &info) != 0)
-				return -10001;
-			*b = *info->ai_addr;
-			freeaddrinfo(info);
-			// For some reason the first 4 bytes need to be zero
-			memset(b, 0x00, 4);
-			return 0;
-		};
-		check_return(SpRegisterDnsHALCallbacks(&cbs, (void*)0xDEADBEEF));
+		sockets.reset(new sp::socket_hal(pump));
+		sp_sockethal_callbacks_t cbs = sp::socket_hal::callbacks();
+		sp::trace::wrap(cbs);
+		sp::session_recorder::wrap(cbs);
+		check_return(SpRegisterSocketHALCallbacks(&cbs, sockets.get()));
+	}
+
+	// Set SP_WARM_START to a file name to log in with the saved blob and resume where the last run stopped
+	if(const char* warm_file = getenv("SP_WARM_START")) {
+		warm.reset(new sp::warm_start(warm_file));
+		if(warm->load()) std::clog << "Warm start: " << warm->get().context_uri << " idx=" << warm->get().index << " pos=" << warm->get().position << std::endl;
 	}
 
 	// wrong login => -112
-	check_return(SpConnectionLoginPassword(SP_USER, SP_PASSWORD));
+	if(warm && warm->can_login())
+		check_return(latency.run(sp::latency_probe::OP_LOGIN, [] { return warm->login(); }));
+	else check_return(latency.run(sp::latency_probe::OP_LOGIN, [] { return SpConnectionLoginPassword(SP_USER, SP_PASSWORD); }));
+	// kill -USR1 prints the command latencies (and samples wmem)
+	signal(SIGUSR1, [](int) { dump_latency = 1; });
 
 	bool loggedin = false;
 	while(true) {
-		check_return(SpPumpEvents());
-		if(!loggedin && isloggedin) {
+		check_return(pump.pump());
+		prefetch.tick();
+		if(warm) warm->tick();
+		if(storage_hal) storage_hal->poll();
+		if(password_login) {
+			password_login = false;
+			check_return(latency.run(sp::latency_probe::OP_LOGIN, [] { return SpConnectionLoginPassword(SP_USER, SP_PASSWORD); }));
+			pump.wake();
+		}
+		if(!loggedin && connection.logged_in) {
 			loggedin = true;
-			SpPlayUri("spotify:user:sollunad:playlist:7sZWboj9zudtQQLOWLKFXF", 28, 170000);
+			if(warm && warm->can_resume())
+				latency.run(sp::latency_probe::OP_PLAY_URI, [] { return warm->resume(); });
+			else latency.run(sp::latency_probe::OP_PLAY_URI, [] { return SpPlayUri("spotify:user:sollunad:playlist:7sZWboj9zudtQQLOWLKFXF", 28, 170000); });
 
 			if(!check_return(SpPlaybackEnableShuffle(0))) {
 				std::clog << "Failed to disable shuffle" << std::endl;
 				return -1;
 			}
+			// Process the commands right away instead of after the idle timeout
+			pump.wake();
 		}
+		if(dump_trace) {
+			dump_trace = 0;
+			if(recorder) recorder->flush();
+			if(trace_file) {
+				std::ofstream out(trace_file);
+				std::clog << "Wrote " << sp::trace::write_chrome_json(out) << " trace events to " << trace_file << std::endl;
+			}
+		}
+		if(dump_latency) {
+			dump_latency = 0;
+			latency.report(std::clog);
+			const sp::page_faults faults = sp::page_faults::process();
+			std::clog << "Page faults: " << faults.minor << " minor, " << faults.major << " major" << std::endl;
+			// A scan reads all of wmem, so it only runs on request and not periodically on the pump thread
+			if(probe_wmem) {
+				wmem.scan();
+				std::clog << "wmem peak: " << wmem.peak() << ", recommended size: " << wmem.recommended_size() << std::endl;
+			}
+		}
+		pump.set_active(isplaying);
+		pump.wait();
+	}
+	if(probe_wmem) {
+		wmem.scan();
+		wmem.report(std::clog);
 	}
-	check_return(SpFree());
+	check_return(session.reset());
 }
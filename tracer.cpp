@@ -0,0 +1,244 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace sp {
+	namespace trace {
+
+		std::atomic<bool> g_enabled(false);
+
+		namespace {
+			// Bumped by clear(), every thread drops its events on its next record()
+			std::atomic<uint64_t> s_epoch(0);
+
+			struct buffer {
+				std::unique_ptr<event[]> events{new event[ring_size]};
+				std::atomic<uint64_t> pos{0};
+				/** Written by the owner only: last s_epoch it saw and the first event recorded since */
+				std::atomic<uint64_t> epoch{0};
+				std::atomic<uint64_t> first{0};
+				long tid = 0;
+				char name[32] = {0};
+			};
+
+			typedef std::chrono::steady_clock clock;
+			const clock::time_point s_base = clock::now();
+
+			// Buffers stay around after their thread exited, so its events can still be exported
+			std::mutex s_mtx;
+			std::vector<buffer*> s_buffers;
+			thread_local buffer* t_buffer = nullptr;
+
+			buffer* local_buffer() {
+				if(!t_buffer) {
+					buffer* b = new buffer();
+					b->tid = ::syscall(SYS_gettid);
+					b->epoch.store(s_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+					std::lock_guard<std::mutex> lck(s_mtx);
+					s_buffers.push_back(b);
+					t_buffer = b;
+				}
+				return t_buffer;
+			}
+
+			void write_string(std::ostream& out, const char* s) {
+				out << '"';
+				for(; *s; s++) {
+					const unsigned char c = *s;
+					if(c == '"' || c == '\\') out << '\\' << c;
+					else if(c < 0x20) {
+						static const char hex[] = "0123456789abcdef";
+						out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+					} else out << c;
+				}
+				out << '"';
+			}
+		}
+
+		void start() {
+			g_enabled.store(true, std::memory_order_relaxed);
+		}
+
+		void stop() {
+			g_enabled.store(false, std::memory_order_relaxed);
+		}
+
+		void clear() {
+			// Only the owner writes its ring, it moves first up on its next record()
+			std::lock_guard<std::mutex> lck(s_mtx);
+			s_epoch.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void set_thread_name(const char* name) {
+			buffer* b = local_buffer();
+			strncpy(b->name, name, sizeof(b->name) - 1);
+		}
+
+		event& record(const char* name, const char* cat, char phase) {
+			buffer* b = local_buffer();
+			const uint64_t pos = b->pos.load(std::memory_order_relaxed);
+			const uint64_t epoch = s_epoch.load(std::memory_order_relaxed);
+			if(b->epoch.load(std::memory_order_relaxed) != epoch) {
+				b->first.store(pos, std::memory_order_relaxed);
+				b->epoch.store(epoch, std::memory_order_release);
+			}
+			event& e = b->events[pos & (ring_size - 1)];
+			e.ts = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - s_base).count();
+			e.name = name;
+			e.cat = cat;
+			e.phase = phase;
+			e.nargs = 0;
+			e.has_result = false;
+			e.str[0] = '\0';
+			b->pos.store(pos + 1, std::memory_order_release);
+			return e;
+		}
+
+		void instant(const char* name, const char* cat) {
+			if(enabled()) record(name, cat, 'i');
+		}
+
+		size_t write_chrome_json(std::ostream& out) {
+			std::lock_guard<std::mutex> lck(s_mtx);
+			const long pid = ::getpid();
+			size_t written = 0;
+			bool first = true;
+			out << "{\"traceEvents\":[";
+			for(auto b : s_buffers) {
+				if(b->name[0]) {
+					out << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << b->tid << ",\"args\":{\"name\":";
+					write_string(out, b->name);
+					out << "}}";
+					first = false;
+				}
+				// A thread that did not record since clear() has nothing to export, clear() can't run meanwhile
+				if(b->epoch.load(std::memory_order_acquire) != s_epoch.load(std::memory_order_relaxed)) continue;
+				const uint64_t since = b->first.load(std::memory_order_relaxed);
+				const uint64_t end = b->pos.load(std::memory_order_acquire);
+				const uint64_t begin = std::max(since, end > ring_size ? end - ring_size : 0);
+				// Ends whose begin got overwritten would unbalance the stack
+				int depth = 0;
+				for(uint64_t i = begin; i < end; i++) {
+					const event& e = b->events[i & (ring_size - 1)];
+					if(e.phase == 'E') {
+						if(!depth) continue;
+						depth--;
+					} else if(e.phase == 'B') depth++;
+
+					out << (first ? "\n" : ",\n") << "{\"name\":";
+					write_string(out, e.name);
+					out << ",\"cat\":";
+					write_string(out, e.cat);
+					out << ",\"ph\":\"" << e.phase << "\",\"ts\":" << e.ts / 1000 << "." << (char)('0' + e.ts / 100 % 10)
+						<< (char)('0' + e.ts / 10 % 10) << (char)('0' + e.ts % 10) << ",\"pid\":" << pid << ",\"tid\":" << b->tid;
+					if(e.phase == 'i') out << ",\"s\":\"t\"";
+					if(e.nargs || e.str[0] || e.has_result) {
+						out << ",\"args\":{";
+						const char* sep = "";
+						for(int a = 0; a < e.nargs; a++) {
+							out << sep << "\"a" << a << "\":" << e.args[a];
+							sep = ",";
+						}
+						if(e.str[0]) {
+							out << sep << "\"s\":";
+							write_string(out, e.str);
+							sep = ",";
+						}
+						if(e.has_result) out << sep << "\"result\":" << e.result;
+						out << "}";
+					}
+					out << "}";
+					first = false;
+					written++;
+				}
+			}
+			out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+			return written;
+		}
+
+		namespace {
+			// One trampoline per callback slot, Slot keeps the instantiations apart
+			template<int Slot, typename R, typename... A>
+			struct hook {
+				static R (*orig)(A...);
+				static const char* name;
+				static R call(A... args) {
+					return invoke(name, "callback", orig, args...);
+				}
+			};
+			template<int Slot, typename R, typename... A>
+			R (*hook<Slot, R, A...>::orig)(A...) = nullptr;
+			template<int Slot, typename R, typename... A>
+			const char* hook<Slot, R, A...>::name = nullptr;
+
+			template<int Slot, typename R, typename... A>
+			void install(R (*&fn)(A...), const char* name) {
+				if(!fn || fn == &hook<Slot, R, A...>::call) return;
+				hook<Slot, R, A...>::orig = fn;
+				hook<Slot, R, A...>::name = name;
+				fn = &hook<Slot, R, A...>::call;
+			}
+		}
+
+		void wrap(sp_playback_callbacks_t& cbs) {
+			install<__LINE__>(cbs.onNotify, "playback.onNotify");
+			install<__LINE__>(cbs.onAudioData, "playback.onAudioData");
+			install<__LINE__>(cbs.onSeek, "playback.onSeek");
+			install<__LINE__>(cbs.onApplyVolume, "playback.onApplyVolume");
+			install<__LINE__>(cbs.onUnavailableTrack, "playback.onUnavailableTrack");
+			install<__LINE__>(cbs.fn6, "playback.fn6");
+		}
+
+		void wrap(sp_connection_callbacks_t& cbs) {
+			install<__LINE__>(cbs.onNotify, "connection.onNotify");
+			install<__LINE__>(cbs.onNotifyLoggedIn, "connection.onNotifyLoggedIn");
+			install<__LINE__>(cbs.onMessage, "connection.onMessage");
+		}
+
+		void wrap(sp_storage_callbacks_t& cbs) {
+			install<__LINE__>(cbs.alloc, "storage.alloc");
+			install<__LINE__>(cbs.write, "storage.write");
+			install<__LINE__>(cbs.read, "storage.read");
+			install<__LINE__>(cbs.close, "storage.close");
+			install<__LINE__>(cbs.fn5, "storage.fn5");
+		}
+
+		void wrap(sp_dnshal_callbacks_t& cbs) {
+			install<__LINE__>(cbs.lookup, "dnshal.lookup");
+		}
+
+		void wrap(sp_sockethal_callbacks_t& cbs) {
+			install<__LINE__>(cbs.fn1, "sockethal.create");
+			install<__LINE__>(cbs.fn2, "sockethal.setsockopt");
+			install<__LINE__>(cbs.fn3, "sockethal.close");
+			install<__LINE__>(cbs.fn4, "sockethal.bind");
+			install<__LINE__>(cbs.fn5, "sockethal.listen");
+			install<__LINE__>(cbs.fn6, "sockethal.connect");
+			install<__LINE__>(cbs.fn7, "sockethal.accept");
+			install<__LINE__>(cbs.fn8, "sockethal.recv");
+			install<__LINE__>(cbs.fn9, "sockethal.send");
+			install<__LINE__>(cbs.fn10, "sockethal.recvfrom");
+			install<__LINE__>(cbs.fn11, "sockethal.sendto");
+			install<__LINE__>(cbs.fn12, "sockethal.error");
+			install<__LINE__>(cbs.fn13, "sockethal.is_readable");
+			install<__LINE__>(cbs.fn14, "sockethal.is_writable");
+			install<__LINE__>(cbs.fn15, "sockethal.local_address");
+			install<__LINE__>(cbs.fn16, "sockethal.remote_address");
+			install<__LINE__>(cbs.fn17, "sockethal.on_pump");
+		}
+
+		void wrap(sp_debug_callbacks_t& cbs) {
+			install<__LINE__>(cbs.print, "debug.print");
+		}
+
+		void wrap(sp_prefetch_callbacks_t& cbs) {
+			install<__LINE__>(cbs.fn, "prefetch.fn");
+		}
+	}
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+/**
+ * @file tracer.h
+ * @brief Low overhead tracing of library calls and callbacks, exported as Chrome trace JSON.
+ *
+ * Every thread records into its own fixed size ring of events, so recording is a few
+ * stores without locks or allocations (the ring is allocated on the first event of a
+ * thread). Old events are overwritten once a ring is full. A scope records a begin and an
+ * end event with the integral and string arguments of the call and the return value.
+ *
+ * Callbacks are traced by replacing the function pointers of a callback table with
+ * trampolines before registering it (wrap()), the data pointer is passed through
+ * unchanged. Calls into the library are traced by linking with -Wl,--wrap for every Sp*
+ * function and tracer_wrap.cpp (SP_TRACE=1 in Android.mk). testapp records a trace when
+ * the environment variable SP_TRACE_FILE names the output file.
+ *
+ * The export can be loaded in chrome://tracing or ui.perfetto.dev. Events recorded while
+ * exporting may show up torn, stop tracing first for an exact dump.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <type_traits>
+
+#include "spotify.h"
+
+namespace sp {
+
+	namespace trace {
+
+		/**
+		 * @brief One recorded event.
+		 */
+		struct event {
+			/** Nanoseconds since the tracer was started */
+			uint64_t ts;
+			const char* name;
+			const char* cat;
+			/** 'B' begin, 'E' end, 'i' instant */
+			char phase;
+			/** Number of values in args */
+			uint8_t nargs;
+			/** Set if result holds a return value */
+			bool has_result;
+			int64_t args[3];
+			int64_t result;
+			/** First string argument, truncated */
+			char str[40];
+		};
+
+		/** @brief Events per thread */
+		constexpr size_t ring_size = 1 << 16;
+
+		extern std::atomic<bool> g_enabled;
+
+		/** @brief Start recording */
+		void start();
+		/** @brief Stop recording, recorded events are kept */
+		void stop();
+		/** @brief True while recording */
+		inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+		/** @brief Drop all recorded events, the rings of other threads are reset by their owners */
+		void clear();
+		/** @brief Name the calling thread in the export */
+		void set_thread_name(const char* name);
+		/** @brief Get an event slot of the calling thread, filled with timestamp, name and phase */
+		event& record(const char* name, const char* cat, char phase);
+		/** @brief Record an instant event */
+		void instant(const char* name, const char* cat = "mark");
+
+		/**
+		 * @brief Write all recorded events as Chrome trace JSON.
+		 * @return Number of events written
+		 */
+		size_t write_chrome_json(std::ostream& out);
+
+		// Argument capture: integral values, enums and handles (void*) go to args, the first string to str
+		inline void capture(event& e, const char* s) {
+			if(e.str[0] || !s) return;
+			strncpy(e.str, s, sizeof(e.str) - 1);
+			e.str[sizeof(e.str) - 1] = '\0';
+		}
+		inline void capture(event& e, char* s) {
+			capture(e, (const char*)s);
+		}
+		template<typename T>
+		inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type capture(event& e, T v) {
+			if(e.nargs < 3) e.args[e.nargs++] = (int64_t)v;
+		}
+		inline void capture(event& e, void* p) {
+			if(e.nargs < 3) e.args[e.nargs++] = (int64_t)(intptr_t)p;
+		}
+		template<typename T>
+		inline void capture(event&, T*) {}
+		inline void capture_all(event&) {}
+		template<typename T, typename... A>
+		inline void capture_all(event& e, T v, A... rest) {
+			capture(e, v);
+			capture_all(e, rest...);
+		}
+
+		/**
+		 * @brief Begin/end pair around a scope.
+		 */
+		class scope {
+		public:
+			template<typename... A>
+			scope(const char* name, const char* cat, A... args) : m_name(nullptr), m_cat(cat) {
+				if(!enabled()) return;
+				m_name = name;
+				capture_all(record(name, cat, 'B'), args...);
+			}
+			~scope() {
+				if(!m_name) return;
+				event& e = record(m_name, m_cat, 'E');
+				if(m_has_result) {
+					e.has_result = true;
+					e.result = m_result;
+				}
+			}
+			scope(const scope&) = delete;
+			scope& operator=(const scope&) = delete;
+
+			template<typename T>
+			typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type result(T v) {
+				m_has_result = true;
+				m_result = (int64_t)v;
+			}
+			template<typename T>
+			void result(T*) {}
+
+		private:
+			const char* m_name;
+			const char* m_cat;
+			bool m_has_result = false;
+			int64_t m_result = 0;
+		};
+
+		/** @brief Call fn inside a scope and record its return value */
+		template<typename R, typename... P, typename... A>
+		inline typename std::enable_if<!std::is_void<R>::value, R>::type invoke(const char* name, const char* cat, R (*fn)(P...), A... args) {
+			scope s(name, cat, args...);
+			R res = fn(args...);
+			s.result(res);
+			return res;
+		}
+		template<typename R, typename... P, typename... A>
+		inline typename std::enable_if<std::is_void<R>::value>::type invoke(const char* name, const char* cat, R (*fn)(P...), A... args) {
+			scope s(name, cat, args...);
+			fn(args...);
+		}
+
+		/**
+		 * @brief Function pointer that traces its calls, see traced().
+		 */
+		template<typename R, typename... P>
+		struct traced_fn {
+			const char* name;
+			const char* cat;
+			R (*fn)(P...);
+			template<typename... A>
+			R operator()(A... args) const { return invoke(name, cat, fn, args...); }
+		};
+
+		/** @brief Wrap a function, traced("SpPumpEvents", "api", &SpPumpEvents)() */
+		template<typename R, typename... P>
+		inline traced_fn<R, P...> traced(const char* name, const char* cat, R (*fn)(P...)) {
+			return traced_fn<R, P...>{ name, cat, fn };
+		}
+
+		/**
+		 * @brief Replace the callbacks of a table with tracing trampolines.
+		 *
+		 * Only one table per type can be traced, wrapping a second one replaces the first.
+		 */
+		void wrap(sp_playback_callbacks_t& cbs);
+		void wrap(sp_connection_callbacks_t& cbs);
+		void wrap(sp_storage_callbacks_t& cbs);
+		void wrap(sp_dnshal_callbacks_t& cbs);
+		void wrap(sp_sockethal_callbacks_t& cbs);
+		void wrap(sp_debug_callbacks_t& cbs);
+		void wrap(sp_prefetch_callbacks_t& cbs);
+	}
+}
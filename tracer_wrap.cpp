@@ -0,0 +1,85 @@
+/**
+ * @file tracer_wrap.cpp
+ * @brief Traces every call into the library, see tracer.h.
+ *
+ * Only link this file together with -Wl,--wrap=<function> for every function listed
+ * below (SP_TRACE=1 in Android.mk), the linker then routes all calls through the
+ * __wrap_ functions and __real_ resolves to the library.
+ */
+
+#include "tracer.h"
+
+// Record the integral and string arguments and the return value
+#define SP_TRACE_CALL(ret, name, params, args) \
+	extern "C" ret __real_##name params; \
+	extern "C" ret __wrap_##name params { \
+		return sp::trace::traced(#name, "api", &__real_##name) args; \
+	}
+
+// Credentials are never recorded
+#define SP_TRACE_SECRET(ret, name, params, args) \
+	extern "C" ret __real_##name params; \
+	extern "C" ret __wrap_##name params { \
+		sp::trace::scope s(#name, "api"); \
+		ret res = __real_##name args; \
+		s.result(res); \
+		return res; \
+	}
+
+SP_TRACE_CALL(sp_error_t, SpRegisterDebugCallbacks, (const sp_debug_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpRegisterConnectionCallbacks, (const sp_connection_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpRegisterPlaybackCallbacks, (const sp_playback_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(const char*, SpGetLibraryVersion, (void), ())
+SP_TRACE_CALL(const char*, SpGetBrandName, (void), ())
+SP_TRACE_CALL(const char*, SpGetModelName, (void), ())
+SP_TRACE_CALL(uint64_t, SpGetServerTime, (void), ())
+SP_TRACE_CALL(const char*, SpGetCanonicalUsername, (void), ())
+SP_TRACE_CALL(sp_error_t, SpGetProductType, (char* buffer, int buflen), (buffer, buflen))
+SP_TRACE_CALL(sp_error_t, SpZeroConfGetVars, (sp_zeroconfvars_t* a0), (a0))
+SP_TRACE_CALL(sp_error_t, SpPumpEvents, (void), ())
+SP_TRACE_CALL(sp_error_t, SpSetDisplayName, (const char* dname), (dname))
+SP_TRACE_CALL(sp_error_t, SpConnectionSetConnectivity, (sp_connectivity_t con), (con))
+SP_TRACE_CALL(sp_connectivity_t, SpConnectionGetConnectivity, (void), ())
+SP_TRACE_SECRET(sp_error_t, SpConnectionLoginPassword, (const char* user, const void* pass), (user, pass))
+SP_TRACE_SECRET(sp_error_t, SpConnectionLoginBlob, (const char* user, const void* blob), (user, blob))
+SP_TRACE_SECRET(sp_error_t, SpConnectionLoginOauthToken, (const char* token), (token))
+SP_TRACE_CALL(unsigned int, SpConnectionIsLoggedIn, (void), ())
+SP_TRACE_CALL(sp_error_t, SpConnectionLogout, (void), ())
+SP_TRACE_CALL(sp_error_t, SpGetMetadataValidRange, (int* max, int* min), (max, min))
+SP_TRACE_CALL(sp_error_t, SpSetDeviceIsGroup, (int group), (group))
+SP_TRACE_CALL(unsigned int, SpPlaybackGetVolume, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackGetPosition, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackSetBitrate, (sp_bitrate_t rate), (rate))
+SP_TRACE_CALL(sp_error_t, SpPlaybackUpdateVolume, (unsigned int vol), (vol))
+SP_TRACE_CALL(sp_error_t, SpPlayUri, (const char* uri, int index, int posInMs), (uri, index, posInMs))
+SP_TRACE_CALL(sp_error_t, SpInit, (const sp_init_config_t* config), (config))
+SP_TRACE_CALL(sp_error_t, SpFree, (void), ())
+SP_TRACE_CALL(sp_error_t, SpGetMetadata, (sp_metadata_t* m, int idx), (m, idx))
+SP_TRACE_CALL(sp_error_t, SpGetMetadataImageURL, (const char* uri, char* buf, unsigned long long int buf_size), (uri, buf, buf_size))
+SP_TRACE_CALL(sp_error_t, SpRegisterContentCallbacks, (const sp_content_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpSetVolumeSteps, (unsigned int max), (max))
+SP_TRACE_CALL(unsigned int, SpPlaybackGetRepeatMode, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackIsActiveDevice, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackIsAdPlaying, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackIsPlaying, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackIsRepeated, (void), ())
+SP_TRACE_CALL(unsigned int, SpPlaybackIsShuffled, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackPause, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackPlay, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackSeek, (unsigned int posInMs), (posInMs))
+SP_TRACE_CALL(sp_error_t, SpPlaybackSkipToNext, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackSkipToPrev, (void), ())
+SP_TRACE_CALL(sp_error_t, SpQueueUri, (const char* uri), (uri))
+SP_TRACE_CALL(sp_error_t, SpRegisterPrefetchCallbacks, (const sp_prefetch_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpRegisterStorageCallbacks, (const sp_storage_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpPrefetchItem, (const char* uri, unsigned int arg), (uri, arg))
+SP_TRACE_CALL(sp_error_t, SpStopPrefetchingItem, (void), ())
+SP_TRACE_CALL(sp_error_t, SpZeroConfAnnouncePause, (void), ())
+SP_TRACE_CALL(sp_error_t, SpZeroConfAnnounceResume, (void), ())
+SP_TRACE_CALL(sp_error_t, SpPlaybackEnableShuffle, (int enable), (enable))
+SP_TRACE_CALL(sp_error_t, SpPlaybackEnableRepeat, (unsigned int enable), (enable))
+SP_TRACE_CALL(sp_error_t, SpRegisterDnsHALCallbacks, (const sp_dnshal_callbacks_t* cbs, void* data), (cbs, data))
+SP_TRACE_CALL(sp_error_t, SpSetAlarmClock, (int a, void* b, unsigned long c, unsigned int d), (a, b, c, d))
+SP_TRACE_CALL(sp_error_t, SpCancelAlarmClock, (int a), (a))
+SP_TRACE_CALL(sp_error_t, SpSetBackendEnv, (int a), (a))
+SP_TRACE_CALL(sp_error_t, SpRegisterSocketHALCallbacks, (const sp_sockethal_callbacks_t* cbs, void* data), (cbs, data))
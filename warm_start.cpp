@@ -0,0 +1,243 @@
+#include "warm_start.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+
+namespace sp {
+
+	static const char* const file_magic = "spwarm 1";
+
+	static bool write_all(int fd, const std::string& data) {
+		size_t done = 0;
+		while(done < data.size()) {
+			ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) return false;
+			done += (size_t)n;
+		}
+		return true;
+	}
+
+	static std::string read_all(int fd) {
+		std::string res;
+		char buf[1024];
+		while(true) {
+			ssize_t n = ::read(fd, buf, sizeof(buf));
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) break;
+			res.append(buf, (size_t)n);
+		}
+		return res;
+	}
+
+	static bool has_newline(const std::string& s) {
+		return s.find_first_of("\r\n") != std::string::npos;
+	}
+
+	warm_start::warm_start(std::string path, options opts)
+		: m_path(std::move(path)), m_opts(opts), m_dirty(false), m_urgent(false), m_playing(false),
+		m_position_pending(false), m_blob_pending(false), m_queued(0), m_written(0), m_last_ok(true), m_stop(false)
+	{
+		m_thread = std::thread(&warm_start::run, this);
+	}
+
+	warm_start::warm_start(std::string path)
+		: warm_start(std::move(path), options())
+	{}
+
+	warm_start::~warm_start() {
+		if(m_dirty) queue();
+		{
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	bool warm_start::load() {
+		int fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		std::istringstream in(read_all(fd));
+		::close(fd);
+
+		std::string line;
+		if(!std::getline(in, line) || line != file_magic) return false;
+		state st;
+		while(std::getline(in, line)) {
+			const size_t sep = line.find(' ');
+			if(sep == std::string::npos) continue;
+			const std::string key = line.substr(0, sep);
+			const std::string value = line.substr(sep + 1);
+			if(key == "user") st.username = value;
+			else if(key == "blob") st.blob = value;
+			else if(key == "context") st.context_uri = value;
+			else if(key == "index") st.index = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+			else if(key == "position") st.position = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+		}
+		m_state = st;
+		m_dirty = false;
+		return true;
+	}
+
+	bool warm_start::save() {
+		if(m_dirty && !queue()) return false;
+		// Also waits for saves queued by tick()
+		std::unique_lock<std::mutex> lck(m_mtx);
+		const uint64_t target = m_queued;
+		m_written_cv.wait(lck, [this, target]() { return m_written >= target; });
+		return m_last_ok;
+	}
+
+	bool warm_start::queue() {
+		m_last_save = clock::now();
+		m_urgent = false;
+		if(has_newline(m_state.username) || has_newline(m_state.blob) || has_newline(m_state.context_uri)) {
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_stats.save_errors++;
+			return false;
+		}
+		std::ostringstream out;
+		out << file_magic << "\n";
+		if(!m_state.username.empty()) out << "user " << m_state.username << "\n";
+		if(!m_state.blob.empty()) out << "blob " << m_state.blob << "\n";
+		if(!m_state.context_uri.empty()) {
+			out << "context " << m_state.context_uri << "\n";
+			out << "index " << m_state.index << "\n";
+			out << "position " << m_state.position << "\n";
+		}
+		m_dirty = false;
+		{
+			// A save still waiting is replaced, only the latest state matters
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_pending = out.str();
+			m_queued++;
+		}
+		m_cv.notify_one();
+		return true;
+	}
+
+	void warm_start::run() {
+		std::unique_lock<std::mutex> lck(m_mtx);
+		for(;;) {
+			m_cv.wait(lck, [this]() { return m_queued != m_written || m_stop; });
+			if(m_queued == m_written) break;
+			const std::string data = std::move(m_pending);
+			const uint64_t seq = m_queued;
+			lck.unlock();
+			const bool ok = write_file(data);
+			lck.lock();
+			if(ok) m_stats.saves++;
+			else m_stats.save_errors++;
+			m_last_ok = ok;
+			m_written = seq;
+			m_written_cv.notify_all();
+		}
+	}
+
+	bool warm_start::write_file(const std::string& data) const {
+		const std::string tmp = m_path + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if(fd < 0) return false;
+		bool ok = write_all(fd, data) && ::fsync(fd) == 0;
+		ok = ::close(fd) == 0 && ok;
+		if(!ok || ::rename(tmp.c_str(), m_path.c_str()) != 0) {
+			::unlink(tmp.c_str());
+			return false;
+		}
+		// Make the rename itself durable
+		const size_t slash = m_path.rfind('/');
+		const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : m_path.substr(0, slash);
+		int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(dfd >= 0) {
+			::fsync(dfd);
+			::close(dfd);
+		}
+		return true;
+	}
+
+	warm_start::stats warm_start::get_stats() const {
+		std::lock_guard<std::mutex> lck(m_mtx);
+		return m_stats;
+	}
+
+	sp_error_t warm_start::login() {
+		if(!can_login()) return E_INVALID_ARGUMENT;
+		sp_error_t res = SpConnectionLoginBlob(m_state.username.c_str(), m_state.blob.c_str());
+		m_blob_pending = res == E_OK;
+		return res;
+	}
+
+	sp_error_t warm_start::resume() const {
+		if(!can_resume()) return E_INVALID_ARGUMENT;
+		return SpPlayUri(m_state.context_uri.c_str(), (int)m_state.index, (int)m_state.position);
+	}
+
+	void warm_start::on_logged_in(const char* blob, const char* username) {
+		m_blob_pending = false;
+		if(!blob || !username) return;
+		if(m_state.blob == blob && m_state.username == username) return;
+		m_state.blob = blob;
+		m_state.username = username;
+		changed(true);
+	}
+
+	void warm_start::on_notify(sp_playbacknotify_t n) {
+		switch(n) {
+			case PN_PLAY:
+				m_playing = true;
+				break;
+			case PN_PAUSE:
+			case PN_BECAMEINACTIVE:
+				// Keep the position the user paused at, read on the next tick() outside the callback
+				m_playing = false;
+				m_position_pending = true;
+				changed(true);
+				break;
+			default:
+				break;
+		}
+	}
+
+	void warm_start::on_track(const track_info& current) {
+		if(!current.valid || !current.playlist_uri || !*current.playlist_uri) return;
+		if(m_state.context_uri == current.playlist_uri && m_state.index == current.playlist_idx) return;
+		m_state.context_uri = current.playlist_uri;
+		m_state.index = current.playlist_idx;
+		m_state.position = 0;
+		changed(true);
+	}
+
+	bool warm_start::on_error(sp_error_t e) {
+		if(!m_blob_pending || e < E_LOGIN_BAD_CREDENTIALS || e > E_GENERAL_LOGIN_ERROR) return false;
+		m_blob_pending = false;
+		{
+			std::lock_guard<std::mutex> lck(m_mtx);
+			m_stats.rejected_blobs++;
+		}
+		m_state.blob.clear();
+		changed(true);
+		return true;
+	}
+
+	void warm_start::tick() {
+		if(m_playing || m_position_pending) {
+			m_position_pending = false;
+			const uint32_t pos = SpPlaybackGetPosition();
+			if(pos != m_state.position) {
+				m_state.position = pos;
+				changed(false);
+			}
+		}
+		if(m_dirty && (m_urgent || clock::now() - m_last_save >= m_opts.save_interval)) queue();
+	}
+
+	void warm_start::changed(bool urgent) {
+		m_dirty = true;
+		m_urgent |= urgent;
+	}
+}
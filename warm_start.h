@@ -0,0 +1,142 @@
+#pragma once
+
+/**
+ * @file warm_start.h
+ * @brief Persisted login blob and playback position for fast restarts.
+ *
+ * The blob handed out by onNotifyLoggedIn, the current context uri, the index within it
+ * and the playback position are kept in a small file. On the next start login() uses
+ * ::SpConnectionLoginBlob instead of the password and resume() continues playback with
+ * ::SpPlayUri(uri, index, position) as soon as the login completed.
+ *
+ * The file is replaced atomically (temporary file, fsync, rename, fsync of the directory),
+ * so a crash leaves either the old or the new state. It holds a credential and is created
+ * with mode 0600. While playing the position is saved every options::save_interval, pauses,
+ * track changes and logins are saved on the next tick().
+ *
+ * The callbacks only update the state and mark it dirty, they neither call into the library
+ * nor touch the file. tick() reads the position and hands the serialized state to a writer
+ * thread, so the fsyncs never run on the pump thread.
+ *
+ * Call on_logged_in() from onNotifyLoggedIn, on_notify() from the playback onNotify,
+ * on_track() after the metadata cache was refreshed, on_error() from
+ * sp_init_config_t::on_error and tick() from the main loop, all on the pump thread.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "spotify.h"
+#include "metadata_cache.h"
+
+namespace sp {
+
+	class warm_start {
+	public:
+		struct options {
+			/** Save the position this often while playing */
+			std::chrono::milliseconds save_interval{5000};
+		};
+
+		struct state {
+			std::string username;
+			std::string blob;
+			/** Context passed to ::SpPlayUri, e.g. a playlist uri */
+			std::string context_uri;
+			uint32_t index = 0;
+			/** Position within the track in milliseconds */
+			uint32_t position = 0;
+		};
+
+		struct stats {
+			uint64_t saves = 0;
+			/** Failed saves, the previous file is still in place */
+			uint64_t save_errors = 0;
+			/** Blob logins rejected by the library */
+			uint64_t rejected_blobs = 0;
+		};
+
+		explicit warm_start(std::string path);
+		warm_start(std::string path, options opts);
+		/** @brief Writes a dirty state before the writer thread stops */
+		~warm_start();
+
+		warm_start(const warm_start&) = delete;
+		warm_start& operator=(const warm_start&) = delete;
+
+		/**
+		 * @brief Read the saved state.
+		 * @return false if there is no file or it is not a warm start file
+		 */
+		bool load();
+		/** @brief Write the state if it changed since the last save, waits until the writer thread wrote everything queued */
+		bool save();
+
+		const state& get() const { return m_state; }
+		/** @brief A blob login is possible */
+		bool can_login() const { return !m_state.username.empty() && !m_state.blob.empty(); }
+		/** @brief There is a context to resume */
+		bool can_resume() const { return !m_state.context_uri.empty(); }
+
+		/** @brief ::SpConnectionLoginBlob with the saved blob */
+		sp_error_t login();
+		/** @brief ::SpPlayUri at the saved context, index and position */
+		sp_error_t resume() const;
+
+		/** @brief Feed onNotifyLoggedIn, saved on the next tick() */
+		void on_logged_in(const char* blob, const char* username);
+		/** @brief Feed playback notifications */
+		void on_notify(sp_playbacknotify_t n);
+		/** @brief Feed the current track after a metadata refresh */
+		void on_track(const track_info& current);
+		/**
+		 * @brief Feed async errors (sp_init_config_t::on_error).
+		 *
+		 * A login error after login() drops the saved blob.
+		 * @return true if a blob login failed and the caller should fall back to the password
+		 */
+		bool on_error(sp_error_t e);
+		/** @brief Track the position and queue saves for the writer thread */
+		void tick();
+
+		stats get_stats() const;
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		void changed(bool urgent);
+		/** @brief Hand the state to the writer thread, false if it can't be serialized */
+		bool queue();
+		bool write_file(const std::string& data) const;
+		void run();
+
+		const std::string m_path;
+		const options m_opts;
+		state m_state;
+		bool m_dirty;
+		/** Save on the next tick() instead of after save_interval */
+		bool m_urgent;
+		bool m_playing;
+		/** Read the position on the next tick(), e.g. after a pause */
+		bool m_position_pending;
+		bool m_blob_pending;
+		clock::time_point m_last_save;
+
+		mutable std::mutex m_mtx;
+		std::condition_variable m_cv;
+		std::condition_variable m_written_cv;
+		/** Serialized state waiting for the writer thread */
+		std::string m_pending;
+		/** Saves queued and done by the writer thread */
+		uint64_t m_queued;
+		uint64_t m_written;
+		bool m_last_ok;
+		bool m_stop;
+		stats m_stats;
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,98 @@
+#include "wmem_probe.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+
+namespace sp {
+
+	constexpr size_t wmem_probe::min_size;
+
+	wmem_probe::wmem_probe(void* mem, size_t size, uint8_t pattern, size_t page_size)
+		: m_mem((uint8_t*)mem), m_size(size), m_pattern(pattern), m_page_size(page_size ? page_size : 4096)
+	{}
+
+	void wmem_probe::fill() {
+		memset(m_mem, m_pattern, m_size);
+	}
+
+	const wmem_probe::sample& wmem_probe::scan() {
+		sample s;
+		s.when = std::chrono::steady_clock::now();
+		s.total_pages = (m_size + m_page_size - 1) / m_page_size;
+
+		size_t run = 0;
+		for(size_t p = 0; p < s.total_pages; p++) {
+			const size_t off = p * m_page_size;
+			const size_t len = std::min(m_page_size, m_size - off);
+			if(!page_touched(m_mem + off, len)) {
+				run++;
+				continue;
+			}
+			s.touched_pages++;
+			if(run) {
+				// Only count gaps between used pages, the tail above the high-water mark is not a hole
+				if(s.high_water) s.free_runs++;
+				if(s.high_water && run * m_page_size > s.largest_free_run) s.largest_free_run = run * m_page_size;
+				run = 0;
+			}
+			size_t last = len;
+			while(last > 0 && m_mem[off + last - 1] == m_pattern) last--;
+			s.high_water = off + last;
+		}
+		m_history.push_back(s);
+		return m_history.back();
+	}
+
+	bool wmem_probe::maybe_scan(std::chrono::milliseconds interval) {
+		if(!m_history.empty() && std::chrono::steady_clock::now() - m_history.back().when < interval) return false;
+		scan();
+		return true;
+	}
+
+	size_t wmem_probe::peak() const {
+		size_t res = 0;
+		for(auto& s : m_history)
+			if(s.high_water > res) res = s.high_water;
+		return res;
+	}
+
+	size_t wmem_probe::recommended_size(double margin) const {
+		size_t res = (size_t)(peak() * margin);
+		res = (res + m_page_size - 1) / m_page_size * m_page_size;
+		return res < min_size ? min_size : res;
+	}
+
+	void wmem_probe::report(std::ostream& out) const {
+		auto fmt = out.flags();
+		out << "wmem: " << m_size << " bytes, pattern 0x" << std::hex << (int)m_pattern << std::dec << std::endl;
+		if(m_history.empty()) {
+			out.flags(fmt);
+			return;
+		}
+		const auto start = m_history.front().when;
+		for(auto& s : m_history) {
+			out << std::setw(8) << std::chrono::duration_cast<std::chrono::milliseconds>(s.when - start).count() << "ms"
+				<< " high_water=" << s.high_water
+				<< " touched=" << s.touched_pages << "/" << s.total_pages << " pages"
+				<< " free_runs=" << s.free_runs
+				<< " largest_free_run=" << s.largest_free_run << std::endl;
+		}
+		out << "peak=" << peak() << " recommended wmem_size=0x" << std::hex << recommended_size() << std::endl;
+		out.flags(fmt);
+	}
+
+	bool wmem_probe::page_touched(const uint8_t* page, size_t len) const {
+		uint64_t word;
+		memset(&word, m_pattern, sizeof(word));
+		size_t i = 0;
+		for(; i + sizeof(word) <= len; i += sizeof(word)) {
+			uint64_t v;
+			memcpy(&v, page + i, sizeof(v));
+			if(v != word) return true;
+		}
+		for(; i < len; i++)
+			if(page[i] != m_pattern) return true;
+		return false;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+/**
+ * @file wmem_probe.h
+ * @brief Measure how much of sp_init_config_t::wmem the library really uses.
+ *
+ * The region is filled with a canary pattern before ::SpInit. Scanning it later shows the
+ * high-water mark, the number of touched pages and how fragmented the used part is.
+ * Samples are kept over time, so the footprint can be right-sized for hosts running
+ * many instances. A scan reads the whole region, take samples on request (testapp does
+ * on SIGUSR1) rather than periodically from the pump thread while audio is playing.
+ *
+ * The sdk hands the library zeroed memory. A non-zero pattern has not shown problems so
+ * far, but a pattern of 0x00 can be used to keep the original behaviour (bytes written
+ * as zero then go unnoticed).
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace sp {
+
+	class wmem_probe {
+	public:
+		/**
+		 * @brief Result of a scan
+		 */
+		struct sample {
+			std::chrono::steady_clock::time_point when;
+			/** Offset after the last byte that differs from the pattern */
+			size_t high_water = 0;
+			/** Number of pages containing at least one changed byte */
+			size_t touched_pages = 0;
+			/** Number of pages in the region */
+			size_t total_pages = 0;
+			/** Number of runs of untouched pages below the high-water mark */
+			size_t free_runs = 0;
+			/** Largest run of untouched pages below the high-water mark in bytes */
+			size_t largest_free_run = 0;
+		};
+
+		/** @brief Smallest wmem_size the library accepts */
+		static constexpr size_t min_size = 0x80000;
+
+		/**
+		 * @brief Create a probe.
+		 * @param mem Region passed as wmem
+		 * @param size Size of the region
+		 * @param pattern Canary byte
+		 * @param page_size Granularity used for page statistics
+		 */
+		wmem_probe(void* mem, size_t size, uint8_t pattern = 0xa5, size_t page_size = 4096);
+
+		/** @brief Fill the region with the canary, must be called before ::SpInit */
+		void fill();
+		/** @brief Scan the region and add a sample to the history */
+		const sample& scan();
+		/** @brief Scan if the last scan is older than interval */
+		bool maybe_scan(std::chrono::milliseconds interval);
+
+		/** @brief All samples so far */
+		const std::vector<sample>& history() const { return m_history; }
+		/** @brief Largest high-water mark seen so far */
+		size_t peak() const;
+		/**
+		 * @brief Suggested wmem_size: the peak plus a safety margin, page aligned and never below min_size.
+		 * @param margin Factor applied to the peak
+		 */
+		size_t recommended_size(double margin = 1.25) const;
+		/** @brief Print the history and the recommendation */
+		void report(std::ostream& out) const;
+
+	private:
+		bool page_touched(const uint8_t* page, size_t len) const;
+
+		uint8_t* const m_mem;
+		const size_t m_size;
+		const uint8_t m_pattern;
+		const size_t m_page_size;
+		std::vector<sample> m_history;
+	};
+}
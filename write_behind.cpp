@@ -0,0 +1,395 @@
+#include "write_behind.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define SP_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+namespace sp {
+
+	static bool overlaps(uint64_t off1, size_t len1, uint64_t off2, size_t len2) {
+		return off1 < off2 + len2 && off2 < off1 + len1;
+	}
+
+	static bool pwrite_all(int fd, const uint8_t* data, size_t len, uint64_t offset) {
+		while(len) {
+			ssize_t n = ::pwrite(fd, data, len, (off_t)offset);
+			if(n < 0 && errno == EINTR) continue;
+			if(n <= 0) return false;
+			data += n;
+			len -= (size_t)n;
+			offset += (uint64_t)n;
+		}
+		return true;
+	}
+
+	write_behind::write_behind(const options& opts)
+		: m_opts(opts), m_buffer_size(std::max<size_t>(opts.buffer_size, 4096)), m_depth(std::max(opts.queue_depth, 1u)),
+		m_inflight(0), m_ring_fd(-1), m_sq_map(nullptr), m_sq_map_size(0), m_cq_map(nullptr), m_cq_map_size(0),
+		m_sqes(nullptr), m_sqes_size(0), m_sq_head(nullptr), m_sq_tail(nullptr), m_sq_mask(nullptr), m_sq_array(nullptr),
+		m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(nullptr), m_cqes(nullptr)
+	{
+		const size_t count = std::max<size_t>(m_opts.pool_size / m_buffer_size, 2);
+		m_pool.resize(count * m_buffer_size);
+		m_extents.resize(count);
+		m_free.reserve(count);
+		for(size_t i = count; i-- > 0;) {
+			m_extents[i].data = m_pool.data() + i * m_buffer_size;
+			m_extents[i].state = ES_FREE;
+			m_free.push_back(&m_extents[i]);
+		}
+		if(m_opts.use_io_uring) setup_ring(m_depth);
+	}
+
+	write_behind::write_behind()
+		: write_behind(options())
+	{}
+
+	write_behind::~write_behind() {
+		flush_all();
+		if(m_sqes) munmap(m_sqes, m_sqes_size);
+		if(m_cq_map && m_cq_map != m_sq_map) munmap(m_cq_map, m_cq_map_size);
+		if(m_sq_map) munmap(m_sq_map, m_sq_map_size);
+		if(m_ring_fd >= 0) ::close(m_ring_fd);
+	}
+
+	void write_behind::write(const std::string& key, int fd, uint64_t offset, const void* buf, size_t size) {
+		m_stats.writes++;
+		reap();
+		submit_queued(false);
+		const size_t cap = m_buffer_size;
+		const uint8_t* src = (const uint8_t*)buf;
+		const clock::time_point now = clock::now();
+		bool coalesced = false;
+		while(size) {
+			extent_list& list = m_keys[key];
+			// Newest first, an extent can take the data unless a newer one overlaps it
+			extent* target = nullptr;
+			for(auto it = list.rbegin(); it != list.rend(); ++it) {
+				extent* e = *it;
+				if(e->state == ES_OPEN && e->fd == fd) {
+					if(offset >= e->offset && offset + size <= e->offset + e->len) {
+						memcpy(e->data + (offset - e->offset), src, size);
+						e->touched = now;
+						size = 0;
+						coalesced = true;
+						break;
+					}
+					if(offset == e->offset + e->len && e->len < cap) {
+						target = e;
+						break;
+					}
+				}
+				if(overlaps(e->offset, e->len, offset, size)) break;
+			}
+			if(!size) break;
+			if(target) coalesced = true;
+			else {
+				target = acquire();
+				target->key = key;
+				target->fd = fd;
+				target->offset = offset;
+				target->len = 0;
+				target->state = ES_OPEN;
+				// acquire() can complete extents, but never removes keys
+				m_keys[key].push_back(target);
+			}
+			const size_t n = std::min(size, cap - target->len);
+			memcpy(target->data + target->len, src, n);
+			target->len += n;
+			target->touched = now;
+			src += n;
+			offset += n;
+			size -= n;
+			if(target->len == cap) close_extent(target, true);
+		}
+		if(coalesced) m_stats.coalesced++;
+		submit_aged(now);
+	}
+
+	bool write_behind::overlay(const std::string& key, uint64_t offset, void* buf, size_t size) {
+		auto it = m_keys.find(key);
+		if(it == m_keys.end()) return false;
+		bool hit = false;
+		// Oldest first, so the newest data of a byte wins
+		for(const extent* e : it->second) {
+			if(!overlaps(e->offset, e->len, offset, size)) continue;
+			const uint64_t from = std::max(e->offset, offset);
+			const uint64_t to = std::min(e->offset + e->len, offset + size);
+			memcpy((uint8_t*)buf + (from - offset), e->data + (from - e->offset), (size_t)(to - from));
+			hit = true;
+		}
+		if(hit) m_stats.read_hits++;
+		return hit;
+	}
+
+	void write_behind::submit(const std::string& key) {
+		auto it = m_keys.find(key);
+		if(it == m_keys.end()) return;
+		const std::vector<extent*> snapshot(it->second.begin(), it->second.end());
+		for(extent* e : snapshot)
+			if(e->state == ES_OPEN) close_extent(e, true);
+	}
+
+	void write_behind::flush(const std::string& key) {
+		while(true) {
+			auto it = m_keys.find(key);
+			if(it == m_keys.end()) return;
+			if(it->second.empty()) {
+				m_keys.erase(it);
+				return;
+			}
+			submit(key);
+			submit_queued(true);
+			it = m_keys.find(key);
+			if(it->second.empty()) continue;
+			// Everything left is in flight or waits for something in flight
+			if(!m_inflight) break;
+			wait_one();
+		}
+	}
+
+	void write_behind::discard(const std::string& key) {
+		auto it = m_keys.find(key);
+		if(it == m_keys.end()) return;
+		extent_list& list = it->second;
+		for(size_t i = 0; i < list.size();) {
+			if(list[i]->state == ES_INFLIGHT) {
+				i++;
+				continue;
+			}
+			extent* e = list[i];
+			list.erase(list.begin() + i);
+			release(e);
+		}
+		flush(key);
+	}
+
+	void write_behind::flush_all() {
+		std::vector<std::string> keys;
+		for(const auto& k : m_keys) keys.push_back(k.first);
+		for(const auto& k : keys) flush(k);
+	}
+
+	void write_behind::poll() {
+		reap();
+		submit_queued(false);
+		submit_aged(clock::now());
+	}
+
+	write_behind::extent* write_behind::acquire() {
+		while(m_free.empty()) {
+			m_stats.pool_waits++;
+			// Pool exhausted: write out what is buffered, oldest extents first
+			std::vector<extent*> open;
+			for(auto& k : m_keys)
+				for(extent* e : k.second)
+					if(e->state == ES_OPEN) open.push_back(e);
+			std::sort(open.begin(), open.end(), [](const extent* a, const extent* b) { return a->touched < b->touched; });
+			for(extent* e : open)
+				if(e->state == ES_OPEN) close_extent(e, true);
+			submit_queued(true);
+			// Whatever could not be submitted waits for a write in flight
+			if(m_free.empty()) wait_one();
+		}
+		extent* e = m_free.back();
+		m_free.pop_back();
+		return e;
+	}
+
+	void write_behind::release(extent* e) {
+		e->state = ES_FREE;
+		e->fd = -1;
+		e->len = 0;
+		e->key.clear();
+		m_free.push_back(e);
+	}
+
+	void write_behind::close_extent(extent* e, bool may_wait) {
+		if(e->state != ES_OPEN) return;
+		e->state = ES_QUEUED;
+		try_submit(e, may_wait);
+	}
+
+	bool write_behind::try_submit(extent* e, bool may_wait) {
+		if(e->state != ES_QUEUED) return e->state == ES_INFLIGHT;
+		// Older overlapping extents have to reach the disk first
+		bool again = true;
+		while(again) {
+			again = false;
+			for(extent* o : m_keys[e->key]) {
+				if(o == e) break;
+				if(!overlaps(o->offset, o->len, e->offset, e->len)) continue;
+				if(o->state == ES_OPEN) {
+					close_extent(o, may_wait);
+					again = true;
+					break;
+				}
+				return false;
+			}
+		}
+		if(m_ring_fd < 0) {
+			write_sync(e);
+			return true;
+		}
+#ifdef SP_HAVE_IO_URING
+		if(m_inflight >= m_depth) {
+			reap();
+			while(may_wait && m_inflight >= m_depth) wait_one();
+			if(m_inflight >= m_depth) return false;
+		}
+		const unsigned tail = *m_sq_tail;
+		const unsigned idx = tail & *m_sq_mask;
+		struct io_uring_sqe* sqe = (struct io_uring_sqe*)m_sqes + idx;
+		memset(sqe, 0, sizeof(*sqe));
+		e->iov.iov_base = e->data;
+		e->iov.iov_len = e->len;
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = e->fd;
+		sqe->off = e->offset;
+		sqe->addr = (uint64_t)(uintptr_t)&e->iov;
+		sqe->len = 1;
+		sqe->user_data = (uint64_t)(uintptr_t)e;
+		m_sq_array[idx] = idx;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		while(true) {
+			const long res = syscall(__NR_io_uring_enter, m_ring_fd, 1, 0, 0, nullptr, 0);
+			if(res >= 1) break;
+			if(res < 0 && errno == EINTR) continue;
+			// Not consumed by the kernel, take the entry back and write it ourselves
+			__atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+			write_sync(e);
+			return true;
+		}
+		e->state = ES_INFLIGHT;
+		m_inflight++;
+		m_stats.submitted++;
+		return true;
+#else
+		write_sync(e);
+		return true;
+#endif
+	}
+
+	void write_behind::write_sync(extent* e) {
+		m_stats.submitted++;
+		m_stats.pwrites++;
+		complete(e, pwrite_all(e->fd, e->data, e->len, e->offset) ? (long)e->len : -EIO);
+	}
+
+	void write_behind::complete(extent* e, long res) {
+		if(e->state == ES_INFLIGHT) {
+			m_inflight--;
+			// Failed or short io_uring write, finish it with pwrite
+			const size_t done = res > 0 ? std::min((size_t)res, e->len) : 0;
+			if(done < e->len) {
+				m_stats.pwrites++;
+				res = pwrite_all(e->fd, e->data + done, e->len - done, e->offset + done) ? (long)e->len : -EIO;
+			}
+		}
+		if(res < 0) m_stats.errors++;
+		else m_stats.bytes += e->len;
+		extent_list& list = m_keys[e->key];
+		list.erase(std::find(list.begin(), list.end(), e));
+		release(e);
+	}
+
+	void write_behind::submit_queued(bool may_wait) {
+		std::vector<extent*> queued;
+		for(auto& k : m_keys)
+			for(extent* e : k.second)
+				if(e->state == ES_QUEUED) queued.push_back(e);
+		// Queued extents are only submitted here, so none of them goes away in between
+		for(extent* e : queued) try_submit(e, may_wait);
+	}
+
+	void write_behind::submit_aged(clock::time_point now) {
+		std::vector<extent*> aged;
+		for(auto& k : m_keys)
+			for(extent* e : k.second)
+				if(e->state == ES_OPEN && now - e->touched >= m_opts.max_delay) aged.push_back(e);
+		for(extent* e : aged)
+			if(e->state == ES_OPEN) close_extent(e, false);
+	}
+
+	void write_behind::reap() {
+#ifdef SP_HAVE_IO_URING
+		if(m_ring_fd < 0 || !m_inflight) return;
+		unsigned head = *m_cq_head;
+		const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+		std::vector<std::pair<extent*, long>> done;
+		while(head != tail) {
+			const struct io_uring_cqe* cqe = (const struct io_uring_cqe*)m_cqes + (head & *m_cq_mask);
+			done.emplace_back((extent*)(uintptr_t)cqe->user_data, (long)cqe->res);
+			head++;
+		}
+		__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+		for(auto& d : done) complete(d.first, d.second);
+#endif
+	}
+
+	void write_behind::wait_one() {
+#ifdef SP_HAVE_IO_URING
+		if(m_ring_fd < 0 || !m_inflight) return;
+		if(*m_cq_head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+			while(syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno == EINTR) {}
+		}
+		reap();
+#endif
+	}
+
+	bool write_behind::setup_ring(unsigned entries) {
+#ifdef SP_HAVE_IO_URING
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		const int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+		if(fd < 0) return false;
+		m_sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if(p.features & IORING_FEAT_SINGLE_MMAP) m_sq_map_size = m_cq_map_size = std::max(m_sq_map_size, m_cq_map_size);
+		void* sq = mmap(nullptr, m_sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		void* cq = sq;
+		if(sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+			cq = mmap(nullptr, m_cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+		void* sqes = sq == MAP_FAILED || cq == MAP_FAILED ? MAP_FAILED
+			: mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if(sqes == MAP_FAILED) {
+			if(cq != MAP_FAILED && cq != sq) munmap(cq, m_cq_map_size);
+			if(sq != MAP_FAILED) munmap(sq, m_sq_map_size);
+			::close(fd);
+			return false;
+		}
+		m_ring_fd = fd;
+		m_sq_map = sq;
+		m_cq_map = cq;
+		m_sqes = sqes;
+		m_sq_head = (unsigned*)((uint8_t*)sq + p.sq_off.head);
+		m_sq_tail = (unsigned*)((uint8_t*)sq + p.sq_off.tail);
+		m_sq_mask = (unsigned*)((uint8_t*)sq + p.sq_off.ring_mask);
+		m_sq_array = (unsigned*)((uint8_t*)sq + p.sq_off.array);
+		m_cq_head = (unsigned*)((uint8_t*)cq + p.cq_off.head);
+		m_cq_tail = (unsigned*)((uint8_t*)cq + p.cq_off.tail);
+		m_cq_mask = (unsigned*)((uint8_t*)cq + p.cq_off.ring_mask);
+		m_cqes = (uint8_t*)cq + p.cq_off.cqes;
+		// The ring may be smaller than asked for
+		if(m_depth > p.sq_entries) m_depth = p.sq_entries;
+		return true;
+#else
+		(void)entries;
+		return false;
+#endif
+	}
+}
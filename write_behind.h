@@ -0,0 +1,168 @@
+#pragma once
+
+/**
+ * @file write_behind.h
+ * @brief Write-behind journal for storage HAL writes, submitted through io_uring.
+ *
+ * Writes are copied into buffers of a preallocated pool and coalesced per key: a write
+ * that continues or lies within a buffered extent is appended or copied in place (the
+ * library writes the header, appends 4116 byte chunks and updates single bitmap bytes
+ * in the header). Extents are submitted once full, older than options::max_delay, on
+ * flush of their key or when the pool runs out of buffers. The caller only pays for the
+ * memcpy.
+ *
+ * Submission uses io_uring through raw syscalls (IORING_OP_WRITEV, kernel 5.1+). If the
+ * ring can't be set up (old kernel, headers missing at build time, seccomp as in Android
+ * app sandboxes) extents are written with pwrite when they are submitted.
+ *
+ * Extents overlapping an older extent in flight are held back until it completed, so
+ * the kernel never sees two overlapping writes at once. overlay() copies buffered and
+ * in-flight data over a read result, reads see every accepted write.
+ *
+ * Not thread-safe, mmap_storage calls it under its lock. Descriptors passed to write()
+ * must stay open until flush() or discard() of the key returned.
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/uio.h>
+
+namespace sp {
+
+	class write_behind {
+	public:
+		struct options {
+			/** Total size of the buffer pool */
+			size_t pool_size = 4 * 1024 * 1024;
+			/** Size of one buffer, the largest extent */
+			size_t buffer_size = 64 * 1024;
+			/** Entries of the submission queue, the maximum number of writes in flight */
+			unsigned queue_depth = 32;
+			/** Submit extents that have not been written to for this long */
+			std::chrono::milliseconds max_delay{50};
+			/** Set to false to always use pwrite */
+			bool use_io_uring = true;
+		};
+
+		struct stats {
+			/** write() calls */
+			uint64_t writes = 0;
+			/** Writes appended to or copied into an existing extent */
+			uint64_t coalesced = 0;
+			/** Extents written */
+			uint64_t submitted = 0;
+			/** Extents written with pwrite because io_uring is not available or failed */
+			uint64_t pwrites = 0;
+			uint64_t bytes = 0;
+			/** Times write() had to wait for a free buffer */
+			uint64_t pool_waits = 0;
+			/** Reads that got data from buffered or in-flight extents */
+			uint64_t read_hits = 0;
+			/** Failed writes, the data is lost */
+			uint64_t errors = 0;
+		};
+
+		write_behind();
+		explicit write_behind(const options& opts);
+		/** @brief Writes everything still buffered */
+		~write_behind();
+
+		write_behind(const write_behind&) = delete;
+		write_behind& operator=(const write_behind&) = delete;
+
+		/** @brief True if writes go through io_uring */
+		bool uring() const { return m_ring_fd >= 0; }
+
+		/** @brief Buffer a write of key to fd */
+		void write(const std::string& key, int fd, uint64_t offset, const void* buf, size_t size);
+		/**
+		 * @brief Copy buffered and in-flight data of key over a read result.
+		 * @return true if any byte of the range was pending
+		 */
+		bool overlay(const std::string& key, uint64_t offset, void* buf, size_t size);
+		/** @brief Submit all extents of key without waiting */
+		void submit(const std::string& key);
+		/** @brief Submit all extents of key and wait until they are written */
+		void flush(const std::string& key);
+		/** @brief Drop extents of key that were not submitted yet and wait for the rest (before truncating) */
+		void discard(const std::string& key);
+		/** @brief flush() every key */
+		void flush_all();
+		/** @brief Process completions and submit extents older than max_delay, does not block */
+		void poll();
+
+		const stats& get_stats() const { return m_stats; }
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		enum extent_state {
+			/** In the free list */
+			ES_FREE,
+			/** Accepts writes */
+			ES_OPEN,
+			/** Closed, waits for an overlapping older extent to complete */
+			ES_QUEUED,
+			ES_INFLIGHT
+		};
+
+		struct extent {
+			std::string key;
+			int fd = -1;
+			uint64_t offset = 0;
+			size_t len = 0;
+			uint8_t* data = nullptr;
+			extent_state state = ES_FREE;
+			clock::time_point touched;
+			struct iovec iov;
+		};
+
+		typedef std::deque<extent*> extent_list;
+
+		extent* acquire();
+		void release(extent* e);
+		void close_extent(extent* e, bool may_wait);
+		bool try_submit(extent* e, bool may_wait);
+		void write_sync(extent* e);
+		void complete(extent* e, long res);
+		/** Retry extents held back by an overlapping write in flight */
+		void submit_queued(bool may_wait);
+		void submit_aged(clock::time_point now);
+		void reap();
+		void wait_one();
+		bool setup_ring(unsigned entries);
+
+		const options m_opts;
+		const size_t m_buffer_size;
+		/** Writes in flight at most, queue_depth capped to the ring size */
+		unsigned m_depth;
+		stats m_stats;
+		std::vector<uint8_t> m_pool;
+		std::vector<extent> m_extents;
+		std::vector<extent*> m_free;
+		std::unordered_map<std::string, extent_list> m_keys;
+		unsigned m_inflight;
+
+		// io_uring, see io_uring_setup(2)
+		int m_ring_fd;
+		void* m_sq_map;
+		size_t m_sq_map_size;
+		void* m_cq_map;
+		size_t m_cq_map_size;
+		void* m_sqes;
+		size_t m_sqes_size;
+		unsigned* m_sq_head;
+		unsigned* m_sq_tail;
+		unsigned* m_sq_mask;
+		unsigned* m_sq_array;
+		unsigned* m_cq_head;
+		unsigned* m_cq_tail;
+		unsigned* m_cq_mask;
+		void* m_cqes;
+	};
+}
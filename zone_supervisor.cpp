@@ -0,0 +1,381 @@
+#include "zone_supervisor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace sp {
+
+	// Commands and reports are single packets
+	static const size_t max_packet = 4096;
+
+	static const char* state_name(zone_supervisor::zone_state s) {
+		switch(s) {
+			case zone_supervisor::ZS_RUNNING: return "running";
+			case zone_supervisor::ZS_BACKOFF: return "backoff";
+			case zone_supervisor::ZS_STOPPING: return "stopping";
+			default: return "stopped";
+		}
+	}
+
+	zone_supervisor::zone_supervisor(const sp_init_config_t& base, worker_t worker, options opts)
+		: m_base(base), m_worker(std::move(worker)), m_opts(opts), m_listen(-1)
+	{}
+
+	zone_supervisor::zone_supervisor(const sp_init_config_t& base, worker_t worker)
+		: zone_supervisor(base, std::move(worker), options())
+	{}
+
+	zone_supervisor::~zone_supervisor() {
+		shutdown();
+		for(auto& c : m_clients) ::close(c.fd);
+		if(m_listen >= 0) {
+			::close(m_listen);
+			::unlink(m_listen_path.c_str());
+		}
+	}
+
+	size_t zone_supervisor::add(const zone_config& cfg) {
+		zone z;
+		z.status.config = cfg;
+		// Picked up by the next poll()
+		z.status.state = ZS_BACKOFF;
+		z.restart_at = clock::now();
+		m_zones.push_back(std::move(z));
+		return m_zones.size() - 1;
+	}
+
+	zone_supervisor::zone_status zone_supervisor::status(size_t zone) const {
+		return m_zones.at(zone).status;
+	}
+
+	bool zone_supervisor::start(size_t idx) {
+		if(idx >= m_zones.size()) return false;
+		zone& z = m_zones[idx];
+		if(z.status.state == ZS_RUNNING) return true;
+		if(z.status.state == ZS_STOPPING) {
+			z.restart_now = true;
+			return true;
+		}
+		z.backoff = std::chrono::milliseconds(0);
+		spawn(idx);
+		return z.status.state == ZS_RUNNING;
+	}
+
+	bool zone_supervisor::stop(size_t idx) {
+		if(idx >= m_zones.size()) return false;
+		zone& z = m_zones[idx];
+		z.restart_now = false;
+		if(z.status.state == ZS_RUNNING) terminate(z);
+		else if(z.status.state == ZS_BACKOFF) z.status.state = ZS_STOPPED;
+		return true;
+	}
+
+	bool zone_supervisor::restart(size_t idx) {
+		if(idx >= m_zones.size()) return false;
+		zone& z = m_zones[idx];
+		if(z.status.state == ZS_RUNNING) {
+			z.restart_now = true;
+			terminate(z);
+			return true;
+		}
+		return start(idx);
+	}
+
+	void zone_supervisor::shutdown() {
+		for(size_t i = 0; i < m_zones.size(); i++) stop(i);
+		for(;;) {
+			bool alive = false;
+			for(auto& z : m_zones) alive |= z.status.pid > 0;
+			if(!alive) break;
+			poll(std::chrono::milliseconds(50));
+		}
+	}
+
+	bool zone_supervisor::send(size_t idx, const std::string& cmd) {
+		if(idx >= m_zones.size()) return false;
+		zone& z = m_zones[idx];
+		if(z.ctrl < 0 || cmd.size() > max_packet) return false;
+		return ::send(z.ctrl, cmd.data(), cmd.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)cmd.size();
+	}
+
+	bool zone_supervisor::receive(int ctrl, std::string& cmd) {
+		char buf[max_packet];
+		ssize_t res = ::recv(ctrl, buf, sizeof(buf), MSG_DONTWAIT);
+		if(res <= 0) return false;
+		cmd.assign(buf, res);
+		return true;
+	}
+
+	bool zone_supervisor::reply(int ctrl, const std::string& report) {
+		if(report.size() > max_packet) return false;
+		return ::send(ctrl, report.data(), report.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)report.size();
+	}
+
+	bool zone_supervisor::listen(const std::string& path) {
+		struct sockaddr_un addr;
+		if(m_listen >= 0 || path.size() >= sizeof(addr.sun_path)) return false;
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd < 0) return false;
+		memset(&addr, 0x00, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		::unlink(path.c_str());
+		if(::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 8) != 0) {
+			::close(fd);
+			return false;
+		}
+		m_listen = fd;
+		m_listen_path = path;
+		return true;
+	}
+
+	std::string zone_supervisor::control(const std::string& line) {
+		std::istringstream in(line);
+		std::string cmd;
+		in >> cmd;
+		std::ostringstream out;
+		if(cmd == "list") {
+			for(size_t i = 0; i < m_zones.size(); i++) {
+				const zone_status& s = m_zones[i].status;
+				out << i << " " << s.config.uniqueid << " \"" << s.config.displayname << "\" " << s.pid << " "
+					<< state_name(s.state) << " " << s.restarts << " " << s.config.cpu << " " << s.report << "\n";
+			}
+			out << "ok\n";
+			return out.str();
+		}
+		if(cmd == "broadcast") {
+			std::string rest;
+			std::getline(in >> std::ws, rest);
+			size_t n = 0;
+			for(size_t i = 0; i < m_zones.size(); i++) n += send(i, rest);
+			out << "ok " << n << "\n";
+			return out.str();
+		}
+
+		size_t idx;
+		if(!(in >> idx) || idx >= m_zones.size()) return "error invalid zone\n";
+		bool ok;
+		if(cmd == "send") {
+			std::string rest;
+			std::getline(in >> std::ws, rest);
+			ok = !rest.empty() && send(idx, rest);
+		} else if(cmd == "restart") ok = restart(idx);
+		else if(cmd == "stop") ok = stop(idx);
+		else if(cmd == "start") ok = start(idx);
+		else return "error unknown command\n";
+		return ok ? "ok\n" : "error failed\n";
+	}
+
+	void zone_supervisor::poll(std::chrono::milliseconds timeout) {
+		reap();
+
+		auto now = clock::now();
+		auto deadline = now + timeout;
+		for(size_t i = 0; i < m_zones.size(); i++) {
+			zone& z = m_zones[i];
+			if(z.status.state == ZS_BACKOFF) {
+				if(z.restart_at <= now) spawn(i);
+				else deadline = std::min(deadline, z.restart_at);
+			} else if(z.status.state == ZS_STOPPING) {
+				if(z.kill_at <= now) {
+					::kill(z.status.pid, SIGKILL);
+					z.kill_at = now + m_opts.kill_timeout;
+				}
+				deadline = std::min(deadline, z.kill_at);
+			}
+		}
+
+		std::vector<struct pollfd> fds;
+		std::vector<size_t> owners;
+		for(size_t i = 0; i < m_zones.size(); i++) {
+			if(m_zones[i].ctrl < 0) continue;
+			fds.push_back({ m_zones[i].ctrl, POLLIN, 0 });
+			owners.push_back(i);
+		}
+		const size_t nzones = fds.size();
+		if(m_listen >= 0) fds.push_back({ m_listen, POLLIN, 0 });
+		for(auto& c : m_clients) fds.push_back({ c.fd, POLLIN, 0 });
+
+		auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count();
+		int res = ::poll(fds.data(), fds.size(), wait > 0 ? (int)wait : 0);
+		if(res <= 0) {
+			reap();
+			return;
+		}
+
+		bool hangup = false;
+		for(size_t i = 0; i < nzones; i++) {
+			zone& z = m_zones[owners[i]];
+			if(fds[i].revents & POLLIN) read_reports(z);
+			if(fds[i].revents & (POLLHUP | POLLERR)) {
+				// The worker is gone or about to be, waitpid picks it up
+				close_ctrl(z);
+				hangup = true;
+			}
+		}
+		size_t next = nzones;
+		if(m_listen >= 0) {
+			if(fds[next].revents & POLLIN) {
+				int fd;
+				while((fd = ::accept4(m_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+					m_clients.push_back(client{ fd, std::string() });
+			}
+			next++;
+		}
+		// Clients accepted above are not part of fds
+		std::vector<int> ready;
+		for(; next < fds.size(); next++)
+			if(fds[next].revents) ready.push_back(fds[next].fd);
+		for(int fd : ready) serve(fd);
+
+		if(hangup) reap();
+	}
+
+	void zone_supervisor::spawn(size_t idx) {
+		zone& z = m_zones[idx];
+		int sv[2];
+		if(::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+			z.status.state = ZS_BACKOFF;
+			z.restart_at = clock::now() + m_opts.min_backoff;
+			return;
+		}
+		pid_t pid = ::fork();
+		if(pid < 0) {
+			::close(sv[0]);
+			::close(sv[1]);
+			z.status.state = ZS_BACKOFF;
+			z.restart_at = clock::now() + m_opts.min_backoff;
+			return;
+		}
+		if(pid == 0) {
+			// Worker: drop everything belonging to the supervisor
+			::close(sv[0]);
+			for(auto& o : m_zones)
+				if(o.ctrl >= 0) ::close(o.ctrl);
+			for(auto& c : m_clients) ::close(c.fd);
+			if(m_listen >= 0) ::close(m_listen);
+			// Do not outlive the supervisor
+			::prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+			const zone_config& zc = z.status.config;
+			if(zc.cpu >= 0) {
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(zc.cpu, &set);
+				::sched_setaffinity(0, sizeof(set), &set);
+			}
+			sp_init_config_t cfg = m_base;
+			cfg.uniqueid = zc.uniqueid.c_str();
+			cfg.displayname = zc.displayname.c_str();
+			if(!cfg.wmem) cfg.wmem = malloc(cfg.wmem_size);
+			int rc = 1;
+			try {
+				rc = m_worker(idx, cfg, sv[1]);
+			} catch(...) {
+				rc = 1;
+			}
+			::_exit(rc & 0xff);
+		}
+		::close(sv[1]);
+		z.ctrl = sv[0];
+		z.status.pid = pid;
+		z.status.state = ZS_RUNNING;
+		z.started = clock::now();
+	}
+
+	void zone_supervisor::terminate(zone& z) {
+		::kill(z.status.pid, SIGTERM);
+		z.status.state = ZS_STOPPING;
+		z.kill_at = clock::now() + m_opts.kill_timeout;
+	}
+
+	void zone_supervisor::reap() {
+		for(size_t i = 0; i < m_zones.size(); i++) {
+			zone& z = m_zones[i];
+			if(z.status.pid <= 0) continue;
+			int st;
+			pid_t res = ::waitpid(z.status.pid, &st, WNOHANG);
+			if(res == 0 || (res < 0 && errno == EINTR)) continue;
+
+			// Reports sent right before exiting are still queued
+			if(z.ctrl >= 0) read_reports(z);
+			close_ctrl(z);
+			z.status.pid = -1;
+			z.status.last_status = res > 0 ? st : 0;
+			const auto now = clock::now();
+
+			if(z.status.state == ZS_STOPPING) {
+				z.status.state = ZS_STOPPED;
+				if(z.restart_now) {
+					z.restart_now = false;
+					z.backoff = std::chrono::milliseconds(0);
+					spawn(i);
+				}
+				continue;
+			}
+			if(res > 0 && WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+				z.status.state = ZS_STOPPED;
+				continue;
+			}
+
+			// Crashed, restart with backoff unless it ran stable for a while
+			if(now - z.started >= m_opts.stable_after || z.backoff.count() == 0) z.backoff = m_opts.min_backoff;
+			else z.backoff = std::min(z.backoff * 2, m_opts.max_backoff);
+			z.status.state = ZS_BACKOFF;
+			z.status.restarts++;
+			z.restart_at = now + z.backoff;
+		}
+	}
+
+	void zone_supervisor::close_ctrl(zone& z) {
+		if(z.ctrl < 0) return;
+		::close(z.ctrl);
+		z.ctrl = -1;
+	}
+
+	void zone_supervisor::read_reports(zone& z) {
+		std::string report;
+		while(z.ctrl >= 0 && receive(z.ctrl, report)) z.status.report = report;
+	}
+
+	void zone_supervisor::serve(int fd) {
+		auto it = std::find_if(m_clients.begin(), m_clients.end(), [fd](const client& c) { return c.fd == fd; });
+		if(it == m_clients.end()) return;
+
+		char buf[max_packet];
+		ssize_t res = ::recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if(res < 0 && (errno == EAGAIN || errno == EINTR)) return;
+		if(res <= 0 || it->buf.size() + res > max_packet) {
+			::close(fd);
+			m_clients.erase(it);
+			return;
+		}
+		it->buf.append(buf, res);
+		size_t pos;
+		while((pos = it->buf.find('\n')) != std::string::npos) {
+			std::string line = it->buf.substr(0, pos);
+			it->buf.erase(0, pos + 1);
+			if(!line.empty() && line.back() == '\r') line.pop_back();
+			if(line.empty()) continue;
+			// Replies are small, a client that does not read them gets dropped
+			std::string out = control(line);
+			if(::send(fd, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)out.size()) {
+				::close(fd);
+				m_clients.erase(std::find_if(m_clients.begin(), m_clients.end(), [fd](const client& c) { return c.fd == fd; }));
+				return;
+			}
+		}
+	}
+}
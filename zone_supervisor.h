@@ -0,0 +1,194 @@
+#pragma once
+
+/**
+ * @file zone_supervisor.h
+ * @brief Run one playback zone per worker process.
+ *
+ * ::SpInit, ::SpFree and the callback registrations are process global, so a process can
+ * only drive a single zone. The supervisor forks one worker per zone, each with its own
+ * copy of ::sp_init_config_t (own uniqueid, displayname and wmem), optionally pinned to a
+ * cpu. Workers that exit abnormally are restarted with exponential backoff, a worker that
+ * exits with status 0 stays stopped.
+ *
+ * Every worker has a SOCK_SEQPACKET socketpair to the supervisor. The supervisor sends
+ * one command per packet, the worker reads them in its main loop with receive() and can
+ * report its state with reply(); the last report is kept in the zone status. The control
+ * plane for the whole host is a text protocol on a unix socket (see listen()):
+ *
+ *     list                       one line per zone: id name pid state restarts cpu last_report
+ *     send <id> <command ...>    forward a command to a zone
+ *     broadcast <command ...>    forward a command to every running zone
+ *     restart <id>               terminate a zone, it is started again right away
+ *     stop <id> / start <id>     stop a zone or start a stopped one
+ *
+ * The supervisor is single threaded, call poll() in a loop.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "spotify.h"
+
+namespace sp {
+
+	class zone_supervisor {
+	public:
+		/**
+		 * @brief Settings of one zone.
+		 */
+		struct zone_config {
+			/** Passed as sp_init_config_t::uniqueid */
+			std::string uniqueid;
+			/** Passed as sp_init_config_t::displayname */
+			std::string displayname;
+			/** Cpu to pin the worker to, -1 to not pin it */
+			int cpu = -1;
+		};
+
+		/**
+		 * @brief Worker entry point, runs in the forked process.
+		 * @param zone Index of the zone
+		 * @param cfg Init config for this zone, ready to be passed to ::SpInit
+		 * @param ctrl Control socket, see receive() and reply()
+		 * @return Exit status of the worker, 0 means the zone should stay stopped
+		 */
+		typedef std::function<int(size_t zone, sp_init_config_t& cfg, int ctrl)> worker_t;
+
+		/**
+		 * @brief Restart policy
+		 */
+		struct options {
+			/** Delay before the first restart */
+			std::chrono::milliseconds min_backoff{500};
+			/** Upper bound for the restart delay */
+			std::chrono::milliseconds max_backoff{60000};
+			/** Workers running at least this long get their backoff reset */
+			std::chrono::milliseconds stable_after{30000};
+			/** Time between SIGTERM and SIGKILL when stopping a worker */
+			std::chrono::milliseconds kill_timeout{5000};
+		};
+
+		enum zone_state {
+			/** Not running and not going to be restarted */
+			ZS_STOPPED = 0,
+			/** Worker process is alive */
+			ZS_RUNNING = 1,
+			/** Worker died, waiting for the restart */
+			ZS_BACKOFF = 2,
+			/** Worker was sent SIGTERM and did not exit yet */
+			ZS_STOPPING = 3
+		};
+
+		/**
+		 * @brief State of one zone.
+		 */
+		struct zone_status {
+			zone_config config;
+			zone_state state = ZS_STOPPED;
+			pid_t pid = -1;
+			/** Number of restarts after abnormal exits */
+			uint64_t restarts = 0;
+			/** Raw waitpid status of the last exit */
+			int last_status = 0;
+			/** Last report sent by the worker */
+			std::string report;
+		};
+
+		/**
+		 * @brief Create a supervisor.
+		 * @param base Init config all zones are derived from. If base.wmem is null every worker
+		 *             allocates base.wmem_size bytes itself.
+		 * @param worker Worker entry point
+		 * @param opts Restart policy
+		 */
+		zone_supervisor(const sp_init_config_t& base, worker_t worker, options opts);
+		zone_supervisor(const sp_init_config_t& base, worker_t worker);
+		/** @brief Stops all workers */
+		~zone_supervisor();
+
+		zone_supervisor(const zone_supervisor&) = delete;
+		zone_supervisor& operator=(const zone_supervisor&) = delete;
+
+		/** @brief Add a zone, it is started by the next poll(). Returns the zone index. */
+		size_t add(const zone_config& cfg);
+		/** @brief Number of zones */
+		size_t size() const { return m_zones.size(); }
+		/** @brief Get the state of a zone */
+		zone_status status(size_t zone) const;
+
+		/** @brief Start a stopped zone */
+		bool start(size_t zone);
+		/** @brief Stop a zone, it is not restarted */
+		bool stop(size_t zone);
+		/** @brief Terminate a zone and start it again without backoff */
+		bool restart(size_t zone);
+		/** @brief Stop all zones and wait until they exited */
+		void shutdown();
+
+		/** @brief Send a command to a running zone */
+		bool send(size_t zone, const std::string& cmd);
+
+		/**
+		 * @brief Accept control connections on a unix socket.
+		 * @return false if the socket could not be created
+		 */
+		bool listen(const std::string& path);
+		/**
+		 * @brief Execute one control plane command.
+		 * @return Reply text
+		 */
+		std::string control(const std::string& line);
+
+		/**
+		 * @brief Reap and restart workers and serve control connections.
+		 * @param timeout Upper bound for blocking
+		 */
+		void poll(std::chrono::milliseconds timeout);
+
+		/**
+		 * @brief Get the next command in a worker, non blocking.
+		 * @return false if no command is pending
+		 */
+		static bool receive(int ctrl, std::string& cmd);
+		/** @brief Report the worker state to the supervisor */
+		static bool reply(int ctrl, const std::string& report);
+
+	private:
+		typedef std::chrono::steady_clock clock;
+
+		struct zone {
+			zone_status status;
+			int ctrl = -1;
+			clock::time_point started;
+			clock::time_point restart_at;
+			clock::time_point kill_at;
+			std::chrono::milliseconds backoff{0};
+			bool restart_now = false;
+		};
+
+		void spawn(size_t idx);
+		void terminate(zone& z);
+		void reap();
+		void close_ctrl(zone& z);
+		void read_reports(zone& z);
+		void serve(int fd);
+
+		struct client {
+			int fd;
+			// Partial command line
+			std::string buf;
+		};
+
+		const sp_init_config_t m_base;
+		const worker_t m_worker;
+		const options m_opts;
+		std::vector<zone> m_zones;
+		int m_listen;
+		std::string m_listen_path;
+		std::vector<client> m_clients;
+	};
+}